@@ -0,0 +1,136 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+#include "chunk.h"
+#include "value.h"
+
+#ifdef JIT
+
+// x86-64 code generation shared by the method JIT and
+// the trace JIT.
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+// Where native code keeps the VM's state. All of them are
+// callee-saved, so they survive calls into C.
+#define VM_BASE     RBX // &vm.
+#define TOP         R12 // vm.stackTop.
+#define SLOTS       R13 // frame->slots.
+#define FRAME       R14 // The frame (or its offset in vm.frames).
+#define CLOSURE     R15 // frame->closure.
+
+// Condition codes, for jcc and setcc.
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_BE   0x6
+#define CC_A    0x7
+#define CC_P    0xA
+#define CC_NP   0xB
+#define ALWAYS  (-1)
+#define NEGATE(condition) ((condition) ^ 1)
+
+#define VALUE_SIZE  ((int32_t) sizeof(Value))
+// PAYLOAD is where a value keeps its double (or, in its
+// lowest byte, its bool).
+#ifdef NAN_BOXING
+#define PAYLOAD     0
+#else
+#define TYPE        ((int32_t) offsetof(Value, type))
+#define PAYLOAD     ((int32_t) offsetof(Value, as))
+#endif
+// Displacement from TOP of the value distance down.
+#define STACK(distance) (-(distance) * VALUE_SIZE)
+
+// Prefix and opcode of the SSE instructions used, for sse().
+#define MOVSD_LOAD      0xF2, 0x10
+#define MOVSD_STORE     0xF2, 0x11
+#define UCOMISD         0x66, 0x2E
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+
+    // Offsets of the rel32 of every jump whose destination
+    // is not known yet, and what each goes to. The meaning
+    // of a target is up to the user, who patches them all.
+    int* patches;
+    int* targets;
+    int patchCount;
+    int patchCapacity;
+} Assembler;
+
+void initAssembler(Assembler* a);
+void freeAssembler(Assembler* a);
+// Copies the code into executable memory. Returns NULL
+// if that cannot be had.
+uint8_t* installCode(Assembler* a);
+void freeCode(uint8_t* code, size_t size);
+
+void emitByte(Assembler* a, uint8_t byte);
+void emitBytes(Assembler* a, const uint8_t* bytes, int count);
+void emit32(Assembler* a, uint32_t value);
+void emit64(Assembler* a, uint64_t value);
+// REX prefix for reg in ModRM.reg and base in ModRM.rm,
+// if the instruction needs one.
+void rex(Assembler* a, bool wide, int reg, int base);
+// ModRM (and SIB) for [base + disp32].
+void memory(Assembler* a, int reg, Register base, int32_t disp);
+
+void loadQword(Assembler* a, Register dst, Register base, int32_t disp);
+void storeQword(Assembler* a, Register base, int32_t disp, Register src);
+void loadImmediate(Assembler* a, Register dst, uint64_t value);
+void addImmediate(Assembler* a, Register reg, int32_t value);
+// SSE instruction between xmm and [base + disp].
+void sse(Assembler* a, uint8_t prefix, uint8_t opcode, int xmm,
+            Register base, int32_t disp);
+void setCondition(Assembler* a, int condition, Register reg);
+// Pushes and pops every register the native code uses.
+// With the return address, that leaves rsp 16-byte aligned
+// for calls into C.
+void saveRegisters(Assembler* a);
+void restoreRegisters(Assembler* a);
+
+// Emits a jump whose rel32 is filled in later, and
+// returns the offset of the rel32.
+int jump(Assembler* a, int condition);
+void patchAt(Assembler* a, int at, int destination);
+void patchHere(Assembler* a, int at);
+// Jump to a target the user resolves once the code is done.
+void jumpTo(Assembler* a, int condition, int target);
+
+// Value templates. They work with either layout of Value.
+// Tests the type of the value at [base + disp] and returns
+// the condition that holds if it has that type. May
+// clobber rcx and rdx.
+int compareType(Assembler* a, Register base, int32_t disp, ValueType type);
+// Makes the value at [base + disp] a number, before its
+// double is stored.
+void storeNumberType(Assembler* a, Register base, int32_t disp);
+// Pushes the value at [base + disp].
+void pushFrom(Assembler* a, Register base, int32_t disp);
+// Copies the value on top of the stack to [base + disp].
+void storeTop(Assembler* a, Register base, int32_t disp);
+void storeImmediate(Assembler* a, Register base, int32_t disp, Value value);
+void pushImmediate(Assembler* a, Value value);
+void pushNumber(Assembler* a, double number);
+// Makes the value distance down a bool, from al.
+void storeBool(Assembler* a, int distance);
+
+// Number templates. The operands must be numbers.
+// Arithmetic instruction on the top two values.
+void numberArithmetic(Assembler* a, Word instruction);
+// Sets ZF if the divisor on top is zero (or NaN).
+void compareDivisor(Assembler* a);
+// Comparison instruction on the top two values.
+void numberComparison(Assembler* a, Word instruction);
+// OP_NEGATE, OP_INCREMENT or OP_DECREMENT.
+void numberUnary(Assembler* a, Word instruction);
+
+#endif
+
+#endif
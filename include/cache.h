@@ -0,0 +1,113 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "shape.h"
+#include "value.h"
+#include "vm.h"
+
+// Receivers a site remembers before it goes megamorphic.
+#define CACHE_WAYS 4
+
+// What a property name meant for receivers of one shape
+// (and, for loads and invokes, one class). Shapes never
+// change once made, and an instance that has a field
+// deleted becomes a dictionary, so no entry can go wrong.
+// Dictionaries have no shape to key an entry on and always
+// miss.
+typedef struct {
+    ObjShape* shape;
+    ObjClass* klass; // NULL for stores.
+    int slot; // Field slot, or -1 if the name is a method.
+    ObjClosure* method;
+    // Stores only: shape the instance moves to when the
+    // field is new, or NULL if it already has it.
+    ObjShape* next;
+} CacheEntry;
+
+// Inline cache of one OP_GET_PROPERTY, OP_SET_PROPERTY or
+// OP_INVOKE site (or of its register form).
+// Monomorphic with one entry, polymorphic up to CACHE_WAYS.
+// A site that sees more receivers than that is megamorphic:
+// it keeps the entries it has and looks the rest up.
+// Every entry is dropped once a method is defined after it
+// was made (see vm.cacheEpoch).
+typedef struct InlineCache {
+    int count;
+    bool megamorphic;
+    uint32_t epoch;
+    CacheEntry entries[CACHE_WAYS];
+} InlineCache;
+
+#ifdef DEBUG_CACHE_STATS
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long megamorphic; // Sites that went megamorphic.
+} CacheStats;
+
+extern CacheStats cacheStats;
+#define CACHE_STAT(counter) cacheStats.counter++
+#else
+#define CACHE_STAT(counter) do {} while (false)
+#endif
+
+void initCaches(InlineCache* caches, int count);
+// Slow paths of cacheLoad() and cacheStore().
+CacheEntry* loadMiss(InlineCache* cache, ObjInstance* instance,
+                        ObjString* name);
+CacheEntry* storeMiss(InlineCache* cache, ObjInstance* instance,
+                        ObjString* name);
+#ifdef DEBUG_CACHE_STATS
+void printCacheStats();
+#endif
+
+static inline CacheEntry* probeCache(InlineCache* cache, ObjShape* shape,
+                                        ObjClass* klass)
+{
+    if (cache->epoch != vm.cacheEpoch) return NULL;
+
+    for (int i = 0; i < cache->count; i++)
+    {
+        CacheEntry* entry = &cache->entries[i];
+        if ((entry->shape == shape) && (entry->klass == klass))
+        {
+            CACHE_STAT(hits);
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// What name means on the instance: a field slot or a method.
+// NULL if the instance has neither.
+static inline CacheEntry* cacheLoad(InlineCache* cache, ObjInstance* instance,
+                                    ObjString* name)
+{
+    CacheEntry* entry = probeCache(cache, instance->shape, instance->klass);
+    return (entry != NULL) ? entry : loadMiss(cache, instance, name);
+}
+
+// Stores the value in the instance's field. The instance
+// and value must stay reachable, since this can allocate.
+static inline void cacheStore(InlineCache* cache, ObjInstance* instance,
+                                ObjString* name, Value value)
+{
+    CacheEntry* entry = probeCache(cache, instance->shape, NULL);
+    if (entry == NULL)
+        entry = storeMiss(cache, instance, name);
+
+    if (entry->next != NULL)
+        reserveFields(instance, entry->next->fieldCount);
+    LOCK_FOR_MARKERS(instance);
+    if (entry->next != NULL)
+        instance->shape = entry->next;
+    instance->fields[entry->slot] = value;
+    WRITE_BARRIER(instance);
+    UNLOCK_FOR_MARKERS(instance);
+}
+
+#endif
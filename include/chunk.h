@@ -12,7 +12,7 @@ typedef enum {
     OP_TWO,
     OP_MINUSONE,
     OP_CONSTANT, // Opcode | position in constant pool.
-    OP_CONSTANT_LONG, // Opcode | position in constant pool.
+    OP_CONSTANT_LONG, // Opcode | position in constant pool. Never seen by VM.
     OP_SHORT, // Index operand is 1 byte. Never seen by VM.
     OP_LONG, // Index operand is 3 bytes, not 1. Never seen by VM.
     OP_DUP,
@@ -28,10 +28,15 @@ typedef enum {
     OP_SET_LOCAL, // Opcode | length of operand | position in constant pool.
     OP_GET_UPVALUE, // Opcode | length of operand (1) | position in constant pool.
     OP_SET_UPVALUE, // Opcode | length of operand (1) | position in constant pool.
+    OP_GET_CAPTURED, // Opcode | length of operand | index in closure->captured.
+    // As OP_GET_GLOBAL and OP_SET_GLOBAL, for a global the
+    // compiler knows is defined by then: no check.
+    OP_GET_DEFINED_GLOBAL,
+    OP_SET_DEFINED_GLOBAL,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
-    OP_COMPZER0,
+    OP_COMPZER0, // Fused with the preceding OP_ZERO when decoded.
     OP_INCREMENT,
     OP_DECREMENT,
     OP_ADD,
@@ -45,17 +50,44 @@ typedef enum {
     OP_JUMP_IF_FALSE, // Opcode | jump offset.
     OP_LOOP, // Opcode | loop start offset.
     OP_CALL, // Opcode | argument number.
+    OP_TAIL_CALL, // Opcode | argument number. Callee takes over the frame.
     OP_INVOKE, // Opcode | name of method | number of arguments.
-    OP_CLOSURE, // Opcode | position in constant pool.
+    // Opcode | position in constant pool | (isLocal | index)
+    // per upvalue, then per captured value.
+    OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_CLASS, // Opcode | position in constant pool.
     OP_METHOD,
     OP_GET_PROPERTY, // Opcode | length of operand (1) | position in constant pool.
     OP_SET_PROPERTY, // Opcode | length of operand (1) | position in constant pool.
     OP_DEL_PROPERTY, // Opcode | length of operand (1) | position in constant pool.
-    OP_RETURN
+    OP_RETURN,
+    // Superinstructions.
+    // Never emitted directly, only by fuseInstructions().
+    OP_NOT_EQUAL, // OP_EQUAL, OP_NOT.
+    OP_GREATER_EQUAL, // OP_LESS, OP_NOT.
+    OP_LESS_EQUAL, // OP_GREATER, OP_NOT.
+    OP_ADD_LOCALS, // Opcode | length of operand | slot | length of operand | slot.
+    // Opcode | length of operand | slot | position in constant pool | jump offset.
+    // OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE.
+    OP_LOCAL_LESS_CONST_JUMP,
+    // Quickened forms, for two number operands.
+    // Never emitted, only written over the generic form by
+    // run() once it has seen numbers there (see QUICKEN()).
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
+    OP_GREATER_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_NUM,
+    OP_LESS_EQUAL_NUM
 } OpCode;
 
+#define OP_COUNT (OP_LESS_EQUAL_NUM + 1)
+
 typedef struct {
     int* lines;
     int* offsets;
@@ -63,12 +95,54 @@ typedef struct {
     int capacity;
 } LineArray;
 
+// Where code inlined from another function came from.
+// Such code is given a line of INLINED_LINE(index), which
+// stands for the entry at index in the chunk's table.
+typedef struct {
+    int line; // In the inlined function.
+    ObjString* function; // Its name.
+    int caller; // Line of the call it replaced.
+} InlinedLine;
+
+#define INLINED_LINE(index) (-2 - (index))
+#define INLINED_INDEX(line) (-2 - (line))
+#define IS_INLINED(line)    ((line) < -1)
+
+// The VM does not run the compact byte-code directly.
+// Once a chunk is loaded, decodeChunk() re-encodes it so
+// that every opcode and every operand takes up exactly one
+// word. OP_SHORT/OP_LONG and OP_CONSTANT/OP_CONSTANT_LONG
+// prefixes are dropped, and jump offsets count words.
+typedef uint32_t Word;
+
 typedef struct {
     int count;
     int capacity;
-    uint8_t* code;
+    uint8_t* code; // Compact form, as emitted by the compiler.
     LineArray opLines;
     ValueArray constants;
+
+    int wordCount;
+    Word* words; // Fixed-width form executed by the VM.
+    // Offset in code of the instruction each word belongs to.
+    int* wordOffsets;
+
+    // Register form, only built in register mode.
+    int regCount;
+    Word* regWords;
+    int* regOffsets; // Same as wordOffsets, for regWords.
+    int maxRegisters; // Registers a call to the chunk uses.
+
+    // One per property access and invoke in the decoded
+    // code, shared by both forms. The index follows the
+    // instruction's other operands.
+    struct InlineCache* caches;
+    int cacheCount;
+
+    // Lines of code inlined into the chunk (see InlinedLine).
+    InlinedLine* inlinedLines;
+    int inlinedCount;
+    int inlinedCapacity;
 } Chunk;
 
 // Initialize an empty chunk.
@@ -77,6 +151,8 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 // Add single byte to chunk.
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+// Drop the code from offset count on, with its lines.
+void truncateChunk(Chunk* chunk, int count);
 // Add constant to chunk pool.
 int addConstant(Chunk* chunk, Value value);
 // More constants in chunk.
@@ -85,5 +161,21 @@ int addConstant(Chunk* chunk, Value value);
 void writeConstant(Chunk* chunk, Value value, int line);
 // Get line of instruction by offset.
 int getLine(Chunk* chunk, int offset);
+// Line of the instruction in the source it was compiled
+// from, even if that was another, inlined function.
+int sourceLine(Chunk* chunk, int offset);
+// Line standing for line of the named function, inlined
+// in place of a call at caller. Entries are shared.
+int addInlinedLine(Chunk* chunk, int line, ObjString* function, int caller);
+// Number of bytes the instruction at offset takes up.
+int instructionLength(Chunk* chunk, int offset);
+// Reads the index following an OP_SHORT/OP_LONG or
+// OP_CONSTANT/OP_CONSTANT_LONG prefix at offset.
+// Moves offset past the index.
+Word readIndex(Chunk* chunk, int* offset);
+// Build the fixed-width word form of the chunk's code.
+void decodeChunk(Chunk* chunk);
+// Number of words the decoded instruction at index takes up.
+int wordLength(Chunk* chunk, int index);
 
 #endif
\ No newline at end of file
@@ -12,6 +12,45 @@
 // #define DEBUG_TRACE_STACK
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_GC_STATS
+// #define DEBUG_PROFILE_OPCODES
+// #define DEBUG_COUNT_INSTRUCTIONS
+// #define DEBUG_CACHE_STATS
+// #define DEBUG_PEEPHOLE_STATS
+// #define DEBUG_MEMORY_STATS
 // #define TIME_RUN
 
+// Represent values as NaN-boxed 64-bit words instead of a
+// 16-byte tagged struct, which halves the VM stack, the
+// constant pools and every hash-table entry.
+// #define NAN_BOXING
+
+// Dispatch opcodes in run() through a table of label
+// addresses (a GCC/Clang extension) instead of a switch.
+// Define NO_COMPUTED_GOTO to force the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Compile hot functions to x86-64 code when run with --jit.
+// Needs mmap() for executable memory and the System V calling
+// convention. Define NO_JIT to leave the JIT out.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+// Mark on background threads when run with --concurrent-gc.
+// Mark bits are claimed with atomics, an instance's shape and
+// fields change under a lock while the markers run, and any
+// object the program fills in after allocating it is left for
+// the program to trace. Needs pthreads, and is only built with
+// NAN_BOXING on x86-64, where it has been tested.
+// Define NO_CONCURRENT_GC to leave it out.
+#if defined(NAN_BOXING) && defined(__x86_64__) && \
+    (defined(__linux__) || defined(__APPLE__)) && \
+    !defined(NO_CONCURRENT_GC)
+#define CONCURRENT_GC
+#endif
+
 #endif
\ No newline at end of file
@@ -11,5 +11,15 @@ void disassembleChunk(Chunk* chunk, const char* name);
 // Disassembles each instruction in the chunk.
 // Not static since VM will also use it.
 int disassembleInstruction(Chunk* chunk, int offset);
+// Same as above, for the register form of the chunk.
+void disassembleRegisters(Chunk* chunk, const char* name);
+int disassembleRegisterInstruction(Chunk* chunk, int index);
+
+#ifdef DEBUG_PROFILE_OPCODES
+// Counts the opcode together with the ones run before it.
+void profileInstruction(int instruction);
+// Dumps the opcode pair and triple counts to stderr.
+void printOpcodeProfile();
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef clox_inline_h
+#define clox_inline_h
+
+#include "common.h"
+#include "object.h"
+
+// Bytes of code a function may have and still be inlined.
+#define INLINE_MAX_LENGTH 64
+// A caller stops taking in bodies once it is this long,
+// which keeps its jumps in range.
+#define INLINE_MAX_CALLER 16384
+
+// Replaces calls to small global functions with their
+// bodies, in the script and every function in it. Only
+// globals the script defines once, as a function, and
+// never assigns are inlined, so each call site knows what
+// it calls. Must run before any other pass has touched
+// the code. Errors in inlined code still report the calls
+// as frames (see InlinedLine).
+void inlineCalls(ObjFunction* script);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef JIT
+
+// Calls plus loop back-edges before a function is compiled.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+// Native calls nested on the C stack. Deeper calls are left
+// to the interpreter, which keeps its frames on the heap.
+#define JIT_MAX_DEPTH 256
+
+// How native code hands control back. Helpers called from
+// native code return JIT_OK to let it carry on, and anything
+// else to make it return that status at once.
+typedef enum {
+    JIT_OK,
+    JIT_RETURNED, // The frame returned, its result is pushed.
+    JIT_EXIT, // The interpreter carries on with the top frame.
+    JIT_TAIL, // Tail call: the top frame is a new callee.
+    JIT_ERROR // A runtime error has been reported.
+} JitStatus;
+
+// Runs the frame a call has just pushed as native code,
+// compiling the function first if it has become hot.
+// Returns JIT_EXIT straight away if it cannot.
+JitStatus jitEnter();
+// On-stack replacement. Carries on with the top frame, which
+// is at a loop header, in its function's native code,
+// compiling the function first if it has become hot. This
+// is how the script, which is never called, gets compiled.
+// Returns JIT_EXIT straight away if it cannot.
+JitStatus jitLoop(Word* header);
+// Releases the function's native code and traces.
+void jitFree(ObjFunction* function);
+// Generic form of a quickened opcode. Native code does not
+// need the quickened ones.
+Word genericOp(Word instruction);
+
+#endif
+
+#endif
@@ -4,8 +4,12 @@
 #include "common.h"
 #include "object.h"
 
+#ifdef CONCURRENT_GC
+#include "vm.h"
+#endif
+
 #define ALLOCATE(type, count) \
-        (type *) reallocate(NULL, 0, sizeof(type) * count)
+        (type *) reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
@@ -13,17 +17,95 @@
         ((capacity) < 8 ? 8 : (capacity) * 2)
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
-        (type *) reallocate(pointer, sizeof(type) * oldCount, \
+        (type *) reallocate(pointer, sizeof(type) * (oldCount), \
                             sizeof(type) * (newCount))
 
 #define FREE_ARRAY(type, pointer, oldCount) \
-        reallocate(pointer, sizeof(type) * oldCount, 0)
+        reallocate(pointer, sizeof(type) * (oldCount), 0)
+
+// Bytes of young objects that set off a minor collection.
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+// Bytes allocated before the first major collection.
+#ifndef GC_FIRST_MAJOR
+#define GC_FIRST_MAJOR (1024 * 1024)
+#endif
+// Major collections run a step each time this many bytes
+// have been allocated...
+#ifndef GC_STEP_SIZE
+#define GC_STEP_SIZE (32 * 1024)
+#endif
+// ...and a step marks or sweeps this many objects, unless it
+// runs out of time first.
+#ifndef GC_STEP_WORK
+#define GC_STEP_WORK 1024
+#endif
+// Default target for how long a step takes, in microseconds.
+#define GC_MAX_PAUSE 1000
+// Most marker threads --gc-threads can ask for, and how many
+// locks the instances are spread over for them.
+#define GC_MAX_THREADS 64
+#define GC_INSTANCE_LOCKS 64
+
+#ifdef CONCURRENT_GC
+// Marker threads trace an instance under its lock, so while
+// they run the program changes its shape and fields under the
+// lock too, barrier included. Either the marker sees the store,
+// or it marked the instance first and the barrier sees that.
+#define LOCK_FOR_MARKERS(instance) \
+        do \
+        { \
+            if (vm.markingConcurrently) lockInstance(instance); \
+        } while (false)
+#define UNLOCK_FOR_MARKERS(instance) \
+        do \
+        { \
+            if (vm.markingConcurrently) unlockInstance(instance); \
+        } while (false)
+// Marker threads set mark bits without a lock.
+#define IS_MARKED(object) __atomic_load_n(&(object)->isMarked, __ATOMIC_RELAXED)
+#else
+#define LOCK_FOR_MARKERS(instance) do { } while (false)
+#define UNLOCK_FOR_MARKERS(instance) do { } while (false)
+#define IS_MARKED(object) ((object)->isMarked)
+#endif
+
+// Must follow every store of a reference into an object
+// made after the object was allocated. An old object may
+// then point at a young one, so the next minor collection
+// has to trace it too. A marked object may point at one
+// marking has not reached, so the major collection under
+// way looks at it again before it sweeps.
+#define WRITE_BARRIER(object) \
+        do \
+        { \
+            Obj* written = (Obj *) (object); \
+            if ((written->isOld || IS_MARKED(written)) && \
+                !written->isRemembered) \
+                rememberObject(written); \
+        } while (false)
 
 // Only function we use for any memory management in clox.
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void markObject(Obj* object);
 void markValue(Value value);
+void rememberObject(Obj* object);
+// Collects the whole heap at once, finishing any major
+// collection under way first.
 void collectGarbage();
 void freeObjects();
+#ifdef CONCURRENT_GC
+// Held by a marker thread while it traces the instance, and
+// by the program while it swaps in a bigger fields array.
+void lockInstance(ObjInstance* instance);
+void unlockInstance(ObjInstance* instance);
+#endif
+#ifdef DEBUG_GC_STATS
+void printGCStats();
+#endif
+#ifdef DEBUG_MEMORY_STATS
+void printMemoryStats();
+#endif
 
 #endif
\ No newline at end of file
@@ -15,6 +15,7 @@
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 
 #define AS_STRING(value)        ((ObjString *) AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString *) AS_OBJ(value))->chars)
@@ -25,6 +26,7 @@
 #define AS_CLASS(value)         ((ObjClass *) AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance *) AS_OBJ(value))
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod *) AS_OBJ(value))
+#define AS_SHAPE(value)         ((ObjShape *) AS_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
@@ -34,7 +36,8 @@ typedef enum {
     OBJ_CLOSURE,
     OBJ_CLASS,
     OBJ_INSTANCE,
-    OBJ_BOUND_METHOD
+    OBJ_BOUND_METHOD,
+    OBJ_SHAPE
 } ObjType;
 
 static const char* objTypes[] = {
@@ -45,12 +48,15 @@ static const char* objTypes[] = {
     "closure",
     "class",
     "instance",
-    "bound method"
+    "bound method",
+    "shape"
 };
 
 struct Obj {
     ObjType type;
     bool isMarked;
+    bool isOld; // Survived a collection.
+    bool isRemembered; // In vm.remembered.
     struct Obj* next;
 };
 
@@ -64,12 +70,43 @@ struct ObjString {
     char chars[];
 };
 
+// Code a function runs as, lowest first. Functions start
+// out interpreted, let their instructions quicken once they
+// are warm (see tier.h) and are compiled by the JIT once hot.
+typedef enum {
+    TIER_INTERPRETED,
+    TIER_QUICKENED,
+    TIER_NATIVE
+} Tier;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    // Fix variables its closures hold copies of, rather than
+    // upvalues. They can never change, so a copy will do.
+    int capturedCount;
+    int maxStack; // Stack slots a call uses, counting from slot 0.
     Chunk chunk;
     ObjString* name;
+    // Counted to decide when to move up a tier.
+    int calls;
+    int backEdges;
+    Tier tier;
+    int deopts; // Times native code fell back to run().
+    // Native code the JIT made for the function, or NULL.
+    uint8_t* native;
+    size_t nativeSize;
+    // Offset in the native code of the instruction at each
+    // word, where on-stack replacement can enter it.
+    int* nativeEntries;
+    bool nativeFailed; // The JIT could not (or may not) compile it.
+    struct Trace* traces; // Loops in the function (see trace.h).
+    // The one closure every OP_CLOSURE of the function
+    // pushes, or NULL to make a new one each time. Only set
+    // when it captures nothing and its closures are never
+    // used but to be called, so no one can tell them apart.
+    struct ObjClosure* closure;
 } ObjFunction;
 
 // Value parameter points to the VM's stack.
@@ -89,13 +126,23 @@ typedef struct {
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount; // In case GC needs it after function is freed.
+    int capturedCount;
+    Value* captured; // Stored right after the upvalues.
+    // Allocated along with the closure, as a string's
+    // characters are.
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
+// Bytes a closure with its upvalues and captured values
+// takes up.
+#define CLOSURE_SIZE(upvalueCount, capturedCount) \
+        (sizeof(ObjClosure) + (upvalueCount) * sizeof(ObjUpvalue*) + \
+        (capturedCount) * sizeof(Value))
+
 typedef struct {
     Obj obj;
     ObjString* name;
@@ -103,10 +150,36 @@ typedef struct {
     Table methods;
 } ObjClass;
 
+// Field layout shared by every instance that got the same
+// fields in the same order. Adding a field moves an
+// instance along a transition to the child shape. The
+// field a shape adds goes in slot fieldCount - 1, so slots
+// are found by walking up the parents.
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent; // NULL for the empty root shape.
+    ObjString* name; // Field this shape adds to its parent.
+    int fieldCount;
+    // Field name -> child shape. Held weakly: a child no
+    // instance or cache uses any more is dropped by the GC.
+    Table transitions;
+} ObjShape;
+
+// Fields of an instance that has left the shapes behind,
+// found through a table of its own (see shape.h).
+typedef struct {
+    Table slots; // Field name -> slot in the instance.
+    ObjString** names; // Slot -> field name.
+    int count;
+} Dictionary;
+
 typedef struct {
     Obj Obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape; // NULL once the instance is a dictionary.
+    Dictionary* dictionary; // NULL while it has a shape.
+    Value* fields; // Indexed by the slots in shape or dictionary.
+    int capacity;
 } ObjInstance;
 
 typedef struct {
@@ -121,9 +194,13 @@ ObjString*      copyString(const char* chars, int length);
 ObjFunction*    newFunction();
 ObjUpvalue*     newUpvalue(Value* slot);
 ObjClosure*     newClosure(ObjFunction* function);
+// The closure OP_CLOSURE pushes: the function's shared one,
+// if it has one, or a new one.
+ObjClosure*     makeClosure(ObjFunction* function);
 ObjClass*       newClass(ObjString* name);
 ObjInstance*    newInstance(ObjClass* klass);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjShape*       newShape(ObjShape* parent, ObjString* name);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type)
@@ -0,0 +1,27 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+#include "common.h"
+
+// Cleans up a finished chunk: threads jumps through the
+// jumps they land on, removes code that cannot run, drops
+// values pushed only to be popped and batches pops.
+void peephole(Chunk* chunk);
+#ifdef DEBUG_PEEPHOLE_STATS
+void printPeepholeStats();
+#endif
+// Replaces common instruction sequences in a finished
+// chunk with single superinstructions.
+void fuseInstructions(Chunk* chunk);
+// Fills depth (one per byte of code) with how deep the
+// stack is on entry to each instruction, counted from the
+// frame's slot 0, or -1 where nothing reaches. Returns
+// the deepest it gets.
+int stackDepths(Chunk* chunk, int entryDepth, int* depth);
+// Deepest the stack gets while the chunk runs, counted
+// from the frame's slot 0. entryDepth values (the callee
+// and its arguments) are already there on entry.
+int maxStackDepth(Chunk* chunk, int entryDepth);
+
+#endif
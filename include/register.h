@@ -0,0 +1,79 @@
+#ifndef clox_register_h
+#define clox_register_h
+
+#include "chunk.h"
+#include "object.h"
+
+// Three-address instructions over the registers of a call
+// frame, run instead of the stack code when the VM is
+// started in register mode.
+// Register i is frame->slots[i], so locals keep the slots
+// the compiler gave them and the temporaries live right
+// above them, where the stack code would have pushed them.
+// Operands marked RK may name a constant instead of a
+// register (see RK_CONSTANT).
+typedef enum {
+    REG_MOVE, // A | RK B. R[A] = B.
+    REG_DEFINE_GLOBAL, // Global index | RK value.
+    REG_GET_GLOBAL, // A | global index.
+    REG_SET_GLOBAL, // Global index | RK value.
+    REG_GET_UPVALUE, // A | upvalue index.
+    REG_SET_UPVALUE, // Upvalue index | RK value.
+    REG_GET_CAPTURED, // A | index in closure->captured.
+    REG_GET_DEFINED_GLOBAL, // A | global index. Unchecked.
+    REG_SET_DEFINED_GLOBAL, // Global index | RK value. Unchecked.
+    REG_EQUAL, // A | RK B | RK C. R[A] = B == C.
+    REG_NOT_EQUAL,
+    REG_GREATER,
+    REG_GREATER_EQUAL,
+    REG_LESS,
+    REG_LESS_EQUAL,
+    REG_ADD,
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_COMPZERO, // A | RK B. R[A] = B == 0.
+    REG_INCREMENT, // A | RK B. R[A] = B + 1.
+    REG_DECREMENT,
+    REG_NOT,
+    REG_NEGATE,
+    REG_PRINT, // RK value.
+    REG_JUMP, // Jump offset.
+    REG_JUMP_IF_FALSE, // Register tested | jump offset.
+    REG_LOOP, // Loop start offset.
+    REG_CALL, // A | argument number. Callee in R[A], result too.
+    REG_TAIL_CALL, // A | argument number. Callee takes over the frame.
+    REG_INVOKE, // A | name of method | argument number | cache.
+    REG_CLOSURE, // A | position in constant pool | (isLocal | index)...
+    REG_CLOSE_UPVALUE, // Register to close.
+    REG_CLASS, // A | position in constant pool.
+    REG_METHOD, // Class register | method register | name.
+    REG_GET_PROPERTY, // A | RK instance | name | cache.
+    REG_SET_PROPERTY, // A | RK instance | name | RK value | cache. R[A] = value.
+    REG_DEL_PROPERTY, // RK instance | name.
+    REG_RETURN, // RK value.
+    // Quickened forms, as for the stack code.
+    REG_ADD_NUM,
+    REG_SUBTRACT_NUM,
+    REG_MULTIPLY_NUM,
+    REG_DIVIDE_NUM,
+    REG_EQUAL_NUM,
+    REG_NOT_EQUAL_NUM,
+    REG_GREATER_NUM,
+    REG_GREATER_EQUAL_NUM,
+    REG_LESS_NUM,
+    REG_LESS_EQUAL_NUM
+} RegOpCode;
+
+#define REG_OP_COUNT (REG_LESS_EQUAL_NUM + 1)
+
+// Set on an RK operand that indexes the constant pool.
+#define RK_CONSTANT         0x80000000u
+#define IS_RK_CONSTANT(rk)  (((rk) & RK_CONSTANT) != 0)
+#define RK_INDEX(rk)        ((rk) & ~RK_CONSTANT)
+
+// Translates the function's decoded stack code into
+// register code. The chunk must already be decoded.
+void buildRegisterCode(ObjFunction* function);
+
+#endif
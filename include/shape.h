@@ -0,0 +1,48 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Fields an instance can have and keep a shape. Adding one
+// more makes it a dictionary, which keeps shape chains short
+// enough to walk.
+#define SHAPE_MAX_FIELDS 32
+
+// Slot the field lives in for instances of the shape,
+// or -1 if the shape has no such field.
+int shapeSlot(ObjShape* shape, ObjString* name);
+// Shape an instance of the given shape moves to when the
+// field is added. Made the first time it is needed, and only
+// kept by the parent for as long as something else uses it.
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+
+static inline int fieldCount(ObjInstance* instance)
+{
+    return (instance->dictionary != NULL) ? instance->dictionary->count :
+                                            instance->shape->fieldCount;
+}
+
+// Slot of the field in the instance, or -1 if it has none.
+int fieldSlot(ObjInstance* instance, ObjString* name);
+// Adds a field the instance does not have yet, set to nil,
+// and returns its slot. The instance moves to the child
+// shape, or becomes a dictionary past SHAPE_MAX_FIELDS. The
+// instance and name must stay reachable.
+int addField(ObjInstance* instance, ObjString* name);
+// Makes room in the instance for count fields.
+void reserveFields(ObjInstance* instance, int count);
+
+// Field access for instances. The instance, name and
+// value must stay reachable, since these can allocate.
+// setField() is for names only known at run time, and
+// deleteField() would need a new chain of shapes for the
+// fields after the deleted one, so both make the instance
+// a dictionary.
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+void setField(ObjInstance* instance, ObjString* name, Value value);
+// Returns false if the instance has no such field.
+bool deleteField(ObjInstance* instance, ObjString* name);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef clox_ssa_h
+#define clox_ssa_h
+
+#include "chunk.h"
+#include "common.h"
+
+// The optimizing middle-end, run at -O2 on every finished
+// chunk. Rebuilds the code as a control-flow graph in SSA
+// form, removes trivial phis (copy propagation), common
+// subexpressions, loop-invariant code and dead code, then
+// lowers it back to stack code, keeping values that live
+// across instructions in local slots. arity is the number
+// of parameters. Chunks using instructions the IR does not
+// model (closures, classes, properties...) are left as
+// they are.
+void optimizeSSA(Chunk* chunk, int arity);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef clox_tier_h
+#define clox_tier_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Calls plus back-edges before a function's instructions
+// start quickening (see QUICKEN()).
+#define QUICKEN_THRESHOLD 8
+// Deoptimizations a function's native code may take
+// before it is dropped for good.
+#define DEOPT_LIMIT 16
+
+// Moves the function up to a higher tier.
+void tierUp(ObjFunction* function, Tier tier);
+// Hands a frame running native code back to the interpreter,
+// which carries on at ip. Native code keeps the frame's
+// closure and slots in vm.frames and its values on the VM
+// stack, so the frame only needs its ip. Too many of these
+// and the function drops back to the quickened tier.
+void deoptimize(CallFrame* frame, Word* ip);
+// Per-function report for --tier-stats.
+void printTierStats();
+
+static inline void warmUp(ObjFunction* function)
+{
+    if ((function->tier == TIER_INTERPRETED) &&
+        (function->calls + function->backEdges >= QUICKEN_THRESHOLD))
+        tierUp(function, TIER_QUICKENED);
+}
+
+static inline void countCall(ObjFunction* function)
+{
+    function->calls++;
+    warmUp(function);
+}
+
+static inline void countBackEdge(ObjFunction* function)
+{
+    function->backEdges++;
+    warmUp(function);
+}
+
+#endif
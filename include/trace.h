@@ -0,0 +1,49 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "chunk.h"
+#include "jit.h"
+#include "object.h"
+#include "value.h"
+
+#ifdef JIT
+
+// Back-edges to a loop header before an iteration is recorded.
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 50
+#endif
+// Instructions a recording may take before it is given up.
+#define TRACE_MAX_LENGTH 512
+// Failed recordings before a loop is left to the interpreter.
+#define TRACE_MAX_ABORTS 3
+// Local slots whose types a trace keeps track of.
+#define TRACE_MAX_SLOTS 256
+
+// A hot loop, and the native code recorded for it.
+typedef struct Trace {
+    Word* header; // First instruction of the loop body.
+    int hotness;
+    int aborts;
+    uint8_t* native; // NULL until recorded and compiled.
+    size_t nativeSize;
+    // Constants the native code holds as bare values, kept
+    // alive by the GC through markTraces().
+    ValueArray constants;
+    struct Trace* next;
+} Trace;
+
+// Called for every back-edge the interpreter takes, with
+// the frame's ip set to the loop header. Counts the loop,
+// records and compiles it once hot, and runs its trace.
+// Afterwards the frame's ip says where to carry on. Any
+// error is left for the interpreter to find and report.
+// Returns false, doing nothing, once the loop has failed
+// to trace too often.
+bool traceLoop(Word* header);
+void markTraces(ObjFunction* function);
+void freeTraces(ObjFunction* function);
+
+#endif
+
+#endif
@@ -2,6 +2,7 @@
 #define clox_value_h
 
 #include "common.h"
+#include <string.h> // For memcpy.
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -15,6 +16,80 @@ typedef enum {
     VAL_UNDEFINED // Undefined variable type.
 } ValueType;
 
+#ifdef NAN_BOXING
+
+// A Value is a double, or a quiet NaN no arithmetic ever
+// produces carrying something else: an Obj* with the sign
+// bit set, or one of the tags below in its low bits. false
+// and true differ in the lowest bit only, which holds the
+// bool, as the payload of the tagged layout does.
+typedef uint64_t Value;
+
+#define SIGN_BIT            ((uint64_t) 0x8000000000000000)
+#define QNAN                ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_FALSE           0
+#define TAG_TRUE            1
+#define TAG_NIL             2
+#define TAG_EMPTY           3
+#define TAG_UNDEFINED       4
+
+#define FALSE_VAL           ((Value) (QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value) (QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_EMPTY(value)     ((value) == EMPTY_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    valueToNumber(value)
+#define AS_OBJ(value) \
+    ((Obj*) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(value)     ((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL             ((Value) (QNAN | TAG_NIL))
+#define NUMBER_VAL(value)   numberToValue(value)
+#define OBJ_VAL(object) \
+    ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (object)))
+#define EMPTY_VAL           ((Value) (QNAN | TAG_EMPTY))
+#define UNDEFINED_VAL       ((Value) (QNAN | TAG_UNDEFINED))
+
+#define VALUE_TYPE(value)   valueType(value)
+
+static inline double valueToNumber(Value value)
+{
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value numberToValue(double number)
+{
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+static inline ValueType valueType(Value value)
+{
+    if (IS_NUMBER(value)) return VAL_NUMBER;
+    if (IS_OBJ(value)) return VAL_OBJ;
+    switch (value & ~QNAN)
+    {
+        case TAG_FALSE:
+        case TAG_TRUE:      return VAL_BOOL;
+        case TAG_NIL:       return VAL_NIL;
+        case TAG_EMPTY:     return VAL_EMPTY;
+        default:            return VAL_UNDEFINED;
+    }
+}
+
+#else
+
 typedef struct {
     ValueType type;
     union {
@@ -42,6 +117,10 @@ typedef struct {
 #define EMPTY_VAL           ((Value) {VAL_EMPTY, {.number = 0}})
 #define UNDEFINED_VAL       ((Value) {VAL_UNDEFINED, {.number = 0}})
 
+#define VALUE_TYPE(value)   ((value).type)
+
+#endif
+
 typedef struct {
     int capacity;
     int count;
@@ -6,7 +6,16 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+// Default limit on how deep calls can nest.
+#define FRAMES_MAX 65536
+// Frames a stack trace shows at each end before it skips
+// the ones in between.
+#define TRACE_FRAMES 10
+// Slots the stack starts out with.
+#define STACK_INITIAL 256
+// Slots kept free above each frame's deepest point, for
+// values pushed only to keep them from the GC.
+#define STACK_SLACK 2
 
 typedef enum {
     ACCESS_FIX,
@@ -16,32 +25,81 @@ typedef enum {
 // Single ongoing function call.
 typedef struct {
     ObjClosure* closure; // Pointer to callee's closure.
-    uint8_t* ip; // Caller's ip to resume from after return.
+    Word* ip; // Caller's ip to resume from after return.
     Value* slots; // Pointer to first slot function can use.
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    // Grown as calls nest, up to frameLimit.
+    CallFrame* frames;
     int frameCount;
-
+    int frameCapacity;
+    int frameLimit;
+    // Run the three-address register code instead
+    // of the stack code. Chosen once per run.
+    bool registerMode;
+    // Compile hot functions to native code (see jit.h).
+    // Only the stack code is compiled.
+    bool jit;
+    bool tierStats; // Report tiers once the script is done.
+    // How hard the compiler optimizes finished chunks
+    // (-O0, -O1 or -O2).
+    int optLevel;
+    // Compiling a line at a time: later lines can redefine
+    // any global.
+    bool repl;
+
+    // Only ever grown by call(), which makes room for all
+    // that the new frame will push, so push() and pop()
+    // just move stackTop.
     Value* stack;
-    int stackCount;
+    Value* stackTop;
     int stackCapacity;
 
     Table strings; // To hold our interned strings.
     ObjString* initString;
+    ObjShape* rootShape; // Shape of an instance with no fields.
+    // Bumped by every method definition, which drops
+    // every inline cache entry made before it.
+    uint32_t cacheEpoch;
 
     Table globalNames; // Table of name-(value index) pairs of global variables.
     ValueArray globalValues; // To hold values of global variables.
 
     Table globalAccess; // Tables of variable-accessibility pairs.
     Table localAccess;
+    // Values of fix globals with constant initializers,
+    // which the compiler loads directly.
+    Table globalConstants;
+    // Globals that some code compiled so far stores to.
+    Table assignedGlobals;
 
     ObjUpvalue* openUpvalues;
 
     size_t bytesAllocated; // Number of bytes VM has allocated.
-    size_t nextGC; // Threshold for next collection.
-    Obj* objects; // Linked list of (most) allocated objects.
+    size_t nextGC; // Threshold for next (full) collection.
+    // Young objects: allocated since the last collection.
+    Obj* objects;
+    size_t youngBytes;
+    // Objects that survived a collection.
+    Obj* oldObjects;
+    // Objects a major collection has yet to sweep.
+    Obj* unsweptOld;
+    Obj* unsweptYoung;
+    // Longest a step of a major collection should take, in
+    // microseconds (--gc-pause).
+    long gcPause;
+    // Mark on background threads (--concurrent-gc), how many
+    // (--gc-threads), and whether they are marking right now.
+    bool concurrentGC;
+    int gcThreads;
+    bool markingConcurrently;
+
+    // Old objects that may point at young ones, which minor
+    // collections trace as well as the roots.
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
 
     // For GC tri-color traversal.
     int grayCount;
@@ -63,4 +121,22 @@ InterpretResult interpret(const char* source);
 void push(Value value);
 Value pop();
 
+// Used by the native code from the JIT as well as by run().
+struct InlineCache;
+
+void runtimeError(const char* format, ...);
+bool callValue(Value callee, int argCount);
+bool invoke(struct InlineCache* cache, ObjString* name, int argCount);
+ObjUpvalue* captureUpvalue(Value* local);
+void closeUpvalues(Value* last);
+void replaceCaller();
+void defineMethod(ObjClass* klass, ObjString* name, Value method);
+// Replaces the instance on top of the stack with the
+// method bound to it.
+void bindMethod(ObjClosure* method);
+void concatenate();
+// Runs the stack code of the top frame, and of whatever it
+// calls, until the frame count drops back to baseFrame.
+InterpretResult run(int baseFrame);
+
 #endif
\ No newline at end of file
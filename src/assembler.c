@@ -0,0 +1,411 @@
+#include "../include/assembler.h"
+
+#ifdef JIT
+
+#include "../include/memory.h"
+#include <string.h>
+#include <sys/mman.h>
+
+void initAssembler(Assembler* a)
+{
+    a->code = NULL;
+    a->count = 0;
+    a->capacity = 0;
+    a->patches = NULL;
+    a->targets = NULL;
+    a->patchCount = 0;
+    a->patchCapacity = 0;
+}
+
+void freeAssembler(Assembler* a)
+{
+    FREE_ARRAY(uint8_t, a->code, a->capacity);
+    FREE_ARRAY(int, a->patches, a->patchCapacity);
+    FREE_ARRAY(int, a->targets, a->patchCapacity);
+    initAssembler(a);
+}
+
+uint8_t* installCode(Assembler* a)
+{
+    void* code = mmap(NULL, (size_t) a->count, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+
+    memcpy(code, a->code, (size_t) a->count);
+    mprotect(code, (size_t) a->count, PROT_READ | PROT_EXEC);
+    return (uint8_t *) code;
+}
+
+void freeCode(uint8_t* code, size_t size)
+{
+    if (code != NULL) munmap(code, size);
+}
+
+void emitByte(Assembler* a, uint8_t byte)
+{
+    if (a->capacity < a->count + 1)
+    {
+        int oldCapacity = a->capacity;
+        a->capacity = GROW_CAPACITY(oldCapacity);
+        a->code = GROW_ARRAY(uint8_t, a->code, oldCapacity, a->capacity);
+    }
+
+    a->code[a->count++] = byte;
+}
+
+void emitBytes(Assembler* a, const uint8_t* bytes, int count)
+{
+    for (int i = 0; i < count; i++)
+        emitByte(a, bytes[i]);
+}
+
+void emit32(Assembler* a, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emitByte(a, (uint8_t) (value >> (8 * i)));
+}
+
+void emit64(Assembler* a, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        emitByte(a, (uint8_t) (value >> (8 * i)));
+}
+
+// REX prefix for reg in ModRM.reg and base in ModRM.rm,
+// if the instruction needs one.
+void rex(Assembler* a, bool wide, int reg, int base)
+{
+    uint8_t prefix = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) |
+                        ((base & 8) ? 0x01 : 0);
+    if (prefix != 0x40) emitByte(a, prefix);
+}
+
+// ModRM (and SIB) for [base + disp32].
+void memory(Assembler* a, int reg, Register base, int32_t disp)
+{
+    emitByte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emitByte(a, 0x24);
+    emit32(a, (uint32_t) disp);
+}
+
+void loadQword(Assembler* a, Register dst, Register base, int32_t disp)
+{
+    rex(a, true, dst, base);
+    emitByte(a, 0x8B);
+    memory(a, dst, base, disp);
+}
+
+void storeQword(Assembler* a, Register base, int32_t disp, Register src)
+{
+    rex(a, true, src, base);
+    emitByte(a, 0x89);
+    memory(a, src, base, disp);
+}
+
+void loadImmediate(Assembler* a, Register dst, uint64_t value)
+{
+    rex(a, true, 0, dst);
+    emitByte(a, 0xB8 | (dst & 7));
+    emit64(a, value);
+}
+
+void addImmediate(Assembler* a, Register reg, int32_t value)
+{
+    rex(a, true, 0, reg);
+    emitByte(a, 0x81);
+    emitByte(a, 0xC0 | (reg & 7));
+    emit32(a, (uint32_t) value);
+}
+
+// SSE instruction between xmm and [base + disp].
+void sse(Assembler* a, uint8_t prefix, uint8_t opcode, int xmm,
+                Register base, int32_t disp)
+{
+    emitByte(a, prefix);
+    rex(a, false, xmm, base);
+    emitByte(a, 0x0F);
+    emitByte(a, opcode);
+    memory(a, xmm, base, disp);
+}
+
+#ifdef NAN_BOXING
+
+// cmp rcx, value, through rdx.
+static void compareRcx(Assembler* a, uint64_t value)
+{
+    loadImmediate(a, RDX, value);
+    emitBytes(a, (uint8_t[]) { 0x48, 0x39, 0xD1 }, 3); // cmp rcx, rdx
+}
+
+int compareType(Assembler* a, Register base, int32_t disp, ValueType type)
+{
+    loadQword(a, RCX, base, disp);
+    switch (type)
+    {
+        case VAL_NUMBER:
+            // A number unless all the quiet NaN bits are set.
+            loadImmediate(a, RDX, QNAN);
+            emitBytes(a, (uint8_t[]) { 0x48, 0x21, 0xD1 }, 3); // and rcx, rdx
+            emitBytes(a, (uint8_t[]) { 0x48, 0x39, 0xD1 }, 3); // cmp rcx, rdx
+            return CC_NE;
+        case VAL_OBJ:
+            loadImmediate(a, RDX, QNAN | SIGN_BIT);
+            emitBytes(a, (uint8_t[]) { 0x48, 0x21, 0xD1 }, 3); // and rcx, rdx
+            emitBytes(a, (uint8_t[]) { 0x48, 0x39, 0xD1 }, 3); // cmp rcx, rdx
+            return CC_E;
+        case VAL_BOOL:
+            emitBytes(a, (uint8_t[]) { 0x48, 0x83, 0xC9, 0x01 }, 4); // or rcx, 1
+            compareRcx(a, TRUE_VAL);
+            return CC_E;
+        case VAL_NIL:       compareRcx(a, NIL_VAL); return CC_E;
+        case VAL_EMPTY:     compareRcx(a, EMPTY_VAL); return CC_E;
+        default:            compareRcx(a, UNDEFINED_VAL); return CC_E;
+    }
+}
+
+// Numbers are their own type.
+void storeNumberType(Assembler* a, Register base, int32_t disp)
+{
+}
+
+#else
+
+int compareType(Assembler* a, Register base, int32_t disp, ValueType type)
+{
+    rex(a, false, 0, base);
+    emitByte(a, 0x81);
+    memory(a, 7, base, disp + TYPE);
+    emit32(a, (uint32_t) type);
+    return CC_E;
+}
+
+static void storeType(Assembler* a, Register base, int32_t disp, ValueType type)
+{
+    // The whole quadword, padding and all.
+    rex(a, true, 0, base);
+    emitByte(a, 0xC7);
+    memory(a, 0, base, disp + TYPE);
+    emit32(a, (uint32_t) type);
+}
+
+void storeNumberType(Assembler* a, Register base, int32_t disp)
+{
+    storeType(a, base, disp, VAL_NUMBER);
+}
+
+#endif
+
+// Emits a jump whose rel32 is filled in later, and
+// returns the offset of the rel32.
+int jump(Assembler* a, int condition)
+{
+    if (condition == ALWAYS)
+        emitByte(a, 0xE9);
+    else
+    {
+        emitByte(a, 0x0F);
+        emitByte(a, 0x80 | condition);
+    }
+    emit32(a, 0);
+    return a->count - 4;
+}
+
+void patchAt(Assembler* a, int at, int destination)
+{
+    int32_t relative = destination - (at + 4);
+    memcpy(a->code + at, &relative, 4);
+}
+
+void patchHere(Assembler* a, int at)
+{
+    patchAt(a, at, a->count);
+}
+
+// Jump to the instruction at a word index, or to EXIT.
+void jumpTo(Assembler* a, int condition, int target)
+{
+    if (a->patchCapacity < a->patchCount + 1)
+    {
+        int oldCapacity = a->patchCapacity;
+        a->patchCapacity = GROW_CAPACITY(oldCapacity);
+        a->patches = GROW_ARRAY(int, a->patches, oldCapacity, a->patchCapacity);
+        a->targets = GROW_ARRAY(int, a->targets, oldCapacity, a->patchCapacity);
+    }
+
+    a->patches[a->patchCount] = jump(a, condition);
+    a->targets[a->patchCount++] = target;
+}
+
+void setCondition(Assembler* a, int condition, Register reg)
+{
+    uint8_t bytes[] = { 0x0F, 0x90 | condition, 0xC0 | reg };
+    emitBytes(a, bytes, 3);
+}
+
+
+// Copies a value a quadword at a time, through rcx and rdx.
+// Values are written that way too (see storeImmediate()),
+// and matching the sizes of the stores lets the CPU forward
+// them straight to the loads.
+static void copyValue(Assembler* a, Register dst, int32_t dstDisp,
+                        Register src, int32_t srcDisp)
+{
+    #ifdef NAN_BOXING
+    loadQword(a, RCX, src, srcDisp);
+    storeQword(a, dst, dstDisp, RCX);
+    #else
+    loadQword(a, RCX, src, srcDisp);
+    loadQword(a, RDX, src, srcDisp + 8);
+    storeQword(a, dst, dstDisp, RCX);
+    storeQword(a, dst, dstDisp + 8, RDX);
+    #endif
+}
+
+void pushFrom(Assembler* a, Register base, int32_t disp)
+{
+    copyValue(a, TOP, 0, base, disp);
+    addImmediate(a, TOP, VALUE_SIZE);
+}
+
+// Copies the value on top of the stack to [base + disp].
+void storeTop(Assembler* a, Register base, int32_t disp)
+{
+    copyValue(a, base, disp, TOP, STACK(1));
+}
+
+void storeImmediate(Assembler* a, Register base, int32_t disp, Value value)
+{
+    #ifdef NAN_BOXING
+    loadImmediate(a, RAX, value);
+    storeQword(a, base, disp, RAX);
+    #else
+    uint64_t payload = 0;
+    switch (value.type)
+    {
+        case VAL_BOOL:      payload = AS_BOOL(value); break;
+        case VAL_NUMBER:    memcpy(&payload, &value.as.number, sizeof(payload)); break;
+        case VAL_OBJ:       payload = (uint64_t) (uintptr_t) AS_OBJ(value); break;
+        default:            break;
+    }
+    storeType(a, base, disp, value.type);
+    loadImmediate(a, RAX, payload);
+    storeQword(a, base, disp + PAYLOAD, RAX);
+    #endif
+}
+
+void pushImmediate(Assembler* a, Value value)
+{
+    storeImmediate(a, TOP, 0, value);
+    addImmediate(a, TOP, VALUE_SIZE);
+}
+
+void pushNumber(Assembler* a, double number)
+{
+    pushImmediate(a, NUMBER_VAL(number));
+}
+
+// Makes the value distance down a bool, from al.
+void storeBool(Assembler* a, int distance)
+{
+    emitBytes(a, (uint8_t[]) { 0x0F, 0xB6, 0xC0 }, 3); // movzx eax, al
+    #ifdef NAN_BOXING
+    loadImmediate(a, RCX, FALSE_VAL);
+    emitBytes(a, (uint8_t[]) { 0x48, 0x09, 0xC8 }, 3); // or rax, rcx
+    storeQword(a, TOP, STACK(distance), RAX);
+    #else
+    storeType(a, TOP, STACK(distance), VAL_BOOL);
+    storeQword(a, TOP, STACK(distance) + PAYLOAD, RAX);
+    #endif
+}
+
+void numberArithmetic(Assembler* a, Word instruction)
+{
+    uint8_t opcode;
+    switch (instruction)
+    {
+        case OP_ADD:        opcode = 0x58; break;
+        case OP_SUBTRACT:   opcode = 0x5C; break;
+        case OP_MULTIPLY:   opcode = 0x59; break;
+        default:            opcode = 0x5E; break;
+    }
+
+    sse(a, MOVSD_LOAD, 0, TOP, STACK(2) + PAYLOAD);
+    sse(a, 0xF2, opcode, 0, TOP, STACK(1) + PAYLOAD);
+    sse(a, MOVSD_STORE, 0, TOP, STACK(2) + PAYLOAD);
+    addImmediate(a, TOP, -VALUE_SIZE);
+}
+
+void compareDivisor(Assembler* a)
+{
+    emitBytes(a, (uint8_t[]) { 0x66, 0x0F, 0x57, 0xC9 }, 4); // xorpd xmm1, xmm1
+    sse(a, UCOMISD, 1, TOP, STACK(1) + PAYLOAD);
+}
+
+void numberComparison(Assembler* a, Word instruction)
+{
+    // Comparisons are set up so that NaN makes them false
+    // (or true for the negated ones), just as in C.
+    int left = STACK(2) + PAYLOAD;
+    int right = STACK(1) + PAYLOAD;
+    int condition = CC_A;
+    switch (instruction)
+    {
+        case OP_LESS:           left = STACK(1) + PAYLOAD;
+                                right = STACK(2) + PAYLOAD; break;
+        case OP_GREATER_EQUAL:  left = STACK(1) + PAYLOAD;
+                                right = STACK(2) + PAYLOAD;
+                                condition = CC_BE; break;
+        case OP_LESS_EQUAL:     condition = CC_BE; break;
+        case OP_EQUAL:          condition = CC_E; break;
+        case OP_NOT_EQUAL:      condition = CC_NE; break;
+        default:                break; // OP_GREATER.
+    }
+
+    sse(a, MOVSD_LOAD, 0, TOP, left);
+    sse(a, UCOMISD, 0, TOP, right);
+    setCondition(a, condition, RAX);
+    if (instruction == OP_EQUAL)
+    {
+        setCondition(a, CC_NP, RCX);
+        emitBytes(a, (uint8_t[]) { 0x20, 0xC8 }, 2); // and al, cl
+    }
+    else if (instruction == OP_NOT_EQUAL)
+    {
+        setCondition(a, CC_P, RCX);
+        emitBytes(a, (uint8_t[]) { 0x08, 0xC8 }, 2); // or al, cl
+    }
+    storeBool(a, 2);
+    addImmediate(a, TOP, -VALUE_SIZE);
+}
+
+void numberUnary(Assembler* a, Word instruction)
+{
+    // Same operations run() does, so NaN keeps its sign.
+    double operand = (instruction == OP_NEGATE) ? -1 : 1;
+    uint8_t opcode = (instruction == OP_NEGATE) ? 0x59 :
+                    (instruction == OP_INCREMENT) ? 0x58 : 0x5C;
+    uint64_t bits;
+    memcpy(&bits, &operand, sizeof(bits));
+
+    sse(a, MOVSD_LOAD, 0, TOP, STACK(1) + PAYLOAD);
+    loadImmediate(a, RAX, bits);
+    emitBytes(a, (uint8_t[]) { 0x66, 0x48, 0x0F, 0x6E, 0xC8 }, 5); // movq xmm1, rax
+    emitBytes(a, (uint8_t[]) { 0xF2, 0x0F, opcode, 0xC1 }, 4); // op xmm0, xmm1
+    sse(a, MOVSD_STORE, 0, TOP, STACK(1) + PAYLOAD);
+}
+
+void saveRegisters(Assembler* a)
+{
+    // push rbx, r12, r13, r14, r15.
+    emitBytes(a, (uint8_t[]) { 0x53, 0x41, 0x54, 0x41, 0x55,
+                                0x41, 0x56, 0x41, 0x57 }, 9);
+}
+
+void restoreRegisters(Assembler* a)
+{
+    // pop r15, r14, r13, r12, rbx.
+    emitBytes(a, (uint8_t[]) { 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D,
+                                0x41, 0x5C, 0x5B }, 9);
+}
+
+#endif
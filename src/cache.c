@@ -0,0 +1,98 @@
+#include "../include/cache.h"
+#include "../include/table.h"
+#include <stdio.h>
+
+#ifdef DEBUG_CACHE_STATS
+CacheStats cacheStats = {0, 0, 0};
+#endif
+
+// Answer handed out by a megamorphic site's misses.
+static CacheEntry scratch;
+
+void initCaches(InlineCache* caches, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        caches[i].count = 0;
+        caches[i].megamorphic = false;
+        caches[i].epoch = 0;
+    }
+}
+
+// Entry to record a miss in.
+static CacheEntry* newEntry(InlineCache* cache, ObjInstance* instance)
+{
+    CACHE_STAT(misses);
+    if (instance->dictionary != NULL) return &scratch;
+
+    if (cache->epoch != vm.cacheEpoch)
+    {
+        // A method was defined since; start over.
+        cache->count = 0;
+        cache->megamorphic = false;
+        cache->epoch = vm.cacheEpoch;
+    }
+
+    if (cache->count < CACHE_WAYS)
+        return &cache->entries[cache->count++];
+
+    if (!cache->megamorphic)
+    {
+        cache->megamorphic = true;
+        CACHE_STAT(megamorphic);
+    }
+    return &scratch;
+}
+
+CacheEntry* loadMiss(InlineCache* cache, ObjInstance* instance,
+                        ObjString* name)
+{
+    int slot = fieldSlot(instance, name);
+    Value method = NIL_VAL;
+    if ((slot == -1) &&
+        !tableGet(&instance->klass->methods, OBJ_VAL(name), &method))
+        return NULL;
+
+    CacheEntry* entry = newEntry(cache, instance);
+    entry->shape = instance->shape;
+    entry->klass = instance->klass;
+    entry->slot = slot;
+    entry->method = (slot == -1) ? AS_CLOSURE(method) : NULL;
+    entry->next = NULL;
+    return entry;
+}
+
+CacheEntry* storeMiss(InlineCache* cache, ObjInstance* instance,
+                        ObjString* name)
+{
+    ObjShape* shape = instance->shape;
+    int slot = fieldSlot(instance, name);
+    ObjShape* next = NULL;
+    if (slot == -1)
+    {
+        // The instance moves now. The entry makes the same
+        // move for the next ones, unless this one became a
+        // dictionary.
+        slot = addField(instance, name);
+        next = instance->shape;
+    }
+
+    CacheEntry* entry = newEntry(cache, instance);
+    entry->shape = shape;
+    entry->klass = NULL;
+    entry->slot = slot;
+    entry->method = NULL;
+    entry->next = next;
+    return entry;
+}
+
+#ifdef DEBUG_CACHE_STATS
+void printCacheStats()
+{
+    unsigned long total = cacheStats.hits + cacheStats.misses;
+    fprintf(stderr, "Inline caches: %lu hits, %lu misses (%.1f%% hit rate), "
+            "%lu megamorphic sites\n", cacheStats.hits, cacheStats.misses,
+            (total == 0) ? 0.0 : 100.0 * cacheStats.hits / total,
+            cacheStats.megamorphic);
+}
+#endif
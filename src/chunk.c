@@ -1,5 +1,7 @@
 #include "../include/chunk.h"
+#include "../include/cache.h"
 #include "../include/memory.h"
+#include "../include/object.h"
 #include "../include/vm.h"
 #include <stdlib.h>
 
@@ -56,6 +58,19 @@ void initChunk(Chunk* chunk)
     initValueArray(&chunk->constants);
     // Clear line array for errors.
     initLines(&chunk->opLines);
+    // Not decoded yet.
+    chunk->wordCount = 0;
+    chunk->words = NULL;
+    chunk->wordOffsets = NULL;
+    chunk->regCount = 0;
+    chunk->regWords = NULL;
+    chunk->regOffsets = NULL;
+    chunk->maxRegisters = 0;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->inlinedLines = NULL;
+    chunk->inlinedCount = 0;
+    chunk->inlinedCapacity = 0;
 }
 
 void freeChunk(Chunk* chunk)
@@ -65,6 +80,13 @@ void freeChunk(Chunk* chunk)
     freeValueArray(&chunk->constants);
     // Free and reset the line array.
     freeLines(&chunk->opLines);
+    // Free the decoded code.
+    FREE_ARRAY(Word, chunk->words, chunk->wordCount);
+    FREE_ARRAY(int, chunk->wordOffsets, chunk->wordCount);
+    FREE_ARRAY(Word, chunk->regWords, chunk->regCount);
+    FREE_ARRAY(int, chunk->regOffsets, chunk->regCount);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCount);
+    FREE_ARRAY(InlinedLine, chunk->inlinedLines, chunk->inlinedCapacity);
     initChunk(chunk);
 }
 
@@ -85,6 +107,27 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
     chunk->count++;
 }
 
+void truncateChunk(Chunk* chunk, int count)
+{
+    chunk->count = count;
+
+    // Each entry holds the last offset on its line, so
+    // entries past the end go and the last one is cut short.
+    LineArray* array = &chunk->opLines;
+    while ((array->count > 0) &&
+            (array->offsets[array->count - 1] >= count))
+    {
+        int previous = (array->count > 1) ?
+                        array->offsets[array->count - 2] : -1;
+        if (previous < count - 1)
+        {
+            array->offsets[array->count - 1] = count - 1;
+            break;
+        }
+        array->count--;
+    }
+}
+
 int addConstant(Chunk* chunk, Value value)
 {
     push(value); // Push onto stack temporarily so GC can reach it.
@@ -126,4 +169,354 @@ int getLine(Chunk* chunk, int offset)
     }
 
     return -1; // Unreachable.
-}
\ No newline at end of file
+}
+
+int sourceLine(Chunk* chunk, int offset)
+{
+    int line = getLine(chunk, offset);
+    return IS_INLINED(line) ?
+            chunk->inlinedLines[INLINED_INDEX(line)].line : line;
+}
+
+int addInlinedLine(Chunk* chunk, int line, ObjString* function, int caller)
+{
+    for (int i = 0; i < chunk->inlinedCount; i++)
+    {
+        InlinedLine* inlined = &chunk->inlinedLines[i];
+        if ((inlined->line == line) && (inlined->function == function) &&
+            (inlined->caller == caller))
+            return INLINED_LINE(i);
+    }
+
+    if (chunk->inlinedCapacity < chunk->inlinedCount + 1)
+    {
+        int oldCapacity = chunk->inlinedCapacity;
+        chunk->inlinedCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->inlinedLines = GROW_ARRAY(InlinedLine, chunk->inlinedLines,
+                                    oldCapacity, chunk->inlinedCapacity);
+    }
+
+    InlinedLine* inlined = &chunk->inlinedLines[chunk->inlinedCount];
+    inlined->line = line;
+    inlined->function = function;
+    inlined->caller = caller;
+    return INLINED_LINE(chunk->inlinedCount++);
+}
+
+Word readIndex(Chunk* chunk, int* offset)
+{
+    uint8_t* code = chunk->code;
+    uint8_t prefix = code[(*offset)++];
+    if ((prefix == OP_SHORT) || (prefix == OP_CONSTANT))
+        return code[(*offset)++];
+
+    *offset += 3;
+    return (Word) ((code[*offset - 3] << 16) |
+                    (code[*offset - 2] << 8) |
+                    code[*offset - 1]);
+}
+
+// Length of the index following an OP_SHORT/OP_LONG or
+// OP_CONSTANT/OP_CONSTANT_LONG prefix, prefix included.
+static int indexLength(uint8_t prefix)
+{
+    return ((prefix == OP_SHORT) || (prefix == OP_CONSTANT)) ? 2 : 4;
+}
+
+int instructionLength(Chunk* chunk, int offset)
+{
+    uint8_t* code = chunk->code + offset;
+    switch (code[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            return indexLength(code[0]);
+        case OP_POPN:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_DEFINED_GLOBAL:
+        case OP_SET_DEFINED_GLOBAL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_DEL_PROPERTY:
+            return 1 + indexLength(code[1]);
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return 3;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 2;
+        case OP_INVOKE:
+            return 1 + indexLength(code[1]) + 1; // Argument count.
+        case OP_CLOSURE:
+        {
+            int next = offset + 1;
+            Word index = readIndex(chunk, &next);
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[index]);
+            // One (isLocal, index) pair per upvalue and
+            // captured value.
+            return (next - offset) +
+                    2 * (function->upvalueCount + function->capturedCount);
+        }
+        case OP_ADD_LOCALS:
+        {
+            int first = indexLength(code[1]);
+            return 1 + first + indexLength(code[1 + first]);
+        }
+        case OP_LOCAL_LESS_CONST_JUMP:
+        {
+            int slot = indexLength(code[1]);
+            return 1 + slot + indexLength(code[1 + slot]) + 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+static void writeWord(Chunk* chunk, int* capacity, Word word, int offset)
+{
+    if (*capacity < chunk->wordCount + 1)
+    {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        chunk->words = GROW_ARRAY(Word, chunk->words,
+                    oldCapacity, *capacity);
+        chunk->wordOffsets = GROW_ARRAY(int, chunk->wordOffsets,
+                    oldCapacity, *capacity);
+    }
+
+    chunk->words[chunk->wordCount] = word;
+    chunk->wordOffsets[chunk->wordCount] = offset;
+    chunk->wordCount++;
+}
+
+void decodeChunk(Chunk* chunk)
+{
+    if (chunk->words != NULL) return; // Already decoded.
+
+    // Word index each byte offset decodes to, so jumps can
+    // be re-targeted once all the words are written.
+    // One extra slot for jumps to the end of the chunk.
+    int* wordIndex = ALLOCATE(int, chunk->count + 1);
+    // Words holding a jump operand, and the byte offset
+    // each jump originally targeted.
+    int* jumps = ALLOCATE(int, chunk->count);
+    int* targets = ALLOCATE(int, chunk->count);
+    int jumpCount = 0;
+    int capacity = 0;
+    int cacheCount = 0;
+
+    // Offsets jumps land on, which cannot be merged into the
+    // instruction before them.
+    bool* isTarget = ALLOCATE(bool, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++)
+        isTarget[i] = false;
+    for (int at = 0; at < chunk->count; at += instructionLength(chunk, at))
+    {
+        uint8_t instruction = chunk->code[at];
+        if ((instruction != OP_JUMP) && (instruction != OP_JUMP_IF_FALSE) &&
+            (instruction != OP_LOOP) &&
+            (instruction != OP_LOCAL_LESS_CONST_JUMP))
+            continue;
+        int end = at + instructionLength(chunk, at);
+        int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+        isTarget[(instruction == OP_LOOP) ? end - jump : end + jump] = true;
+    }
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        int start = offset;
+        uint8_t instruction = chunk->code[offset++];
+        wordIndex[start] = chunk->wordCount;
+
+        #define EMIT(word) writeWord(chunk, &capacity, (Word) (word), start)
+
+        switch (instruction)
+        {
+            case OP_ZERO:
+                if ((offset < chunk->count) &&
+                    (chunk->code[offset] == OP_COMPZER0))
+                {
+                    wordIndex[offset++] = chunk->wordCount;
+                    EMIT(OP_COMPZER0);
+                }
+                else
+                    EMIT(OP_ZERO);
+                break;
+            case OP_POP:
+                // Two pops are a byte shorter than an OP_POPN
+                // (see foldPops()), but take two dispatches.
+                if ((offset < chunk->count) &&
+                    (chunk->code[offset] == OP_POP) && !isTarget[offset])
+                {
+                    wordIndex[offset++] = chunk->wordCount;
+                    EMIT(OP_POPN);
+                    EMIT(2);
+                }
+                else
+                    EMIT(OP_POP);
+                break;
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+                offset = start; // The opcode is its own prefix.
+                EMIT(OP_CONSTANT);
+                EMIT(readIndex(chunk, &offset));
+                break;
+            case OP_POPN:
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_SET_GLOBAL:
+            case OP_SET_LOCAL:
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+            case OP_GET_CAPTURED:
+            case OP_GET_DEFINED_GLOBAL:
+            case OP_SET_DEFINED_GLOBAL:
+            case OP_CLASS:
+            case OP_METHOD:
+            case OP_DEL_PROPERTY:
+                EMIT(instruction);
+                EMIT(readIndex(chunk, &offset));
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+                EMIT(instruction);
+                EMIT(readIndex(chunk, &offset));
+                EMIT(cacheCount++);
+                break;
+            case OP_ADD_LOCALS:
+                EMIT(instruction);
+                EMIT(readIndex(chunk, &offset));
+                EMIT(readIndex(chunk, &offset));
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_LOCAL_LESS_CONST_JUMP:
+            {
+                EMIT(instruction);
+                if (instruction == OP_LOCAL_LESS_CONST_JUMP)
+                {
+                    EMIT(readIndex(chunk, &offset)); // Slot.
+                    EMIT(readIndex(chunk, &offset)); // Constant.
+                }
+                int jump = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+                offset += 2;
+                jumps[jumpCount] = chunk->wordCount;
+                targets[jumpCount++] = (instruction == OP_LOOP) ?
+                                        offset - jump : offset + jump;
+                EMIT(0); // Patched below.
+                break;
+            }
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                EMIT(instruction);
+                EMIT(chunk->code[offset++]);
+                break;
+            case OP_INVOKE:
+                EMIT(instruction);
+                EMIT(readIndex(chunk, &offset));
+                EMIT(chunk->code[offset++]); // Argument count.
+                EMIT(cacheCount++);
+                break;
+            case OP_CLOSURE:
+            {
+                Word index = readIndex(chunk, &offset);
+                ObjFunction* function = AS_FUNCTION(chunk->constants.values[index]);
+                EMIT(instruction);
+                EMIT(index);
+                int pairs = function->upvalueCount + function->capturedCount;
+                for (int i = 0; i < pairs; i++)
+                {
+                    EMIT(chunk->code[offset++]); // isLocal.
+                    EMIT(chunk->code[offset++]); // index.
+                }
+                break;
+            }
+            default:
+                EMIT(instruction);
+                break;
+        }
+
+        #undef EMIT
+    }
+    wordIndex[chunk->count] = chunk->wordCount;
+
+    // Jump operands count words from the end of the jump
+    // instruction, just like they counted bytes before.
+    for (int i = 0; i < jumpCount; i++)
+    {
+        int from = jumps[i] + 1;
+        int to = wordIndex[targets[i]];
+        chunk->words[jumps[i]] = (Word) (to > from ? to - from : from - to);
+    }
+
+    // Trim the word arrays down so freeChunk() knows their size.
+    chunk->words = GROW_ARRAY(Word, chunk->words, capacity,
+                                chunk->wordCount);
+    chunk->wordOffsets = GROW_ARRAY(int, chunk->wordOffsets, capacity,
+                                chunk->wordCount);
+
+    chunk->caches = ALLOCATE(InlineCache, cacheCount);
+    initCaches(chunk->caches, cacheCount);
+    chunk->cacheCount = cacheCount;
+
+    FREE_ARRAY(int, wordIndex, chunk->count + 1);
+    FREE_ARRAY(int, jumps, chunk->count);
+    FREE_ARRAY(int, targets, chunk->count);
+    FREE_ARRAY(bool, isTarget, chunk->count + 1);
+}
+
+int wordLength(Chunk* chunk, int index)
+{
+    switch (chunk->words[index])
+    {
+        case OP_CONSTANT:
+        case OP_POPN:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_DEFINED_GLOBAL:
+        case OP_SET_DEFINED_GLOBAL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_DEL_PROPERTY:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 2;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_ADD_LOCALS:
+            return 3;
+        case OP_INVOKE:
+        case OP_LOCAL_LESS_CONST_JUMP:
+            return 4;
+        case OP_CLOSURE:
+        {
+            ObjFunction* function = AS_FUNCTION(
+                    chunk->constants.values[chunk->words[index + 1]]);
+            return 2 + 2 * (function->upvalueCount + function->capturedCount);
+        }
+        default:
+            return 1;
+    }
+}
@@ -2,11 +2,15 @@
 #include "../include/chunk.h"
 #include "../include/common.h"
 #include "../include/debug.h"
+#include "../include/inline.h"
 #include "../include/memory.h"
 #include "../include/natives.h"
 #include "../include/object.h"
+#include "../include/optimizer.h"
 #include "../include/scanner.h"
+#include "../include/ssa.h"
 #include "../include/table.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +49,14 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    bool isFix; // Never assigned again once initialized.
+    // A fix whose initializer is a constant. Uses load
+    // the value itself.
+    bool isConstant;
+    Value constant;
+    // Function a local function declaration made, as long
+    // as every use of the local so far is a call of it.
+    ObjFunction* function;
 } Local;
 
 typedef struct {
@@ -65,6 +77,29 @@ typedef enum {
     TYPE_INITIALIZER
 } FunctionType;
 
+// Jumps out of a loop body are patched once the loop
+// is done. Both kinds first pop the locals declared inside
+// the loop, so every instruction runs at one stack depth
+// however it is reached.
+typedef struct Loop {
+    struct Loop* enclosing;
+    int breakLocals; // Locals still in scope where a break lands.
+    int continueLocals; // Locals still in scope where a continue lands.
+    int breakJumps[UINT8_COUNT]; // Fixed size for simplicity.
+    int breakCount;
+    int continueJumps[UINT8_COUNT];
+    int continueCount;
+} Loop;
+
+// The latest constant load emitted. Folding replaces it,
+// and whatever else it is an operand of, with a new load.
+typedef struct {
+    Value value;
+    int start; // Offset of the load.
+    int end; // Offset just past it, or -1 if there is none.
+    int constantCount; // Size of the pool before the load.
+} ConstantLoad;
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
@@ -72,7 +107,14 @@ typedef struct Compiler {
 
     LocalArray locals;
     Upvalue upvalues[UINT8_COUNT]; // Fixed size for simplicity.
+    // Fix variables copied into the closure. index is the
+    // slot or, if not isLocal, the enclosing closure's copy.
+    Upvalue captured[UINT8_COUNT];
     int scopeDepth;
+    Loop* loop; // Innermost loop in this function.
+    int lastCall; // Offset of the latest OP_CALL, or -1.
+    ConstantLoad constant;
+    int lastTarget; // Latest offset a forward jump lands on.
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -82,9 +124,15 @@ typedef struct ClassCompiler {
 Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
-int continueJump = -1; // End of innermost loop (before loop instruction).
-int breakJump = -1; // End of innermost loop (after loop instruction).
-int loopDepth = 0; // Depth of innermost loop.
+// Globals the script has defined by the point being
+// compiled. Top-level code runs in order, and a function
+// only once it is declared, so the definitions compiled so
+// far have always run before the code compiled next.
+Table definedGlobals;
+// Fix globals whose values this script sets or clears,
+// which only reach vm.globalConstants if it compiles. An
+// undefined value means the global is no longer a fix.
+Table fixedGlobals;
 
 static void expression();
 static void statement();
@@ -252,6 +300,8 @@ static void patchJump(int offset)
     
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    // Code before here can no longer be folded away.
+    current->lastTarget = currentChunk()->count;
 }
 
 static void emitLoop(int loopStart)
@@ -285,6 +335,136 @@ static void emitOperand(int operand)
     }
 }
 
+// ---- Constant folding. ----
+
+// Emits the cheapest load of value, and notes it so it
+// can be folded.
+static void emitValue(Value value)
+{
+    Chunk* chunk = currentChunk();
+    current->constant.value = value;
+    current->constant.start = chunk->count;
+    current->constant.constantCount = chunk->constants.count;
+
+    // -0 is not OP_ZERO: dividing by it gives -infinity.
+    if (IS_NUMBER(value) && (AS_NUMBER(value) == 0) &&
+        !signbit(AS_NUMBER(value)))
+        emitByte(OP_ZERO);
+    else if (IS_NUMBER(value) && (AS_NUMBER(value) == 1))
+        emitByte(OP_ONE);
+    else if (IS_NUMBER(value) && (AS_NUMBER(value) == 2))
+        emitByte(OP_TWO);
+    else if (IS_NUMBER(value) && (AS_NUMBER(value) == -1))
+        emitByte(OP_MINUSONE);
+    else if (IS_NIL(value))
+        emitByte(OP_NIL);
+    else if (IS_BOOL(value))
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        emitConstant(value);
+
+    current->constant.end = chunk->count;
+}
+
+// Whether the code from start on is a single constant load
+// that no jump lands in. If so, load is set to it.
+static bool constantSince(int start, ConstantLoad* load)
+{
+    if ((current->constant.start != start) ||
+        (current->constant.end != currentChunk()->count) ||
+        (current->lastTarget > start))
+        return false;
+    *load = current->constant;
+    return true;
+}
+
+// Whether the operand just compiled, for an infix
+// operator, is a constant.
+static bool constantOperand(ConstantLoad* load)
+{
+    return constantSince(current->constant.start, load);
+}
+
+// Drops the code from offset on, and the constants added
+// since the pool had constantCount of them.
+static void discardCode(int offset, int constantCount)
+{
+    truncateChunk(currentChunk(), offset);
+    currentChunk()->constants.count = constantCount;
+    if (current->lastCall >= offset)
+        current->lastCall = -1;
+    if (current->lastTarget > offset)
+        current->lastTarget = offset;
+    if (current->constant.end > offset)
+        current->constant.end = -1;
+}
+
+// Compiles an operand a constant has made dead, for its
+// errors, then drops its code.
+static void skipOperand(Precedence precedence)
+{
+    ConstantLoad kept = current->constant;
+    int start = currentChunk()->count;
+    int constantCount = currentChunk()->constants.count;
+    parsePrecedence(precedence);
+    discardCode(start, constantCount);
+    current->constant = kept;
+}
+
+static bool isFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Works out a binary operator on two constants, unless
+// that would fail, which is left for run time.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result)
+{
+    switch (operatorType)
+    {
+        case TOKEN_EQUAL_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+        case TOKEN_BANG_EQUAL:
+            *result = BOOL_VAL(!valuesEqual(a, b));
+            return true;
+        case TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b))
+            {
+                push(a);
+                push(b);
+                concatenate();
+                *result = pop();
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType)
+    {
+        case TOKEN_PLUS:            *result = NUMBER_VAL(x + y); break;
+        case TOKEN_MINUS:           *result = NUMBER_VAL(x - y); break;
+        case TOKEN_STAR:            *result = NUMBER_VAL(x * y); break;
+        case TOKEN_SLASH:
+            if (y == 0) return false;
+            *result = NUMBER_VAL(x / y);
+            break;
+        // As the OP_LESS, OP_NOT and OP_GREATER, OP_NOT
+        // pairs emitted for these, which differ for NaN.
+        case TOKEN_GREATER:         *result = BOOL_VAL(x > y); break;
+        case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(!(x < y)); break;
+        case TOKEN_LESS:            *result = BOOL_VAL(x < y); break;
+        case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(!(x > y)); break;
+        default: return false; // Unreachable.
+    }
+    return true;
+}
+
 static void initLocalArray(LocalArray* locals)
 {
     locals->count = 0;
@@ -304,6 +484,10 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     compiler->function = NULL;
     compiler->type = type;
     compiler->scopeDepth = 0;
+    compiler->loop = NULL;
+    compiler->lastCall = -1;
+    compiler->constant.end = -1;
+    compiler->lastTarget = 0;
     // Null the function then assign in case of
     // GC being triggered.
     compiler->function = newFunction();
@@ -323,6 +507,9 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     Local* local = &current->locals.vars[current->locals.count++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isFix = false;
+    local->isConstant = false;
+    local->function = NULL;
     if (type != TYPE_FUNCTION)
     {
         local->name.start = "this";
@@ -335,18 +522,66 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     }
 }
 
+// A local function that was only ever called never
+// escapes the call it is declared in, and capturing nothing
+// all its closures are the same. So they can be one.
+// Passing it as an argument counts as escaping, even to a
+// callee that only calls it: that would take looking into
+// the callee, which the compiler does not do. Bound methods
+// are not covered at all; OP_INVOKE already skips the ones
+// called straight away, and any other is a value that could
+// be compared or stored.
+static void endLocal(Local* local)
+{
+    if ((local->function != NULL) && !local->isCaptured &&
+        (local->function->upvalueCount == 0) &&
+        (local->function->capturedCount == 0))
+        local->function->closure = newClosure(local->function);
+}
+
+// Runs the optimization passes over a finished function,
+// and the functions declared in it.
+static void optimizeFunction(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        if (IS_FUNCTION(chunk->constants.values[i]))
+            optimizeFunction(AS_FUNCTION(chunk->constants.values[i]));
+    }
+
+    if (vm.optLevel >= 2)
+        optimizeSSA(chunk, function->arity);
+    if (vm.optLevel >= 1)
+    {
+        peephole(chunk);
+        fuseInstructions(chunk);
+    }
+    // Slot 0 and the parameters are there on entry.
+    function->maxStack = maxStackDepth(chunk, function->arity + 1);
+    #ifdef DEBUG_PRINT_CODE
+    disassembleChunk(chunk, function->name == NULL ?
+                "<script>" : function->name->chars);
+    #endif
+}
+
 static ObjFunction* endCompiler()
 {
     emitReturn();
     ObjFunction* function = current->function;
+    for (int i = 0; i < current->locals.count; i++)
+        endLocal(&current->locals.vars[i]);
     freeLocalArray(&current->locals);
-    #ifdef DEBUG_PRINT_CODE
-    // Only show chunk code if compiling was
-    // successful.
-    if (!parser.hadError)
-        disassembleChunk(currentChunk(), function->name == NULL ?
-                    "<script>" : function->name->chars);
-    #endif
+    // Functions are optimized once the whole script is
+    // compiled, when every call can be seen. Unpatched
+    // jumps would send the rewriters off the end of the
+    // chunk, so only valid code is.
+    if (!parser.hadError && (current->type == TYPE_SCRIPT))
+    {
+        if ((vm.optLevel >= 2) && !vm.repl)
+            inlineCalls(function);
+        optimizeFunction(function);
+    }
 
     current = current->enclosing;
     return function;
@@ -368,6 +603,7 @@ static void endScope()
                 current->scopeDepth)
     {
         // numPop++;
+        endLocal(&locals->vars[locals->count - 1]);
         if (locals->vars[locals->count - 1].isCaptured)
             emitByte(OP_CLOSE_UPVALUE);
         else
@@ -391,6 +627,42 @@ static void endScope()
     // }
 }
 
+static void beginLoop(Loop* loop)
+{
+    loop->enclosing = current->loop;
+    loop->breakLocals = current->locals.count;
+    loop->continueLocals = current->locals.count;
+    loop->breakCount = 0;
+    loop->continueCount = 0;
+    current->loop = loop;
+}
+
+static void patchJumps(int* jumps, int count)
+{
+    for (int i = 0; i < count; i++)
+        patchJump(jumps[i]);
+}
+
+static void endLoop()
+{
+    current->loop = current->loop->enclosing;
+}
+
+// Pops the locals above the first count before jumping
+// out of their scope. The locals stay declared, since
+// code after the jump still belongs to that scope.
+static void discardLocals(int count)
+{
+    LocalArray* locals = &current->locals;
+    for (int i = locals->count - 1; i >= count; i--)
+    {
+        if (locals->vars[i].isCaptured)
+            emitByte(OP_CLOSE_UPVALUE);
+        else
+            emitByte(OP_POP);
+    }
+}
+
 static void parsePrecedence(Precedence precedence)
 {
     advance();
@@ -419,23 +691,14 @@ static void parsePrecedence(Precedence precedence)
 static void number(bool canAssign)
 {
     double value = strtod(parser.previous.start, NULL);
-    if (value == 0)
-        emitByte(OP_ZERO);
-    else if (value == 1)
-        emitByte(OP_ONE);
-    else if (value == 2)
-        emitByte(OP_TWO);
-    else if (value == -1)
-        emitByte(OP_MINUSONE);
-    else
-        emitConstant(NUMBER_VAL(value));
+    emitValue(NUMBER_VAL(value));
 }
 
 static void string(bool canAssign)
 {
     // +1 to skip leading ".
     // -2 to trim trailing " (full string would be -1).
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, 
+    emitValue(OBJ_VAL(copyString(parser.previous.start + 1, 
                                     parser.previous.length -2)));
 }
 
@@ -443,15 +706,31 @@ static void literal(bool canAssign)
 {
     switch (parser.previous.type)
     {
-        case TOKEN_FALSE:   emitByte(OP_FALSE); break;
-        case TOKEN_NIL:     emitByte(OP_NIL); break;
-        case TOKEN_TRUE:    emitByte(OP_TRUE); break;
+        case TOKEN_FALSE:   emitValue(BOOL_VAL(false)); break;
+        case TOKEN_NIL:     emitValue(NIL_VAL); break;
+        case TOKEN_TRUE:    emitValue(BOOL_VAL(true)); break;
         default: return; // Unreachable.
     }
 }
 
 // Returns value slot in vm.globalValues
 // associated with given variable identifier.
+// Whether the global is sure to have a value when the
+// code being compiled runs, so its uses need no check.
+// Globals never lose their values, so one that has a value
+// already (a native, or one from an earlier REPL line) is.
+static bool isDefined(int global)
+{
+    Value value;
+    return !IS_UNDEFINED(vm.globalValues.values[global]) ||
+            tableGet(&definedGlobals, NUMBER_VAL((double) global), &value);
+}
+
+static void markDefined(int global)
+{
+    tableSet(&definedGlobals, NUMBER_VAL((double) global), BOOL_VAL(true));
+}
+
 static int identifierIndex(Token* name)
 {
     // See if we already have it.
@@ -461,9 +740,12 @@ static int identifierIndex(Token* name)
         // We do.
         return ((int) AS_NUMBER(indexValue));
 
+    // Both can collect, and nothing else holds the name yet.
+    push(OBJ_VAL(identifier));
     int newIndex = vm.globalValues.count;
     writeValueArray(&vm.globalValues, UNDEFINED_VAL);
     tableSet(&vm.globalNames, OBJ_VAL(identifier), NUMBER_VAL((double) newIndex));
+    pop();
     return newIndex;
 }
 
@@ -490,6 +772,9 @@ static void addLocal(Token name, LocalArray* locals)
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isFix = false;
+    local->isConstant = false;
+    local->function = NULL;
 }
 
 static int resolveLocal(LocalArray* locals, Token* name)
@@ -559,6 +844,50 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
     return -1;
 }
 
+static int addCaptured(Compiler* compiler, uint8_t index, bool isLocal)
+{
+    int capturedCount = compiler->function->capturedCount;
+
+    for (int i = 0; i < capturedCount; i++)
+    {
+        Upvalue* captured = &compiler->captured[i];
+        if ((captured->index == index) && (captured->isLocal == isLocal))
+            return i;
+    }
+
+    if (capturedCount == UINT8_COUNT)
+    {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+
+    compiler->captured[capturedCount].isLocal = isLocal;
+    compiler->captured[capturedCount].index = index;
+    return compiler->function->capturedCount++;
+}
+
+// Like resolveUpvalue(), for a fix variable of an enclosing
+// function. Its value is copied into the closure when it is
+// made, as it cannot change after that. -1 if the variable
+// is not one.
+static int resolveCaptured(Compiler* compiler, Token* name)
+{
+    if (compiler->enclosing == NULL) return -1;
+
+    int local = resolveLocal(&compiler->enclosing->locals, name);
+    if (local != -1)
+    {
+        if (!compiler->enclosing->locals.vars[local].isFix) return -1;
+        return addCaptured(compiler, (uint8_t) local, true);
+    }
+
+    int captured = resolveCaptured(compiler->enclosing, name);
+    if (captured != -1)
+        return addCaptured(compiler, (uint8_t) captured, false);
+
+    return -1;
+}
+
 // Declares local variables.
 static void declareVariable()
 {
@@ -602,6 +931,7 @@ static void markInitialized(Access accessType)
     LocalArray* locals = &current->locals;
     locals->vars[locals->count - 1].depth =
         current->scopeDepth;
+    locals->vars[locals->count - 1].isFix = (accessType == ACCESS_FIX);
     tableSet(&vm.localAccess, NUMBER_VAL((double) (locals->count - 1)),
                                         NUMBER_VAL((double) accessType));
 }
@@ -620,25 +950,79 @@ static void defineVariable(int global, Access accessType)
     // value in vm.globalValues.
     emitByte(OP_DEFINE_GLOBAL);
     emitOperand(global);
+    markDefined(global);
+    // varDeclaration() puts it back if this is a fix
+    // with a constant value.
+    tableSet(&fixedGlobals, NUMBER_VAL((double) global), UNDEFINED_VAL);
     
     tableSet(&vm.globalAccess, NUMBER_VAL((double) global), 
                                 NUMBER_VAL((double) accessType));
 }
 
+// Value of the variable, if it is a fix whose value is
+// known here. A fix global can be declared again later,
+// which functions compiled before then would not see, so
+// only top-level code, which runs in order, loads those,
+// and only once the definition is sure to have run.
+static bool fixedValue(Token* name, Value* value)
+{
+    for (Compiler* compiler = current; compiler != NULL;
+            compiler = compiler->enclosing)
+    {
+        LocalArray* locals = &compiler->locals;
+        for (int i = locals->count - 1; i >= 0; i--)
+        {
+            Local* local = &locals->vars[i];
+            if (identifiersEqual(name, &local->name))
+            {
+                *value = local->constant;
+                return local->isConstant;
+            }
+        }
+    }
+
+    if (current->type != TYPE_SCRIPT) return false;
+    int global = identifierIndex(name);
+    if (!isDefined(global)) return false;
+    
+    Value key = NUMBER_VAL((double) global);
+    if (tableGet(&fixedGlobals, key, value))
+        return !IS_UNDEFINED(*value);
+    return tableGet(&vm.globalConstants, key, value);
+}
+
 // Emits byte-code for variable access or assignment.
 static void namedVariable(Token name, bool canAssign)
 {
+    Value constant;
+    if (!(canAssign && check(TOKEN_EQUAL)) && fixedValue(&name, &constant))
+    {
+        emitValue(constant);
+        return;
+    }
+
     uint8_t getOp, setOp;
     Table* accessTable = NULL; // Dummy initialization.
     bool isUpvalue = false;
+    bool isCopy = false;
 
     int arg = resolveLocal(&current->locals, &name);
     if (arg != -1)
     {
+        // Anything but a call could hand the closure on.
+        if (!check(TOKEN_LEFT_PAREN))
+            current->locals.vars[arg].function = NULL;
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
         accessTable = &vm.localAccess;
     }
+    // A fix of an enclosing function.
+    else if ((arg = resolveCaptured(current, &name)) != -1)
+    {
+        getOp = OP_GET_CAPTURED;
+        setOp = OP_SET_UPVALUE; // Never runs: see below.
+        isCopy = true;
+    }
     // Variable is not in current compiler/function's scope.
     else if ((arg = resolveUpvalue(current, &name)) != -1)
     {
@@ -650,15 +1034,18 @@ static void namedVariable(Token name, bool canAssign)
     else
     {
         arg = identifierIndex(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        bool defined = isDefined(arg);
+        getOp = defined ? OP_GET_DEFINED_GLOBAL : OP_GET_GLOBAL;
+        setOp = defined ? OP_SET_DEFINED_GLOBAL : OP_SET_GLOBAL;
         accessTable = &vm.globalAccess;
     }
 
     if (canAssign && match(TOKEN_EQUAL))
     {
         Value value;
-        if (accessTable != NULL)
+        if (isCopy)
+            error("Fixed variable cannot be reassigned.");
+        else if (accessTable != NULL)
         {
            int index = isUpvalue ? current->upvalues[arg].index : arg;
            
@@ -667,6 +1054,11 @@ static void namedVariable(Token name, bool canAssign)
                     error("Fixed variable cannot be reassigned.");
         }
         
+        // A fix declared after this can still be changed by
+        // it, so varDeclaration() does not fold that one.
+        if (accessTable == &vm.globalAccess)
+            tableSet(&vm.assignedGlobals, NUMBER_VAL((double) arg),
+                        BOOL_VAL(true));
         expression();
         emitByte(setOp);
     }
@@ -714,8 +1106,21 @@ static void binary(bool canAssign)
 {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    ConstantLoad left, right;
+    bool constant = constantOperand(&left);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    Value result;
+    if (constant && constantSince(left.end, &right) &&
+        foldBinary(operatorType, left.value, right.value, &result))
+    {
+        // Nothing allocates before the new load is in
+        // the pool, so a string result is safe.
+        discardCode(left.start, left.constantCount);
+        emitValue(result);
+        return;
+    }
+
     // Chunk* chunk = currentChunk();
     // bool zero = (chunk->code[chunk->count - 1] == OP_ZERO);
     // bool one = (chunk->code[chunk->count - 1] == OP_ONE);
@@ -753,6 +1158,7 @@ static void binary(bool canAssign)
 static void call(bool canAssign)
 {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -786,8 +1192,23 @@ static void unary(bool canAssign)
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand.
+    int start = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
 
+    // Negating anything but a number is left to fail
+    // at run time.
+    ConstantLoad operand;
+    if (constantSince(start, &operand) &&
+        ((operatorType == TOKEN_BANG) || IS_NUMBER(operand.value)))
+    {
+        Value value = (operatorType == TOKEN_BANG) ?
+                        BOOL_VAL(isFalsey(operand.value)) :
+                        NUMBER_VAL(-AS_NUMBER(operand.value));
+        discardCode(operand.start, operand.constantCount);
+        emitValue(value);
+        return;
+    }
+
     // Emit the operator instruction.
     switch (operatorType)
     {
@@ -806,6 +1227,19 @@ static void grouping(bool canAssign)
 
 static void and_(bool canAssign)
 {
+    ConstantLoad left;
+    if (constantOperand(&left))
+    {
+        if (isFalsey(left.value))
+            skipOperand(PREC_AND);
+        else
+        {
+            discardCode(left.start, left.constantCount);
+            parsePrecedence(PREC_AND);
+        }
+        return;
+    }
+
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
     emitByte(OP_POP);
@@ -816,6 +1250,19 @@ static void and_(bool canAssign)
 
 static void or_(bool canAssign)
 {
+    ConstantLoad left;
+    if (constantOperand(&left))
+    {
+        if (!isFalsey(left.value))
+            skipOperand(PREC_OR);
+        else
+        {
+            discardCode(left.start, left.constantCount);
+            parsePrecedence(PREC_OR);
+        }
+        return;
+    }
+
     int elseJump = emitJump(OP_JUMP_IF_FALSE);
     int endJump = emitJump(OP_JUMP);
 
@@ -829,6 +1276,23 @@ static void or_(bool canAssign)
 
 static void conditional(bool canAssign)
 {
+    ConstantLoad condition;
+    if (constantOperand(&condition))
+    {
+        discardCode(condition.start, condition.constantCount);
+        bool truthy = !isFalsey(condition.value);
+        if (truthy)
+            expression();
+        else
+            skipOperand(PREC_ASSIGNMENT);
+        consume(TOKEN_COLON, "Expect ':' separator between ternary branches.");
+        if (truthy)
+            skipOperand(PREC_CONDITIONAL);
+        else
+            parsePrecedence(PREC_CONDITIONAL);
+        return;
+    }
+
     int falseJump = emitJump(OP_JUMP_IF_FALSE);
     // Expression is not falsey -> pop its value.
     emitByte(OP_POP);
@@ -856,7 +1320,7 @@ static void block()
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+static ObjFunction* function(FunctionType type)
 {
     Compiler compiler;
     initCompiler(&compiler, type);
@@ -879,14 +1343,24 @@ static void function(FunctionType type)
     block();
 
     ObjFunction* function = endCompiler();
+    // Nothing roots the function until it is in the constant
+    // pool, and writing OP_CLOSURE can collect.
+    push(OBJ_VAL(function));
     emitByte(OP_CLOSURE);
     emitConstant(OBJ_VAL(function));
+    pop();
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
         emitByte(compiler.upvalues[i].index);
     }
+    for (int i = 0; i < function->capturedCount; i++)
+    {
+        emitByte(compiler.captured[i].isLocal ? 1 : 0);
+        emitByte(compiler.captured[i].index);
+    }
+    return function;
 }
 
 static void method()
@@ -937,21 +1411,49 @@ static void varDeclaration(Access accessType)
 {
     int global = parseVariable("Expect variable name.");
 
+    int start = currentChunk()->count;
     if (match(TOKEN_EQUAL))
         expression();
     else
-        emitByte(OP_NIL);
+        emitValue(NIL_VAL);
     
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    ConstantLoad initializer;
+    bool constant = (accessType == ACCESS_FIX) &&
+                    constantSince(start, &initializer);
     // Only define if no compilation problem.
     defineVariable(global, accessType);
+
+    if (!constant) return;
+    if (current->scopeDepth > 0)
+    {
+        Local* local = &current->locals.vars[current->locals.count - 1];
+        local->isConstant = true;
+        local->constant = initializer.value;
+    }
+    else
+    {
+        // Code compiled before this that stores to the global
+        // can still run, so its value is only known if there
+        // is none.
+        Value key = NUMBER_VAL((double) global);
+        Value assigned;
+        if (!tableGet(&vm.assignedGlobals, key, &assigned))
+            tableSet(&fixedGlobals, key, initializer.value);
+    }
 }
 
 static void funDeclaration()
 {
     int global = parseVariable("Expect function name");
     markInitialized(ACCESS_VAR);
-    function(TYPE_FUNCTION);
+    // The function is defined as soon as it is made, so it
+    // is by the time its body can run.
+    if (current->scopeDepth == 0)
+        markDefined(global);
+    ObjFunction* declared = function(TYPE_FUNCTION);
+    if (current->scopeDepth > 0)
+        current->locals.vars[current->locals.count - 1].function = declared;
     defineVariable(global, ACCESS_VAR);
 }
 
@@ -995,10 +1497,8 @@ static void ifStatement()
 
 static void whileStatement()
 {
-    int surroundBreakJump = breakJump;
-    int surroundContinueJump = continueJump;
-
-    loopDepth++;
+    Loop loop;
+    beginLoop(&loop);
     int loopStart = currentChunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
@@ -1008,26 +1508,18 @@ static void whileStatement()
     emitByte(OP_POP);
     statement();
 
-    if (continueJump != -1)
-        patchJump(continueJump);
+    patchJumps(loop.continueJumps, loop.continueCount);
     emitLoop(loopStart);
 
     patchJump(exitJump);
     emitByte(OP_POP);
 
-    if (breakJump != -1)
-        patchJump(breakJump);
-
-    breakJump = surroundBreakJump;
-    continueJump = surroundContinueJump;
-    loopDepth--;
+    patchJumps(loop.breakJumps, loop.breakCount);
+    endLoop();
 }
 
 static void forStatement()
 {   
-    int surroundBreakJump = breakJump;
-    int surroundContinueJump = continueJump;
-
     // Grab the name and slot of the loop variable
     // so we can refer to it later.
     int loopVariable = -1;
@@ -1035,7 +1527,6 @@ static void forStatement()
     loopVariableName.start = NULL;
     
     beginScope();
-    loopDepth++;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
     if (match(TOKEN_SEMICOLON)) {}
     else if (match(TOKEN_VAR))
@@ -1049,6 +1540,8 @@ static void forStatement()
     else
         expressionStatement();
     
+    Loop loop;
+    beginLoop(&loop);
     int loopStart = currentChunk()->count;
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON))
@@ -1088,10 +1581,14 @@ static void forStatement()
         markInitialized(ACCESS_VAR);
         // Keep track of its slot.
         innerVariable = current->locals.count - 1;
+        // A continue still stores the copy back.
+        loop.continueLocals = current->locals.count;
     }
 
     statement();
 
+    patchJumps(loop.continueJumps, loop.continueCount);
+
     if (loopVariable != -1)
     {
         // Store the inner variable back in the loop
@@ -1108,14 +1605,8 @@ static void forStatement()
         endScope();
     }
 
-    if (continueJump != -1)
-        patchJump(continueJump);
-
     emitLoop(loopStart);
 
-    if (breakJump != -1)
-        patchJump(breakJump);
-
     if (exitJump != -1)
     {
         patchJump(exitJump);
@@ -1124,11 +1615,10 @@ static void forStatement()
         emitByte(OP_POP);
     }
 
-    loopDepth--;
+    // Breaks skip the condition, so they land after its pop.
+    patchJumps(loop.breakJumps, loop.breakCount);
+    endLoop();
     endScope();
-
-    breakJump = surroundBreakJump;
-    continueJump = surroundContinueJump;
 }
 
 static void matchStruct()
@@ -1142,6 +1632,7 @@ static void matchStruct()
 
     int cases[MAX_CASES];
     int caseNum = 0;
+    bool hasDefault = false;
 
     while (match(TOKEN_IS))
     {
@@ -1153,6 +1644,7 @@ static void matchStruct()
             consume(TOKEN_COLON, "Expect ':' after default case.");
             // Pop the match value.
             emitByte(OP_POP);
+            hasDefault = true;
             statement();
             // Small check.
             if (match(TOKEN_IS))
@@ -1184,8 +1676,10 @@ static void matchStruct()
 
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after cases.");
 
-    // Pop the match value if OP_JUMP didn't run.
-    emitByte(OP_POP);
+    // Pop the match value if OP_JUMP didn't run
+    // and the default case hasn't popped it already.
+    if (!hasDefault)
+        emitByte(OP_POP);
     for (int i = 0; i < caseNum; i++)
         patchJump(cases[i]);
 
@@ -1194,18 +1688,38 @@ static void matchStruct()
 
 static void breakStatement()
 {
-    if (loopDepth == 0)
+    Loop* loop = current->loop;
+    if (loop == NULL)
         error("Cannot use 'break' outside of a loop.");
     consume(TOKEN_SEMICOLON, "Expect ';' after 'break'.");
-    breakJump = emitJump(OP_JUMP);
+    if (loop == NULL) return;
+
+    if (loop->breakCount == UINT8_COUNT)
+    {
+        error("Too many 'break' statements in loop.");
+        return;
+    }
+
+    discardLocals(loop->breakLocals);
+    loop->breakJumps[loop->breakCount++] = emitJump(OP_JUMP);
 }
 
 static void continueStatement()
 {
-    if (loopDepth == 0)
+    Loop* loop = current->loop;
+    if (loop == NULL)
         error("Cannot use 'continue' outside of a loop.");
     consume(TOKEN_SEMICOLON, "Expect ';' after 'continue'.");
-    continueJump = emitJump(OP_JUMP);
+    if (loop == NULL) return;
+
+    if (loop->continueCount == UINT8_COUNT)
+    {
+        error("Too many 'continue' statements in loop.");
+        return;
+    }
+
+    discardLocals(loop->continueLocals);
+    loop->continueJumps[loop->continueCount++] = emitJump(OP_JUMP);
 }
 
 static void delStatement()
@@ -1227,6 +1741,7 @@ static void delStatement()
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after 'del' command.");
+    emitByte(OP_POP); // OP_DEL_PROPERTY leaves the instance.
 }
 
 static void returnStatement()
@@ -1243,6 +1758,12 @@ static void returnStatement()
         // Compile the rest to avoid cascading errors.
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // 'return f(...);' Nothing is left to do in this
+        // frame once the call is made, so the callee can
+        // have it. Any jump to the OP_RETURN still works.
+        if ((current->lastCall != -1) &&
+            (current->lastCall == currentChunk()->count - 2))
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
         emitByte(OP_RETURN);
     }
 }
@@ -1343,6 +1864,21 @@ static ParseRule* getRule(TokenType type)
     return &rules[type];
 }
 
+// Hands the fix globals of a script that compiled on
+// to later scripts.
+static void keepFixedGlobals()
+{
+    for (int i = 0; i < fixedGlobals.capacity; i++)
+    {
+        Entry* entry = &fixedGlobals.entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        if (IS_UNDEFINED(entry->value))
+            tableDelete(&vm.globalConstants, entry->key);
+        else
+            tableSet(&vm.globalConstants, entry->key, entry->value);
+    }
+}
+
 ObjFunction* compile(const char* source)
 {
     // Set up scanner.
@@ -1354,12 +1890,24 @@ ObjFunction* compile(const char* source)
 
     parser.hadError = false;
     parser.panicMode = false;
+    initTable(&definedGlobals);
+    initTable(&fixedGlobals);
 
     advance();
     while (!match(TOKEN_EOF))
         declaration();
 
     ObjFunction* function = endCompiler();
+    if (!parser.hadError)
+    {
+        // endCompiler() popped the compiler that kept the
+        // script rooted, and keepFixedGlobals() can collect.
+        push(OBJ_VAL(function));
+        keepFixedGlobals();
+        pop();
+    }
+    freeTable(&definedGlobals);
+    freeTable(&fixedGlobals);
     return (parser.hadError ? NULL : function);
 }
 
@@ -1371,4 +1919,5 @@ void markCompilerRoots()
         markObject((Obj *) compiler->function);
         compiler = compiler->enclosing;
     }
+    markTable(&fixedGlobals);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "../include/debug.h"
 #include "../include/object.h"
+#include "../include/register.h"
 #include "../include/value.h"
 #include "../include/vm.h"
 #include <stdio.h>
@@ -96,6 +97,29 @@ static int varInstruction(const char* name, Chunk* chunk, int offset)
     return offset + off;
 }
 
+static int addLocalsInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int next = offset + 1;
+    int first = readIndex(chunk, &next);
+    int second = readIndex(chunk, &next);
+    printf("%-20s %4s  %d + %d\n", name, "VAR", first, second);
+    return next;
+}
+
+static int lessJumpInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int next = offset + 1;
+    int slot = readIndex(chunk, &next);
+    int index = readIndex(chunk, &next);
+    uint16_t jump = (uint16_t) (chunk->code[next] << 8);
+    jump |= chunk->code[next + 1];
+    next += 2;
+    printf("%-20s %4s  %d < '", name, "VAR", slot);
+    printValue(chunk->constants.values[index]);
+    printf("' %4d -> %d\n", offset, next + jump);
+    return next;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk,
                             int offset)
 {
@@ -129,9 +153,9 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset)
 int disassembleInstruction(Chunk* chunk, int offset)
 {
     printf("%04d ", offset);
-    int line = getLine(chunk, offset);
+    int line = sourceLine(chunk, offset);
     if (offset > 0 &&
-        line == getLine(chunk, offset - 1))
+        line == sourceLine(chunk, offset - 1))
             printf("   | ");
     else
         printf("%4d ", line);
@@ -174,9 +198,15 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_SET_LOCAL:
             return varInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_UPVALUE:
-            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+            return varInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
-            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+            return varInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_CAPTURED:
+            return varInstruction("OP_GET_CAPTURED", chunk, offset);
+        case OP_GET_DEFINED_GLOBAL:
+            return varInstruction("OP_GET_DEFINED_GLOBAL", chunk, offset);
+        case OP_SET_DEFINED_GLOBAL:
+            return varInstruction("OP_SET_DEFINED_GLOBAL", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -211,6 +241,8 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_CLOSURE:
@@ -241,6 +273,13 @@ int disassembleInstruction(Chunk* chunk, int offset)
                 printf("%04d    |                     %s  %d\n",
                     offset - 2, isLocal ? "local" : "upvalue", index);
             }
+            for (int i = 0; i < function->capturedCount; i++)
+            {
+                int isLocal = chunk->code[offset++];
+                int index = chunk->code[offset++];
+                printf("%04d    |                     copy %s  %d\n",
+                    offset - 2, isLocal ? "local" : "captured", index);
+            }
 
             return offset;
         }
@@ -258,8 +297,374 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return valueInstruction("OP_DEL_PROPERTY", chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_ADD_LOCALS:
+            return addLocalsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_LOCAL_LESS_CONST_JUMP:
+            return lessJumpInstruction("OP_LOCAL_LESS_CONST_JUMP", chunk, offset);
         default:
             printf("UNKNOWN OPCODE %d\n", instruction);
             return offset + 1;
     }
-}
\ No newline at end of file
+}
+
+void disassembleRegisters(Chunk* chunk, const char* name)
+{
+    printf("== %s (registers: %d) ==\n", name, chunk->maxRegisters);
+
+    for (int index = 0; index < chunk->regCount;)
+        index = disassembleRegisterInstruction(chunk, index);
+}
+
+// Prints a register, or a constant for an RK operand.
+static void printOperand(Chunk* chunk, Word operand)
+{
+    if (IS_RK_CONSTANT(operand))
+    {
+        printf(" k%d '", (int) RK_INDEX(operand));
+        printValue(chunk->constants.values[RK_INDEX(operand)]);
+        printf("'");
+    }
+    else
+        printf(" r%d", (int) operand);
+}
+
+// Prints an index into the constant pool with its value.
+static void printConstant(Chunk* chunk, Word index)
+{
+    printOperand(chunk, RK_CONSTANT | index);
+}
+
+// Registers and RK operands, count of them after the opcode.
+static int operandInstruction(const char* name, Chunk* chunk,
+                                int index, int count)
+{
+    printf("%-20s", name);
+    for (int i = 1; i <= count; i++)
+        printOperand(chunk, chunk->regWords[index + i]);
+    printf("\n");
+    return index + 1 + count;
+}
+
+// Register or RK operand, followed by a name in the pool.
+static int namedInstruction(const char* name, Chunk* chunk, int index)
+{
+    printf("%-20s", name);
+    printOperand(chunk, chunk->regWords[index + 1]);
+    printConstant(chunk, chunk->regWords[index + 2]);
+    printf("\n");
+    return index + 3;
+}
+
+// Register followed by a plain index (global, upvalue).
+static int indexInstruction(const char* name, Chunk* chunk,
+                            int index, bool registerFirst)
+{
+    Word first = chunk->regWords[index + 1];
+    Word second = chunk->regWords[index + 2];
+    printf("%-20s", name);
+    if (registerFirst)
+        printf(" r%d %d\n", (int) first, (int) second);
+    else
+    {
+        printf(" %d", (int) first);
+        printOperand(chunk, second);
+        printf("\n");
+    }
+    return index + 3;
+}
+
+static int regJumpInstruction(const char* name, int sign, Chunk* chunk,
+                                int index, bool hasTest)
+{
+    int end = index + (hasTest ? 3 : 2);
+    Word jump = chunk->regWords[end - 1];
+    printf("%-20s", name);
+    if (hasTest)
+        printOperand(chunk, chunk->regWords[index + 1]);
+    printf(" %4d -> %d\n", index, end + sign * (int) jump);
+    return end;
+}
+
+int disassembleRegisterInstruction(Chunk* chunk, int index)
+{
+    printf("%04d ", index);
+    int line = sourceLine(chunk, chunk->regOffsets[index]);
+    if (index > 0 &&
+        line == sourceLine(chunk, chunk->regOffsets[index - 1]))
+            printf("   | ");
+    else
+        printf("%4d ", line);
+
+    Word* words = chunk->regWords + index;
+    switch (words[0])
+    {
+        case REG_MOVE:
+            return operandInstruction("REG_MOVE", chunk, index, 2);
+        case REG_DEFINE_GLOBAL:
+            return indexInstruction("REG_DEFINE_GLOBAL", chunk, index, false);
+        case REG_GET_GLOBAL:
+            return indexInstruction("REG_GET_GLOBAL", chunk, index, true);
+        case REG_SET_GLOBAL:
+            return indexInstruction("REG_SET_GLOBAL", chunk, index, false);
+        case REG_GET_UPVALUE:
+            return indexInstruction("REG_GET_UPVALUE", chunk, index, true);
+        case REG_SET_UPVALUE:
+            return indexInstruction("REG_SET_UPVALUE", chunk, index, false);
+        case REG_GET_CAPTURED:
+            return indexInstruction("REG_GET_CAPTURED", chunk, index, true);
+        case REG_GET_DEFINED_GLOBAL:
+            return indexInstruction("REG_GET_DEFINED_GLOBAL", chunk, index,
+                                    true);
+        case REG_SET_DEFINED_GLOBAL:
+            return indexInstruction("REG_SET_DEFINED_GLOBAL", chunk, index,
+                                    false);
+        case REG_EQUAL:
+            return operandInstruction("REG_EQUAL", chunk, index, 3);
+        case REG_NOT_EQUAL:
+            return operandInstruction("REG_NOT_EQUAL", chunk, index, 3);
+        case REG_GREATER:
+            return operandInstruction("REG_GREATER", chunk, index, 3);
+        case REG_GREATER_EQUAL:
+            return operandInstruction("REG_GREATER_EQUAL", chunk, index, 3);
+        case REG_LESS:
+            return operandInstruction("REG_LESS", chunk, index, 3);
+        case REG_LESS_EQUAL:
+            return operandInstruction("REG_LESS_EQUAL", chunk, index, 3);
+        case REG_ADD:
+            return operandInstruction("REG_ADD", chunk, index, 3);
+        case REG_SUBTRACT:
+            return operandInstruction("REG_SUBTRACT", chunk, index, 3);
+        case REG_MULTIPLY:
+            return operandInstruction("REG_MULTIPLY", chunk, index, 3);
+        case REG_DIVIDE:
+            return operandInstruction("REG_DIVIDE", chunk, index, 3);
+        case REG_COMPZERO:
+            return operandInstruction("REG_COMPZERO", chunk, index, 2);
+        case REG_INCREMENT:
+            return operandInstruction("REG_INCREMENT", chunk, index, 2);
+        case REG_DECREMENT:
+            return operandInstruction("REG_DECREMENT", chunk, index, 2);
+        case REG_NOT:
+            return operandInstruction("REG_NOT", chunk, index, 2);
+        case REG_NEGATE:
+            return operandInstruction("REG_NEGATE", chunk, index, 2);
+        case REG_PRINT:
+            return operandInstruction("REG_PRINT", chunk, index, 1);
+        case REG_JUMP:
+            return regJumpInstruction("REG_JUMP", 1, chunk, index, false);
+        case REG_JUMP_IF_FALSE:
+            return regJumpInstruction("REG_JUMP_IF_FALSE", 1, chunk, index, true);
+        case REG_LOOP:
+            return regJumpInstruction("REG_LOOP", -1, chunk, index, false);
+        case REG_CALL:
+        case REG_TAIL_CALL:
+            printf("%-20s r%d (%d args)\n", (words[0] == REG_CALL) ?
+                    "REG_CALL" : "REG_TAIL_CALL", (int) words[1], (int) words[2]);
+            return index + 3;
+        case REG_INVOKE:
+            printf("%-20s r%d", "REG_INVOKE", (int) words[1]);
+            printConstant(chunk, words[2]);
+            printf(" (%d args)\n", (int) words[3]);
+            return index + 5;
+        case REG_CLOSURE:
+        {
+            printf("%-20s r%d", "REG_CLOSURE", (int) words[1]);
+            printConstant(chunk, words[2]);
+            printf("\n");
+
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[words[2]]);
+            int next = index + 3;
+            for (int i = 0; i < function->upvalueCount; i++)
+            {
+                printf("%04d    |                     %s  %d\n",
+                    next, words[3 + 2 * i] ? "local" : "upvalue",
+                    (int) words[4 + 2 * i]);
+                next += 2;
+            }
+            for (int i = function->upvalueCount;
+                    i < function->upvalueCount + function->capturedCount; i++)
+            {
+                printf("%04d    |                     copy %s  %d\n",
+                    next, words[3 + 2 * i] ? "local" : "captured",
+                    (int) words[4 + 2 * i]);
+                next += 2;
+            }
+
+            return next;
+        }
+        case REG_CLOSE_UPVALUE:
+            return operandInstruction("REG_CLOSE_UPVALUE", chunk, index, 1);
+        case REG_CLASS:
+            printf("%-20s r%d", "REG_CLASS", (int) words[1]);
+            printConstant(chunk, words[2]);
+            printf("\n");
+            return index + 3;
+        case REG_METHOD:
+            printf("%-20s", "REG_METHOD");
+            printOperand(chunk, words[1]);
+            printOperand(chunk, words[2]);
+            printConstant(chunk, words[3]);
+            printf("\n");
+            return index + 4;
+        case REG_GET_PROPERTY:
+            printf("%-20s r%d", "REG_GET_PROPERTY", (int) words[1]);
+            printOperand(chunk, words[2]);
+            printConstant(chunk, words[3]);
+            printf("\n");
+            return index + 5;
+        case REG_SET_PROPERTY:
+            printf("%-20s r%d", "REG_SET_PROPERTY", (int) words[1]);
+            printOperand(chunk, words[2]);
+            printConstant(chunk, words[3]);
+            printOperand(chunk, words[4]);
+            printf("\n");
+            return index + 6;
+        case REG_DEL_PROPERTY:
+            return namedInstruction("REG_DEL_PROPERTY", chunk, index);
+        case REG_RETURN:
+            return operandInstruction("REG_RETURN", chunk, index, 1);
+        case REG_ADD_NUM:
+            return operandInstruction("REG_ADD_NUM", chunk, index, 3);
+        case REG_SUBTRACT_NUM:
+            return operandInstruction("REG_SUBTRACT_NUM", chunk, index, 3);
+        case REG_MULTIPLY_NUM:
+            return operandInstruction("REG_MULTIPLY_NUM", chunk, index, 3);
+        case REG_DIVIDE_NUM:
+            return operandInstruction("REG_DIVIDE_NUM", chunk, index, 3);
+        case REG_EQUAL_NUM:
+            return operandInstruction("REG_EQUAL_NUM", chunk, index, 3);
+        case REG_NOT_EQUAL_NUM:
+            return operandInstruction("REG_NOT_EQUAL_NUM", chunk, index, 3);
+        case REG_GREATER_NUM:
+            return operandInstruction("REG_GREATER_NUM", chunk, index, 3);
+        case REG_GREATER_EQUAL_NUM:
+            return operandInstruction("REG_GREATER_EQUAL_NUM", chunk, index, 3);
+        case REG_LESS_NUM:
+            return operandInstruction("REG_LESS_NUM", chunk, index, 3);
+        case REG_LESS_EQUAL_NUM:
+            return operandInstruction("REG_LESS_EQUAL_NUM", chunk, index, 3);
+        default:
+            printf("UNKNOWN OPCODE %d\n", (int) words[0]);
+            return index + 1;
+    }
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+static const char* opNames[OP_COUNT] = {
+    "OP_ZERO",
+    "OP_ONE",
+    "OP_TWO",
+    "OP_MINUSONE",
+    "OP_CONSTANT",
+    "OP_CONSTANT_LONG",
+    "OP_SHORT",
+    "OP_LONG",
+    "OP_DUP",
+    "OP_NIL",
+    "OP_TRUE",
+    "OP_FALSE",
+    "OP_POP",
+    "OP_POPN",
+    "OP_DEFINE_GLOBAL",
+    "OP_GET_GLOBAL",
+    "OP_GET_LOCAL",
+    "OP_SET_GLOBAL",
+    "OP_SET_LOCAL",
+    "OP_GET_UPVALUE",
+    "OP_SET_UPVALUE",
+    "OP_GET_CAPTURED",
+    "OP_GET_DEFINED_GLOBAL",
+    "OP_SET_DEFINED_GLOBAL",
+    "OP_EQUAL",
+    "OP_GREATER",
+    "OP_LESS",
+    "OP_COMPZER0",
+    "OP_INCREMENT",
+    "OP_DECREMENT",
+    "OP_ADD",
+    "OP_SUBTRACT",
+    "OP_MULTIPLY",
+    "OP_DIVIDE",
+    "OP_NOT",
+    "OP_NEGATE",
+    "OP_PRINT",
+    "OP_JUMP",
+    "OP_JUMP_IF_FALSE",
+    "OP_LOOP",
+    "OP_CALL",
+    "OP_TAIL_CALL",
+    "OP_INVOKE",
+    "OP_CLOSURE",
+    "OP_CLOSE_UPVALUE",
+    "OP_CLASS",
+    "OP_METHOD",
+    "OP_GET_PROPERTY",
+    "OP_SET_PROPERTY",
+    "OP_DEL_PROPERTY",
+    "OP_RETURN",
+    "OP_NOT_EQUAL",
+    "OP_GREATER_EQUAL",
+    "OP_LESS_EQUAL",
+    "OP_ADD_LOCALS",
+    "OP_LOCAL_LESS_CONST_JUMP",
+    "OP_ADD_NUM",
+    "OP_SUBTRACT_NUM",
+    "OP_MULTIPLY_NUM",
+    "OP_DIVIDE_NUM",
+    "OP_EQUAL_NUM",
+    "OP_NOT_EQUAL_NUM",
+    "OP_GREATER_NUM",
+    "OP_GREATER_EQUAL_NUM",
+    "OP_LESS_NUM",
+    "OP_LESS_EQUAL_NUM"
+};
+
+// How often each pair and triple of opcodes ran back to back.
+static unsigned long bigrams[OP_COUNT][OP_COUNT];
+static unsigned long trigrams[OP_COUNT][OP_COUNT][OP_COUNT];
+// The two opcodes executed before the current one.
+static int previous[2] = {-1, -1};
+
+void profileInstruction(int instruction)
+{
+    if (previous[1] != -1)
+    {
+        bigrams[previous[1]][instruction]++;
+        if (previous[0] != -1)
+            trigrams[previous[0]][previous[1]][instruction]++;
+    }
+
+    previous[0] = previous[1];
+    previous[1] = instruction;
+}
+
+void printOpcodeProfile()
+{
+    // One tab-separated record per sequence that ran, so
+    // the output of several runs can be summed up
+    // (see the profile target in the Makefile).
+    for (int a = 0; a < OP_COUNT; a++)
+    {
+        for (int b = 0; b < OP_COUNT; b++)
+        {
+            if (bigrams[a][b] != 0)
+                fprintf(stderr, "bigram\t%s %s\t%lu\n",
+                        opNames[a], opNames[b], bigrams[a][b]);
+
+            for (int c = 0; c < OP_COUNT; c++)
+            {
+                if (trigrams[a][b][c] != 0)
+                    fprintf(stderr, "trigram\t%s %s %s\t%lu\n",
+                            opNames[a], opNames[b], opNames[c],
+                            trigrams[a][b][c]);
+            }
+        }
+    }
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,553 @@
+#include "../include/inline.h"
+#include "../include/chunk.h"
+#include "../include/memory.h"
+#include "../include/optimizer.h"
+#include "../include/vm.h"
+#include <math.h>
+#include <stdlib.h>
+
+typedef enum {
+    UNVISITED,
+    IN_PROGRESS, // Calls back into it are recursion: left alone.
+    DONE
+} InlineState;
+
+typedef struct {
+    ObjFunction** functions; // The script and every function in it.
+    InlineState* states;
+    // Whether the function calls back into itself, directly
+    // or through others. Inlining it would unroll the
+    // recursion into the caller until the caller is full.
+    bool* recursive;
+    int count;
+    int capacity;
+    // Function each global holds for good, or NULL.
+    ObjFunction** callees;
+    int globalCount;
+} Inliner;
+
+static void addFunction(Inliner* inliner, ObjFunction* function)
+{
+    if (inliner->capacity < inliner->count + 1)
+    {
+        int oldCapacity = inliner->capacity;
+        inliner->capacity = GROW_CAPACITY(oldCapacity);
+        inliner->functions = GROW_ARRAY(ObjFunction*, inliner->functions,
+                                    oldCapacity, inliner->capacity);
+        inliner->states = GROW_ARRAY(InlineState, inliner->states,
+                                    oldCapacity, inliner->capacity);
+        inliner->recursive = GROW_ARRAY(bool, inliner->recursive,
+                                    oldCapacity, inliner->capacity);
+    }
+    inliner->functions[inliner->count] = function;
+    inliner->recursive[inliner->count] = false;
+    inliner->states[inliner->count++] = UNVISITED;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        if (IS_FUNCTION(constants->values[i]))
+            addFunction(inliner, AS_FUNCTION(constants->values[i]));
+    }
+}
+
+// Finds the globals that are only ever a function
+// declared at the top of the script. One that already
+// has a value (a native) could be called before the
+// declaration runs, so it is not one of them.
+static void findCallees(Inliner* inliner)
+{
+    int count = vm.globalValues.count;
+    inliner->globalCount = count;
+    inliner->callees = ALLOCATE(ObjFunction*, count);
+    int* definitions = ALLOCATE(int, count);
+    bool* assigned = ALLOCATE(bool, count);
+    for (int i = 0; i < count; i++)
+    {
+        inliner->callees[i] = NULL;
+        definitions[i] = 0;
+        assigned[i] = false;
+    }
+
+    for (int i = 0; i < inliner->count; i++)
+    {
+        Chunk* chunk = &inliner->functions[i]->chunk;
+        for (int offset = 0; offset < chunk->count;
+                offset += instructionLength(chunk, offset))
+        {
+            uint8_t instruction = chunk->code[offset];
+            int next = offset + 1;
+            if (instruction == OP_DEFINE_GLOBAL)
+                definitions[readIndex(chunk, &next)]++;
+            else if ((instruction == OP_SET_GLOBAL) ||
+                        (instruction == OP_SET_DEFINED_GLOBAL))
+                assigned[readIndex(chunk, &next)] = true;
+            else if ((instruction == OP_CLOSURE) && (i == 0))
+            {
+                Value function = chunk->constants.values[readIndex(chunk,
+                                                                    &next)];
+                int define = offset + instructionLength(chunk, offset);
+                if ((define < chunk->count) &&
+                    (chunk->code[define] == OP_DEFINE_GLOBAL))
+                {
+                    next = define + 1;
+                    inliner->callees[readIndex(chunk, &next)] =
+                        AS_FUNCTION(function);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if ((definitions[i] != 1) || assigned[i] ||
+            !IS_UNDEFINED(vm.globalValues.values[i]))
+            inliner->callees[i] = NULL;
+    }
+
+    FREE_ARRAY(int, definitions, count);
+    FREE_ARRAY(bool, assigned, count);
+}
+
+// Whether the function is small enough, and uses nothing
+// that depends on having a frame of its own. It has no
+// upvalues and makes no closures, so none of its locals
+// are ever captured.
+static bool canInline(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    if ((function->upvalueCount > 0) || (chunk->count > INLINE_MAX_LENGTH))
+        return false;
+
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk, offset))
+    {
+        switch (chunk->code[offset])
+        {
+            case OP_ZERO:
+            case OP_ONE:
+            case OP_TWO:
+            case OP_MINUSONE:
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_DUP:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_POP:
+            case OP_POPN:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_GET_DEFINED_GLOBAL:
+            case OP_SET_DEFINED_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_COMPZER0:
+            case OP_INCREMENT:
+            case OP_DECREMENT:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_PRINT:
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_INVOKE:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_DEL_PROPERTY:
+            case OP_RETURN:
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool isJump(uint8_t instruction)
+{
+    return (instruction == OP_JUMP) ||
+            (instruction == OP_JUMP_IF_FALSE) ||
+            (instruction == OP_LOOP);
+}
+
+static int jumpTarget(Chunk* chunk, int offset)
+{
+    int end = offset + instructionLength(chunk, offset);
+    int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return (chunk->code[offset] == OP_LOOP) ? end - jump : end + jump;
+}
+
+// The call taking the callee pushed at start off the
+// stack, or -1 if something else gets to it first.
+static int matchingCall(Chunk* chunk, int start, int* depth)
+{
+    int base = depth[start];
+    if (base == -1)
+        return -1;
+
+    for (int offset = start + instructionLength(chunk, start);
+            offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (depth[offset] <= base)
+            return -1;
+
+        uint8_t instruction = chunk->code[offset];
+        if (((instruction == OP_CALL) || (instruction == OP_TAIL_CALL)) &&
+            (depth[offset] == base + 1 + chunk->code[offset + 1]))
+            return offset;
+    }
+    return -1;
+}
+
+// Whether no jump goes into or out of the code after
+// start, up to and including end.
+static bool selfContained(Chunk* chunk, int start, int end)
+{
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk, offset))
+    {
+        if (!isJump(chunk->code[offset]))
+            continue;
+        int target = jumpTarget(chunk, offset);
+        bool from = (offset > start) && (offset < end);
+        bool to = (target > start) && (target <= end);
+        if (from != to)
+            return false;
+    }
+    return true;
+}
+
+// Index of value in the chunk's constant pool, adding it
+// if it is not there yet.
+static int poolIndex(Chunk* chunk, Value value)
+{
+    ValueArray* constants = &chunk->constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        Value constant = constants->values[i];
+        // -0 equals 0, but divides differently.
+        if (valuesEqual(constant, value) && (!IS_NUMBER(value) ||
+            (signbit(AS_NUMBER(constant)) == signbit(AS_NUMBER(value)))))
+            return i;
+    }
+    return addConstant(chunk, value);
+}
+
+static void emitIndex(Chunk* out, uint8_t instruction, int index, int line)
+{
+    writeChunk(out, instruction, line);
+    if (index < 256)
+    {
+        writeChunk(out, OP_SHORT, line);
+        writeChunk(out, (uint8_t) index, line);
+        return;
+    }
+
+    writeChunk(out, OP_LONG, line);
+    writeChunk(out, (uint8_t) ((index >> 16) & 0xff), line);
+    writeChunk(out, (uint8_t) ((index >> 8) & 0xff), line);
+    writeChunk(out, (uint8_t) (index & 0xff), line);
+}
+
+// Constant index, with OP_CONSTANT or OP_CONSTANT_LONG
+// as its prefix.
+static void emitConstantIndex(Chunk* out, int index, int line)
+{
+    if (index < 256)
+    {
+        writeChunk(out, OP_CONSTANT, line);
+        writeChunk(out, (uint8_t) index, line);
+        return;
+    }
+
+    writeChunk(out, OP_CONSTANT_LONG, line);
+    writeChunk(out, (uint8_t) ((index >> 16) & 0xff), line);
+    writeChunk(out, (uint8_t) ((index >> 8) & 0xff), line);
+    writeChunk(out, (uint8_t) (index & 0xff), line);
+}
+
+static void copyCode(Chunk* out, Chunk* chunk, int start, int end)
+{
+    for (int offset = start; offset < end;
+            offset += instructionLength(chunk, offset))
+    {
+        int line = getLine(chunk, offset);
+        int length = instructionLength(chunk, offset);
+        for (int i = 0; i < length; i++)
+            writeChunk(out, chunk->code[offset + i], line);
+    }
+}
+
+static void patchJump(Chunk* out, int operand, int target)
+{
+    bool loop = (out->code[operand - 1] == OP_LOOP);
+    int jump = loop ? (operand + 2) - target : target - (operand + 2);
+    out->code[operand] = (jump >> 8) & 0xff;
+    out->code[operand + 1] = jump & 0xff;
+}
+
+// Line in the caller's chunk for a line of the callee's,
+// which may itself come from something inlined there.
+static int inlinedLine(Chunk* chunk, ObjFunction* callee, int line, int call)
+{
+    if (!IS_INLINED(line))
+        return addInlinedLine(chunk, line, callee->name, call);
+
+    InlinedLine inlined = callee->chunk.inlinedLines[INLINED_INDEX(line)];
+    return addInlinedLine(chunk, inlined.line, inlined.function,
+                            inlinedLine(chunk, callee, inlined.caller, call));
+}
+
+// Emits the callee's body in place of a call, with its
+// slots moved up to base, where the callee itself is.
+// A return leaves its value there, as the call would
+// have, and drops the rest of the callee's window.
+static void emitBody(Chunk* out, ObjFunction* caller, ObjFunction* callee,
+                        int base, int callLine)
+{
+    Chunk* chunk = &caller->chunk;
+    Chunk* body = &callee->chunk;
+    int* depth = ALLOCATE(int, body->count);
+    int* newOffsets = ALLOCATE(int, body->count + 1);
+    int* jumps = ALLOCATE(int, body->count);
+    int* targets = ALLOCATE(int, body->count);
+    int* returns = ALLOCATE(int, body->count);
+    int jumpCount = 0;
+    int returnCount = 0;
+    stackDepths(body, callee->arity + 1, depth);
+
+    for (int offset = 0; offset < body->count;
+            offset += instructionLength(body, offset))
+    {
+        uint8_t instruction = body->code[offset];
+        int line = inlinedLine(chunk, callee, getLine(body, offset), callLine);
+        int next = offset + 1;
+        newOffsets[offset] = out->count;
+        // Nothing jumps to code that never runs.
+        if (depth[offset] == -1)
+            continue;
+
+        switch (instruction)
+        {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                emitIndex(out, instruction, base + readIndex(body, &next),
+                            line);
+                break;
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+                next = offset;
+                emitConstantIndex(out, poolIndex(chunk,
+                        body->constants.values[readIndex(body, &next)]), line);
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_DEL_PROPERTY:
+            case OP_INVOKE:
+                writeChunk(out, instruction, line);
+                emitConstantIndex(out, poolIndex(chunk,
+                        body->constants.values[readIndex(body, &next)]), line);
+                if (instruction == OP_INVOKE)
+                    writeChunk(out, body->code[next], line);
+                break;
+            case OP_TAIL_CALL:
+                // The frame is the caller's, not the callee's
+                // to hand over.
+                writeChunk(out, OP_CALL, line);
+                writeChunk(out, body->code[offset + 1], line);
+                break;
+            case OP_RETURN:
+            {
+                int above = depth[offset] - 1;
+                emitIndex(out, OP_SET_LOCAL, base, line);
+                if (above == 1)
+                    writeChunk(out, OP_POP, line);
+                else
+                    emitIndex(out, OP_POPN, above, line);
+
+                if (offset + 1 < body->count)
+                {
+                    writeChunk(out, OP_JUMP, line);
+                    returns[returnCount++] = out->count;
+                    writeChunk(out, 0xff, line);
+                    writeChunk(out, 0xff, line);
+                }
+                break;
+            }
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+                writeChunk(out, instruction, line);
+                jumps[jumpCount] = out->count;
+                targets[jumpCount++] = jumpTarget(body, offset);
+                writeChunk(out, 0xff, line);
+                writeChunk(out, 0xff, line);
+                break;
+            default:
+            {
+                int length = instructionLength(body, offset);
+                for (int i = 0; i < length; i++)
+                    writeChunk(out, body->code[offset + i], line);
+                break;
+            }
+        }
+    }
+    newOffsets[body->count] = out->count;
+
+    for (int i = 0; i < jumpCount; i++)
+        patchJump(out, jumps[i], newOffsets[targets[i]]);
+    for (int i = 0; i < returnCount; i++)
+        patchJump(out, returns[i], out->count);
+
+    FREE_ARRAY(int, depth, body->count);
+    FREE_ARRAY(int, newOffsets, body->count + 1);
+    FREE_ARRAY(int, jumps, body->count);
+    FREE_ARRAY(int, targets, body->count);
+    FREE_ARRAY(int, returns, body->count);
+}
+
+// Replaces the call at offset call with the callee's body.
+// Returns false, changing nothing, if a jump of the
+// caller's would end up out of range.
+static bool inlineCall(ObjFunction* caller, int call, ObjFunction* callee,
+                        int base)
+{
+    Chunk* chunk = &caller->chunk;
+    int callLength = instructionLength(chunk, call);
+    Chunk out;
+    initChunk(&out);
+
+    copyCode(&out, chunk, 0, call);
+    emitBody(&out, caller, callee, base, getLine(chunk, call));
+    int delta = out.count - call - callLength;
+    copyCode(&out, chunk, call + callLength, chunk->count);
+
+    // The caller's own jumps, over the body now.
+    bool valid = true;
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk, offset))
+    {
+        if (!isJump(chunk->code[offset]))
+            continue;
+
+        int target = jumpTarget(chunk, offset);
+        int from = (offset > call) ? offset + delta : offset;
+        int to = (target > call) ? target + delta : target;
+        int operand = from + instructionLength(chunk, offset) - 2;
+        if (abs(to - (operand + 2)) > UINT16_MAX)
+            valid = false;
+        else
+            patchJump(&out, operand, to);
+    }
+
+    if (!valid)
+    {
+        freeChunk(&out);
+        return false;
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->opLines.lines, chunk->opLines.capacity);
+    FREE_ARRAY(int, chunk->opLines.offsets, chunk->opLines.capacity);
+    chunk->code = out.code;
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+    chunk->opLines = out.opLines;
+    return true;
+}
+
+static void inlineInto(Inliner* inliner, int index);
+
+// Inlines the call of the callee loaded at offset, if
+// there is one that can be.
+static bool tryInline(Inliner* inliner, ObjFunction* caller, int offset,
+                        ObjFunction* callee)
+{
+    int index = 0;
+    while (inliner->functions[index] != callee)
+        index++;
+    if (inliner->states[index] == IN_PROGRESS)
+    {
+        inliner->recursive[index] = true;
+        return false;
+    }
+    // Its own calls first, so what is inlined is final.
+    if (inliner->states[index] == UNVISITED)
+        inlineInto(inliner, index);
+    if (inliner->recursive[index])
+        return false;
+
+    Chunk* chunk = &caller->chunk;
+    if (!canInline(callee) ||
+        (chunk->count + callee->chunk.count > INLINE_MAX_CALLER))
+        return false;
+
+    int* depth = ALLOCATE(int, chunk->count);
+    stackDepths(chunk, caller->arity + 1, depth);
+    int call = matchingCall(chunk, offset, depth);
+    bool inlined = (call != -1) &&
+                    (chunk->code[call + 1] == callee->arity) &&
+                    selfContained(chunk, offset, call);
+    int base = depth[offset];
+    FREE_ARRAY(int, depth, chunk->count);
+
+    return inlined && inlineCall(caller, call, callee, base);
+}
+
+static void inlineInto(Inliner* inliner, int index)
+{
+    ObjFunction* caller = inliner->functions[index];
+    Chunk* chunk = &caller->chunk;
+    inliner->states[index] = IN_PROGRESS;
+
+    // The callee is still loaded, so a call before the
+    // declaration fails as it always has. Arguments, and
+    // the inlined body after them, are looked at next.
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk, offset))
+    {
+        if ((chunk->code[offset] != OP_GET_GLOBAL) &&
+            (chunk->code[offset] != OP_GET_DEFINED_GLOBAL))
+            continue;
+
+        int next = offset + 1;
+        ObjFunction* callee = inliner->callees[readIndex(chunk, &next)];
+        if (callee != NULL)
+            tryInline(inliner, caller, offset, callee);
+    }
+
+    inliner->states[index] = DONE;
+}
+
+void inlineCalls(ObjFunction* script)
+{
+    Inliner inliner;
+    inliner.functions = NULL;
+    inliner.states = NULL;
+    inliner.recursive = NULL;
+    inliner.count = 0;
+    inliner.capacity = 0;
+    addFunction(&inliner, script);
+    findCallees(&inliner);
+
+    for (int i = 0; i < inliner.count; i++)
+    {
+        if (inliner.states[i] == UNVISITED)
+            inlineInto(&inliner, i);
+    }
+
+    FREE_ARRAY(ObjFunction*, inliner.functions, inliner.capacity);
+    FREE_ARRAY(InlineState, inliner.states, inliner.capacity);
+    FREE_ARRAY(bool, inliner.recursive, inliner.capacity);
+    FREE_ARRAY(ObjFunction*, inliner.callees, inliner.globalCount);
+}
@@ -0,0 +1,830 @@
+#include "../include/jit.h"
+
+#ifdef JIT
+
+#include "../include/assembler.h"
+#include "../include/cache.h"
+#include "../include/chunk.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+#include "../include/shape.h"
+#include "../include/tier.h"
+#include "../include/trace.h"
+#include "../include/vm.h"
+#include <stdio.h>
+#include <string.h>
+
+// A template JIT. Every decoded instruction of a hot function
+// becomes a fixed piece of x86-64 code. Numbers, locals,
+// globals and jumps are handled inline; anything else, and
+// every operand that is not what the fast path expects,
+// goes through a helper that does what run() would do.
+//
+// Native code keeps the VM's state in callee-saved registers
+// and writes vm.stackTop back before each helper call, so
+// the GC always sees the whole stack. The helpers can grow
+// the stack and the frame array, so both are reloaded after.
+
+// Starts at entry if it is not NULL (see jitLoop()).
+typedef JitStatus (*NativeCode)(uint8_t* entry);
+typedef JitStatus (*Helper)(Word* ip);
+
+// Jump target standing for the epilogue. Any other target
+// is the word index of an instruction.
+#define EXIT    (-1)
+
+// Native calls currently on the C stack.
+static int depth = 0;
+
+// ---- Helpers, called from native code. ----
+// Each gets the instruction it stands in for.
+
+static CallFrame* topFrame()
+{
+    return &vm.frames[vm.frameCount - 1];
+}
+
+// Points the frame past the instruction, as run() does
+// before anything that can fail or call.
+static void leave(Word* ip, int length)
+{
+    topFrame()->ip = ip + length;
+}
+
+static Value constant(Word index)
+{
+    return topFrame()->closure->function->chunk.constants.values[index];
+}
+
+Word genericOp(Word instruction)
+{
+    switch (instruction)
+    {
+        case OP_ADD_NUM:            return OP_ADD;
+        case OP_SUBTRACT_NUM:       return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM:       return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:         return OP_DIVIDE;
+        case OP_EQUAL_NUM:          return OP_EQUAL;
+        case OP_NOT_EQUAL_NUM:      return OP_NOT_EQUAL;
+        case OP_GREATER_NUM:        return OP_GREATER;
+        case OP_GREATER_EQUAL_NUM:  return OP_GREATER_EQUAL;
+        case OP_LESS_NUM:           return OP_LESS;
+        case OP_LESS_EQUAL_NUM:     return OP_LESS_EQUAL;
+        default:                    return instruction;
+    }
+}
+
+// Generic form of an arithmetic or comparison instruction,
+// once the frame points past it.
+static JitStatus arithmeticOp(Word instruction)
+{
+    if ((instruction == OP_NEGATE) || (instruction == OP_INCREMENT) ||
+        (instruction == OP_DECREMENT))
+    {
+        // The fast path takes every number.
+        runtimeError("Operand must be a number.");
+        return JIT_ERROR;
+    }
+
+    Value b = vm.stackTop[-1];
+    Value a = vm.stackTop[-2];
+    switch (instruction)
+    {
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        {
+            bool equal = valuesEqual(a, b);
+            vm.stackTop--;
+            vm.stackTop[-1] = BOOL_VAL((instruction == OP_EQUAL) ? equal : !equal);
+            return JIT_OK;
+        }
+        case OP_ADD:
+            if (IS_STRING(a) && IS_STRING(b))
+            {
+                concatenate();
+                return JIT_OK;
+            }
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                runtimeError("Operands must be two numbers or two strings.");
+                return JIT_ERROR;
+            }
+            break;
+        case OP_DIVIDE:
+            if (IS_NUMBER(b) && AS_NUMBER(b) == 0)
+            {
+                runtimeError("Cannot divide by zero.");
+                return JIT_ERROR;
+            }
+            // Fall through.
+        default:
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            {
+                runtimeError("Operands must be numbers.");
+                return JIT_ERROR;
+            }
+            break;
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    Value result;
+    switch (instruction)
+    {
+        case OP_ADD:            result = NUMBER_VAL(x + y); break;
+        case OP_SUBTRACT:       result = NUMBER_VAL(x - y); break;
+        case OP_MULTIPLY:       result = NUMBER_VAL(x * y); break;
+        case OP_DIVIDE:         result = NUMBER_VAL(x / y); break;
+        case OP_GREATER:        result = BOOL_VAL(x > y); break;
+        case OP_LESS:           result = BOOL_VAL(x < y); break;
+        case OP_GREATER_EQUAL:  result = BOOL_VAL(!(x < y)); break;
+        default:                result = BOOL_VAL(!(x > y)); break;
+    }
+    vm.stackTop--;
+    vm.stackTop[-1] = result;
+    return JIT_OK;
+}
+
+// Slow path of the arithmetic and comparison instructions.
+static JitStatus helperArithmetic(Word* ip)
+{
+    leave(ip, 1);
+    return arithmeticOp(genericOp(*ip));
+}
+
+static JitStatus helperAddLocals(Word* ip)
+{
+    leave(ip, 3);
+    Value* slots = topFrame()->slots;
+    push(slots[ip[1]]);
+    push(slots[ip[2]]);
+    return arithmeticOp(OP_ADD);
+}
+
+static JitStatus helperLessJump(Word* ip)
+{
+    leave(ip, 4);
+    runtimeError("Operands must be numbers.");
+    return JIT_ERROR;
+}
+
+static JitStatus helperUndefined(Word* ip)
+{
+    leave(ip, 2);
+    runtimeError("Undefined variable.");
+    return JIT_ERROR;
+}
+
+// Slow path of a quickened instruction. The interpreter has
+// only ever seen numbers there, so the native code has no
+// generic path of its own and hands the frame back instead.
+static JitStatus helperDeoptimize(Word* ip)
+{
+    deoptimize(topFrame(), ip);
+    return JIT_EXIT;
+}
+
+static JitStatus helperPrint(Word* ip)
+{
+    printValue(pop());
+    printf("\n");
+    return JIT_OK;
+}
+
+// Runs the function a helper has just called, if that
+// pushed a frame, until it returns.
+static JitStatus finishCall(int frameCount)
+{
+    if (vm.frameCount == frameCount) return JIT_OK;
+
+    JitStatus status = jitEnter();
+    if (status == JIT_ERROR) return JIT_ERROR;
+    if ((status == JIT_EXIT) && (run(frameCount) != INTERPRET_OK))
+        return JIT_ERROR;
+    return JIT_OK;
+}
+
+static JitStatus helperCall(Word* ip)
+{
+    leave(ip, 2);
+    int argCount = (int) ip[1];
+    int frameCount = vm.frameCount;
+    if (!callValue(vm.stackTop[-1 - argCount], argCount))
+        return JIT_ERROR;
+    return finishCall(frameCount);
+}
+
+static JitStatus helperTailCall(Word* ip)
+{
+    leave(ip, 2);
+    int argCount = (int) ip[1];
+    int frameCount = vm.frameCount;
+    if (!callValue(vm.stackTop[-1 - argCount], argCount))
+        return JIT_ERROR;
+    // Natives and classes without an initializer leave
+    // their result for the OP_RETURN after.
+    if (vm.frameCount == frameCount) return JIT_OK;
+
+    replaceCaller();
+    return JIT_TAIL;
+}
+
+static JitStatus helperInvoke(Word* ip)
+{
+    leave(ip, 4);
+    ObjString* name = AS_STRING(constant(ip[1]));
+    int argCount = (int) ip[2];
+    InlineCache* cache = &topFrame()->closure->function->chunk.caches[ip[3]];
+    int frameCount = vm.frameCount;
+    if (!invoke(cache, name, argCount))
+        return JIT_ERROR;
+    return finishCall(frameCount);
+}
+
+static JitStatus helperClosure(Word* ip)
+{
+    CallFrame* frame = topFrame();
+    ObjFunction* function = AS_FUNCTION(constant(ip[1]));
+    leave(ip, 2 + 2 * (function->upvalueCount + function->capturedCount));
+    ObjClosure* closure = makeClosure(function);
+    push(OBJ_VAL(closure));
+
+    for (int i = 0; i < closure->upvalueCount; i++)
+    {
+        Word isLocal = ip[2 + 2 * i];
+        Word index = ip[3 + 2 * i];
+        if (isLocal)
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        else
+            closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+    for (int i = closure->upvalueCount;
+            i < closure->upvalueCount + closure->capturedCount; i++)
+    {
+        Word isLocal = ip[2 + 2 * i];
+        Word index = ip[3 + 2 * i];
+        closure->captured[i - closure->upvalueCount] = isLocal ?
+                frame->slots[index] : frame->closure->captured[index];
+    }
+    WRITE_BARRIER(closure);
+
+    return JIT_OK;
+}
+
+static JitStatus helperCloseUpvalue(Word* ip)
+{
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+    return JIT_OK;
+}
+
+static JitStatus helperClass(Word* ip)
+{
+    push(OBJ_VAL(newClass(AS_STRING(constant(ip[1])))));
+    return JIT_OK;
+}
+
+static JitStatus helperMethod(Word* ip)
+{
+    defineMethod(AS_CLASS(vm.stackTop[-2]), AS_STRING(constant(ip[1])),
+                    vm.stackTop[-1]);
+    pop();
+    return JIT_OK;
+}
+
+static JitStatus helperGetProperty(Word* ip)
+{
+    leave(ip, 3);
+    if (!IS_INSTANCE(vm.stackTop[-1]))
+    {
+        runtimeError("Only instances have properties.");
+        return JIT_ERROR;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(vm.stackTop[-1]);
+    ObjString* name = AS_STRING(constant(ip[1]));
+    InlineCache* cache = &topFrame()->closure->function->chunk.caches[ip[2]];
+    CacheEntry* entry = cacheLoad(cache, instance, name);
+    if (entry == NULL)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return JIT_ERROR;
+    }
+
+    if (entry->slot != -1)
+        vm.stackTop[-1] = instance->fields[entry->slot];
+    else
+        bindMethod(entry->method);
+    return JIT_OK;
+}
+
+static JitStatus helperSetProperty(Word* ip)
+{
+    leave(ip, 3);
+    if (!IS_INSTANCE(vm.stackTop[-2]))
+    {
+        runtimeError("Only instances have properties.");
+        return JIT_ERROR;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(vm.stackTop[-2]);
+    ObjString* name = AS_STRING(constant(ip[1]));
+    InlineCache* cache = &topFrame()->closure->function->chunk.caches[ip[2]];
+    cacheStore(cache, instance, name, vm.stackTop[-1]);
+    Value value = pop();
+    vm.stackTop[-1] = value;
+    return JIT_OK;
+}
+
+static JitStatus helperDelProperty(Word* ip)
+{
+    leave(ip, 2);
+    if (!IS_INSTANCE(vm.stackTop[-1]))
+    {
+        runtimeError("Only instances have properties.");
+        return JIT_ERROR;
+    }
+
+    ObjString* name = AS_STRING(constant(ip[1]));
+    if (!deleteField(AS_INSTANCE(vm.stackTop[-1]), name))
+    {
+        runtimeError("Failed to delete field '%s'.", name->chars);
+        return JIT_ERROR;
+    }
+    return JIT_OK;
+}
+
+static JitStatus helperReturn(Word* ip)
+{
+    CallFrame* frame = topFrame();
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+    vm.stackTop = frame->slots;
+    // The script, entered through jitLoop(), leaves nothing.
+    if (vm.frameCount > 0)
+        push(result);
+    return JIT_RETURNED;
+}
+
+// ---- Code generation. ----
+
+// Reloads what a helper may have moved.
+static void reload(Assembler* a)
+{
+    loadQword(a, TOP, VM_BASE, offsetof(VM, stackTop));
+    loadQword(a, RAX, VM_BASE, offsetof(VM, frames));
+    emitBytes(a, (uint8_t[]) { 0x4C, 0x01, 0xF0 }, 3); // add rax, r14
+    loadQword(a, SLOTS, RAX, offsetof(CallFrame, slots));
+}
+
+static void callHelper(Assembler* a, Helper helper, Word* ip)
+{
+    storeQword(a, VM_BASE, offsetof(VM, stackTop), TOP);
+    loadImmediate(a, RDI, (uint64_t) (uintptr_t) ip);
+    loadImmediate(a, RAX, (uint64_t) (uintptr_t) helper);
+    emitBytes(a, (uint8_t[]) { 0xFF, 0xD0 }, 2); // call rax
+    emitBytes(a, (uint8_t[]) { 0x85, 0xC0 }, 2); // test eax, eax
+    jumpTo(a, CC_NE, EXIT);
+    reload(a);
+}
+
+// ---- Templates. ----
+
+// Jumps to slow unless the top count values are numbers.
+static int guardNumbers(Assembler* a, int count, int* slow)
+{
+    for (int i = 1; i <= count; i++)
+    {
+        int isNumber = compareType(a, TOP, STACK(i), VAL_NUMBER);
+        slow[i - 1] = jump(a, NEGATE(isNumber));
+    }
+    return count;
+}
+
+// Ends a fast path, then emits the slow one: a call to
+// the helper, which all the guard jumps land on.
+static void slowPath(Assembler* a, int* slow, int slowCount,
+                        Helper helper, Word* ip)
+{
+    int done = jump(a, ALWAYS);
+    for (int i = 0; i < slowCount; i++)
+        patchHere(a, slow[i]);
+    callHelper(a, helper, ip);
+    patchHere(a, done);
+}
+
+static void arithmetic(Assembler* a, Word* ip, Word instruction, Helper slowHelper)
+{
+    int slow[3];
+    int slowCount = guardNumbers(a, 2, slow);
+    if (instruction == OP_DIVIDE)
+    {
+        // Zero (or NaN) divisors go the slow way, which
+        // reports division by zero.
+        compareDivisor(a);
+        slow[slowCount++] = jump(a, CC_E);
+    }
+
+    numberArithmetic(a, instruction);
+    slowPath(a, slow, slowCount, slowHelper, ip);
+}
+
+static void comparison(Assembler* a, Word* ip, Word instruction, Helper slowHelper)
+{
+    int slow[2];
+    int slowCount = guardNumbers(a, 2, slow);
+    numberComparison(a, instruction);
+    slowPath(a, slow, slowCount, slowHelper, ip);
+}
+
+static void unary(Assembler* a, Word* ip, Word instruction)
+{
+    int slow[1];
+    int slowCount = guardNumbers(a, 1, slow);
+    numberUnary(a, instruction);
+    slowPath(a, slow, slowCount, helperArithmetic, ip);
+}
+
+// OP_NOT: replaces the top value with whether it is falsey.
+static void not(Assembler* a)
+{
+    int isNil = jump(a, compareType(a, TOP, STACK(1), VAL_NIL));
+    int isBool = compareType(a, TOP, STACK(1), VAL_BOOL);
+    int other = jump(a, NEGATE(isBool));
+
+    rex(a, false, RAX, TOP);
+    emitBytes(a, (uint8_t[]) { 0x0F, 0xB6 }, 2); // movzx eax, byte
+    memory(a, RAX, TOP, STACK(1) + PAYLOAD);
+    emitBytes(a, (uint8_t[]) { 0x83, 0xF0, 0x01 }, 3); // xor eax, 1
+    int store = jump(a, ALWAYS);
+
+    patchHere(a, isNil);
+    emitByte(a, 0xB8); // mov eax, 1
+    emit32(a, 1);
+    int storeNil = jump(a, ALWAYS);
+
+    patchHere(a, other);
+    emitBytes(a, (uint8_t[]) { 0x31, 0xC0 }, 2); // xor eax, eax
+
+    patchHere(a, store);
+    patchHere(a, storeNil);
+    storeBool(a, 1);
+}
+
+// OP_COMPZER0: whether the top value equals 0.
+static void compareZero(Assembler* a)
+{
+    int isNumber = compareType(a, TOP, STACK(1), VAL_NUMBER);
+    int other = jump(a, NEGATE(isNumber));
+    sse(a, MOVSD_LOAD, 0, TOP, STACK(1) + PAYLOAD);
+    emitBytes(a, (uint8_t[]) { 0x66, 0x0F, 0x57, 0xC9 }, 4); // xorpd xmm1, xmm1
+    emitBytes(a, (uint8_t[]) { 0x66, 0x0F, 0x2E, 0xC1 }, 4); // ucomisd xmm0, xmm1
+    setCondition(a, CC_E, RAX);
+    setCondition(a, CC_NP, RCX);
+    emitBytes(a, (uint8_t[]) { 0x20, 0xC8 }, 2); // and al, cl
+    int store = jump(a, ALWAYS);
+
+    patchHere(a, other);
+    emitBytes(a, (uint8_t[]) { 0x31, 0xC0 }, 2); // xor eax, eax
+
+    patchHere(a, store);
+    storeBool(a, 1);
+}
+
+// OP_JUMP_IF_FALSE. Leaves the value where it is.
+static void jumpIfFalse(Assembler* a, int target)
+{
+    jumpTo(a, compareType(a, TOP, STACK(1), VAL_NIL), target);
+    int isBool = compareType(a, TOP, STACK(1), VAL_BOOL);
+    int truthy = jump(a, NEGATE(isBool));
+
+    rex(a, false, 0, TOP);
+    emitByte(a, 0x80); // cmp byte [top - 1], 0
+    memory(a, 7, TOP, STACK(1) + PAYLOAD);
+    emitByte(a, 0);
+    jumpTo(a, CC_E, target);
+
+    patchHere(a, truthy);
+}
+
+static void addLocals(Assembler* a, Word* ip)
+{
+    int32_t left = (int32_t) ip[1] * VALUE_SIZE;
+    int32_t right = (int32_t) ip[2] * VALUE_SIZE;
+    int slow[2];
+    slow[0] = jump(a, NEGATE(compareType(a, SLOTS, left, VAL_NUMBER)));
+    slow[1] = jump(a, NEGATE(compareType(a, SLOTS, right, VAL_NUMBER)));
+
+    sse(a, MOVSD_LOAD, 0, SLOTS, left + PAYLOAD);
+    sse(a, 0xF2, 0x58, 0, SLOTS, right + PAYLOAD); // addsd
+    storeNumberType(a, TOP, 0);
+    sse(a, MOVSD_STORE, 0, TOP, PAYLOAD);
+    addImmediate(a, TOP, VALUE_SIZE);
+    slowPath(a, slow, 2, helperAddLocals, ip);
+}
+
+static void localLessConstJump(Assembler* a, Chunk* chunk, Word* ip, int target)
+{
+    Value* bound = &chunk->constants.values[ip[2]];
+    if (!IS_NUMBER(*bound))
+    {
+        // Can only ever fail.
+        callHelper(a, helperLessJump, ip);
+        return;
+    }
+
+    int32_t slot = (int32_t) ip[1] * VALUE_SIZE;
+    int slow[1];
+    slow[0] = jump(a, NEGATE(compareType(a, SLOTS, slot, VAL_NUMBER)));
+
+    // slot < bound is bound > slot.
+    loadImmediate(a, RAX, (uint64_t) (uintptr_t) bound);
+    sse(a, MOVSD_LOAD, 0, RAX, PAYLOAD);
+    sse(a, UCOMISD, 0, SLOTS, slot + PAYLOAD);
+    setCondition(a, CC_A, RAX);
+    storeBool(a, 0);
+    addImmediate(a, TOP, VALUE_SIZE);
+    emitBytes(a, (uint8_t[]) { 0x85, 0xC0 }, 2); // test eax, eax
+    jumpTo(a, CC_E, target);
+    slowPath(a, slow, 1, helperLessJump, ip);
+}
+
+// Word index a decoded jump at index lands on.
+static int jumpTarget(Chunk* chunk, int index)
+{
+    int end = index + wordLength(chunk, index);
+    Word offset = chunk->words[end - 1];
+    return (chunk->words[index] == OP_LOOP) ? end - (int) offset :
+                                                end + (int) offset;
+}
+
+// Emits the instruction at index. Returns false if the JIT
+// has no template for it.
+static bool compileInstruction(Assembler* a, Chunk* chunk, int index)
+{
+    Word* ip = chunk->words + index;
+    Word instruction = genericOp(ip[0]);
+    Helper slowHelper = (instruction != ip[0]) ? helperDeoptimize : helperArithmetic;
+    int32_t globals = offsetof(VM, globalValues) + offsetof(ValueArray, values);
+
+    switch (instruction)
+    {
+        case OP_ZERO:       pushNumber(a, 0); break;
+        case OP_ONE:        pushNumber(a, 1); break;
+        case OP_TWO:        pushNumber(a, 2); break;
+        case OP_MINUSONE:   pushNumber(a, -1); break;
+        case OP_NIL:        pushImmediate(a, NIL_VAL); break;
+        case OP_TRUE:       pushImmediate(a, BOOL_VAL(true)); break;
+        case OP_FALSE:      pushImmediate(a, BOOL_VAL(false)); break;
+        case OP_CONSTANT:
+            loadImmediate(a, RAX,
+                    (uint64_t) (uintptr_t) &chunk->constants.values[ip[1]]);
+            pushFrom(a, RAX, 0);
+            break;
+        case OP_DUP:        pushFrom(a, TOP, STACK(1)); break;
+        case OP_POP:        addImmediate(a, TOP, -VALUE_SIZE); break;
+        case OP_POPN:
+            addImmediate(a, TOP, -(int32_t) ip[1] * VALUE_SIZE);
+            break;
+        case OP_DEFINE_GLOBAL:
+            loadQword(a, RAX, VM_BASE, globals);
+            storeTop(a, RAX, (int32_t) ip[1] * VALUE_SIZE);
+            addImmediate(a, TOP, -VALUE_SIZE);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        {
+            int32_t global = (int32_t) ip[1] * VALUE_SIZE;
+            int slow[1];
+            loadQword(a, RAX, VM_BASE, globals);
+            slow[0] = jump(a, compareType(a, RAX, global, VAL_UNDEFINED));
+            if (instruction == OP_GET_GLOBAL)
+                pushFrom(a, RAX, global);
+            else
+                storeTop(a, RAX, global);
+            slowPath(a, slow, 1, helperUndefined, ip);
+            break;
+        }
+        case OP_GET_DEFINED_GLOBAL:
+        case OP_SET_DEFINED_GLOBAL:
+        {
+            int32_t global = (int32_t) ip[1] * VALUE_SIZE;
+            loadQword(a, RAX, VM_BASE, globals);
+            if (instruction == OP_GET_DEFINED_GLOBAL)
+                pushFrom(a, RAX, global);
+            else
+                storeTop(a, RAX, global);
+            break;
+        }
+        case OP_GET_LOCAL:
+            pushFrom(a, SLOTS, (int32_t) ip[1] * VALUE_SIZE);
+            break;
+        case OP_SET_LOCAL:
+            storeTop(a, SLOTS, (int32_t) ip[1] * VALUE_SIZE);
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            loadQword(a, RAX, CLOSURE, offsetof(ObjClosure, upvalues) +
+                        (int32_t) ip[1] * sizeof(ObjUpvalue*));
+            loadQword(a, RAX, RAX, offsetof(ObjUpvalue, location));
+            if (instruction == OP_GET_UPVALUE)
+                pushFrom(a, RAX, 0);
+            else
+                storeTop(a, RAX, 0);
+            break;
+        case OP_GET_CAPTURED:
+            loadQword(a, RAX, CLOSURE, offsetof(ObjClosure, captured));
+            pushFrom(a, RAX, (int32_t) ip[1] * VALUE_SIZE);
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            arithmetic(a, ip, instruction, slowHelper);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            comparison(a, ip, instruction, slowHelper);
+            break;
+        case OP_NEGATE:
+        case OP_INCREMENT:
+        case OP_DECREMENT:
+            unary(a, ip, instruction);
+            break;
+        case OP_NOT:        not(a); break;
+        case OP_COMPZER0:   compareZero(a); break;
+        case OP_JUMP:
+        case OP_LOOP:
+            jumpTo(a, ALWAYS, jumpTarget(chunk, index));
+            break;
+        case OP_JUMP_IF_FALSE:
+            jumpIfFalse(a, jumpTarget(chunk, index));
+            break;
+        case OP_ADD_LOCALS:
+            addLocals(a, ip);
+            break;
+        case OP_LOCAL_LESS_CONST_JUMP:
+            localLessConstJump(a, chunk, ip, jumpTarget(chunk, index));
+            break;
+        case OP_PRINT:          callHelper(a, helperPrint, ip); break;
+        case OP_CALL:           callHelper(a, helperCall, ip); break;
+        case OP_TAIL_CALL:      callHelper(a, helperTailCall, ip); break;
+        case OP_INVOKE:         callHelper(a, helperInvoke, ip); break;
+        case OP_CLOSURE:        callHelper(a, helperClosure, ip); break;
+        case OP_CLOSE_UPVALUE:  callHelper(a, helperCloseUpvalue, ip); break;
+        case OP_CLASS:          callHelper(a, helperClass, ip); break;
+        case OP_METHOD:         callHelper(a, helperMethod, ip); break;
+        case OP_GET_PROPERTY:   callHelper(a, helperGetProperty, ip); break;
+        case OP_SET_PROPERTY:   callHelper(a, helperSetProperty, ip); break;
+        case OP_DEL_PROPERTY:   callHelper(a, helperDelProperty, ip); break;
+        case OP_RETURN:         callHelper(a, helperReturn, ip); break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+static void prologue(Assembler* a)
+{
+    saveRegisters(a);
+    loadImmediate(a, VM_BASE, (uint64_t) (uintptr_t) &vm);
+
+    // r14 = (vm.frameCount - 1) * sizeof(CallFrame).
+    rex(a, true, RAX, VM_BASE);
+    emitByte(a, 0x63); // movsxd rax, dword
+    memory(a, RAX, VM_BASE, offsetof(VM, frameCount));
+    emitBytes(a, (uint8_t[]) { 0x48, 0xFF, 0xC8 }, 3); // dec rax
+    emitBytes(a, (uint8_t[]) { 0x4C, 0x69, 0xF0 }, 3); // imul r14, rax, imm32
+    emit32(a, (uint32_t) sizeof(CallFrame));
+
+    reload(a);
+    loadQword(a, CLOSURE, RAX, offsetof(CallFrame, closure));
+
+    // On-stack replacement: carry on at the entry given.
+    emitBytes(a, (uint8_t[]) { 0x48, 0x85, 0xFF }, 3); // test rdi, rdi
+    emitBytes(a, (uint8_t[]) { 0x74, 0x02 }, 2); // jz +2
+    emitBytes(a, (uint8_t[]) { 0xFF, 0xE7 }, 2); // jmp rdi
+}
+
+static void epilogue(Assembler* a)
+{
+    // Status is already in eax.
+    restoreRegisters(a);
+    emitByte(a, 0xC3); // ret
+}
+
+static bool compile(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    Assembler a;
+    initAssembler(&a);
+    // Offset in the code of the instruction at each word.
+    int* labels = ALLOCATE(int, chunk->wordCount + 1);
+
+    prologue(&a);
+    bool compiled = true;
+    for (int index = 0; index < chunk->wordCount;
+            index += wordLength(chunk, index))
+    {
+        labels[index] = a.count;
+        if (!compileInstruction(&a, chunk, index))
+        {
+            compiled = false;
+            break;
+        }
+    }
+
+    if (compiled)
+    {
+        int exit = a.count;
+        labels[chunk->wordCount] = exit;
+        epilogue(&a);
+        for (int i = 0; i < a.patchCount; i++)
+        {
+            int target = a.targets[i];
+            patchAt(&a, a.patches[i], (target == EXIT) ? exit : labels[target]);
+        }
+
+        function->native = installCode(&a);
+        function->nativeSize = (size_t) a.count;
+        compiled = (function->native != NULL);
+    }
+
+    // The stack is all the state there is between two
+    // instructions, so every one of them is an entry.
+    if (compiled)
+        function->nativeEntries = labels;
+    else
+        FREE_ARRAY(int, labels, chunk->wordCount + 1);
+    freeAssembler(&a);
+
+    if (!compiled)
+        function->nativeFailed = true;
+    return compiled;
+}
+
+// Whether the function has native code to run, compiling
+// it first if it has become hot.
+static bool ready(ObjFunction* function)
+{
+    if (function->tier == TIER_NATIVE) return true;
+    if (function->nativeFailed ||
+        (function->calls + function->backEdges < JIT_THRESHOLD) ||
+        !compile(function))
+        return false;
+    tierUp(function, TIER_NATIVE);
+    return true;
+}
+
+static JitStatus runNative(ObjFunction* function, uint8_t* entry)
+{
+    if (depth == JIT_MAX_DEPTH) return JIT_EXIT;
+
+    depth++;
+    JitStatus status = ((NativeCode) function->native)(entry);
+    depth--;
+    return status;
+}
+
+JitStatus jitEnter()
+{
+    for (;;)
+    {
+        ObjFunction* function = topFrame()->closure->function;
+        if (!ready(function)) return JIT_EXIT;
+
+        JitStatus status = runNative(function, NULL);
+        if (status != JIT_TAIL) return status;
+    }
+}
+
+JitStatus jitLoop(Word* header)
+{
+    ObjFunction* function = topFrame()->closure->function;
+    if (!ready(function)) return JIT_EXIT;
+
+    int entry = function->nativeEntries[header - function->chunk.words];
+    JitStatus status = runNative(function, function->native + entry);
+    if (status == JIT_TAIL)
+        status = jitEnter();
+    return status;
+}
+
+void jitFree(ObjFunction* function)
+{
+    freeCode(function->native, function->nativeSize);
+    if (function->nativeEntries != NULL)
+        FREE_ARRAY(int, function->nativeEntries, function->chunk.wordCount + 1);
+    freeTraces(function);
+    function->native = NULL;
+    function->nativeSize = 0;
+    function->nativeEntries = NULL;
+}
+
+#endif
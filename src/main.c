@@ -4,6 +4,7 @@
 #include "../include/common.h"
 #include "../include/debug.h"
 #include "../include/memory.h"
+#include "../include/tier.h"
 #include "../include/vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -112,11 +113,78 @@ static void runFile(const char* path)
     char* source = readFile(path);
     InterpretResult result = interpret(source);
     free(source);
+    if (vm.tierStats) printTierStats();
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [-O0|-O1|-O2] [--registers] ");
+    #ifdef JIT
+    fprintf(stderr, "[--jit] ");
+    #endif
+    fprintf(stderr, "[--tier-stats] [--max-frames=N] [--gc-pause=N] ");
+    #ifdef CONCURRENT_GC
+    fprintf(stderr, "[--concurrent-gc] [--gc-threads=N] ");
+    #endif
+    fprintf(stderr, "[script]\n");
+    exit(64);
+}
+
+// Applies a command-line option to the VM.
+// Returns false if the option is unknown.
+static bool parseOption(const char* option)
+{
+    if (strcmp(option, "--registers") == 0)
+        vm.registerMode = true;
+    #ifdef JIT
+    else if (strcmp(option, "--jit") == 0)
+        vm.jit = true;
+    #endif
+    #ifdef CONCURRENT_GC
+    else if (strcmp(option, "--concurrent-gc") == 0)
+        vm.concurrentGC = true;
+    else if (strncmp(option, "--gc-threads=", 13) == 0)
+    {
+        // Threads that mark in parallel, in the background.
+        char* end;
+        long threads = strtol(option + 13, &end, 10);
+        if ((*end != '\0') || (threads < 1) || (threads > GC_MAX_THREADS))
+            return false;
+        vm.gcThreads = (int) threads;
+        vm.concurrentGC = true;
+    }
+    #endif
+    else if (strcmp(option, "--tier-stats") == 0)
+        vm.tierStats = true;
+    else if ((strncmp(option, "-O", 2) == 0) && (option[2] >= '0') &&
+                (option[2] <= '2') && (option[3] == '\0'))
+        vm.optLevel = option[2] - '0';
+    else if (strncmp(option, "--max-frames=", 13) == 0)
+    {
+        // Limit on how deep calls can nest.
+        char* end;
+        long frames = strtol(option + 13, &end, 10);
+        if ((*end != '\0') || (frames < 1) || (frames > INT32_MAX))
+            return false;
+        vm.frameLimit = (int) frames;
+    }
+    else if (strncmp(option, "--gc-pause=", 11) == 0)
+    {
+        // Target pause of the collector, in microseconds.
+        char* end;
+        long pause = strtol(option + 11, &end, 10);
+        if ((*end != '\0') || (pause < 1))
+            return false;
+        vm.gcPause = pause;
+    }
+    else
+        return false;
+    return true;
+}
+
 int main(int argc, const char* argv[])
 {
     clock_t start, end;
@@ -124,16 +192,31 @@ int main(int argc, const char* argv[])
     (void) start; (void) end; (void) cpu_time_used;
     start = clock();
     initVM();
+
+    // Options come before the script.
+    int arg = 1;
+    while ((arg < argc) && (argv[arg][0] == '-'))
+    {
+        if (!parseOption(argv[arg]))
+        {
+            fprintf(stderr, "Unknown option '%s'.\n", argv[arg]);
+            usage();
+        }
+        arg++;
+    }
+    // Only the stack code is compiled.
+    if (vm.registerMode)
+        vm.jit = false;
     
-    if (argc == 1)
-        repl();
-    else if (argc == 2)
-        runFile(argv[1]);
-    else
+    if (arg == argc)
     {
-        fprintf(stderr, "Usage: clox [script]");
-        exit(64);
+        vm.repl = true;
+        repl();
     }
+    else if (arg == argc - 1)
+        runFile(argv[arg]);
+    else
+        usage();
 
     freeVM();
     //freeHeap(&heap);
@@ -1,21 +1,177 @@
 #include "../include/memory.h"
+#include "../include/cache.h"
 #include "../include/compiler.h"
+#include "../include/jit.h"
 #include "../include/object.h"
 #include "../include/table.h"
+#include "../include/trace.h"
 #include "../include/vm.h"
 // #include "../include/heap.h"
 #include <stdlib.h>
+#include <time.h>
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "../include/debug.h"
 #endif
 
+#ifdef DEBUG_GC_STATS
+#include <stdio.h>
+// Collections of each kind, and their pauses in seconds.
+// A major collection pauses once for each of its steps.
+static int minorCount = 0;
+static int majorCount = 0;
+static int majorSteps = 0;
+static double minorTime = 0;
+static double majorTime = 0;
+static double minorLongest = 0;
+static double majorLongest = 0;
+// Attempts at finishing marking, those the step cut short, and
+// the longest one.
+static int remarkCount = 0;
+static int remarksCut = 0;
+static double remarkLongest = 0;
+#ifdef CONCURRENT_GC
+// Rounds of marking on the marker threads, and the wall time
+// from starting them to the last one running out of work.
+static int markerRounds = 0;
+static double markerTime = 0;
+static double markerStart;
+static double markerEnd;
+#endif
+#endif
+
+#ifdef CONCURRENT_GC
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#endif
+
+#ifdef DEBUG_MEMORY_STATS
+#include <stdio.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+// Most bytes the VM has had allocated at once.
+static size_t peakBytes = 0;
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
+// Steps read the clock once every this many objects.
+#define GC_CLOCK_INTERVAL 128
+// Times marking catches up with the roots and the remembered
+// objects a step at a time before it tries to finish.
+#define GC_MARK_ROUNDS 3
+// Times finishing marking may run out of step before it is
+// let finish in one go.
+#define GC_REMARK_TRIES 8
+
+// Where the major collection is. It marks a little at a
+// time, finishes marking within a step, then sweeps a little
+// at a time. Minor collections wait while it marks.
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GCPhase;
+
+static GCPhase phase = GC_IDLE;
+
+// Set while a minor collection runs. Old objects count as
+// reachable then, and are neither marked nor traced.
+static bool collectingYoung = false;
+
+// Bytes allocated since the last step that no step has
+// paid for yet.
+static size_t debt = 0;
+// Catch-up rounds left in the marking under way.
+static int markRounds;
+// Attempts at finishing it that may still be cut short.
+static int remarkTries;
+
+// What the current step may still do. An unbounded step
+// goes until its phase is over.
+static bool stepBounded;
+static long stepWork;
+static double stepDeadline;
+
+// Shapes blackened since transitions were last pruned.
+static int tracedShapeCount = 0;
+static int tracedShapeCapacity = 0;
+static ObjShape** tracedShapes = NULL;
+
+#ifdef CONCURRENT_GC
+// A marker thread's gray objects, as a Chase-Lev deque: the
+// thread pushes and pops at the bottom, the others steal from
+// the top. items grows by doubling. Arrays it outgrows may
+// still be read by a thief, so they are kept on the previous
+// chain until the threads are joined.
+typedef struct GrayArray {
+    long size;
+    struct GrayArray* previous;
+    _Atomic(Obj*) items[];
+} GrayArray;
+
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(GrayArray*) array;
+} GrayDeque;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    GrayDeque gray;
+    // Gray objects it leaves to the program's thread.
+    int deferredCount;
+    int deferredCapacity;
+    Obj** deferred;
+} Marker;
+
+// The marker threads (--gc-threads), how many of them got
+// started, how many are out of work, and whether they all
+// are.
+static Marker* markers = NULL;
+static int markerThreads = 0;
+static atomic_int idleMarkers;
+static atomic_bool markerDone;
+// The marker running on this thread, if any.
+static _Thread_local Marker* currentMarker = NULL;
+// Instances are traced and grown under one of these, picked
+// by address.
+static pthread_mutex_t instanceLocks[GC_INSTANCE_LOCKS];
+// Heap size past which the program waits for the markers.
+static size_t markLimit;
+
+static void markInParallel(Obj* object);
+static void startMarker();
+#endif
+
+#ifdef DEBUG_LOG_GC
+static size_t cycleStart;
+#endif
+
+#ifndef DEBUG_STRESS_GC
+static void collectYoung();
+static void stepCollection();
+#endif
+
+// Seconds on the wall clock. Unlike clock(), this leaves out
+// the time the marker threads run alongside the program.
+static double now()
+{
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
     vm.bytesAllocated += newSize - oldSize;
+    #ifdef DEBUG_MEMORY_STATS
+    if (vm.bytesAllocated > peakBytes) peakBytes = vm.bytesAllocated;
+    #endif
     
     // Only trigger for new allocation.
     if (newSize > oldSize)
@@ -23,8 +179,27 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
         #ifdef DEBUG_STRESS_GC
             collectGarbage();
         #else
-            if (vm.bytesAllocated > vm.nextGC)
-                collectGarbage();
+            #ifdef CONCURRENT_GC
+            if (vm.markingConcurrently)
+            {
+                if (atomic_load(&markerDone) ||
+                    (vm.bytesAllocated > markLimit))
+                    stepCollection();
+            }
+            else
+            #endif
+            if (phase != GC_IDLE)
+            {
+                debt += newSize - oldSize;
+                if (debt >= GC_STEP_SIZE)
+                    stepCollection();
+            }
+            else if (vm.bytesAllocated > vm.nextGC)
+                stepCollection();
+
+            // Marking has to see every young object.
+            if ((phase != GC_MARKING) && (vm.youngBytes > GC_NURSERY_SIZE))
+                collectYoung();
         #endif
     }
     
@@ -39,10 +214,32 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
+// Pushes a marked object to be traced (again).
+static void grayObject(Obj* object)
+{
+    if (vm.grayCapacity < vm.grayCount + 1)
+    {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj **) realloc(vm.grayStack, 
+                                        sizeof(Obj*) * vm.grayCapacity);
+        if (vm.grayStack == NULL) exit(1);
+    }
+
+    vm.grayStack[vm.grayCount++] = object;
+}
+
 void markObject(Obj* object)
 {
     if (object == NULL) return;
+    #ifdef CONCURRENT_GC
+    if (currentMarker != NULL)
+    {
+        markInParallel(object);
+        return;
+    }
+    #endif
     if (object->isMarked) return;
+    if (collectingYoung && object->isOld) return;
 
     #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void *) object);
@@ -51,22 +248,59 @@ void markObject(Obj* object)
     #endif
 
     object->isMarked = true;
+    grayObject(object);
+}
 
-    if (vm.grayCapacity < vm.grayCount + 1)
+void markValue(Value value)
+{
+    if (!IS_OBJ(value)) return;
+    markObject(AS_OBJ(value));
+}
+
+// Adds an old object to the remembered set (see
+// WRITE_BARRIER).
+void rememberObject(Obj* object)
+{
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
     {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj **) realloc(vm.grayStack, 
-                                        sizeof(Obj*) * vm.grayCapacity);
-        if (vm.grayStack == NULL) exit(1);
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj **) realloc(vm.remembered,
+                                        sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.remembered == NULL) exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    vm.remembered[vm.rememberedCount++] = object;
 }
 
-void markValue(Value value)
+// Old objects that stay in the remembered set for good.
+// Functions get constants and inline cache entries written
+// into them from all over, and closed upvalues are stored to
+// by native code, so neither goes through the barrier.
+static bool alwaysRemembered(Obj* object)
 {
-    if (!IS_OBJ(value)) return;
-    markObject(AS_OBJ(value));
+    if (object->type == OBJ_FUNCTION) return true;
+    if (object->type != OBJ_UPVALUE) return false;
+    ObjUpvalue* upvalue = (ObjUpvalue *) object;
+    return (upvalue->location == &upvalue->closed);
+}
+
+// Drops the remembered objects that no longer need to be
+// there: after a collection there are no young objects left
+// for them to point at.
+static void forgetRemembered()
+{
+    int kept = 0;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        Obj* object = vm.remembered[i];
+        if (alwaysRemembered(object))
+            vm.remembered[kept++] = object;
+        else
+            object->isRemembered = false;
+    }
+    vm.rememberedCount = kept;
 }
 
 static void blackenObject(Obj* object)
@@ -85,6 +319,26 @@ static void blackenObject(Obj* object)
             ObjFunction* function = (ObjFunction *) object;
             markObject((Obj *) function->name);
             markValueArray(&function->chunk.constants);
+            markObject((Obj *) function->closure);
+            for (int i = 0; i < function->chunk.inlinedCount; i++)
+                markObject((Obj *) function->chunk.inlinedLines[i].function);
+            // Classes and shapes the inline caches still compare
+            // against, so none of them can be freed and its
+            // address reused.
+            for (int i = 0; i < function->chunk.cacheCount; i++)
+            {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++)
+                {
+                    CacheEntry* entry = &cache->entries[j];
+                    markObject((Obj *) entry->shape);
+                    markObject((Obj *) entry->klass);
+                    markObject((Obj *) entry->next);
+                }
+            }
+            #ifdef JIT
+            markTraces(function);
+            #endif
             break;
         }
         case OBJ_NATIVE: break;
@@ -97,12 +351,16 @@ static void blackenObject(Obj* object)
             markObject((Obj *) closure->function);
             for (int i = 0; i < closure->upvalueCount; i++)
                 markObject((Obj *) closure->upvalues[i]);
+            for (int i = 0; i < closure->capturedCount; i++)
+                markValue(closure->captured[i]);
             break;
         }
         case OBJ_CLASS:
         {
             ObjClass* klass = (ObjClass *) object;
             markObject((Obj *) klass->name);
+            // The initializer is kept out of the method table.
+            markObject((Obj *) klass->init);
             markTable(&klass->methods);
             break;
         }
@@ -110,7 +368,16 @@ static void blackenObject(Obj* object)
         {
             ObjInstance* instance = (ObjInstance *) object;
             markObject((Obj *) instance->klass);
-            markTable(&instance->fields);
+            Dictionary* dictionary = instance->dictionary;
+            if (dictionary != NULL)
+            {
+                for (int i = 0; i < dictionary->count; i++)
+                    markObject((Obj *) dictionary->names[i]);
+            }
+            else
+                markObject((Obj *) instance->shape);
+            for (int i = 0; i < fieldCount(instance); i++)
+                markValue(instance->fields[i]);
             break;
         }
         case OBJ_BOUND_METHOD:
@@ -120,6 +387,23 @@ static void blackenObject(Obj* object)
             markObject((Obj *) bound->method);
             break;
         }
+        case OBJ_SHAPE:
+        {
+            ObjShape* shape = (ObjShape *) object;
+            markObject((Obj *) shape->parent);
+            markObject((Obj *) shape->name);
+            // The transitions are weak. Those to children that
+            // go unmarked are dropped once marking is over.
+            if (tracedShapeCapacity < tracedShapeCount + 1)
+            {
+                tracedShapeCapacity = GROW_CAPACITY(tracedShapeCapacity);
+                tracedShapes = (ObjShape **) realloc(tracedShapes,
+                                sizeof(ObjShape*) * tracedShapeCapacity);
+                if (tracedShapes == NULL) exit(1);
+            }
+            tracedShapes[tracedShapeCount++] = shape;
+            break;
+        }
     }
 }
 
@@ -144,6 +428,9 @@ static void freeObject(Obj* object)
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction *) object;
+            #ifdef JIT
+            jitFree(function); // Needs the chunk's size.
+            #endif
             freeChunk(&function->chunk);
             FREE(ObjFunction, object);
             // GC handles the function object's ObjString name.
@@ -166,8 +453,8 @@ static void freeObject(Obj* object)
         case OBJ_CLOSURE:
         {
             ObjClosure* closure = (ObjClosure *) object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            reallocate(object, CLOSURE_SIZE(closure->upvalueCount,
+                                            closure->capturedCount), 0);
             // Do not free the function
             // since closure doesn't own it.
             break;
@@ -183,10 +470,16 @@ static void freeObject(Obj* object)
         case OBJ_INSTANCE:
         {
             ObjInstance* instance = (ObjInstance *) object;
-            // Each instance owns its field table.
-            // Don't free references in table.
-            // Only the entry array.
-            freeTable(&instance->fields);
+            // Each instance owns its field values.
+            // The shape is shared, so the GC frees it.
+            Dictionary* dictionary = instance->dictionary;
+            if (dictionary != NULL)
+            {
+                freeTable(&dictionary->slots);
+                FREE_ARRAY(ObjString*, dictionary->names, instance->capacity);
+                FREE(Dictionary, dictionary);
+            }
+            FREE_ARRAY(Value, instance->fields, instance->capacity);
             FREE(ObjInstance, object);
             break;
         }
@@ -195,13 +488,19 @@ static void freeObject(Obj* object)
             FREE(ObjBoundMethod, object);
             break;
         }
+        case OBJ_SHAPE:
+        {
+            ObjShape* shape = (ObjShape *) object;
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
     }
 }
 
 static void markRoots()
 {
-    Value* stackTop = vm.stack + vm.stackCount;
-    for (Value* slot = vm.stack; slot < stackTop; slot++)
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
         markValue(*slot);
 
     for (int i = 0; i < vm.frameCount; i++)
@@ -214,76 +513,852 @@ static void markRoots()
 
     markTable(&vm.globalNames);
     markValueArray(&vm.globalValues);
+    markTable(&vm.globalConstants);
     markCompilerRoots();
     markObject((Obj *) vm.initString);
+    markObject((Obj *) vm.rootShape);
 }
 
-static void traceReferences()
+// Drops the transitions to shapes this collection is about to
+// free. Every shape that could hold one was blackened in it:
+// in a major collection every live shape is, and for a minor
+// one a shape that gains a young child goes through the
+// barrier.
+static void pruneTransitions()
 {
-    while (vm.grayCount > 0)
+    for (int i = 0; i < tracedShapeCount; i++)
     {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+        Table* transitions = &tracedShapes[i]->transitions;
+        for (int j = 0; j < transitions->capacity; j++)
+        {
+            Entry* entry = &transitions->entries[j];
+            if (IS_EMPTY(entry->key)) continue;
+            Obj* child = AS_OBJ(entry->value);
+            if (!child->isMarked && !(collectingYoung && child->isOld))
+                tableDelete(transitions, entry->key);
+        }
     }
+    tracedShapeCount = 0;
+}
+
+// Counts one object against the current step and tells
+// whether the step is over.
+static bool stepDone()
+{
+    if (!stepBounded) return false;
+    if (--stepWork <= 0) return true;
+    if ((stepWork % GC_CLOCK_INTERVAL) != 0) return false;
+    return (now() >= stepDeadline);
 }
 
-static void sweep()
+// Moves a young object that survived to the old list.
+static void promote(Obj* object)
+{
+    object->isMarked = false;
+    object->isOld = true;
+    object->next = vm.oldObjects;
+    vm.oldObjects = object;
+    if (alwaysRemembered(object) && !object->isRemembered)
+        rememberObject(object);
+}
+
+// Stressing the collector runs only full collections.
+#ifndef DEBUG_STRESS_GC
+// Frees every unmarked young object and promotes the rest.
+// The strings table only holds its strings weakly, so the
+// young ones that die are taken out of it here.
+static void sweepYoung()
 {
-    Obj* previous = NULL;
     Obj* object = vm.objects;
     while (object != NULL)
     {
+        Obj* next = object->next;
         if (object->isMarked)
-        {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        }
+            promote(object);
         else
         {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL)
-                previous->next = object;
-            else
-                vm.objects = object;
-
-            freeObject(unreached);
+            if (object->type == OBJ_STRING)
+                tableDelete(&vm.strings, OBJ_VAL(object));
+            freeObject(object);
         }
+        object = next;
     }
+
+    vm.objects = NULL;
+    vm.youngBytes = 0;
 }
 
-void collectGarbage()
+static void traceReferences()
+{
+    while (vm.grayCount > 0)
+    {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    }
+}
+
+// Collects only the young objects. Whatever the roots or
+// the remembered old objects reach survives, and is
+// promoted.
+static void collectYoung()
 {
     #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- minor gc begin\n");
     size_t before = vm.bytesAllocated;
     #endif
+    #ifdef DEBUG_GC_STATS
+    double start = now();
+    #endif
 
+    collectingYoung = true;
     markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++)
+        blackenObject(vm.remembered[i]);
     traceReferences();
+    pruneTransitions();
+    sweepYoung();
+    forgetRemembered();
+    collectingYoung = false;
+
+    #ifdef DEBUG_GC_STATS
+    double pause = now() - start;
+    minorCount++;
+    minorTime += pause;
+    if (pause > minorLongest) minorLongest = pause;
+    #endif
+    #ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+            before - vm.bytesAllocated, before, vm.bytesAllocated);
+    #endif
+}
+#endif
+
+// Begins a major collection by graying the roots. Marking
+// reaches every young object, so the remembered set is only
+// needed for what the barrier adds from here on.
+static void startCollection()
+{
+    #ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    cycleStart = vm.bytesAllocated;
+    #endif
+
+    forgetRemembered();
+    markRoots();
+    phase = GC_MARKING;
+    markRounds = GC_MARK_ROUNDS;
+    remarkTries = GC_REMARK_TRIES;
+    debt = 0;
+
+    #ifdef CONCURRENT_GC
+    if (vm.concurrentGC)
+    {
+        markLimit = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+        startMarker();
+    }
+    #endif
+}
+
+// Grays the roots and the remembered objects again, so what
+// the program allocated or stored since marking began gets
+// traced in steps rather than when marking finishes. Returns
+// false if that found nothing new.
+static bool catchUp()
+{
+    bool found = false;
+    int kept = 0;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        Obj* object = vm.remembered[i];
+        // These skip the barrier, so they are kept to be
+        // looked at when marking finishes.
+        if (alwaysRemembered(object))
+        {
+            vm.remembered[kept++] = object;
+            if (object->isMarked) grayObject(object);
+            continue;
+        }
+
+        object->isRemembered = false;
+        if (object->isMarked)
+        {
+            grayObject(object);
+            found = true;
+        }
+    }
+    vm.rememberedCount = kept;
+
+    int grayed = vm.grayCount;
+    markRoots();
+    return found || (vm.grayCount > grayed);
+}
+
+// Blackens gray objects until there are none left and
+// catching up is done (true), or the step is over.
+static bool markSome()
+{
+    while (true)
+    {
+        while (vm.grayCount > 0)
+        {
+            Obj* object = vm.grayStack[--vm.grayCount];
+            blackenObject(object);
+            if (alwaysRemembered(object) && !object->isRemembered)
+                rememberObject(object);
+            if (stepDone()) return false;
+        }
+
+        if (markRounds == 0) return true;
+        markRounds--;
+        if (!catchUp()) return true;
+    }
+}
+
+// Finishes marking if it can within the current step. The
+// roots were not tracked while the program ran, and the
+// remembered objects have been written to since they were
+// blackened, so both are grayed and traced again, with the
+// program stopped. If the step runs out first, what got
+// marked stays marked, the rest is left gray for the next
+// steps, and marking finishes after them from fresh roots.
+// Only once GC_REMARK_TRIES attempts have been cut short does
+// it finish regardless of the step.
+static void finishMarking()
+{
+    #ifdef DEBUG_GC_STATS
+    double start = now();
+    remarkCount++;
+    #endif
+
+    catchUp();
+    while (vm.grayCount > 0)
+    {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+        if (alwaysRemembered(object) && !object->isRemembered)
+            rememberObject(object);
+        if ((remarkTries > 0) && stepDone())
+        {
+            remarkTries--;
+            #ifdef DEBUG_GC_STATS
+            remarksCut++;
+            double pause = now() - start;
+            if (pause > remarkLongest) remarkLongest = pause;
+            #endif
+            return;
+        }
+    }
+
+    #ifdef DEBUG_GC_STATS
+    double pause = now() - start;
+    if (pause > remarkLongest) remarkLongest = pause;
+    #endif
+    pruneTransitions();
     tableRemoveWhite(&vm.strings);
-    sweep();
 
+    // Remembered objects about to be freed must go first.
+    int kept = 0;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        Obj* object = vm.remembered[i];
+        if (object->isMarked)
+            vm.remembered[kept++] = object;
+        else
+            object->isRemembered = false;
+    }
+    vm.rememberedCount = kept;
+    // No young object will be left once sweeping is done.
+    forgetRemembered();
+
+    // Objects allocated or promoted from now on are not swept.
+    vm.unsweptOld = vm.oldObjects;
+    vm.oldObjects = NULL;
+    vm.unsweptYoung = vm.objects;
+    vm.objects = NULL;
+    vm.youngBytes = 0;
+    phase = GC_SWEEPING;
+
+    #ifdef DEBUG_LOG_GC
+    printf("-- gc marked\n");
+    #endif
+}
+
+// Sweeps the objects there were when marking finished,
+// until none are left (true) or the step is over. Those that
+// survived go on the old list.
+static bool sweepSome()
+{
+    while (vm.unsweptOld != NULL)
+    {
+        Obj* object = vm.unsweptOld;
+        vm.unsweptOld = object->next;
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            object->next = vm.oldObjects;
+            vm.oldObjects = object;
+        }
+        else
+            freeObject(object);
+        if (stepDone()) return false;
+    }
+
+    while (vm.unsweptYoung != NULL)
+    {
+        Obj* object = vm.unsweptYoung;
+        vm.unsweptYoung = object->next;
+        if (object->isMarked)
+            promote(object);
+        else
+            freeObject(object);
+        if (stepDone()) return false;
+    }
+    return true;
+}
+
+static void finishCollection()
+{
+    phase = GC_IDLE;
+    debt = 0;
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
+    #ifdef DEBUG_GC_STATS
+    majorCount++;
+    #endif
     #ifdef DEBUG_LOG_GC
+    // The program allocates while it runs, so the heap can
+    // end up bigger than it started.
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-            before - vm.bytesAllocated, before, vm.bytesAllocated,
-            vm.nextGC);
+    printf("   heap went from %zu to %zu bytes, next at %zu\n",
+            cycleStart, vm.bytesAllocated, vm.nextGC);
     #endif
 }
 
-void freeObjects()
+#ifdef CONCURRENT_GC
+static pthread_mutex_t* instanceLock(ObjInstance* instance)
+{
+    return &instanceLocks[((uintptr_t) instance >> 4) % GC_INSTANCE_LOCKS];
+}
+
+void lockInstance(ObjInstance* instance)
+{
+    pthread_mutex_lock(instanceLock(instance));
+}
+
+void unlockInstance(ObjInstance* instance)
+{
+    pthread_mutex_unlock(instanceLock(instance));
+}
+
+static GrayArray* newGrayArray(long size)
+{
+    GrayArray* array = (GrayArray *) malloc(sizeof(GrayArray) +
+                                            sizeof(Obj*) * size);
+    if (array == NULL) exit(1);
+    array->size = size;
+    array->previous = NULL;
+    return array;
+}
+
+// Frees the arrays a deque has outgrown. No thread may be
+// stealing from it.
+static void freeRetired(GrayDeque* deque)
+{
+    GrayArray* array = atomic_load(&deque->array);
+    GrayArray* retired = array->previous;
+    array->previous = NULL;
+    while (retired != NULL)
+    {
+        GrayArray* previous = retired->previous;
+        free(retired);
+        retired = previous;
+    }
+}
+
+// Copies what is in the deque to an array twice the size.
+static GrayArray* growDeque(GrayDeque* deque, long top, long bottom)
+{
+    GrayArray* old = atomic_load_explicit(&deque->array,
+                                            memory_order_relaxed);
+    GrayArray* array = newGrayArray(old->size * 2);
+    for (long i = top; i < bottom; i++)
+    {
+        Obj* object = atomic_load_explicit(&old->items[i % old->size],
+                                            memory_order_relaxed);
+        atomic_store_explicit(&array->items[i % array->size], object,
+                                memory_order_relaxed);
+    }
+    array->previous = old;
+    atomic_store_explicit(&deque->array, array, memory_order_release);
+    return array;
+}
+
+// Only the deque's own thread pushes and pops.
+static void pushGray(GrayDeque* deque, Obj* object)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    GrayArray* array = atomic_load_explicit(&deque->array,
+                                            memory_order_relaxed);
+    if (bottom - top > array->size - 1)
+        array = growDeque(deque, top, bottom);
+
+    atomic_store_explicit(&array->items[bottom % array->size], object,
+                            memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+// Returns NULL once the deque is empty, or if a thief took
+// the last object first.
+static Obj* popGray(GrayDeque* deque)
+{
+    long bottom = atomic_load_explicit(&deque->bottom,
+                                        memory_order_relaxed) - 1;
+    GrayArray* array = atomic_load_explicit(&deque->array,
+                                            memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                                memory_order_relaxed);
+        return NULL;
+    }
+
+    Obj* object = atomic_load_explicit(&array->items[bottom % array->size],
+                                        memory_order_relaxed);
+    if (top == bottom)
+    {
+        // The last one, which a thief may be after too.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top,
+                top + 1, memory_order_seq_cst, memory_order_relaxed))
+            object = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                                memory_order_relaxed);
+    }
+    return object;
+}
+
+// Takes the oldest object from another thread's deque. Returns
+// NULL if it is empty or another thief got there first.
+static Obj* stealGray(GrayDeque* deque)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    GrayArray* array = atomic_load_explicit(&deque->array,
+                                            memory_order_acquire);
+    Obj* object = atomic_load_explicit(&array->items[top % array->size],
+                                        memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top,
+            top + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return object;
+}
+
+static bool dequeEmpty(GrayDeque* deque)
+{
+    return atomic_load(&deque->top) >= atomic_load(&deque->bottom);
+}
+
+// Marks an object on a marker thread. Another one may reach it
+// at the same time, so the mark bit is claimed with an atomic
+// exchange and only the thread that set it grays the object.
+static void markInParallel(Obj* object)
+{
+    if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED)) return;
+    if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED))
+        return;
+    pushGray(&currentMarker->gray, object);
+}
+
+// Objects whose insides the program changes as it runs: code
+// and its caches, closures, which it fills in after allocating
+// them and may collect in between, method and shape tables,
+// and upvalues, which it closes and stores to without a
+// barrier. Marker threads only mark these, and leave tracing
+// them to the program's.
+static bool leftToProgram(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_FUNCTION:
+        case OBJ_CLOSURE:
+        case OBJ_CLASS:
+        case OBJ_SHAPE:
+        case OBJ_UPVALUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void deferObject(Marker* self, Obj* object)
+{
+    if (self->deferredCapacity < self->deferredCount + 1)
+    {
+        self->deferredCapacity = GROW_CAPACITY(self->deferredCapacity);
+        self->deferred = (Obj **) realloc(self->deferred,
+                            sizeof(Obj*) * self->deferredCapacity);
+        if (self->deferred == NULL) exit(1);
+    }
+    self->deferred[self->deferredCount++] = object;
+}
+
+static void traceInParallel(Marker* self, Obj* object)
+{
+    if (leftToProgram(object))
+        deferObject(self, object);
+    else if (object->type == OBJ_INSTANCE)
+    {
+        // The program changes a dictionary without the lock, so
+        // those are left to it too.
+        ObjInstance* instance = (ObjInstance *) object;
+        lockInstance(instance);
+        bool dictionary = (instance->dictionary != NULL);
+        if (!dictionary) blackenObject(object);
+        unlockInstance(instance);
+        if (dictionary) deferObject(self, object);
+    }
+    else
+        blackenObject(object);
+}
+
+// Tries every other marker's deque once, starting with the
+// next one.
+static Obj* stealWork(Marker* self)
+{
+    for (int i = 1; i < vm.gcThreads; i++)
+    {
+        Marker* victim = &markers[(self->index + i) % vm.gcThreads];
+        Obj* object = stealGray(&victim->gray);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+// Waits until some deque has objects in it (false), or every
+// marker is out of work (true). Only a marker with objects
+// pushes more, so once they are all idle marking is over.
+static bool waitForWork()
+{
+    atomic_fetch_add(&idleMarkers, 1);
+    while (true)
+    {
+        if (atomic_load(&idleMarkers) == vm.gcThreads) return true;
+        for (int i = 0; i < vm.gcThreads; i++)
+        {
+            if (!dequeEmpty(&markers[i].gray))
+            {
+                atomic_fetch_sub(&idleMarkers, 1);
+                return false;
+            }
+        }
+        sched_yield();
+    }
+}
+
+// Runs on each marker thread, tracing its own gray objects
+// and stealing others' until there are none left anywhere.
+static void* markConcurrently(void* argument)
+{
+    Marker* self = (Marker *) argument;
+    currentMarker = self;
+    while (true)
+    {
+        Obj* object = popGray(&self->gray);
+        if (object == NULL) object = stealWork(self);
+        if (object != NULL)
+            traceInParallel(self, object);
+        else if (waitForWork())
+            break;
+    }
+    currentMarker = NULL;
+
+    // Every thread gets here; the first one ends the round.
+    #ifdef DEBUG_GC_STATS
+    double end = now();
+    if (!atomic_exchange(&markerDone, true)) markerEnd = end;
+    #else
+    atomic_store(&markerDone, true);
+    #endif
+    return NULL;
+}
+
+static void initMarkers()
+{
+    markers = (Marker *) malloc(sizeof(Marker) * vm.gcThreads);
+    if (markers == NULL) exit(1);
+    for (int i = 0; i < vm.gcThreads; i++)
+    {
+        Marker* marker = &markers[i];
+        marker->index = i;
+        atomic_init(&marker->gray.top, 0);
+        atomic_init(&marker->gray.bottom, 0);
+        atomic_init(&marker->gray.array, newGrayArray(256));
+        marker->deferredCount = 0;
+        marker->deferredCapacity = 0;
+        marker->deferred = NULL;
+    }
+    for (int i = 0; i < GC_INSTANCE_LOCKS; i++)
+        pthread_mutex_init(&instanceLocks[i], NULL);
+}
+
+// Hands the gray objects to the first marker, for the others to
+// steal, and starts the threads.
+static void startMarker()
+{
+    if (markers == NULL) initMarkers();
+    while (vm.grayCount > 0)
+        pushGray(&markers[0].gray, vm.grayStack[--vm.grayCount]);
+
+    atomic_store(&idleMarkers, 0);
+    atomic_store(&markerDone, false);
+    #ifdef DEBUG_GC_STATS
+    markerStart = now();
+    #endif
+    vm.markingConcurrently = true;
+
+    markerThreads = 0;
+    while (markerThreads < vm.gcThreads)
+    {
+        Marker* marker = &markers[markerThreads];
+        if (pthread_create(&marker->thread, NULL, markConcurrently,
+                            marker) != 0)
+            break;
+        markerThreads++;
+    }
+
+    if (markerThreads == 0)
+    {
+        // Without a thread, steps do the marking instead.
+        Obj* object;
+        while ((object = popGray(&markers[0].gray)) != NULL)
+            grayObject(object);
+        vm.markingConcurrently = false;
+    }
+    else
+    {
+        // The ones that did not start have nothing to do.
+        atomic_fetch_add(&idleMarkers, vm.gcThreads - markerThreads);
+    }
+}
+
+// Waits for the marker threads to finish, then traces what they
+// left to this one.
+static void joinMarker()
+{
+    for (int i = 0; i < markerThreads; i++)
+        pthread_join(markers[i].thread, NULL);
+    markerThreads = 0;
+    vm.markingConcurrently = false;
+
+    #ifdef DEBUG_GC_STATS
+    markerRounds++;
+    markerTime += markerEnd - markerStart;
+    #endif
+
+    for (int i = 0; i < vm.gcThreads; i++)
+    {
+        Marker* marker = &markers[i];
+        freeRetired(&marker->gray);
+        for (int j = 0; j < marker->deferredCount; j++)
+        {
+            Obj* object = marker->deferred[j];
+            blackenObject(object);
+            if (alwaysRemembered(object) && !object->isRemembered)
+                rememberObject(object);
+        }
+        marker->deferredCount = 0;
+    }
+}
+
+#ifndef DEBUG_STRESS_GC
+// Takes the marking back from the marker threads, then hands
+// them whatever is gray again or a round of catching up, or
+// finishes marking here.
+static void takeBackMarking()
+{
+    joinMarker();
+    if (vm.grayCount == 0)
+    {
+        if (markRounds == 0)
+        {
+            finishMarking();
+            return;
+        }
+        markRounds--;
+        if (!catchUp())
+        {
+            finishMarking();
+            return;
+        }
+    }
+    startMarker();
+}
+#endif
+#endif
+
+// Does the part of the major collection that falls in the
+// current step.
+static void runPhase()
+{
+    if (phase == GC_MARKING)
+    {
+        #ifdef CONCURRENT_GC
+        if (vm.markingConcurrently) joinMarker();
+        #endif
+        if (markSome()) finishMarking();
+    }
+    else if (phase == GC_SWEEPING)
+    {
+        if (sweepSome()) finishCollection();
+    }
+}
+
+// Stressing the collector runs whole collections, not steps.
+#ifndef DEBUG_STRESS_GC
+// Pays some of the allocation debt with marking or sweeping,
+// and stops early if it runs past vm.gcPause. Any debt left
+// starts the next step on the next allocation. Starting a
+// collection, and taking marking back from the marker threads,
+// are steps too.
+static void stepCollection()
+{
+    double start = now();
+    long work = (long) (debt / GC_STEP_SIZE) * GC_STEP_WORK;
+    #ifdef CONCURRENT_GC
+    // No debt builds up while the threads mark, so taking the
+    // marking back gets one step's worth of work.
+    if (vm.markingConcurrently) work = GC_STEP_WORK;
+    #endif
+    stepBounded = true;
+    stepWork = work;
+    stepDeadline = start + vm.gcPause / 1e6;
+
+    if (phase == GC_IDLE)
+        startCollection();
+    #ifdef CONCURRENT_GC
+    else if (vm.markingConcurrently)
+        takeBackMarking();
+    #endif
+    else
+        runPhase();
+
+    size_t paid = (size_t) (work - stepWork) * GC_STEP_SIZE / GC_STEP_WORK;
+    debt = (phase == GC_IDLE || paid >= debt) ? 0 : debt - paid;
+
+    #ifdef DEBUG_GC_STATS
+    double pause = now() - start;
+    majorSteps++;
+    majorTime += pause;
+    if (pause > majorLongest) majorLongest = pause;
+    #endif
+}
+#endif
+
+void collectGarbage()
+{
+    #ifdef DEBUG_GC_STATS
+    double start = now();
+    #endif
+
+    stepBounded = false;
+    while (phase != GC_IDLE)
+        runPhase();
+    startCollection();
+    while (phase != GC_IDLE)
+        runPhase();
+
+    #ifdef DEBUG_GC_STATS
+    double pause = now() - start;
+    majorSteps++;
+    majorTime += pause;
+    if (pause > majorLongest) majorLongest = pause;
+    #endif
+}
+
+static void freeList(Obj* object)
 {
-    Obj* object = vm.objects;
     while (object != NULL)
     {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects()
+{
+    #ifdef CONCURRENT_GC
+    for (int i = 0; i < markerThreads; i++)
+        pthread_join(markers[i].thread, NULL);
+    if (markers != NULL)
+    {
+        for (int i = 0; i < vm.gcThreads; i++)
+        {
+            freeRetired(&markers[i].gray);
+            free(atomic_load(&markers[i].gray.array));
+            free(markers[i].deferred);
+        }
+        free(markers);
+    }
+    #endif
+
+    freeList(vm.objects);
+    freeList(vm.unsweptOld);
+    freeList(vm.unsweptYoung);
+    freeList(vm.oldObjects);
 
     free(vm.grayStack);
-}
\ No newline at end of file
+    free(vm.remembered);
+    free(tracedShapes);
+}
+
+#ifdef DEBUG_GC_STATS
+void printGCStats()
+{
+    fprintf(stderr, "Minor collections: %d, %.3f ms (longest %.3f ms)\n",
+            minorCount, minorTime * 1000, minorLongest * 1000);
+    fprintf(stderr, "Major collections: %d in %d steps, %.3f ms "
+                    "(longest %.3f ms)\n",
+            majorCount, majorSteps, majorTime * 1000, majorLongest * 1000);
+    fprintf(stderr, "Remarks: %d, %d cut short (longest %.3f ms)\n",
+            remarkCount, remarksCut, remarkLongest * 1000);
+    #ifdef CONCURRENT_GC
+    if (vm.concurrentGC)
+        fprintf(stderr, "Concurrent marking: %d rounds, %.3f ms on %d "
+                        "threads\n",
+                markerRounds, markerTime * 1000, vm.gcThreads);
+    #endif
+}
+#endif
+
+#ifdef DEBUG_MEMORY_STATS
+// Reports the peak of the VM's own heap (objects, stack,
+// constant pools, tables) and, where the OS tells, of the
+// whole process.
+void printMemoryStats()
+{
+    fprintf(stderr, "Peak heap: %zu KB", peakBytes / 1024);
+    #if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        #ifdef __APPLE__
+        long rss = usage.ru_maxrss / 1024; // Bytes there.
+        #else
+        long rss = usage.ru_maxrss;
+        #endif
+        fprintf(stderr, ", peak RSS: %ld KB", rss);
+    }
+    #endif
+    fprintf(stderr, "\n");
+}
+#endif
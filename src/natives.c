@@ -1,5 +1,6 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "../include/natives.h"
+#include "../include/shape.h"
 #include "../include/value.h"
 #include "../include/vm.h"
 #include <math.h>
@@ -23,7 +24,11 @@ static bool setFieldNative(int argCount, Value* args);
 static void fillNatives()
 {
     for (int i = 0; i < nativesCount; i++)
+    {
         natives[i].obj.type = OBJ_NATIVE;
+        // Never freed, so minor collections can skip them.
+        natives[i].obj.isOld = true;
+    }
     
     natives[0].name = "clock";
     natives[0].function = clockNative;
@@ -59,8 +64,11 @@ static void defineNative(ObjNative* nativeFunc)
     int index = vm.globalValues.count;
     ObjString* identifier = copyString(nativeFunc->name, 
                                     (int) strlen(nativeFunc->name));
+    // Push onto stack temporarily so GC can reach it.
+    push(OBJ_VAL(identifier));
     writeValueArray(&vm.globalValues, OBJ_VAL(nativeFunc));
     tableSet(&vm.globalNames, OBJ_VAL(identifier), NUMBER_VAL((double)index));
+    pop();
 }
 
 void defineNatives()
@@ -95,7 +103,7 @@ static bool typeNative(int argCount, Value* args)
 {
     ObjString* typeName = NULL; // Dummy initial value.
     
-    switch (args[0].type)
+    switch (VALUE_TYPE(args[0]))
     {
         case VAL_BOOL:
             typeName = copyString("<boolean>", 9);
@@ -138,6 +146,9 @@ static bool typeNative(int argCount, Value* args)
                 case OBJ_BOUND_METHOD:
                     typeName = copyString("<bound method>", 14);
                     break;
+                case OBJ_SHAPE: // Never stored in a variable.
+                    typeName = copyString("<shape>", 7);
+                    break;
             }
             break;
         }
@@ -179,7 +190,7 @@ static bool hasFieldNative(int argCount, Value* args)
     
     ObjInstance* instance = AS_INSTANCE(args[0]);
     Value dummy;
-    args[-1] = BOOL_VAL(tableGet(&instance->fields, args[1], &dummy));
+    args[-1] = BOOL_VAL(getField(instance, AS_STRING(args[1]), &dummy));
     return true;
 }
 
@@ -200,7 +211,7 @@ static bool getFieldNative(int argCount, Value* args)
 
     ObjInstance* instance = AS_INSTANCE(args[0]);
     Value returnVal;
-    if (tableGet(&instance->fields, args[1], &returnVal))
+    if (getField(instance, AS_STRING(args[1]), &returnVal))
     {
         args[-1] = returnVal;
         return true;
@@ -230,6 +241,6 @@ static bool setFieldNative(int argCount, Value* args)
     }
 
     ObjInstance* instance = AS_INSTANCE(args[0]);
-    tableSet(&instance->fields, args[1], args[2]);
+    setField(instance, AS_STRING(args[1]), args[2]);
     return true;
 }
\ No newline at end of file
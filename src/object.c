@@ -16,8 +16,11 @@ static Obj* allocateObject(size_t size, ObjType type)
     Obj* object = (Obj*) reallocate(NULL, 0, size);
     object->type = type;
     object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
     object->next = vm.objects;
     vm.objects = object;
+    vm.youngBytes += size;
 
     #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %s\n", (void *) object, size, 
@@ -78,8 +81,20 @@ ObjFunction* newFunction()
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->capturedCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
     initChunk(&function->chunk);
+    function->calls = 0;
+    function->backEdges = 0;
+    function->tier = TIER_INTERPRETED;
+    function->deopts = 0;
+    function->native = NULL;
+    function->nativeSize = 0;
+    function->nativeEntries = NULL;
+    function->nativeFailed = false;
+    function->traces = NULL;
+    function->closure = NULL;
     return function;
 }
 
@@ -94,19 +109,27 @@ ObjUpvalue* newUpvalue(Value* slot)
 
 ObjClosure* newClosure(ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++)
-        // Initialize all pointer elements to NULL.
-        // No uninitialized memory for GC.
-        upvalues[i] = NULL;
-    
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = (ObjClosure *) allocateObject(
+            CLOSURE_SIZE(function->upvalueCount, function->capturedCount),
+            OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    closure->capturedCount = function->capturedCount;
+    closure->captured = (Value *) &closure->upvalues[closure->upvalueCount];
+    // No uninitialized memory for GC.
+    for (int i = 0; i < function->upvalueCount; i++)
+        closure->upvalues[i] = NULL;
+    for (int i = 0; i < function->capturedCount; i++)
+        closure->captured[i] = NIL_VAL;
     return closure;
 }
 
+ObjClosure* makeClosure(ObjFunction* function)
+{
+    return (function->closure != NULL) ? function->closure :
+                                        newClosure(function);
+}
+
 ObjClass* newClass(ObjString* name)
 {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
@@ -120,7 +143,11 @@ ObjInstance* newInstance(ObjClass* klass)
 {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    // Every instance starts out with no fields.
+    instance->shape = vm.rootShape;
+    instance->dictionary = NULL;
+    instance->fields = NULL;
+    instance->capacity = 0;
     return instance;
 }
 
@@ -132,6 +159,16 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
     return bound;
 }
 
+ObjShape* newShape(ObjShape* parent, ObjString* name)
+{
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = (parent == NULL) ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
 static void printFunction(ObjFunction* function)
 {
     if (function->name == NULL)
@@ -162,6 +199,9 @@ void printObject(Value value)
         case OBJ_UPVALUE: // Only to silence compiler warnings.
             printf("upvalue");
             break;
+        case OBJ_SHAPE: // Never a user-visible value either.
+            printf("shape");
+            break;
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
@@ -0,0 +1,606 @@
+#include "../include/optimizer.h"
+#include "../include/chunk.h"
+#include "../include/memory.h"
+#include <stdio.h>
+
+// A chunk being rebuilt, one instruction at a time, into
+// a fresh code array and line table.
+typedef struct {
+    Chunk* chunk; // The chunk being rewritten.
+    Chunk out; // Only its code and line array are used.
+    int* newOffsets; // New offset of each old instruction.
+    bool* isTarget; // Whether some jump lands on the old offset.
+    // Offsets in the new code of every jump operand, and
+    // the old offset each of those jumps goes to.
+    int* jumpOperands;
+    int* jumpTargets;
+    int jumpCount;
+} Rewriter;
+
+// Tries to rewrite the instructions starting at offset.
+// Returns the offset after the ones it replaced, or offset
+// itself if nothing matched.
+typedef int (*RewriteRule)(Rewriter* rewriter, int offset);
+
+#ifdef DEBUG_PEEPHOLE_STATS
+typedef enum {
+    PASS_JUMPS,
+    PASS_DEAD_CODE,
+    PASS_POPS,
+    PASS_COUNT
+} PeepholePass;
+
+static const char* passNames[PASS_COUNT] = {
+    "jump threading",
+    "dead code",
+    "pops"
+};
+
+// Bytes each pass has saved, over every chunk so far.
+static long bytesSaved[PASS_COUNT];
+static long bytesBefore = 0;
+// Threading saves no bytes itself, so it is counted too.
+static long jumpsThreaded = 0;
+#endif
+
+static bool isJump(uint8_t instruction)
+{
+    return (instruction == OP_JUMP) ||
+            (instruction == OP_JUMP_IF_FALSE) ||
+            (instruction == OP_LOOP) ||
+            (instruction == OP_LOCAL_LESS_CONST_JUMP);
+}
+
+// Old offset the jump instruction at offset goes to.
+static int jumpTarget(Chunk* chunk, int offset)
+{
+    int end = offset + instructionLength(chunk, offset);
+    int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return (chunk->code[offset] == OP_LOOP) ? end - jump : end + jump;
+}
+
+static void initRewriter(Rewriter* rewriter, Chunk* chunk)
+{
+    rewriter->chunk = chunk;
+    initChunk(&rewriter->out);
+    rewriter->newOffsets = ALLOCATE(int, chunk->count + 1);
+    rewriter->isTarget = ALLOCATE(bool, chunk->count + 1);
+    rewriter->jumpOperands = ALLOCATE(int, chunk->count);
+    rewriter->jumpTargets = ALLOCATE(int, chunk->count);
+    rewriter->jumpCount = 0;
+
+    for (int i = 0; i <= chunk->count; i++)
+        rewriter->isTarget[i] = false;
+
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk, offset))
+    {
+        if (isJump(chunk->code[offset]))
+            rewriter->isTarget[jumpTarget(chunk, offset)] = true;
+    }
+}
+
+static void emitByte(Rewriter* rewriter, uint8_t byte, int line)
+{
+    writeChunk(&rewriter->out, byte, line);
+}
+
+static void copyBytes(Rewriter* rewriter, int from, int length, int line)
+{
+    for (int i = 0; i < length; i++)
+        emitByte(rewriter, rewriter->chunk->code[from + i], line);
+}
+
+// Emits a placeholder jump operand, patched once the new
+// offset of the old target is known.
+static void emitJumpOperand(Rewriter* rewriter, int target, int line)
+{
+    rewriter->jumpOperands[rewriter->jumpCount] = rewriter->out.count;
+    rewriter->jumpTargets[rewriter->jumpCount++] = target;
+    emitByte(rewriter, 0xff, line);
+    emitByte(rewriter, 0xff, line);
+}
+
+// Copies the instruction at offset over unchanged.
+// Returns the offset of the next instruction.
+static int copyInstruction(Rewriter* rewriter, int offset)
+{
+    Chunk* chunk = rewriter->chunk;
+    int length = instructionLength(chunk, offset);
+    int line = getLine(chunk, offset);
+    rewriter->newOffsets[offset] = rewriter->out.count;
+
+    if (isJump(chunk->code[offset]))
+    {
+        copyBytes(rewriter, offset, length - 2, line);
+        emitJumpOperand(rewriter, jumpTarget(chunk, offset), line);
+    }
+    else
+        copyBytes(rewriter, offset, length, line);
+
+    return offset + length;
+}
+
+// Hands the rewritten code and line table over to the chunk.
+static void finishRewrite(Rewriter* rewriter)
+{
+    Chunk* chunk = rewriter->chunk;
+    Chunk* out = &rewriter->out;
+    rewriter->newOffsets[chunk->count] = out->count;
+
+    for (int i = 0; i < rewriter->jumpCount; i++)
+    {
+        int operand = rewriter->jumpOperands[i];
+        int target = rewriter->newOffsets[rewriter->jumpTargets[i]];
+        // Jumps count from the end of their operand.
+        int jump = (target > operand) ? target - (operand + 2) :
+                                        (operand + 2) - target;
+        out->code[operand] = (jump >> 8) & 0xff;
+        out->code[operand + 1] = jump & 0xff;
+    }
+
+    FREE_ARRAY(int, rewriter->newOffsets, chunk->count + 1);
+    FREE_ARRAY(bool, rewriter->isTarget, chunk->count + 1);
+    FREE_ARRAY(int, rewriter->jumpOperands, chunk->count);
+    FREE_ARRAY(int, rewriter->jumpTargets, chunk->count);
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->opLines.lines, chunk->opLines.capacity);
+    FREE_ARRAY(int, chunk->opLines.offsets, chunk->opLines.capacity);
+    chunk->code = out->code;
+    chunk->count = out->count;
+    chunk->capacity = out->capacity;
+    chunk->opLines = out->opLines;
+}
+
+// Rebuilds the chunk, applying the rule at every
+// instruction.
+static void rewrite(Chunk* chunk, RewriteRule rule)
+{
+    Rewriter rewriter;
+    initRewriter(&rewriter, chunk);
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        int next = rule(&rewriter, offset);
+        if (next == offset)
+            next = copyInstruction(&rewriter, offset);
+        offset = next;
+    }
+
+    finishRewrite(&rewriter);
+}
+
+// Offsets control can go to after the instruction at
+// offset: the next one and/or the jump target.
+static int successors(Chunk* chunk, int offset, int next[2])
+{
+    uint8_t instruction = chunk->code[offset];
+    int count = 0;
+    if ((instruction != OP_JUMP) && (instruction != OP_LOOP) &&
+        (instruction != OP_RETURN))
+        next[count++] = offset + instructionLength(chunk, offset);
+    if (isJump(instruction))
+        next[count++] = jumpTarget(chunk, offset);
+    return count;
+}
+
+// ---- Peephole passes. ----
+
+// Where a jump really ends up, going through any jumps it
+// lands on. An OP_JUMP_IF_FALSE that is taken leaves the
+// falsey value behind, so it can go on through another
+// one, but never back up through an OP_LOOP.
+static int finalTarget(Chunk* chunk, int offset)
+{
+    // Bounded, since jumps can form a cycle.
+    #define MAX_THREADED 8
+
+    bool conditional = (chunk->code[offset] == OP_JUMP_IF_FALSE);
+    int target = jumpTarget(chunk, offset);
+    for (int i = 0; (i < MAX_THREADED) && (target < chunk->count); i++)
+    {
+        uint8_t next = chunk->code[target];
+        if ((next == OP_JUMP) ||
+            (conditional && (next == OP_JUMP_IF_FALSE)) ||
+            (!conditional && (next == OP_LOOP)))
+            target = jumpTarget(chunk, target);
+        else
+            break;
+    }
+    return target;
+
+    #undef MAX_THREADED
+}
+
+// Sends jumps straight to where the jumps they land on
+// go, and drops jumps to the next instruction.
+static int threadJump(Rewriter* rewriter, int offset)
+{
+    Chunk* chunk = rewriter->chunk;
+    uint8_t instruction = chunk->code[offset];
+    if ((instruction != OP_JUMP) && (instruction != OP_JUMP_IF_FALSE))
+        return offset;
+
+    int end = offset + instructionLength(chunk, offset);
+    int target = finalTarget(chunk, offset);
+    // The new code is never longer, so a distance that
+    // fits now fits after.
+    if (((target > end) ? target - end : end - target) > UINT16_MAX)
+        target = jumpTarget(chunk, offset);
+
+    #ifdef DEBUG_PEEPHOLE_STATS
+    if (target != jumpTarget(chunk, offset))
+        jumpsThreaded++;
+    #endif
+
+    rewriter->newOffsets[offset] = rewriter->out.count;
+    if (target == end) return end;
+
+    int line = getLine(chunk, offset);
+    emitByte(rewriter, (target < end) ? OP_LOOP : instruction, line);
+    emitJumpOperand(rewriter, target, line);
+    return end;
+}
+
+// Marks every instruction control can reach from the start.
+static void findReachable(Chunk* chunk, bool* reachable)
+{
+    int* pending = ALLOCATE(int, chunk->count);
+    int pendingCount = 0;
+    for (int i = 0; i <= chunk->count; i++)
+        reachable[i] = false;
+
+    if (chunk->count > 0)
+    {
+        reachable[0] = true;
+        pending[pendingCount++] = 0;
+    }
+
+    while (pendingCount > 0)
+    {
+        int next[2];
+        int nextCount = successors(chunk, pending[--pendingCount], next);
+        for (int i = 0; i < nextCount; i++)
+        {
+            if ((next[i] < chunk->count) && !reachable[next[i]])
+            {
+                reachable[next[i]] = true;
+                pending[pendingCount++] = next[i];
+            }
+        }
+    }
+
+    FREE_ARRAY(int, pending, chunk->count);
+}
+
+// Drops code after returns and jumps that nothing jumps to.
+static void removeDeadCode(Chunk* chunk)
+{
+    Rewriter rewriter;
+    initRewriter(&rewriter, chunk);
+    bool* reachable = ALLOCATE(bool, chunk->count + 1);
+    findReachable(chunk, reachable);
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        if (reachable[offset])
+            offset = copyInstruction(&rewriter, offset);
+        else
+        {
+            rewriter.newOffsets[offset] = rewriter.out.count;
+            offset += instructionLength(chunk, offset);
+        }
+    }
+
+    FREE_ARRAY(bool, reachable, chunk->count + 1);
+    finishRewrite(&rewriter);
+}
+
+// Whether the instruction only pushes a value, and cannot
+// fail or do anything else.
+static bool onlyPushes(uint8_t instruction)
+{
+    switch (instruction)
+    {
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_TWO:
+        case OP_MINUSONE:
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUP:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_DEFINED_GLOBAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Drops values pushed only to be popped, and turns runs
+// of OP_POP (one per local at the end of a scope) into an
+// OP_POPN.
+static int foldPops(Rewriter* rewriter, int offset)
+{
+    // Shorter runs would not get any smaller. decodeChunk()
+    // merges the pairs left.
+    #define MIN_POPN 3
+
+    Chunk* chunk = rewriter->chunk;
+    uint8_t instruction = chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+
+    if (onlyPushes(instruction) && (next < chunk->count) &&
+        (chunk->code[next] == OP_POP) && !rewriter->isTarget[next])
+    {
+        rewriter->newOffsets[offset] = rewriter->out.count;
+        rewriter->newOffsets[next] = rewriter->out.count;
+        return next + 1;
+    }
+
+    if (instruction != OP_POP) return offset;
+
+    int count = 1;
+    while ((offset + count < chunk->count) && (count < UINT8_MAX) &&
+            (chunk->code[offset + count] == OP_POP) &&
+            !rewriter->isTarget[offset + count])
+        count++;
+    if (count < MIN_POPN) return offset;
+
+    int line = getLine(chunk, offset);
+    for (int i = 0; i < count; i++)
+        rewriter->newOffsets[offset + i] = rewriter->out.count;
+    emitByte(rewriter, OP_POPN, line);
+    emitByte(rewriter, OP_SHORT, line);
+    emitByte(rewriter, (uint8_t) count, line);
+    return offset + count;
+
+    #undef MIN_POPN
+}
+
+void peephole(Chunk* chunk)
+{
+    #ifdef DEBUG_PEEPHOLE_STATS
+    bytesBefore += chunk->count;
+    int count = chunk->count;
+    #define COUNT_SAVED(pass) \
+        do \
+        { \
+            bytesSaved[pass] += count - chunk->count; \
+            count = chunk->count; \
+        } while (false)
+    #else
+    #define COUNT_SAVED(pass) do {} while (false)
+    #endif
+
+    // Threading leaves jumps nothing reaches any more for
+    // the dead code pass to remove.
+    rewrite(chunk, threadJump);
+    COUNT_SAVED(PASS_JUMPS);
+    removeDeadCode(chunk);
+    COUNT_SAVED(PASS_DEAD_CODE);
+    rewrite(chunk, foldPops);
+    COUNT_SAVED(PASS_POPS);
+
+    #undef COUNT_SAVED
+}
+
+#ifdef DEBUG_PEEPHOLE_STATS
+void printPeepholeStats()
+{
+    long total = 0;
+    for (int i = 0; i < PASS_COUNT; i++)
+        total += bytesSaved[i];
+    fprintf(stderr, "Peephole: %ld of %ld bytes saved (%.1f%%):", total,
+            bytesBefore, (bytesBefore == 0) ? 0.0 : 100.0 * total / bytesBefore);
+    for (int i = 0; i < PASS_COUNT; i++)
+        fprintf(stderr, "%s %s %ld", (i == 0) ? "" : ",", passNames[i],
+                bytesSaved[i]);
+    fprintf(stderr, " (%ld jumps threaded)\n", jumpsThreaded);
+}
+#endif
+
+// ---- Superinstructions. ----
+
+// Tries to fuse the instructions starting at offset into
+// one superinstruction.
+// Returns the offset after the fused instructions, or
+// offset itself if nothing matched.
+static int fuseAt(Rewriter* rewriter, int offset)
+{
+    #define MAX_FUSED 4
+
+    Chunk* chunk = rewriter->chunk;
+    // Start offset and opcode of each instruction in the
+    // window. A window stops early at the end of the chunk
+    // or at an instruction something jumps to, since the
+    // jump would land in the middle of the superinstruction.
+    int at[MAX_FUSED + 1];
+    uint8_t op[MAX_FUSED];
+    int count = 0;
+    at[0] = offset;
+    while ((count < MAX_FUSED) && (at[count] < chunk->count) &&
+            ((count == 0) || !rewriter->isTarget[at[count]]))
+    {
+        op[count] = chunk->code[at[count]];
+        at[count + 1] = at[count] + instructionLength(chunk, at[count]);
+        count++;
+    }
+
+    int line = getLine(chunk, offset);
+    int fused = 0; // Number of instructions replaced.
+
+    if ((count >= 2) && (op[1] == OP_NOT) &&
+        ((op[0] == OP_EQUAL) || (op[0] == OP_LESS) || (op[0] == OP_GREATER)))
+    {
+        rewriter->newOffsets[offset] = rewriter->out.count;
+        if (op[0] == OP_EQUAL)
+            emitByte(rewriter, OP_NOT_EQUAL, line);
+        else if (op[0] == OP_LESS)
+            emitByte(rewriter, OP_GREATER_EQUAL, line);
+        else
+            emitByte(rewriter, OP_LESS_EQUAL, line);
+        fused = 2;
+    }
+    else if ((count >= 3) && (op[0] == OP_GET_LOCAL) &&
+                (op[1] == OP_GET_LOCAL) && (op[2] == OP_ADD))
+    {
+        rewriter->newOffsets[offset] = rewriter->out.count;
+        emitByte(rewriter, OP_ADD_LOCALS, line);
+        // Both slot operands, length prefixes included.
+        copyBytes(rewriter, at[0] + 1, at[1] - at[0] - 1, line);
+        copyBytes(rewriter, at[1] + 1, at[2] - at[1] - 1, line);
+        fused = 3;
+    }
+    else if ((count >= 4) && (op[0] == OP_GET_LOCAL) &&
+                ((op[1] == OP_CONSTANT) || (op[1] == OP_CONSTANT_LONG)) &&
+                (op[2] == OP_LESS) && (op[3] == OP_JUMP_IF_FALSE))
+    {
+        rewriter->newOffsets[offset] = rewriter->out.count;
+        emitByte(rewriter, OP_LOCAL_LESS_CONST_JUMP, line);
+        copyBytes(rewriter, at[0] + 1, at[1] - at[0] - 1, line);
+        // The constant opcode doubles as its operand's prefix.
+        copyBytes(rewriter, at[1], at[2] - at[1], line);
+        emitJumpOperand(rewriter, jumpTarget(chunk, at[3]), line);
+        fused = 4;
+    }
+
+    // Nothing can jump into the middle, but keep the map
+    // complete anyway.
+    for (int i = 1; i < fused; i++)
+        rewriter->newOffsets[at[i]] = rewriter->newOffsets[offset];
+
+    return at[fused];
+
+    #undef MAX_FUSED
+}
+
+void fuseInstructions(Chunk* chunk)
+{
+    rewrite(chunk, fuseAt);
+}
+
+// Values the instruction at offset leaves on the stack
+// minus those it takes off. *peak is set to the most it
+// has pushed at any point while running, over the depth
+// it started at.
+static int stackEffect(Chunk* chunk, int offset, int* peak)
+{
+    uint8_t* code = chunk->code + offset;
+    *peak = 0;
+    switch (code[0])
+    {
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_TWO:
+        case OP_MINUSONE:
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_DUP:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_DEFINED_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_LOCAL_LESS_CONST_JUMP:
+            *peak = 1;
+            return 1;
+        case OP_ADD_LOCALS:
+            // Pushes both operands when it falls back to OP_ADD.
+            *peak = 2;
+            return 1;
+        case OP_POPN:
+        {
+            int next = offset + 1;
+            return -(int) readIndex(chunk, &next);
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE:
+            return -code[instructionLength(chunk, offset) - 1];
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_COMPZER0: // Takes the OP_ZERO before it too.
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_METHOD:
+        case OP_SET_PROPERTY:
+        case OP_RETURN:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+int stackDepths(Chunk* chunk, int entryDepth, int* depth)
+{
+    // The compiler keeps the depth the same along every
+    // path into an instruction, so each one is visited once.
+    int* pending = ALLOCATE(int, chunk->count);
+    int pendingCount = 0;
+    for (int i = 0; i < chunk->count; i++)
+        depth[i] = -1;
+
+    int max = entryDepth;
+    if (chunk->count > 0)
+    {
+        depth[0] = entryDepth;
+        pending[pendingCount++] = 0;
+    }
+
+    while (pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        int peak;
+        int after = depth[offset] + stackEffect(chunk, offset, &peak);
+        if (depth[offset] + peak > max)
+            max = depth[offset] + peak;
+
+        int next[2];
+        int nextCount = successors(chunk, offset, next);
+
+        for (int i = 0; i < nextCount; i++)
+        {
+            if ((next[i] < chunk->count) && (depth[next[i]] == -1))
+            {
+                depth[next[i]] = after;
+                pending[pendingCount++] = next[i];
+            }
+        }
+    }
+
+    FREE_ARRAY(int, pending, chunk->count);
+    return max;
+}
+
+int maxStackDepth(Chunk* chunk, int entryDepth)
+{
+    int* depth = ALLOCATE(int, chunk->count);
+    int max = stackDepths(chunk, entryDepth, depth);
+    FREE_ARRAY(int, depth, chunk->count);
+    return max;
+}
@@ -0,0 +1,578 @@
+#include "../include/register.h"
+#include "../include/chunk.h"
+#include "../include/debug.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+#include <math.h>
+
+// The stack code is translated by walking it with a
+// compile-time model of the value stack. Slot i of the
+// model holds the operand the value at stack depth i would
+// be read from: register i itself once the value has been
+// written there, or a constant/lower register while the
+// value is still pending. Pending values cost nothing until
+// something needs them in their own register.
+typedef struct {
+    Chunk* chunk; // The chunk being translated.
+
+    Word* code;
+    int* offsets;
+    int count;
+    int capacity;
+    int offset; // Offset in code of the instruction being translated.
+
+    Word* stack; // Operand of each value on the modelled stack.
+    int depth;
+    int stackCapacity;
+    int maxDepth;
+
+    int* newIndex; // New index of each old instruction.
+    bool* isTarget; // Whether some jump lands on the old index.
+    int* labelDepth; // Stack depth at each jump target, -1 until known.
+    // Indices in the new code of every jump operand, and
+    // the old index each of those jumps goes to.
+    int* jumpOperands;
+    int* jumpTargets;
+    int jumpCount;
+
+    // Index of the destination operand of the instruction
+    // just emitted, if it produced the value on top of the
+    // stack. Lets a following OP_SET_LOCAL write the local
+    // directly.
+    int lastResult;
+} Translator;
+
+static bool isJump(Word instruction)
+{
+    return (instruction == OP_JUMP) ||
+            (instruction == OP_JUMP_IF_FALSE) ||
+            (instruction == OP_LOOP) ||
+            (instruction == OP_LOCAL_LESS_CONST_JUMP);
+}
+
+// Old index the decoded jump instruction at index goes to.
+static int jumpTarget(Chunk* chunk, int index)
+{
+    int end = index + wordLength(chunk, index);
+    Word jump = chunk->words[end - 1];
+    return (chunk->words[index] == OP_LOOP) ? end - (int) jump : end + (int) jump;
+}
+
+static void initTranslator(Translator* translator, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    translator->chunk = chunk;
+    translator->code = NULL;
+    translator->offsets = NULL;
+    translator->count = 0;
+    translator->capacity = 0;
+    translator->offset = 0;
+
+    // Slot 0 and the parameters are in their registers
+    // when the call starts.
+    translator->depth = function->arity + 1;
+    translator->stackCapacity = translator->depth;
+    translator->stack = ALLOCATE(Word, translator->stackCapacity);
+    for (int i = 0; i < translator->depth; i++)
+        translator->stack[i] = (Word) i;
+    translator->maxDepth = translator->depth;
+
+    translator->newIndex = ALLOCATE(int, chunk->wordCount + 1);
+    translator->isTarget = ALLOCATE(bool, chunk->wordCount + 1);
+    translator->labelDepth = ALLOCATE(int, chunk->wordCount + 1);
+    translator->jumpOperands = ALLOCATE(int, chunk->wordCount);
+    translator->jumpTargets = ALLOCATE(int, chunk->wordCount);
+    translator->jumpCount = 0;
+    translator->lastResult = -1;
+
+    for (int i = 0; i <= chunk->wordCount; i++)
+    {
+        translator->isTarget[i] = false;
+        translator->labelDepth[i] = -1;
+    }
+
+    for (int index = 0; index < chunk->wordCount;
+            index += wordLength(chunk, index))
+    {
+        if (isJump(chunk->words[index]))
+            translator->isTarget[jumpTarget(chunk, index)] = true;
+    }
+}
+
+static void freeTranslator(Translator* translator)
+{
+    int words = translator->chunk->wordCount;
+    FREE_ARRAY(Word, translator->stack, translator->stackCapacity);
+    FREE_ARRAY(int, translator->newIndex, words + 1);
+    FREE_ARRAY(bool, translator->isTarget, words + 1);
+    FREE_ARRAY(int, translator->labelDepth, words + 1);
+    FREE_ARRAY(int, translator->jumpOperands, words);
+    FREE_ARRAY(int, translator->jumpTargets, words);
+}
+
+static void emitWord(Translator* translator, Word word)
+{
+    if (translator->capacity < translator->count + 1)
+    {
+        int oldCapacity = translator->capacity;
+        translator->capacity = GROW_CAPACITY(oldCapacity);
+        translator->code = GROW_ARRAY(Word, translator->code,
+                    oldCapacity, translator->capacity);
+        translator->offsets = GROW_ARRAY(int, translator->offsets,
+                    oldCapacity, translator->capacity);
+    }
+
+    translator->code[translator->count] = word;
+    translator->offsets[translator->count] = translator->offset;
+    translator->count++;
+}
+
+static void emitWords(Translator* translator, Word word1, Word word2)
+{
+    emitWord(translator, word1);
+    emitWord(translator, word2);
+}
+
+// Emits an instruction's opcode followed by the register
+// its result goes to.
+static void emitResult(Translator* translator, RegOpCode op, int dest)
+{
+    emitWords(translator, op, (Word) dest);
+    translator->lastResult = translator->count - 1;
+}
+
+static void pushOperand(Translator* translator, Word operand)
+{
+    if (translator->stackCapacity < translator->depth + 1)
+    {
+        int oldCapacity = translator->stackCapacity;
+        translator->stackCapacity = GROW_CAPACITY(oldCapacity);
+        translator->stack = GROW_ARRAY(Word, translator->stack,
+                    oldCapacity, translator->stackCapacity);
+    }
+
+    translator->stack[translator->depth++] = operand;
+    if (translator->depth > translator->maxDepth)
+        translator->maxDepth = translator->depth;
+}
+
+// Pushes a value that has just been written to the
+// register at the current depth.
+static int pushRegister(Translator* translator)
+{
+    int dest = translator->depth;
+    pushOperand(translator, (Word) dest);
+    return dest;
+}
+
+static Word popOperand(Translator* translator)
+{
+    // Only malformed code could pop more than it pushed.
+    if (translator->depth == 0) return 0;
+    return translator->stack[--translator->depth];
+}
+
+static Word peekOperand(Translator* translator)
+{
+    if (translator->depth == 0) return 0;
+    return translator->stack[translator->depth - 1];
+}
+
+// Writes the value at depth to its own register.
+static void materialize(Translator* translator, int depth)
+{
+    if (translator->stack[depth] == (Word) depth) return;
+
+    emitWords(translator, REG_MOVE, (Word) depth);
+    emitWord(translator, translator->stack[depth]);
+    translator->stack[depth] = (Word) depth;
+    translator->lastResult = -1;
+}
+
+// Writes every pending value to its register, as jump
+// targets and calls expect to find them there.
+static void flush(Translator* translator)
+{
+    for (int i = 0; i < translator->depth; i++)
+        materialize(translator, i);
+    translator->lastResult = -1;
+}
+
+// Operand a local is read from. Locals above the depth
+// would only be seen in code that can't run.
+static Word localOperand(Translator* translator, Word slot)
+{
+    if (slot < (Word) translator->depth)
+        return translator->stack[slot];
+    return slot;
+}
+
+static bool isReferenced(Translator* translator, Word reg, int below)
+{
+    for (int i = 0; i < below; i++)
+    {
+        if ((i != (int) reg) && (translator->stack[i] == reg))
+            return true;
+    }
+    return false;
+}
+
+static void setLocal(Translator* translator, Word slot, int lastResult)
+{
+    int top = translator->depth - 1;
+    Word value = peekOperand(translator);
+
+    // Retarget the instruction that produced the value
+    // when nothing else still reads the local's old value.
+    if ((lastResult != -1) && (value == (Word) top) &&
+        (translator->code[lastResult] == (Word) top) &&
+        !isReferenced(translator, slot, top))
+    {
+        translator->code[lastResult] = slot;
+    }
+    else
+    {
+        for (int i = 0; i < top; i++)
+        {
+            if ((i != (int) slot) && (translator->stack[i] == slot))
+                materialize(translator, i);
+        }
+        emitWords(translator, REG_MOVE, slot);
+        emitWord(translator, value);
+    }
+
+    if (slot < (Word) translator->depth)
+        translator->stack[slot] = slot;
+    // The assigned value now sits in the local.
+    if (top != (int) slot)
+        translator->stack[top] = slot;
+}
+
+// Constant operand for a literal the stack code pushes
+// without an entry in the constant pool.
+static Word literal(Translator* translator, Value value)
+{
+    ValueArray* constants = &translator->chunk->constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        Value constant = constants->values[i];
+        // -0 equals 0, but divides differently.
+        if ((VALUE_TYPE(constant) == VALUE_TYPE(value)) &&
+            valuesEqual(constant, value) && (!IS_NUMBER(value) ||
+            (signbit(AS_NUMBER(constant)) == signbit(AS_NUMBER(value)))))
+            return RK_CONSTANT | (Word) i;
+    }
+
+    return RK_CONSTANT | (Word) addConstant(translator->chunk, value);
+}
+
+static void binary(Translator* translator, RegOpCode op)
+{
+    Word right = popOperand(translator);
+    Word left = popOperand(translator);
+    emitResult(translator, op, pushRegister(translator));
+    emitWords(translator, left, right);
+}
+
+static void unary(Translator* translator, RegOpCode op)
+{
+    Word operand = popOperand(translator);
+    emitResult(translator, op, pushRegister(translator));
+    emitWord(translator, operand);
+}
+
+// Emits a placeholder jump operand, patched once the new
+// index of the old target is known.
+static void emitJumpOperand(Translator* translator, int target)
+{
+    translator->jumpOperands[translator->jumpCount] = translator->count;
+    translator->jumpTargets[translator->jumpCount++] = target;
+    if (translator->labelDepth[target] == -1)
+        translator->labelDepth[target] = translator->depth;
+    emitWord(translator, 0);
+}
+
+// Translates the instruction at index.
+// Returns the index of the next instruction.
+static int translateInstruction(Translator* translator, int index)
+{
+    Chunk* chunk = translator->chunk;
+    Word* words = chunk->words + index;
+    int next = index + wordLength(chunk, index);
+    int lastResult = translator->lastResult;
+    translator->lastResult = -1;
+
+    switch (words[0])
+    {
+        case OP_ZERO:
+            pushOperand(translator, literal(translator, NUMBER_VAL(0)));
+            break;
+        case OP_ONE:
+            pushOperand(translator, literal(translator, NUMBER_VAL(1)));
+            break;
+        case OP_TWO:
+            pushOperand(translator, literal(translator, NUMBER_VAL(2)));
+            break;
+        case OP_MINUSONE:
+            pushOperand(translator, literal(translator, NUMBER_VAL(-1)));
+            break;
+        case OP_NIL:
+            pushOperand(translator, literal(translator, NIL_VAL));
+            break;
+        case OP_TRUE:
+            pushOperand(translator, literal(translator, BOOL_VAL(true)));
+            break;
+        case OP_FALSE:
+            pushOperand(translator, literal(translator, BOOL_VAL(false)));
+            break;
+        case OP_CONSTANT:
+            pushOperand(translator, RK_CONSTANT | words[1]);
+            break;
+        case OP_DUP:
+            pushOperand(translator, peekOperand(translator));
+            break;
+        case OP_POP:
+            popOperand(translator);
+            break;
+        case OP_POPN:
+            for (Word i = 0; i < words[1]; i++)
+                popOperand(translator);
+            break;
+        case OP_DEFINE_GLOBAL:
+            emitWords(translator, REG_DEFINE_GLOBAL, words[1]);
+            emitWord(translator, popOperand(translator));
+            break;
+        case OP_GET_GLOBAL:
+            emitResult(translator, REG_GET_GLOBAL, pushRegister(translator));
+            emitWord(translator, words[1]);
+            break;
+        case OP_SET_GLOBAL:
+            emitWords(translator, REG_SET_GLOBAL, words[1]);
+            emitWord(translator, peekOperand(translator));
+            break;
+        case OP_GET_LOCAL:
+            pushOperand(translator, localOperand(translator, words[1]));
+            break;
+        case OP_SET_LOCAL:
+            setLocal(translator, words[1], lastResult);
+            break;
+        case OP_GET_UPVALUE:
+            emitResult(translator, REG_GET_UPVALUE, pushRegister(translator));
+            emitWord(translator, words[1]);
+            break;
+        case OP_SET_UPVALUE:
+            emitWords(translator, REG_SET_UPVALUE, words[1]);
+            emitWord(translator, peekOperand(translator));
+            break;
+        case OP_GET_CAPTURED:
+            emitResult(translator, REG_GET_CAPTURED, pushRegister(translator));
+            emitWord(translator, words[1]);
+            break;
+        case OP_GET_DEFINED_GLOBAL:
+            emitResult(translator, REG_GET_DEFINED_GLOBAL,
+                        pushRegister(translator));
+            emitWord(translator, words[1]);
+            break;
+        case OP_SET_DEFINED_GLOBAL:
+            emitWords(translator, REG_SET_DEFINED_GLOBAL, words[1]);
+            emitWord(translator, peekOperand(translator));
+            break;
+        case OP_EQUAL:          binary(translator, REG_EQUAL); break;
+        case OP_NOT_EQUAL:      binary(translator, REG_NOT_EQUAL); break;
+        case OP_GREATER:        binary(translator, REG_GREATER); break;
+        case OP_GREATER_EQUAL:  binary(translator, REG_GREATER_EQUAL); break;
+        case OP_LESS:           binary(translator, REG_LESS); break;
+        case OP_LESS_EQUAL:     binary(translator, REG_LESS_EQUAL); break;
+        case OP_ADD:            binary(translator, REG_ADD); break;
+        case OP_SUBTRACT:       binary(translator, REG_SUBTRACT); break;
+        case OP_MULTIPLY:       binary(translator, REG_MULTIPLY); break;
+        case OP_DIVIDE:         binary(translator, REG_DIVIDE); break;
+        case OP_COMPZER0:       unary(translator, REG_COMPZERO); break;
+        case OP_INCREMENT:      unary(translator, REG_INCREMENT); break;
+        case OP_DECREMENT:      unary(translator, REG_DECREMENT); break;
+        case OP_NOT:            unary(translator, REG_NOT); break;
+        case OP_NEGATE:         unary(translator, REG_NEGATE); break;
+        case OP_ADD_LOCALS:
+            pushOperand(translator, localOperand(translator, words[1]));
+            pushOperand(translator, localOperand(translator, words[2]));
+            binary(translator, REG_ADD);
+            break;
+        case OP_PRINT:
+            emitWords(translator, REG_PRINT, popOperand(translator));
+            break;
+        case OP_JUMP:
+            flush(translator);
+            emitWord(translator, REG_JUMP);
+            emitJumpOperand(translator, jumpTarget(chunk, index));
+            break;
+        case OP_LOCAL_LESS_CONST_JUMP:
+            pushOperand(translator, localOperand(translator, words[1]));
+            pushOperand(translator, RK_CONSTANT | words[2]);
+            binary(translator, REG_LESS);
+            // Fall through.
+        case OP_JUMP_IF_FALSE:
+            flush(translator);
+            emitWords(translator, REG_JUMP_IF_FALSE,
+                        (Word) (translator->depth - 1));
+            emitJumpOperand(translator, jumpTarget(chunk, index));
+            break;
+        case OP_LOOP:
+            flush(translator);
+            emitWord(translator, REG_LOOP);
+            emitJumpOperand(translator, jumpTarget(chunk, index));
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        {
+            // The callee can change any local through its
+            // upvalues, so nothing may stay pending.
+            flush(translator);
+            int argCount = (int) words[1];
+            translator->depth -= argCount + 1;
+            emitWord(translator, (words[0] == OP_CALL) ? REG_CALL :
+                                                        REG_TAIL_CALL);
+            emitWords(translator, (Word) pushRegister(translator), words[1]);
+            break;
+        }
+        case OP_INVOKE:
+        {
+            flush(translator);
+            int argCount = (int) words[2];
+            translator->depth -= argCount + 1;
+            emitWord(translator, REG_INVOKE);
+            emitWord(translator, (Word) pushRegister(translator));
+            emitWords(translator, words[1], words[2]);
+            emitWord(translator, words[3]); // Cache.
+            break;
+        }
+        case OP_CLOSURE:
+        {
+            // Captured locals have to be in their registers.
+            flush(translator);
+            emitResult(translator, REG_CLOSURE, pushRegister(translator));
+            for (int i = 1; i < next - index; i++)
+                emitWord(translator, words[i]);
+            // The upvalues are captured after the closure is
+            // stored, so it has to stay where it is.
+            translator->lastResult = -1;
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            materialize(translator, translator->depth - 1);
+            emitWords(translator, REG_CLOSE_UPVALUE,
+                        (Word) (translator->depth - 1));
+            popOperand(translator);
+            break;
+        case OP_CLASS:
+            emitResult(translator, REG_CLASS, pushRegister(translator));
+            emitWord(translator, words[1]);
+            break;
+        case OP_METHOD:
+        {
+            Word method = popOperand(translator);
+            emitWords(translator, REG_METHOD, peekOperand(translator));
+            emitWords(translator, method, words[1]);
+            break;
+        }
+        case OP_GET_PROPERTY:
+        {
+            Word instance = popOperand(translator);
+            emitResult(translator, REG_GET_PROPERTY, pushRegister(translator));
+            emitWords(translator, instance, words[1]);
+            emitWord(translator, words[2]); // Cache.
+            break;
+        }
+        case OP_SET_PROPERTY:
+        {
+            Word value = popOperand(translator);
+            Word instance = popOperand(translator);
+            emitResult(translator, REG_SET_PROPERTY, pushRegister(translator));
+            emitWords(translator, instance, words[1]);
+            emitWords(translator, value, words[2]); // Cache.
+            break;
+        }
+        case OP_DEL_PROPERTY:
+            // Leaves the instance where it is.
+            emitWords(translator, REG_DEL_PROPERTY, peekOperand(translator));
+            emitWord(translator, words[1]);
+            break;
+        case OP_RETURN:
+            emitWords(translator, REG_RETURN, popOperand(translator));
+            break;
+        default:
+            break; // Never in decoded code.
+    }
+
+    return next;
+}
+
+void buildRegisterCode(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    if (chunk->regWords != NULL) return; // Already built.
+
+    Translator translator;
+    initTranslator(&translator, function);
+
+    // Code after a jump or a return can only run if some
+    // jump lands on it. Code that can't run is dropped.
+    bool reachable = true;
+    for (int index = 0; index < chunk->wordCount;)
+    {
+        // Code reached by a jump starts with every value in
+        // its register, at the depth the jumps recorded.
+        // Loop starts are only jumped to from below, so they
+        // keep the depth they are reached at.
+        if (translator.isTarget[index])
+        {
+            if (reachable)
+                flush(&translator);
+            else if (translator.labelDepth[index] != -1)
+            {
+                translator.depth = 0;
+                for (int i = 0; i < translator.labelDepth[index]; i++)
+                    pushRegister(&translator);
+            }
+            reachable = true;
+        }
+
+        translator.newIndex[index] = translator.count;
+        if (!reachable)
+        {
+            index += wordLength(chunk, index);
+            continue;
+        }
+
+        Word instruction = chunk->words[index];
+        translator.offset = chunk->wordOffsets[index];
+        index = translateInstruction(&translator, index);
+        if ((instruction == OP_JUMP) || (instruction == OP_LOOP) ||
+            (instruction == OP_RETURN))
+            reachable = false;
+    }
+    translator.newIndex[chunk->wordCount] = translator.count;
+
+    // Jump operands count words from the end of the jump
+    // instruction, as in the decoded stack code.
+    for (int i = 0; i < translator.jumpCount; i++)
+    {
+        int from = translator.jumpOperands[i] + 1;
+        int to = translator.newIndex[translator.jumpTargets[i]];
+        translator.code[translator.jumpOperands[i]] =
+                    (Word) (to > from ? to - from : from - to);
+    }
+
+    chunk->regWords = GROW_ARRAY(Word, translator.code,
+                translator.capacity, translator.count);
+    chunk->regOffsets = GROW_ARRAY(int, translator.offsets,
+                translator.capacity, translator.count);
+    chunk->regCount = translator.count;
+    chunk->maxRegisters = translator.maxDepth;
+
+    freeTranslator(&translator);
+
+    #ifdef DEBUG_PRINT_CODE
+    disassembleRegisters(chunk, function->name == NULL ?
+                "<script>" : function->name->chars);
+    #endif
+}
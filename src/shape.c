@@ -0,0 +1,181 @@
+#include "../include/shape.h"
+#include "../include/memory.h"
+#include "../include/table.h"
+#include "../include/vm.h"
+
+int shapeSlot(ObjShape* shape, ObjString* name)
+{
+    // Names are interned, so comparing pointers will do.
+    for (; shape->parent != NULL; shape = shape->parent)
+    {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name)
+{
+    Value child;
+    if (tableGet(&shape->transitions, OBJ_VAL(name), &child))
+        return AS_SHAPE(child);
+
+    ObjShape* next = newShape(shape, name);
+    // Push onto stack temporarily so GC can reach it. The
+    // caller has to move an instance to it (or cache it)
+    // before allocating again.
+    push(OBJ_VAL(next));
+    tableSet(&shape->transitions, OBJ_VAL(name), OBJ_VAL(next));
+    // A minor collection has to see the new child from here
+    // to know whether to drop it.
+    WRITE_BARRIER(shape);
+    pop();
+
+    return next;
+}
+
+int fieldSlot(ObjInstance* instance, ObjString* name)
+{
+    if (instance->dictionary == NULL)
+        return shapeSlot(instance->shape, name);
+
+    Value slot;
+    if (!tableGet(&instance->dictionary->slots, OBJ_VAL(name), &slot))
+        return -1;
+    return (int) AS_NUMBER(slot);
+}
+
+// Gives the instance a table of its own for its fields, in
+// place of its shape. The fields keep their slots.
+static void makeDictionary(ObjInstance* instance)
+{
+    Dictionary* dictionary = ALLOCATE(Dictionary, 1);
+    initTable(&dictionary->slots);
+    dictionary->names = ALLOCATE(ObjString*, instance->capacity);
+    // The names stay reachable from the shape until the
+    // instance lets go of it below.
+    ObjShape* shape = instance->shape;
+    for (; shape->parent != NULL; shape = shape->parent)
+    {
+        int slot = shape->fieldCount - 1;
+        dictionary->names[slot] = shape->name;
+        tableSet(&dictionary->slots, OBJ_VAL(shape->name), NUMBER_VAL(slot));
+    }
+    dictionary->count = instance->shape->fieldCount;
+
+    LOCK_FOR_MARKERS(instance);
+    instance->dictionary = dictionary;
+    instance->shape = NULL;
+    WRITE_BARRIER(instance);
+    UNLOCK_FOR_MARKERS(instance);
+}
+
+int addField(ObjInstance* instance, ObjString* name)
+{
+    if ((instance->dictionary == NULL) &&
+        (instance->shape->fieldCount >= SHAPE_MAX_FIELDS))
+        makeDictionary(instance);
+
+    Dictionary* dictionary = instance->dictionary;
+    if (dictionary != NULL)
+    {
+        int slot = dictionary->count;
+        int oldCapacity = instance->capacity;
+        reserveFields(instance, slot + 1);
+        if (instance->capacity > oldCapacity)
+            dictionary->names = GROW_ARRAY(ObjString*, dictionary->names,
+                                    oldCapacity, instance->capacity);
+        tableSet(&dictionary->slots, OBJ_VAL(name), NUMBER_VAL(slot));
+        instance->fields[slot] = NIL_VAL;
+        dictionary->names[slot] = name;
+        dictionary->count++;
+        WRITE_BARRIER(instance);
+        return slot;
+    }
+
+    // New fields always go in the next slot. The room is made
+    // first, since nothing else holds the new shape yet.
+    int slot = instance->shape->fieldCount;
+    reserveFields(instance, slot + 1);
+    ObjShape* shape = shapeTransition(instance->shape, name);
+    LOCK_FOR_MARKERS(instance);
+    instance->fields[slot] = NIL_VAL;
+    instance->shape = shape;
+    WRITE_BARRIER(instance);
+    UNLOCK_FOR_MARKERS(instance);
+    return slot;
+}
+
+void reserveFields(ObjInstance* instance, int count)
+{
+    if (instance->capacity >= count) return;
+
+    int oldCapacity = instance->capacity;
+    #ifdef CONCURRENT_GC
+    if (vm.concurrentGC)
+    {
+        // A marker may be reading the old array, so the new
+        // one is swapped in under its lock, and filled with
+        // nil since it may look at a slot before the value
+        // lands there.
+        int capacity = GROW_CAPACITY(oldCapacity);
+        Value* fields = ALLOCATE(Value, capacity);
+        for (int i = 0; i < capacity; i++)
+            fields[i] = (i < oldCapacity) ? instance->fields[i] : NIL_VAL;
+
+        Value* oldFields = instance->fields;
+        LOCK_FOR_MARKERS(instance);
+        instance->fields = fields;
+        instance->capacity = capacity;
+        UNLOCK_FOR_MARKERS(instance);
+        FREE_ARRAY(Value, oldFields, oldCapacity);
+        return;
+    }
+    #endif
+    instance->capacity = GROW_CAPACITY(oldCapacity);
+    instance->fields = GROW_ARRAY(Value, instance->fields,
+                            oldCapacity, instance->capacity);
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value)
+{
+    int slot = fieldSlot(instance, name);
+    if (slot == -1) return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+void setField(ObjInstance* instance, ObjString* name, Value value)
+{
+    if (instance->dictionary == NULL) makeDictionary(instance);
+
+    int slot = fieldSlot(instance, name);
+    if (slot == -1) slot = addField(instance, name);
+    instance->fields[slot] = value;
+    WRITE_BARRIER(instance);
+}
+
+bool deleteField(ObjInstance* instance, ObjString* name)
+{
+    if (fieldSlot(instance, name) == -1) return false;
+    if (instance->dictionary == NULL) makeDictionary(instance);
+
+    Dictionary* dictionary = instance->dictionary;
+    int slot = fieldSlot(instance, name);
+    int last = dictionary->count - 1;
+    tableDelete(&dictionary->slots, OBJ_VAL(name));
+    if (slot != last)
+    {
+        // The last field moves into the freed slot.
+        instance->fields[slot] = instance->fields[last];
+        dictionary->names[slot] = dictionary->names[last];
+        tableSet(&dictionary->slots, OBJ_VAL(dictionary->names[slot]),
+                    NUMBER_VAL(slot));
+    }
+    // Nothing is left in the last slot for a collector to
+    // find once the value there is gone.
+    instance->fields[last] = NIL_VAL;
+    dictionary->count--;
+    WRITE_BARRIER(instance);
+    return true;
+}
@@ -0,0 +1,1834 @@
+#include "../include/ssa.h"
+#include "../include/chunk.h"
+#include "../include/memory.h"
+#include <string.h>
+
+// Past this many values living in slots, the interference
+// matrix gets too big, and the chunk is left alone.
+#define SSA_MAX_REGISTERS 4096
+
+typedef enum {
+    IR_CONSTANT, // Never emitted by itself: loaded at every use.
+    IR_PARAM, // Slot 0 or a parameter, which keeps its slot.
+    IR_PHI,
+    IR_BINARY, // opcode is the instruction.
+    IR_UNARY, // opcode is the instruction.
+    IR_GET_GLOBAL,
+    IR_SET_GLOBAL,
+    IR_DEFINE_GLOBAL,
+    IR_GET_UPVALUE,
+    IR_SET_UPVALUE,
+    IR_GET_CAPTURED,
+    IR_PRINT,
+    IR_CALL, // opcode is OP_CALL or OP_TAIL_CALL.
+    IR_RETURN,
+    IR_JUMP, // To the block's only successor.
+    IR_BRANCH // To the second successor if the operand is falsey.
+} IrKind;
+
+typedef struct {
+    IrKind kind;
+    uint8_t opcode;
+    // Constant pool index (-1 for OP_NIL and the like),
+    // global, upvalue, stack position (phis and parameters)
+    // or argument count.
+    int index;
+    Value value; // IR_CONSTANT.
+    int* operands;
+    int operandCount;
+    int operandCapacity;
+    int block;
+    int line;
+    bool dead;
+    bool marked;
+    bool number; // Always a number when it is used.
+
+    // Lowering.
+    int uses;
+    bool stacked; // Left on the stack for its only user.
+    int user; // That user, if stacked.
+    int position; // In its block's list of emitted instructions.
+    int treeStart; // Position of the first instruction of its tree.
+} IrInstr;
+
+typedef struct {
+    int start; // Offsets of its code in the chunk.
+    int end;
+    int* preds; // A block that branches here twice is here twice.
+    int predCount;
+    int predCapacity;
+    // Falls through to succs[0]. A branch goes to succs[1].
+    int succs[2];
+    int succCount;
+    int* code; // Instructions in order, phis first.
+    int count;
+    int capacity;
+    int depth; // Stack depth on entry.
+    int* exit; // Value in each stack position on exit.
+    int exitDepth;
+    int rpo; // Position in reverse postorder, -1 if unreachable.
+    int idom;
+} IrBlock;
+
+typedef struct {
+    Chunk* chunk;
+    int arity;
+    IrInstr* instrs;
+    int instrCount;
+    int instrCapacity;
+    // Blocks of the chunk, by offset, then an entry block of
+    // its own that holds the parameters and no code.
+    IrBlock* blocks;
+    int blockCount;
+    int entry;
+    int* order; // Reachable blocks in reverse postorder.
+    int orderCount;
+} Graph;
+
+static void appendInt(int** array, int* count, int* capacity, int value)
+{
+    if (*capacity < *count + 1)
+    {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *array = GROW_ARRAY(int, *array, oldCapacity, *capacity);
+    }
+    (*array)[(*count)++] = value;
+}
+
+static int newInstr(Graph* graph, IrKind kind, int block, int line)
+{
+    if (graph->instrCapacity < graph->instrCount + 1)
+    {
+        int oldCapacity = graph->instrCapacity;
+        graph->instrCapacity = GROW_CAPACITY(oldCapacity);
+        graph->instrs = GROW_ARRAY(IrInstr, graph->instrs, oldCapacity,
+                                    graph->instrCapacity);
+    }
+
+    IrInstr* instr = &graph->instrs[graph->instrCount];
+    memset(instr, 0, sizeof(IrInstr));
+    instr->kind = kind;
+    instr->value = NIL_VAL;
+    instr->block = block;
+    instr->line = line;
+    instr->user = -1;
+
+    IrBlock* owner = &graph->blocks[block];
+    appendInt(&owner->code, &owner->count, &owner->capacity,
+                graph->instrCount);
+    return graph->instrCount++;
+}
+
+static void addOperand(Graph* graph, int instr, int operand)
+{
+    IrInstr* to = &graph->instrs[instr];
+    appendInt(&to->operands, &to->operandCount, &to->operandCapacity,
+                operand);
+}
+
+static bool producesValue(IrInstr* instr)
+{
+    switch (instr->kind)
+    {
+        case IR_CONSTANT:
+        case IR_PARAM:
+        case IR_PHI:
+        case IR_BINARY:
+        case IR_UNARY:
+        case IR_GET_GLOBAL:
+        case IR_GET_UPVALUE:
+        case IR_GET_CAPTURED:
+        case IR_CALL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// No side effects: unused, it can go.
+static bool isPure(IrInstr* instr)
+{
+    switch (instr->kind)
+    {
+        case IR_CONSTANT:
+        case IR_PARAM:
+        case IR_PHI:
+        case IR_BINARY:
+        case IR_UNARY:
+        case IR_GET_UPVALUE:
+        case IR_GET_CAPTURED:
+            return true;
+        case IR_GET_GLOBAL:
+            return instr->opcode == OP_GET_DEFINED_GLOBAL;
+        default:
+            return false;
+    }
+}
+
+// Whether a pure instruction can raise a runtime error,
+// going by what is known of its operands' types.
+static bool canThrow(Graph* graph, IrInstr* instr)
+{
+    IrInstr* a = (instr->operandCount > 0) ?
+                    &graph->instrs[instr->operands[0]] : NULL;
+    IrInstr* b = (instr->operandCount > 1) ?
+                    &graph->instrs[instr->operands[1]] : NULL;
+
+    if (instr->kind == IR_UNARY)
+        return (instr->opcode == OP_NEGATE) && !a->number;
+    if (instr->kind != IR_BINARY)
+        return !isPure(instr);
+
+    switch (instr->opcode)
+    {
+        case OP_EQUAL:
+            return false;
+        case OP_DIVIDE:
+            // Dividing by zero is an error too.
+            return !a->number || (b->kind != IR_CONSTANT) ||
+                    !IS_NUMBER(b->value) || (AS_NUMBER(b->value) == 0);
+        default:
+            return !a->number || !b->number;
+    }
+}
+
+static void replaceUses(Graph* graph, int from, int to)
+{
+    for (int i = 0; i < graph->instrCount; i++)
+    {
+        IrInstr* instr = &graph->instrs[i];
+        for (int j = 0; j < instr->operandCount; j++)
+        {
+            if (instr->operands[j] == from)
+                instr->operands[j] = to;
+        }
+    }
+}
+
+// ---- Building the graph. ----
+
+static bool isJump(uint8_t instruction)
+{
+    return (instruction == OP_JUMP) ||
+            (instruction == OP_JUMP_IF_FALSE) ||
+            (instruction == OP_LOOP);
+}
+
+static int jumpTarget(Chunk* chunk, int offset)
+{
+    int end = offset + instructionLength(chunk, offset);
+    int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return (chunk->code[offset] == OP_LOOP) ? end - jump : end + jump;
+}
+
+// Instructions the IR models. Anything else (closures,
+// upvalues being closed, classes, properties, invokes)
+// leaves the chunk alone.
+static bool supported(uint8_t instruction)
+{
+    switch (instruction)
+    {
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_TWO:
+        case OP_MINUSONE:
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUP:
+        case OP_POP:
+        case OP_POPN:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_GET_DEFINED_GLOBAL:
+        case OP_SET_DEFINED_GLOBAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_RETURN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Splits the chunk into basic blocks. Returns false if it
+// uses anything unsupported.
+static bool buildBlocks(Graph* graph)
+{
+    Chunk* chunk = graph->chunk;
+    bool* isLeader = ALLOCATE(bool, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++)
+        isLeader[i] = false;
+    isLeader[0] = true;
+
+    bool valid = (chunk->count > 0);
+    uint8_t last = OP_RETURN;
+    for (int offset = 0; valid && (offset < chunk->count);
+            offset += instructionLength(chunk, offset))
+    {
+        last = chunk->code[offset];
+        int next = offset + instructionLength(chunk, offset);
+        if (!supported(last) || (next > chunk->count))
+            valid = false;
+        else if (isJump(last))
+        {
+            int target = jumpTarget(chunk, offset);
+            if ((target < 0) || (target >= chunk->count))
+                valid = false;
+            else
+                isLeader[target] = isLeader[next] = true;
+        }
+        else if (last == OP_RETURN)
+            isLeader[next] = true;
+    }
+    // Nothing may run off the end.
+    if ((last != OP_RETURN) && (last != OP_JUMP) && (last != OP_LOOP))
+        valid = false;
+
+    if (!valid)
+    {
+        FREE_ARRAY(bool, isLeader, chunk->count + 1);
+        return false;
+    }
+
+    int* blockAt = ALLOCATE(int, chunk->count + 1);
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset++)
+        blockAt[offset] = isLeader[offset] ? count++ : -1;
+    blockAt[chunk->count] = -1;
+
+    graph->blockCount = count + 1;
+    graph->entry = count;
+    graph->blocks = ALLOCATE(IrBlock, graph->blockCount);
+    memset(graph->blocks, 0, sizeof(IrBlock) * graph->blockCount);
+    for (int i = 0; i < graph->blockCount; i++)
+    {
+        graph->blocks[i].rpo = -1;
+        graph->blocks[i].idom = -1;
+    }
+
+    int block = -1;
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk, offset))
+    {
+        if (isLeader[offset])
+        {
+            block = blockAt[offset];
+            graph->blocks[block].start = offset;
+        }
+
+        int next = offset + instructionLength(chunk, offset);
+        if ((next < chunk->count) && !isLeader[next])
+            continue;
+
+        // Last instruction of the block.
+        IrBlock* current = &graph->blocks[block];
+        current->end = next;
+        uint8_t instruction = chunk->code[offset];
+        if ((instruction != OP_JUMP) && (instruction != OP_LOOP) &&
+            (instruction != OP_RETURN))
+            current->succs[current->succCount++] = blockAt[next];
+        if (isJump(instruction))
+        {
+            current->succs[current->succCount++] =
+                blockAt[jumpTarget(chunk, offset)];
+        }
+    }
+
+    IrBlock* entry = &graph->blocks[graph->entry];
+    entry->succs[0] = 0;
+    entry->succCount = 1;
+
+    FREE_ARRAY(bool, isLeader, chunk->count + 1);
+    FREE_ARRAY(int, blockAt, chunk->count + 1);
+    return true;
+}
+
+// Orders the reachable blocks and links up predecessors.
+static void orderBlocks(Graph* graph)
+{
+    int count = graph->blockCount;
+    int* postorder = ALLOCATE(int, count);
+    int* stack = ALLOCATE(int, count);
+    int* nextSucc = ALLOCATE(int, count);
+    bool* visited = ALLOCATE(bool, count);
+    for (int i = 0; i < count; i++)
+    {
+        nextSucc[i] = 0;
+        visited[i] = false;
+    }
+
+    int postCount = 0;
+    int top = 0;
+    stack[top++] = graph->entry;
+    visited[graph->entry] = true;
+    while (top > 0)
+    {
+        int block = stack[top - 1];
+        IrBlock* current = &graph->blocks[block];
+        if (nextSucc[block] < current->succCount)
+        {
+            int succ = current->succs[nextSucc[block]++];
+            if (!visited[succ])
+            {
+                visited[succ] = true;
+                stack[top++] = succ;
+            }
+        }
+        else
+        {
+            postorder[postCount++] = block;
+            top--;
+        }
+    }
+
+    graph->order = ALLOCATE(int, postCount);
+    graph->orderCount = postCount;
+    for (int i = 0; i < postCount; i++)
+    {
+        int block = postorder[postCount - 1 - i];
+        graph->order[i] = block;
+        graph->blocks[block].rpo = i;
+    }
+
+    for (int i = 0; i < postCount; i++)
+    {
+        int block = graph->order[i];
+        IrBlock* current = &graph->blocks[block];
+        for (int j = 0; j < current->succCount; j++)
+        {
+            IrBlock* succ = &graph->blocks[current->succs[j]];
+            appendInt(&succ->preds, &succ->predCount, &succ->predCapacity,
+                        block);
+        }
+    }
+
+    FREE_ARRAY(int, postorder, count);
+    FREE_ARRAY(int, stack, count);
+    FREE_ARRAY(int, nextSucc, count);
+    FREE_ARRAY(bool, visited, count);
+}
+
+static int constant(Graph* graph, int block, int line, Value value,
+                    int index, uint8_t opcode)
+{
+    int instr = newInstr(graph, IR_CONSTANT, block, line);
+    graph->instrs[instr].value = value;
+    graph->instrs[instr].index = index;
+    graph->instrs[instr].opcode = opcode;
+    graph->instrs[instr].number = IS_NUMBER(value);
+    return instr;
+}
+
+// Runs the block's code over a stack of SSA values, which
+// turns every stack slot into the instruction that put
+// its value there. Returns false on malformed code.
+static bool interpretBlock(Graph* graph, int block, int* stack, int* depth)
+{
+    Chunk* chunk = graph->chunk;
+    IrBlock* current = &graph->blocks[block];
+    bool terminated = false;
+    int line = (current->start < chunk->count) ?
+                getLine(chunk, current->start) : 0;
+
+    #define PUSH(value) \
+        do { int pushed = (value); stack[(*depth)++] = pushed; } while (false)
+    #define NEED(count) if (*depth < (count)) return false
+
+    for (int offset = current->start; offset < current->end;
+            offset += instructionLength(chunk, offset))
+    {
+        uint8_t instruction = chunk->code[offset];
+        int next = offset + 1;
+        int instr;
+        line = getLine(chunk, offset);
+
+        switch (instruction)
+        {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            {
+                next = offset;
+                int index = (int) readIndex(chunk, &next);
+                PUSH(constant(graph, block, line,
+                        chunk->constants.values[index], index, OP_CONSTANT));
+                break;
+            }
+            case OP_ZERO:
+                PUSH(constant(graph, block, line, NUMBER_VAL(0), -1,
+                                instruction));
+                break;
+            case OP_ONE:
+                PUSH(constant(graph, block, line, NUMBER_VAL(1), -1,
+                                instruction));
+                break;
+            case OP_TWO:
+                PUSH(constant(graph, block, line, NUMBER_VAL(2), -1,
+                                instruction));
+                break;
+            case OP_MINUSONE:
+                PUSH(constant(graph, block, line, NUMBER_VAL(-1), -1,
+                                instruction));
+                break;
+            case OP_NIL:
+                PUSH(constant(graph, block, line, NIL_VAL, -1, instruction));
+                break;
+            case OP_TRUE:
+                PUSH(constant(graph, block, line, BOOL_VAL(true), -1,
+                                instruction));
+                break;
+            case OP_FALSE:
+                PUSH(constant(graph, block, line, BOOL_VAL(false), -1,
+                                instruction));
+                break;
+            case OP_DUP:
+                NEED(1);
+                PUSH(stack[*depth - 1]);
+                break;
+            case OP_POP:
+                NEED(1);
+                (*depth)--;
+                break;
+            case OP_POPN:
+            {
+                int count = (int) readIndex(chunk, &next);
+                NEED(count);
+                *depth -= count;
+                break;
+            }
+            case OP_GET_LOCAL:
+            {
+                int slot = (int) readIndex(chunk, &next);
+                NEED(slot + 1);
+                PUSH(stack[slot]);
+                break;
+            }
+            case OP_SET_LOCAL:
+            {
+                int slot = (int) readIndex(chunk, &next);
+                NEED(slot + 1);
+                stack[slot] = stack[*depth - 1];
+                break;
+            }
+            case OP_GET_GLOBAL:
+            case OP_GET_DEFINED_GLOBAL:
+            case OP_GET_UPVALUE:
+            case OP_GET_CAPTURED:
+                instr = newInstr(graph, (instruction == OP_GET_UPVALUE) ?
+                                    IR_GET_UPVALUE :
+                                    (instruction == OP_GET_CAPTURED) ?
+                                    IR_GET_CAPTURED : IR_GET_GLOBAL,
+                                    block, line);
+                // Which of the two global loads it is.
+                graph->instrs[instr].opcode = instruction;
+                graph->instrs[instr].index = (int) readIndex(chunk, &next);
+                PUSH(instr);
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_DEFINED_GLOBAL:
+            case OP_SET_UPVALUE:
+            case OP_DEFINE_GLOBAL:
+                NEED(1);
+                instr = newInstr(graph, (instruction == OP_SET_UPVALUE) ?
+                                    IR_SET_UPVALUE :
+                                    (instruction == OP_DEFINE_GLOBAL) ?
+                                    IR_DEFINE_GLOBAL : IR_SET_GLOBAL,
+                                    block, line);
+                graph->instrs[instr].opcode = instruction;
+                graph->instrs[instr].index = (int) readIndex(chunk, &next);
+                addOperand(graph, instr, stack[*depth - 1]);
+                // Only a definition takes the value off the stack.
+                if (instruction == OP_DEFINE_GLOBAL)
+                    (*depth)--;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+                NEED(2);
+                instr = newInstr(graph, IR_BINARY, block, line);
+                graph->instrs[instr].opcode = instruction;
+                addOperand(graph, instr, stack[*depth - 2]);
+                addOperand(graph, instr, stack[*depth - 1]);
+                *depth -= 2;
+                PUSH(instr);
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                NEED(1);
+                instr = newInstr(graph, IR_UNARY, block, line);
+                graph->instrs[instr].opcode = instruction;
+                addOperand(graph, instr, stack[*depth - 1]);
+                stack[*depth - 1] = instr;
+                break;
+            case OP_PRINT:
+                NEED(1);
+                instr = newInstr(graph, IR_PRINT, block, line);
+                addOperand(graph, instr, stack[--(*depth)]);
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            {
+                int argCount = chunk->code[offset + 1];
+                NEED(argCount + 1);
+                instr = newInstr(graph, IR_CALL, block, line);
+                graph->instrs[instr].opcode = instruction;
+                graph->instrs[instr].index = argCount;
+                for (int i = *depth - argCount - 1; i < *depth; i++)
+                    addOperand(graph, instr, stack[i]);
+                *depth -= argCount + 1;
+                PUSH(instr);
+                break;
+            }
+            case OP_RETURN:
+                NEED(1);
+                instr = newInstr(graph, IR_RETURN, block, line);
+                addOperand(graph, instr, stack[--(*depth)]);
+                terminated = true;
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                newInstr(graph, IR_JUMP, block, line);
+                terminated = true;
+                break;
+            case OP_JUMP_IF_FALSE:
+                // The condition stays on the stack.
+                NEED(1);
+                instr = newInstr(graph, IR_BRANCH, block, line);
+                addOperand(graph, instr, stack[*depth - 1]);
+                terminated = true;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    #undef PUSH
+    #undef NEED
+
+    if (!terminated)
+        newInstr(graph, IR_JUMP, block, line);
+    return true;
+}
+
+// Puts the graph in SSA form. Every block joining others
+// gets a phi per stack slot, filled in once all blocks,
+// loop bodies included, have been run.
+static bool buildSSA(Graph* graph)
+{
+    Chunk* chunk = graph->chunk;
+    int capacity = chunk->count + graph->arity + 2;
+    int* stack = ALLOCATE(int, capacity);
+    int line = getLine(chunk, 0);
+    bool valid = true;
+
+    for (int i = 0; valid && (i < graph->orderCount); i++)
+    {
+        int block = graph->order[i];
+        IrBlock* current = &graph->blocks[block];
+        int depth = 0;
+
+        if (block == graph->entry)
+        {
+            for (; depth <= graph->arity; depth++)
+            {
+                stack[depth] = newInstr(graph, IR_PARAM, block, line);
+                graph->instrs[stack[depth]].index = depth;
+            }
+        }
+        else
+        {
+            // Some predecessor has always been run already.
+            IrBlock* from = NULL;
+            for (int j = 0; j < current->predCount; j++)
+            {
+                IrBlock* pred = &graph->blocks[current->preds[j]];
+                if (pred->rpo < current->rpo)
+                {
+                    from = pred;
+                    break;
+                }
+            }
+
+            depth = from->exitDepth;
+            for (int slot = 0; slot < depth; slot++)
+            {
+                if (current->predCount == 1)
+                    stack[slot] = from->exit[slot];
+                else
+                {
+                    stack[slot] = newInstr(graph, IR_PHI, block,
+                                    getLine(chunk, current->start));
+                    graph->instrs[stack[slot]].index = slot;
+                }
+            }
+        }
+
+        current->depth = depth;
+        if (!interpretBlock(graph, block, stack, &depth))
+            valid = false;
+        current->exit = ALLOCATE(int, depth + 1);
+        current->exitDepth = depth;
+        if (depth > 0)
+            memcpy(current->exit, stack, sizeof(int) * depth);
+    }
+
+    for (int i = 0; valid && (i < graph->orderCount); i++)
+    {
+        IrBlock* current = &graph->blocks[graph->order[i]];
+        for (int j = 0; j < current->count; j++)
+        {
+            int phi = current->code[j];
+            if (graph->instrs[phi].kind != IR_PHI)
+                break;
+
+            for (int k = 0; k < current->predCount; k++)
+            {
+                IrBlock* pred = &graph->blocks[current->preds[k]];
+                if (pred->exitDepth != current->depth)
+                    valid = false;
+                else
+                    addOperand(graph, phi,
+                                pred->exit[graph->instrs[phi].index]);
+            }
+        }
+    }
+
+    FREE_ARRAY(int, stack, capacity);
+    return valid;
+}
+
+// ---- Passes. ----
+
+// A phi whose operands are all one value (or itself) is
+// that value. Removing them leaves only the phis where
+// values really merge.
+static void removeTrivialPhis(Graph* graph)
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = 0; i < graph->instrCount; i++)
+        {
+            IrInstr* phi = &graph->instrs[i];
+            if ((phi->kind != IR_PHI) || phi->dead)
+                continue;
+
+            int same = -1;
+            bool trivial = true;
+            for (int j = 0; j < phi->operandCount; j++)
+            {
+                int operand = phi->operands[j];
+                if ((operand == i) || (operand == same))
+                    continue;
+                if (same != -1)
+                {
+                    trivial = false;
+                    break;
+                }
+                same = operand;
+            }
+
+            if (trivial)
+            {
+                phi->dead = true;
+                if (same != -1)
+                    replaceUses(graph, i, same);
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool dominates(Graph* graph, int dominator, int block)
+{
+    while (true)
+    {
+        if (block == dominator)
+            return true;
+        if (block == graph->entry)
+            return false;
+        block = graph->blocks[block].idom;
+    }
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm.
+static void computeDominators(Graph* graph)
+{
+    IrBlock* blocks = graph->blocks;
+    blocks[graph->entry].idom = graph->entry;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = 1; i < graph->orderCount; i++)
+        {
+            int block = graph->order[i];
+            int idom = -1;
+            for (int j = 0; j < blocks[block].predCount; j++)
+            {
+                int pred = blocks[block].preds[j];
+                if (blocks[pred].idom == -1)
+                    continue;
+                if (idom == -1)
+                {
+                    idom = pred;
+                    continue;
+                }
+
+                int a = pred;
+                int b = idom;
+                while (a != b)
+                {
+                    while (blocks[a].rpo > blocks[b].rpo)
+                        a = blocks[a].idom;
+                    while (blocks[b].rpo > blocks[a].rpo)
+                        b = blocks[b].idom;
+                }
+                idom = a;
+            }
+
+            if (blocks[block].idom != idom)
+            {
+                blocks[block].idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Reuses an arithmetic result already computed on every
+// path to a second, identical instruction.
+static void eliminateCommonSubexpressions(Graph* graph)
+{
+    int* seen = ALLOCATE(int, graph->instrCount);
+    int seenCount = 0;
+
+    for (int i = 0; i < graph->orderCount; i++)
+    {
+        IrBlock* current = &graph->blocks[graph->order[i]];
+        for (int j = 0; j < current->count; j++)
+        {
+            int id = current->code[j];
+            IrInstr* instr = &graph->instrs[id];
+            if (instr->dead || ((instr->kind != IR_BINARY) &&
+                                (instr->kind != IR_UNARY)))
+                continue;
+
+            int match = -1;
+            for (int k = 0; (match == -1) && (k < seenCount); k++)
+            {
+                IrInstr* other = &graph->instrs[seen[k]];
+                if ((other->kind == instr->kind) &&
+                    (other->opcode == instr->opcode) &&
+                    (other->operands[0] == instr->operands[0]) &&
+                    ((instr->kind == IR_UNARY) ||
+                        (other->operands[1] == instr->operands[1])) &&
+                    dominates(graph, other->block, instr->block))
+                    match = seen[k];
+            }
+
+            if (match == -1)
+                seen[seenCount++] = id;
+            else
+            {
+                instr->dead = true;
+                replaceUses(graph, id, match);
+            }
+        }
+    }
+
+    FREE_ARRAY(int, seen, graph->instrCount);
+}
+
+// Finds the values that are always numbers, assuming the
+// best of phis and additions until shown otherwise.
+// Arithmetic that fails raises an error, so whatever uses
+// its result only ever sees a number.
+static void inferNumbers(Graph* graph)
+{
+    for (int i = 0; i < graph->instrCount; i++)
+    {
+        IrInstr* instr = &graph->instrs[i];
+        if (instr->kind == IR_PHI)
+            instr->number = true;
+        else if (instr->kind == IR_BINARY)
+        {
+            instr->number = (instr->opcode == OP_ADD) ||
+                            (instr->opcode == OP_SUBTRACT) ||
+                            (instr->opcode == OP_MULTIPLY) ||
+                            (instr->opcode == OP_DIVIDE);
+        }
+        else if (instr->kind == IR_UNARY)
+            instr->number = (instr->opcode == OP_NEGATE);
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = 0; i < graph->instrCount; i++)
+        {
+            IrInstr* instr = &graph->instrs[i];
+            if (instr->dead || !instr->number)
+                continue;
+
+            bool number = true;
+            if (instr->kind == IR_PHI)
+            {
+                for (int j = 0; j < instr->operandCount; j++)
+                    number = number &&
+                                graph->instrs[instr->operands[j]].number;
+            }
+            else if ((instr->kind == IR_BINARY) && (instr->opcode == OP_ADD))
+            {
+                // Strings add up too.
+                number = graph->instrs[instr->operands[0]].number &&
+                            graph->instrs[instr->operands[1]].number;
+            }
+
+            if (!number)
+            {
+                instr->number = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool isInvariant(Graph* graph, int id, bool* inLoop)
+{
+    IrInstr* instr = &graph->instrs[id];
+    if (instr->dead || ((instr->kind != IR_BINARY) &&
+                        (instr->kind != IR_UNARY)) ||
+        canThrow(graph, instr))
+        return false;
+
+    for (int i = 0; i < instr->operandCount; i++)
+    {
+        IrInstr* operand = &graph->instrs[instr->operands[i]];
+        if ((operand->kind != IR_CONSTANT) && inLoop[operand->block])
+            return false;
+    }
+    return true;
+}
+
+// Moves arithmetic that gives the same result on every
+// iteration out in front of the loop. Only what cannot
+// fail is moved, since it now runs even when the loop
+// body does not, and only into a block that goes nowhere
+// but the loop. Inner loops go first, so their invariants
+// can move on out of the loops around them.
+static void hoistInvariants(Graph* graph)
+{
+    IrBlock* blocks = graph->blocks;
+    bool* inLoop = ALLOCATE(bool, graph->blockCount);
+    int* worklist = ALLOCATE(int, graph->blockCount);
+
+    for (int i = graph->orderCount - 1; i >= 0; i--)
+    {
+        int header = graph->order[i];
+        int count = 0;
+        for (int j = 0; j < graph->blockCount; j++)
+            inLoop[j] = false;
+
+        // Back-edges come from blocks the header dominates.
+        for (int j = 0; j < blocks[header].predCount; j++)
+        {
+            int pred = blocks[header].preds[j];
+            if (dominates(graph, header, pred) && !inLoop[pred])
+            {
+                inLoop[pred] = true;
+                worklist[count++] = pred;
+            }
+        }
+        if (count == 0)
+            continue;
+
+        inLoop[header] = true;
+        while (count > 0)
+        {
+            int block = worklist[--count];
+            if (block == header)
+                continue;
+            for (int j = 0; j < blocks[block].predCount; j++)
+            {
+                int pred = blocks[block].preds[j];
+                if (!inLoop[pred])
+                {
+                    inLoop[pred] = true;
+                    worklist[count++] = pred;
+                }
+            }
+        }
+
+        int preheader = -1;
+        for (int j = 0; j < blocks[header].predCount; j++)
+        {
+            int pred = blocks[header].preds[j];
+            if (inLoop[pred] || (pred == preheader))
+                continue;
+            preheader = (preheader == -1) ? pred : -2;
+        }
+        if ((preheader < 0) || (blocks[preheader].succCount != 1))
+            continue;
+
+        // The body comes after its header in reverse postorder,
+        // and operands before what uses them.
+        IrBlock* into = &blocks[preheader];
+        for (int j = i; j < graph->orderCount; j++)
+        {
+            IrBlock* current = &blocks[graph->order[j]];
+            if (!inLoop[graph->order[j]])
+                continue;
+
+            for (int k = 0; k < current->count; k++)
+            {
+                int id = current->code[k];
+                if (!isInvariant(graph, id, inLoop))
+                    continue;
+
+                memmove(&current->code[k], &current->code[k + 1],
+                        sizeof(int) * (current->count - k - 1));
+                current->count--;
+                k--;
+
+                // In front of the preheader's jump.
+                appendInt(&into->code, &into->count, &into->capacity, id);
+                into->code[into->count - 1] = into->code[into->count - 2];
+                into->code[into->count - 2] = id;
+                graph->instrs[id].block = preheader;
+            }
+        }
+    }
+
+    FREE_ARRAY(bool, inLoop, graph->blockCount);
+    FREE_ARRAY(int, worklist, graph->blockCount);
+}
+
+// Removes everything no side effect, error or control
+// flow depends on.
+static void removeDeadCode(Graph* graph)
+{
+    int* worklist = ALLOCATE(int, graph->instrCount);
+    int count = 0;
+
+    for (int i = 0; i < graph->instrCount; i++)
+    {
+        IrInstr* instr = &graph->instrs[i];
+        instr->marked = false;
+        if (!instr->dead && (graph->blocks[instr->block].rpo != -1) &&
+            canThrow(graph, instr))
+        {
+            instr->marked = true;
+            worklist[count++] = i;
+        }
+    }
+
+    while (count > 0)
+    {
+        IrInstr* instr = &graph->instrs[worklist[--count]];
+        for (int i = 0; i < instr->operandCount; i++)
+        {
+            IrInstr* operand = &graph->instrs[instr->operands[i]];
+            if (!operand->marked)
+            {
+                operand->marked = true;
+                worklist[count++] = instr->operands[i];
+            }
+        }
+    }
+
+    for (int i = 0; i < graph->orderCount; i++)
+    {
+        IrBlock* current = &graph->blocks[graph->order[i]];
+        int kept = 0;
+        for (int j = 0; j < current->count; j++)
+        {
+            IrInstr* instr = &graph->instrs[current->code[j]];
+            instr->dead = !instr->marked;
+            if (!instr->dead)
+                current->code[kept++] = current->code[j];
+        }
+        current->count = kept;
+    }
+
+    FREE_ARRAY(int, worklist, graph->instrCount);
+}
+
+// ---- Lowering. ----
+
+// Back to stack code. An instruction whose value is used
+// once, right away, leaves it on the stack for its user,
+// so expressions come out much as the compiler wrote
+// them. Every other value gets a slot of its own after
+// the parameters: a register. Constants are loaded again
+// wherever they are used.
+
+typedef struct {
+    Graph* graph;
+    Chunk out; // Only its code and line array are used.
+    int* regIndex; // Of each instruction in a register, or -1.
+    int* regs; // Instruction in each register index.
+    int regCount;
+    int* color; // Slot of each register index, past the parameters.
+    int slotCount;
+
+    int* layout; // Blocks in the order they are emitted.
+    int* layoutIndex;
+    int layoutCount;
+    bool* entryPop; // Block starts by popping its branch's condition.
+    int* labels; // Blocks, then stubs. -1 until emitted.
+    int* stubFrom;
+    int* stubTo;
+    int stubCount;
+    int* patches; // Forward jump operands and their labels.
+    int* patchLabels;
+    int patchCount;
+    bool valid; // Cleared when a jump will not fit.
+} Lowering;
+
+static bool isRegister(Graph* graph, int id)
+{
+    IrInstr* instr = &graph->instrs[id];
+    return !instr->dead && producesValue(instr) &&
+            (instr->kind != IR_CONSTANT) && (instr->kind != IR_PARAM) &&
+            !instr->stacked && (instr->uses > 0);
+}
+
+// Whether the instruction is emitted as code of its own.
+static bool isEmitted(IrInstr* instr)
+{
+    return !instr->dead && (instr->kind != IR_PHI) &&
+            (instr->kind != IR_CONSTANT) && (instr->kind != IR_PARAM);
+}
+
+// Counts uses, and picks the values that can stay on the
+// stack: used once, by the next instruction in the block
+// whose operands they are the end of.
+static void findStackedValues(Graph* graph)
+{
+    for (int i = 0; i < graph->instrCount; i++)
+    {
+        IrInstr* instr = &graph->instrs[i];
+        if (instr->dead)
+            continue;
+        for (int j = 0; j < instr->operandCount; j++)
+            graph->instrs[instr->operands[j]].uses++;
+    }
+
+    int* list = ALLOCATE(int, graph->instrCount);
+    for (int i = 0; i < graph->orderCount; i++)
+    {
+        IrBlock* current = &graph->blocks[graph->order[i]];
+        int count = 0;
+        for (int j = 0; j < current->count; j++)
+        {
+            IrInstr* instr = &graph->instrs[current->code[j]];
+            if (isEmitted(instr))
+            {
+                instr->position = count;
+                list[count++] = current->code[j];
+            }
+        }
+
+        for (int position = 0; position < count; position++)
+        {
+            IrInstr* instr = &graph->instrs[list[position]];
+            int cursor = position - 1;
+            for (int j = instr->operandCount - 1; j >= 0; j--)
+            {
+                int id = instr->operands[j];
+                IrInstr* operand = &graph->instrs[id];
+                if ((cursor < 0) || (list[cursor] != id) ||
+                    (operand->uses != 1) || !producesValue(operand))
+                    continue;
+
+                operand->stacked = true;
+                operand->user = list[position];
+                cursor = operand->treeStart - 1;
+            }
+            instr->treeStart = cursor + 1;
+        }
+    }
+    FREE_ARRAY(int, list, graph->instrCount);
+}
+
+#define WORDS(count) (((count) + 63) / 64)
+#define HAS(bits, i) (((bits)[(i) / 64] >> ((i) % 64)) & 1)
+#define ADD(bits, i) ((bits)[(i) / 64] |= (uint64_t) 1 << ((i) % 64))
+#define REMOVE(bits, i) ((bits)[(i) / 64] &= ~((uint64_t) 1 << ((i) % 64)))
+
+// Operand the phi takes from pred.
+static int phiOperand(Graph* graph, int block, int phi, int pred)
+{
+    IrBlock* current = &graph->blocks[block];
+    for (int i = 0; i < current->predCount; i++)
+    {
+        if (current->preds[i] == pred)
+            return graph->instrs[phi].operands[i];
+    }
+    return -1; // Unreachable.
+}
+
+static void addEdge(uint64_t* matrix, int words, int a, int b)
+{
+    ADD(&matrix[a * words], b);
+    ADD(&matrix[b * words], a);
+}
+
+// Builds the interference graph of the registers from
+// their liveness.
+static uint64_t* interference(Lowering* lowering)
+{
+    Graph* graph = lowering->graph;
+    int words = WORDS(lowering->regCount);
+    int blockCount = graph->blockCount;
+    uint64_t* liveIn = ALLOCATE(uint64_t, words * blockCount);
+    uint64_t* liveOut = ALLOCATE(uint64_t, words * blockCount);
+    uint64_t* uses = ALLOCATE(uint64_t, words * blockCount);
+    uint64_t* defs = ALLOCATE(uint64_t, words * blockCount);
+    uint64_t* live = ALLOCATE(uint64_t, words);
+    memset(liveIn, 0, sizeof(uint64_t) * words * blockCount);
+    memset(liveOut, 0, sizeof(uint64_t) * words * blockCount);
+    memset(uses, 0, sizeof(uint64_t) * words * blockCount);
+    memset(defs, 0, sizeof(uint64_t) * words * blockCount);
+
+    for (int i = 0; i < graph->orderCount; i++)
+    {
+        int block = graph->order[i];
+        IrBlock* current = &graph->blocks[block];
+        for (int j = 0; j < current->count; j++)
+        {
+            int id = current->code[j];
+            IrInstr* instr = &graph->instrs[id];
+            if (instr->kind != IR_PHI)
+            {
+                for (int k = 0; k < instr->operandCount; k++)
+                {
+                    int operand = lowering->regIndex[instr->operands[k]];
+                    if ((operand != -1) &&
+                        !HAS(&defs[block * words], operand))
+                        ADD(&uses[block * words], operand);
+                }
+            }
+            if (lowering->regIndex[id] != -1)
+                ADD(&defs[block * words], lowering->regIndex[id]);
+        }
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = graph->orderCount - 1; i >= 0; i--)
+        {
+            int block = graph->order[i];
+            IrBlock* current = &graph->blocks[block];
+            uint64_t* out = &liveOut[block * words];
+            for (int j = 0; j < current->succCount; j++)
+            {
+                int succ = current->succs[j];
+                IrBlock* next = &graph->blocks[succ];
+                for (int k = 0; k < words; k++)
+                    out[k] |= liveIn[succ * words + k];
+                for (int k = 0; k < next->count; k++)
+                {
+                    if (graph->instrs[next->code[k]].kind != IR_PHI)
+                        break;
+                    int operand = phiOperand(graph, succ, next->code[k],
+                                                block);
+                    if (lowering->regIndex[operand] != -1)
+                        ADD(out, lowering->regIndex[operand]);
+                }
+            }
+
+            for (int k = 0; k < words; k++)
+            {
+                uint64_t in = uses[block * words + k] |
+                                (out[k] & ~defs[block * words + k]);
+                if (in != liveIn[block * words + k])
+                {
+                    liveIn[block * words + k] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    uint64_t* matrix = ALLOCATE(uint64_t, words * lowering->regCount);
+    memset(matrix, 0, sizeof(uint64_t) * words * lowering->regCount);
+
+    // Whatever is live where a register is written
+    // interferes with it.
+    for (int i = 0; i < graph->orderCount; i++)
+    {
+        int block = graph->order[i];
+        IrBlock* current = &graph->blocks[block];
+        memcpy(live, &liveOut[block * words], sizeof(uint64_t) * words);
+
+        for (int j = current->count - 1; j >= 0; j--)
+        {
+            IrInstr* instr = &graph->instrs[current->code[j]];
+            int reg = lowering->regIndex[current->code[j]];
+            if (reg != -1)
+            {
+                for (int k = 0; k < lowering->regCount; k++)
+                {
+                    if ((k != reg) && HAS(live, k))
+                        addEdge(matrix, words, reg, k);
+                }
+                // Phis are written at once, on the way in.
+                if (instr->kind != IR_PHI)
+                    REMOVE(live, reg);
+            }
+            if (instr->kind == IR_PHI)
+                continue;
+
+            for (int k = 0; k < instr->operandCount; k++)
+            {
+                int operand = lowering->regIndex[instr->operands[k]];
+                if (operand != -1)
+                    ADD(live, operand);
+            }
+        }
+    }
+
+    FREE_ARRAY(uint64_t, liveIn, words * blockCount);
+    FREE_ARRAY(uint64_t, liveOut, words * blockCount);
+    FREE_ARRAY(uint64_t, uses, words * blockCount);
+    FREE_ARRAY(uint64_t, defs, words * blockCount);
+    FREE_ARRAY(uint64_t, live, words);
+    return matrix;
+}
+
+static int findWeb(int* parent, int reg)
+{
+    while (parent[reg] != reg)
+        reg = parent[reg] = parent[parent[reg]];
+    return reg;
+}
+
+// Gives every register a slot. A phi shares one with its
+// operands wherever they do not interfere, which saves
+// copying them on the way in.
+static void allocateRegisters(Lowering* lowering)
+{
+    Graph* graph = lowering->graph;
+    int count = lowering->regCount;
+    int words = WORDS(count);
+    uint64_t* matrix = interference(lowering);
+
+    // Webs of registers sharing a slot, as linked lists.
+    int* parent = ALLOCATE(int, count);
+    int* nextMember = ALLOCATE(int, count);
+    int* lastMember = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++)
+    {
+        parent[i] = lastMember[i] = i;
+        nextMember[i] = -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        IrInstr* phi = &graph->instrs[lowering->regs[i]];
+        if (phi->kind != IR_PHI)
+            continue;
+
+        for (int j = 0; j < phi->operandCount; j++)
+        {
+            int operand = lowering->regIndex[phi->operands[j]];
+            if (operand == -1)
+                continue;
+            int a = findWeb(parent, i);
+            int b = findWeb(parent, operand);
+            if (a == b)
+                continue;
+
+            bool interferes = false;
+            for (int x = a; !interferes && (x != -1); x = nextMember[x])
+            {
+                for (int y = b; !interferes && (y != -1); y = nextMember[y])
+                    interferes = HAS(&matrix[x * words], y);
+            }
+            if (interferes)
+                continue;
+
+            parent[b] = a;
+            nextMember[lastMember[a]] = b;
+            lastMember[a] = lastMember[b];
+        }
+    }
+
+    bool* taken = ALLOCATE(bool, count + 1);
+    lowering->slotCount = 0;
+    for (int i = 0; i < count; i++)
+        lowering->color[i] = -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (findWeb(parent, i) != i)
+            continue;
+
+        for (int j = 0; j <= count; j++)
+            taken[j] = false;
+        for (int x = i; x != -1; x = nextMember[x])
+        {
+            for (int y = 0; y < count; y++)
+            {
+                if ((lowering->color[y] != -1) && HAS(&matrix[x * words], y))
+                    taken[lowering->color[y]] = true;
+            }
+        }
+
+        int color = 0;
+        while (taken[color])
+            color++;
+        for (int x = i; x != -1; x = nextMember[x])
+            lowering->color[x] = color;
+        if (color + 1 > lowering->slotCount)
+            lowering->slotCount = color + 1;
+    }
+
+    FREE_ARRAY(bool, taken, count + 1);
+    FREE_ARRAY(int, parent, count);
+    FREE_ARRAY(int, nextMember, count);
+    FREE_ARRAY(int, lastMember, count);
+    FREE_ARRAY(uint64_t, matrix, words * count);
+}
+
+#undef WORDS
+#undef HAS
+#undef ADD
+#undef REMOVE
+
+static void emitByte(Lowering* lowering, uint8_t byte, int line)
+{
+    writeChunk(&lowering->out, byte, line);
+}
+
+static void emitIndex(Lowering* lowering, uint8_t instruction, int index,
+                        int line)
+{
+    emitByte(lowering, instruction, line);
+    if (index < 256)
+    {
+        emitByte(lowering, OP_SHORT, line);
+        emitByte(lowering, (uint8_t) index, line);
+        return;
+    }
+
+    emitByte(lowering, OP_LONG, line);
+    emitByte(lowering, (uint8_t) ((index >> 16) & 0xff), line);
+    emitByte(lowering, (uint8_t) ((index >> 8) & 0xff), line);
+    emitByte(lowering, (uint8_t) (index & 0xff), line);
+}
+
+static int slotOf(Lowering* lowering, int id)
+{
+    IrInstr* instr = &lowering->graph->instrs[id];
+    if (instr->kind == IR_PARAM)
+        return instr->index;
+    return lowering->graph->arity + 1 +
+            lowering->color[lowering->regIndex[id]];
+}
+
+static void emitLoad(Lowering* lowering, int id, int line)
+{
+    IrInstr* instr = &lowering->graph->instrs[id];
+    if (instr->kind != IR_CONSTANT)
+    {
+        emitIndex(lowering, OP_GET_LOCAL, slotOf(lowering, id), line);
+        return;
+    }
+
+    if (instr->index == -1)
+        emitByte(lowering, instr->opcode, line);
+    else if (instr->index < 256)
+    {
+        emitByte(lowering, OP_CONSTANT, line);
+        emitByte(lowering, (uint8_t) instr->index, line);
+    }
+    else
+    {
+        emitByte(lowering, OP_CONSTANT_LONG, line);
+        emitByte(lowering, (uint8_t) ((instr->index >> 16) & 0xff), line);
+        emitByte(lowering, (uint8_t) ((instr->index >> 8) & 0xff), line);
+        emitByte(lowering, (uint8_t) (instr->index & 0xff), line);
+    }
+}
+
+// Jumps to a label: back with OP_LOOP if it is already
+// emitted, otherwise forward, patched later.
+static void emitJump(Lowering* lowering, uint8_t instruction, int label,
+                        int line)
+{
+    int target = lowering->labels[label];
+    if (target != -1)
+    {
+        emitByte(lowering, OP_LOOP, line);
+        int jump = lowering->out.count + 2 - target;
+        if (jump > UINT16_MAX)
+            lowering->valid = false;
+        emitByte(lowering, (jump >> 8) & 0xff, line);
+        emitByte(lowering, jump & 0xff, line);
+        return;
+    }
+
+    emitByte(lowering, instruction, line);
+    lowering->patches[lowering->patchCount] = lowering->out.count;
+    lowering->patchLabels[lowering->patchCount++] = label;
+    emitByte(lowering, 0xff, line);
+    emitByte(lowering, 0xff, line);
+}
+
+// Sets the phis of block to what they take from pred, all
+// at once: every value is pushed before any is stored.
+static void emitCopies(Lowering* lowering, int pred, int block, int line)
+{
+    Graph* graph = lowering->graph;
+    IrBlock* current = &graph->blocks[block];
+    int* phis = ALLOCATE(int, current->count);
+    int count = 0;
+
+    for (int i = 0; i < current->count; i++)
+    {
+        int phi = current->code[i];
+        if (graph->instrs[phi].kind != IR_PHI)
+            break;
+
+        int operand = phiOperand(graph, block, phi, pred);
+        if ((lowering->regIndex[operand] != -1) &&
+            (slotOf(lowering, operand) == slotOf(lowering, phi)))
+            continue;
+        emitLoad(lowering, operand, line);
+        phis[count++] = phi;
+    }
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        emitIndex(lowering, OP_SET_LOCAL, slotOf(lowering, phis[i]), line);
+        emitByte(lowering, OP_POP, line);
+    }
+    FREE_ARRAY(int, phis, current->count);
+}
+
+static bool isNext(Lowering* lowering, int block, int succ)
+{
+    return lowering->layoutIndex[succ] == lowering->layoutIndex[block] + 1;
+}
+
+static void emitTree(Lowering* lowering, int id)
+{
+    Graph* graph = lowering->graph;
+    IrInstr* instr = &graph->instrs[id];
+    int line = instr->line;
+    int block = instr->block;
+    IrBlock* current = &graph->blocks[block];
+
+    for (int i = 0; i < instr->operandCount; i++)
+    {
+        int operand = instr->operands[i];
+        if (graph->instrs[operand].stacked)
+            emitTree(lowering, operand);
+        else
+            emitLoad(lowering, operand, line);
+    }
+
+    switch (instr->kind)
+    {
+        case IR_BINARY:
+        case IR_UNARY:
+            emitByte(lowering, instr->opcode, line);
+            break;
+        case IR_GET_GLOBAL:
+            emitIndex(lowering, instr->opcode, instr->index, line);
+            break;
+        case IR_GET_UPVALUE:
+            emitIndex(lowering, OP_GET_UPVALUE, instr->index, line);
+            break;
+        case IR_GET_CAPTURED:
+            emitIndex(lowering, OP_GET_CAPTURED, instr->index, line);
+            break;
+        case IR_DEFINE_GLOBAL:
+            emitIndex(lowering, OP_DEFINE_GLOBAL, instr->index, line);
+            break;
+        case IR_SET_GLOBAL:
+        case IR_SET_UPVALUE:
+            emitIndex(lowering, instr->opcode, instr->index, line);
+            emitByte(lowering, OP_POP, line);
+            break;
+        case IR_PRINT:
+            emitByte(lowering, OP_PRINT, line);
+            break;
+        case IR_CALL:
+        {
+            // Only a call returned straight away can hand
+            // the frame over.
+            bool tail = (instr->opcode == OP_TAIL_CALL) && instr->stacked &&
+                        (graph->instrs[instr->user].kind == IR_RETURN);
+            emitByte(lowering, tail ? OP_TAIL_CALL : OP_CALL, line);
+            emitByte(lowering, (uint8_t) instr->index, line);
+            break;
+        }
+        case IR_RETURN:
+            emitByte(lowering, OP_RETURN, line);
+            break;
+        case IR_JUMP:
+        {
+            int succ = current->succs[0];
+            emitCopies(lowering, block, succ, line);
+            if (!isNext(lowering, block, succ))
+                emitJump(lowering, OP_JUMP, succ, line);
+            break;
+        }
+        case IR_BRANCH:
+        {
+            int taken = current->succs[1];
+            int through = current->succs[0];
+            IrBlock* target = &graph->blocks[taken];
+            if ((target->predCount == 1) && (taken != through) &&
+                (lowering->layoutIndex[taken] > lowering->layoutIndex[block]))
+            {
+                lowering->entryPop[taken] = true;
+                emitJump(lowering, OP_JUMP_IF_FALSE, taken, line);
+            }
+            else
+            {
+                // Through a stub at the end that copies into
+                // the target's phis.
+                int stub = lowering->stubCount++;
+                lowering->stubFrom[stub] = block;
+                lowering->stubTo[stub] = taken;
+                emitJump(lowering, OP_JUMP_IF_FALSE,
+                            graph->blockCount + stub, line);
+            }
+
+            emitByte(lowering, OP_POP, line);
+            emitCopies(lowering, block, through, line);
+            if (!isNext(lowering, block, through))
+                emitJump(lowering, OP_JUMP, through, line);
+            break;
+        }
+        default:
+            break;
+    }
+
+    if (producesValue(instr) && !instr->stacked)
+    {
+        if (lowering->regIndex[id] != -1)
+            emitIndex(lowering, OP_SET_LOCAL, slotOf(lowering, id), line);
+        emitByte(lowering, OP_POP, line);
+    }
+}
+
+// Returns false, leaving the chunk as it is, if the code
+// comes out with a jump too long to encode.
+static bool lower(Graph* graph)
+{
+    Chunk* chunk = graph->chunk;
+    Lowering lowering;
+    lowering.graph = graph;
+    lowering.valid = true;
+    initChunk(&lowering.out);
+
+    findStackedValues(graph);
+
+    lowering.regIndex = ALLOCATE(int, graph->instrCount);
+    lowering.regs = ALLOCATE(int, graph->instrCount);
+    lowering.regCount = 0;
+    for (int i = 0; i < graph->instrCount; i++)
+    {
+        lowering.regIndex[i] = -1;
+        if (isRegister(graph, i))
+        {
+            lowering.regIndex[i] = lowering.regCount;
+            lowering.regs[lowering.regCount++] = i;
+        }
+    }
+    if (lowering.regCount > SSA_MAX_REGISTERS)
+    {
+        FREE_ARRAY(int, lowering.regIndex, graph->instrCount);
+        FREE_ARRAY(int, lowering.regs, graph->instrCount);
+        return false;
+    }
+
+    lowering.color = ALLOCATE(int, lowering.regCount + 1);
+    lowering.slotCount = 0;
+    if (lowering.regCount > 0)
+        allocateRegisters(&lowering);
+
+    // The entry block first, then the rest in their
+    // original order.
+    int blockCount = graph->blockCount;
+    lowering.layout = ALLOCATE(int, blockCount);
+    lowering.layoutIndex = ALLOCATE(int, blockCount);
+    lowering.entryPop = ALLOCATE(bool, blockCount);
+    lowering.labels = ALLOCATE(int, blockCount * 2);
+    lowering.stubFrom = ALLOCATE(int, blockCount);
+    lowering.stubTo = ALLOCATE(int, blockCount);
+    lowering.patches = ALLOCATE(int, blockCount * 3);
+    lowering.patchLabels = ALLOCATE(int, blockCount * 3);
+    lowering.stubCount = 0;
+    lowering.patchCount = 0;
+    lowering.layoutCount = 0;
+    lowering.layout[lowering.layoutCount++] = graph->entry;
+    for (int i = 0; i < blockCount; i++)
+    {
+        if ((i != graph->entry) && (graph->blocks[i].rpo != -1))
+            lowering.layout[lowering.layoutCount++] = i;
+    }
+    for (int i = 0; i < blockCount; i++)
+    {
+        lowering.layoutIndex[i] = -1;
+        lowering.entryPop[i] = false;
+        lowering.labels[i] = lowering.labels[blockCount + i] = -1;
+    }
+    for (int i = 0; i < lowering.layoutCount; i++)
+        lowering.layoutIndex[lowering.layout[i]] = i;
+
+    int firstLine = getLine(chunk, 0);
+    for (int i = 0; i < lowering.layoutCount; i++)
+    {
+        int block = lowering.layout[i];
+        IrBlock* current = &graph->blocks[block];
+        lowering.labels[block] = lowering.out.count;
+
+        if (lowering.entryPop[block])
+            emitByte(&lowering, OP_POP, getLine(chunk, current->start));
+        // Room for the registers.
+        if (block == graph->entry)
+        {
+            for (int slot = 0; slot < lowering.slotCount; slot++)
+                emitByte(&lowering, OP_NIL, firstLine);
+        }
+
+        for (int j = 0; j < current->count; j++)
+        {
+            IrInstr* instr = &graph->instrs[current->code[j]];
+            if (isEmitted(instr) && !instr->stacked)
+                emitTree(&lowering, current->code[j]);
+        }
+    }
+
+    for (int i = 0; i < lowering.stubCount; i++)
+    {
+        int from = lowering.stubFrom[i];
+        int to = lowering.stubTo[i];
+        IrBlock* pred = &graph->blocks[from];
+        int line = graph->instrs[pred->code[pred->count - 1]].line;
+        lowering.labels[blockCount + i] = lowering.out.count;
+        emitByte(&lowering, OP_POP, line);
+        emitCopies(&lowering, from, to, line);
+        emitJump(&lowering, OP_JUMP, to, line);
+    }
+
+    Chunk* out = &lowering.out;
+    for (int i = 0; i < lowering.patchCount; i++)
+    {
+        int operand = lowering.patches[i];
+        int jump = lowering.labels[lowering.patchLabels[i]] - (operand + 2);
+        if (jump > UINT16_MAX)
+            lowering.valid = false;
+        out->code[operand] = (jump >> 8) & 0xff;
+        out->code[operand + 1] = jump & 0xff;
+    }
+
+    if (lowering.valid)
+    {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->opLines.lines, chunk->opLines.capacity);
+        FREE_ARRAY(int, chunk->opLines.offsets, chunk->opLines.capacity);
+        chunk->code = out->code;
+        chunk->count = out->count;
+        chunk->capacity = out->capacity;
+        chunk->opLines = out->opLines;
+    }
+    else
+        freeChunk(out);
+
+    FREE_ARRAY(int, lowering.regIndex, graph->instrCount);
+    FREE_ARRAY(int, lowering.regs, graph->instrCount);
+    FREE_ARRAY(int, lowering.color, lowering.regCount + 1);
+    FREE_ARRAY(int, lowering.layout, blockCount);
+    FREE_ARRAY(int, lowering.layoutIndex, blockCount);
+    FREE_ARRAY(bool, lowering.entryPop, blockCount);
+    FREE_ARRAY(int, lowering.labels, blockCount * 2);
+    FREE_ARRAY(int, lowering.stubFrom, blockCount);
+    FREE_ARRAY(int, lowering.stubTo, blockCount);
+    FREE_ARRAY(int, lowering.patches, blockCount * 3);
+    FREE_ARRAY(int, lowering.patchLabels, blockCount * 3);
+    return lowering.valid;
+}
+
+static void freeGraph(Graph* graph)
+{
+    for (int i = 0; i < graph->instrCount; i++)
+    {
+        IrInstr* instr = &graph->instrs[i];
+        FREE_ARRAY(int, instr->operands, instr->operandCapacity);
+    }
+    FREE_ARRAY(IrInstr, graph->instrs, graph->instrCapacity);
+
+    for (int i = 0; i < graph->blockCount; i++)
+    {
+        IrBlock* block = &graph->blocks[i];
+        FREE_ARRAY(int, block->preds, block->predCapacity);
+        FREE_ARRAY(int, block->code, block->capacity);
+        if (block->exit != NULL)
+            FREE_ARRAY(int, block->exit, block->exitDepth + 1);
+    }
+    FREE_ARRAY(IrBlock, graph->blocks, graph->blockCount);
+    FREE_ARRAY(int, graph->order, graph->orderCount);
+}
+
+void optimizeSSA(Chunk* chunk, int arity)
+{
+    Graph graph;
+    memset(&graph, 0, sizeof(Graph));
+    graph.chunk = chunk;
+    graph.arity = arity;
+
+    if (!buildBlocks(&graph))
+        return;
+
+    orderBlocks(&graph);
+    if (buildSSA(&graph))
+    {
+        removeTrivialPhis(&graph);
+        computeDominators(&graph);
+        eliminateCommonSubexpressions(&graph);
+        inferNumbers(&graph);
+        hoistInvariants(&graph);
+        removeDeadCode(&graph);
+        lower(&graph);
+    }
+    freeGraph(&graph);
+}
@@ -132,7 +132,7 @@ void tableAddAll(Table* from, Table* to)
     for (int i = 0; i < from->capacity; i++)
     {
         Entry* entry = &from->entries[i];
-        if (IS_EMPTY(entry->key))
+        if (!IS_EMPTY(entry->key))
             tableSet(to, entry->key, entry->value);
     }
 }
@@ -151,10 +151,9 @@ ObjString* tableFindString(Table* table, const char* chars,
             // Stop if we find a non-tombstone entry.
             if (IS_NIL(entry->value)) return NULL;
         }
-
-        ObjString* string = AS_STRING(entry->key);
-        if (string != NULL)
+        else
         {
+            ObjString* string = AS_STRING(entry->key);
             if (string->length == length &&
                 string->hash == hash &&
                 memcmp(string->chars, chars, length) == 0)
@@ -182,8 +181,7 @@ void tableRemoveWhite(Table* table)
     for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
-        ObjString* keyString = AS_STRING(entry->key);
-        if ((keyString != NULL) && !(keyString->obj.isMarked))
+        if (!IS_EMPTY(entry->key) && !(AS_STRING(entry->key)->obj.isMarked))
             tableDelete(table, entry->key);
     }
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include "../include/tier.h"
+#include "../include/trace.h"
+#include <stdio.h>
+
+void tierUp(ObjFunction* function, Tier tier)
+{
+    if (function->tier < tier)
+        function->tier = tier;
+}
+
+void deoptimize(CallFrame* frame, Word* ip)
+{
+    ObjFunction* function = frame->closure->function;
+    frame->ip = ip;
+    function->deopts++;
+
+    if ((function->tier == TIER_NATIVE) && (function->deopts >= DEOPT_LIMIT))
+    {
+        // Its native code may still be running further down
+        // the C stack, so it is only freed with the function.
+        // It is never entered again.
+        function->tier = TIER_QUICKENED;
+        function->nativeFailed = true;
+    }
+}
+
+static const char* tierName(ObjFunction* function)
+{
+    switch (function->tier)
+    {
+        case TIER_INTERPRETED:  return "interpreted";
+        case TIER_QUICKENED:
+            return (function->native != NULL) ? "quickened (native dropped)" :
+                                                "quickened";
+        default:                return "native";
+    }
+}
+
+static void printFunctionTier(ObjFunction* function)
+{
+    int traces = 0;
+    #ifdef JIT
+    for (Trace* trace = function->traces; trace != NULL; trace = trace->next)
+    {
+        if (trace->native != NULL) traces++;
+    }
+    #endif
+    // Functions that never got warm are not worth a line.
+    if ((function->tier == TIER_INTERPRETED) && (traces == 0))
+        return;
+
+    fprintf(stderr, "%-20s %-28s %10d %12d %8d %8d\n",
+            (function->name == NULL) ? "<script>" : function->name->chars,
+            tierName(function), function->calls, function->backEdges,
+            function->deopts, traces);
+}
+
+void printTierStats()
+{
+    fprintf(stderr, "%-20s %-28s %10s %12s %8s %8s\n", "function", "tier",
+            "calls", "back-edges", "deopts", "traces");
+    for (Obj* object = vm.oldObjects; object != NULL; object = object->next)
+    {
+        if (object->type == OBJ_FUNCTION)
+            printFunctionTier((ObjFunction *) object);
+    }
+    for (Obj* object = vm.objects; object != NULL; object = object->next)
+    {
+        if (object->type == OBJ_FUNCTION)
+            printFunctionTier((ObjFunction *) object);
+    }
+    for (Obj* object = vm.unsweptOld; object != NULL; object = object->next)
+    {
+        if (object->type == OBJ_FUNCTION)
+            printFunctionTier((ObjFunction *) object);
+    }
+    for (Obj* object = vm.unsweptYoung; object != NULL;
+            object = object->next)
+    {
+        if (object->type == OBJ_FUNCTION)
+            printFunctionTier((ObjFunction *) object);
+    }
+}
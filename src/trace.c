@@ -0,0 +1,747 @@
+#include "../include/trace.h"
+
+#ifdef JIT
+
+#include "../include/assembler.h"
+#include "../include/memory.h"
+#include "../include/vm.h"
+#include <string.h>
+
+// The tracing tier. Once a loop header has been reached
+// TRACE_THRESHOLD times, the next iteration is run by the
+// recorder below. It notes the instructions it takes, the
+// way each branch goes and the type of every value it loads.
+// It only knows the simple instructions (numbers, locals,
+// globals, upvalues and jumps). On anything else it stops
+// and leaves the interpreter to carry on from there.
+//
+// The recorded iteration becomes a straight line of native
+// code. Loads are guarded on their recorded type, so the
+// type of every value pushed is known when compiling, and
+// the arithmetic needs no checks of its own. Branches going
+// the other way and failed guards are side exits. They
+// point the frame at the instruction to resume with and
+// return to run(). Values always live on the VM stack, so
+// there is nothing else to write back.
+//
+// The iteration is compiled twice. The first copy guards
+// everything it loads, the second assumes what the first
+// has found out about the locals, which takes the guards
+// on values that do not change type out of the loop.
+
+typedef JitStatus (*TraceCode)(CallFrame* frame);
+
+// Local slot whose type the trace does not know.
+#define UNKNOWN (-1)
+
+typedef struct {
+    int index; // Word index of the instruction.
+    bool taken; // Branches: whether the jump was taken.
+    ValueType type; // Loads: type of the value loaded.
+} TraceStep;
+
+typedef struct {
+    TraceStep steps[TRACE_MAX_LENGTH];
+    int count;
+} Recording;
+
+typedef struct {
+    Assembler a;
+    Trace* trace;
+    Chunk* chunk;
+    // Types of the values pushed since the loop header.
+    ValueType stack[TRACE_MAX_LENGTH];
+    int depth;
+    // Type of each local slot, if a guard or a store in the
+    // trace has made it known.
+    int locals[TRACE_MAX_SLOTS];
+    // Instruction each side exit resumes the interpreter at.
+    Word** exits;
+    int exitCount;
+    int exitCapacity;
+} TraceCompiler;
+
+// ---- Recording. ----
+
+static bool falsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static Value numberOp(Word instruction, double a, double b)
+{
+    switch (instruction)
+    {
+        case OP_ADD:            return NUMBER_VAL(a + b);
+        case OP_SUBTRACT:       return NUMBER_VAL(a - b);
+        case OP_MULTIPLY:       return NUMBER_VAL(a * b);
+        case OP_DIVIDE:         return NUMBER_VAL(a / b);
+        case OP_EQUAL:          return BOOL_VAL(a == b);
+        case OP_NOT_EQUAL:      return BOOL_VAL(a != b);
+        case OP_GREATER:        return BOOL_VAL(a > b);
+        case OP_LESS:           return BOOL_VAL(a < b);
+        case OP_GREATER_EQUAL:  return BOOL_VAL(!(a < b));
+        default:                return BOOL_VAL(!(a > b));
+    }
+}
+
+// Runs the instruction as run() would, and fills in the
+// step. Returns false, without running it, if the recorder
+// cannot handle it or it would fail.
+static bool recordStep(TraceStep* step, CallFrame* frame, Word* ip, Word** next)
+{
+    Chunk* chunk = &frame->closure->function->chunk;
+    Value* slots = frame->slots;
+    Value* globals = vm.globalValues.values;
+    Word instruction = genericOp(*ip);
+
+    step->index = (int) (ip - chunk->words);
+    step->taken = false;
+    step->type = VAL_NIL;
+    *next = ip + wordLength(chunk, step->index);
+
+    switch (instruction)
+    {
+        case OP_ZERO:       push(NUMBER_VAL(0)); break;
+        case OP_ONE:        push(NUMBER_VAL(1)); break;
+        case OP_TWO:        push(NUMBER_VAL(2)); break;
+        case OP_MINUSONE:   push(NUMBER_VAL(-1)); break;
+        case OP_NIL:        push(NIL_VAL); break;
+        case OP_TRUE:       push(BOOL_VAL(true)); break;
+        case OP_FALSE:      push(BOOL_VAL(false)); break;
+        case OP_CONSTANT:   push(chunk->constants.values[ip[1]]); break;
+        case OP_DUP:        push(vm.stackTop[-1]); break;
+        case OP_POP:        vm.stackTop--; break;
+        case OP_POPN:       vm.stackTop -= ip[1]; break;
+        case OP_GET_LOCAL:
+            step->type = VALUE_TYPE(slots[ip[1]]);
+            push(slots[ip[1]]);
+            break;
+        case OP_SET_LOCAL:
+            slots[ip[1]] = vm.stackTop[-1];
+            break;
+        case OP_GET_GLOBAL:
+            if (IS_UNDEFINED(globals[ip[1]])) return false;
+            step->type = VALUE_TYPE(globals[ip[1]]);
+            push(globals[ip[1]]);
+            break;
+        case OP_SET_GLOBAL:
+            if (IS_UNDEFINED(globals[ip[1]])) return false;
+            globals[ip[1]] = vm.stackTop[-1];
+            break;
+        case OP_GET_DEFINED_GLOBAL:
+            step->type = VALUE_TYPE(globals[ip[1]]);
+            push(globals[ip[1]]);
+            break;
+        case OP_SET_DEFINED_GLOBAL:
+            globals[ip[1]] = vm.stackTop[-1];
+            break;
+        case OP_GET_UPVALUE:
+        {
+            Value value = *frame->closure->upvalues[ip[1]]->location;
+            step->type = VALUE_TYPE(value);
+            push(value);
+            break;
+        }
+        case OP_SET_UPVALUE:
+            *frame->closure->upvalues[ip[1]]->location = vm.stackTop[-1];
+            break;
+        case OP_GET_CAPTURED:
+        {
+            Value value = frame->closure->captured[ip[1]];
+            step->type = VALUE_TYPE(value);
+            push(value);
+            break;
+        }
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        {
+            Value a = vm.stackTop[-2];
+            Value b = vm.stackTop[-1];
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+            if ((instruction == OP_DIVIDE) && (AS_NUMBER(b) == 0)) return false;
+            vm.stackTop--;
+            vm.stackTop[-1] = numberOp(instruction, AS_NUMBER(a), AS_NUMBER(b));
+            break;
+        }
+        case OP_NOT:
+            vm.stackTop[-1] = BOOL_VAL(falsey(vm.stackTop[-1]));
+            break;
+        case OP_COMPZER0:
+            vm.stackTop[-1] = BOOL_VAL(valuesEqual(vm.stackTop[-1], NUMBER_VAL(0)));
+            break;
+        case OP_NEGATE:
+        case OP_INCREMENT:
+        case OP_DECREMENT:
+            if (!IS_NUMBER(vm.stackTop[-1])) return false;
+            if (instruction == OP_NEGATE)
+                vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) * -1);
+            else if (instruction == OP_INCREMENT)
+                vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) + 1);
+            else
+                vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) - 1);
+            break;
+        case OP_JUMP:
+            *next += ip[1];
+            break;
+        case OP_JUMP_IF_FALSE:
+            step->taken = falsey(vm.stackTop[-1]);
+            if (step->taken) *next += ip[1];
+            break;
+        case OP_LOOP:
+            *next -= ip[1];
+            break;
+        case OP_ADD_LOCALS:
+        {
+            Value a = slots[ip[1]];
+            Value b = slots[ip[2]];
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+            push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            break;
+        }
+        case OP_LOCAL_LESS_CONST_JUMP:
+        {
+            Value a = slots[ip[1]];
+            Value b = chunk->constants.values[ip[2]];
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+            bool less = AS_NUMBER(a) < AS_NUMBER(b);
+            push(BOOL_VAL(less));
+            step->taken = !less;
+            if (step->taken) *next += ip[3];
+            break;
+        }
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Runs and records one iteration of the loop: everything
+// from its header until control gets back there, however
+// it does. Stops before any instruction it cannot record,
+// with the frame pointing there. Returns whether it got
+// back to the header.
+static bool record(Recording* recording, CallFrame* frame, Word* header)
+{
+    Word* ip = header;
+    recording->count = 0;
+
+    while (recording->count < TRACE_MAX_LENGTH)
+    {
+        TraceStep step;
+        Word* next;
+        if (!recordStep(&step, frame, ip, &next))
+            break;
+
+        recording->steps[recording->count++] = step;
+        if (next == header)
+        {
+            frame->ip = header;
+            return true;
+        }
+        ip = next;
+    }
+
+    frame->ip = ip;
+    return false;
+}
+
+// ---- Compiling. ----
+
+#define PUSH_TYPE(type) (c->stack[c->depth++] = (type))
+#define TYPE_AT(distance) c->stack[c->depth - (distance)]
+// Nothing in a loop body pops what was there before it,
+// but make sure.
+#define NEED(count) \
+        do \
+        { \
+            if (c->depth < (count)) return false; \
+        } while (false)
+
+static void sideExit(TraceCompiler* c, int condition, Word* ip)
+{
+    if (c->exitCapacity < c->exitCount + 1)
+    {
+        int oldCapacity = c->exitCapacity;
+        c->exitCapacity = GROW_CAPACITY(oldCapacity);
+        c->exits = GROW_ARRAY(Word*, c->exits, oldCapacity, c->exitCapacity);
+    }
+
+    c->exits[c->exitCount] = ip;
+    jumpTo(&c->a, condition, c->exitCount++);
+}
+
+static void forgetLocals(TraceCompiler* c)
+{
+    for (int i = 0; i < TRACE_MAX_SLOTS; i++)
+        c->locals[i] = UNKNOWN;
+}
+
+static void setLocal(TraceCompiler* c, Word slot, ValueType type)
+{
+    if (slot < TRACE_MAX_SLOTS) c->locals[slot] = type;
+}
+
+// Makes sure the local has the type, guarding it unless the
+// trace already knows. False if it knows something else.
+static bool guardLocal(TraceCompiler* c, Word slot, ValueType type, Word* ip)
+{
+    int known = (slot < TRACE_MAX_SLOTS) ? c->locals[slot] : UNKNOWN;
+    if (known == (int) type) return true;
+    if (known != UNKNOWN) return false;
+
+    int32_t disp = (int32_t) slot * VALUE_SIZE;
+    sideExit(c, NEGATE(compareType(&c->a, SLOTS, disp, type)), ip);
+    setLocal(c, slot, type);
+    return true;
+}
+
+// Points rax at the upvalue's variable.
+static void loadUpvalue(Assembler* a, Word index)
+{
+    loadQword(a, RAX, CLOSURE, offsetof(ObjClosure, upvalues) +
+                (int32_t) index * sizeof(ObjUpvalue*));
+    loadQword(a, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void loadGlobals(Assembler* a)
+{
+    loadQword(a, RAX, VM_BASE,
+                offsetof(VM, globalValues) + offsetof(ValueArray, values));
+}
+
+// Makes the value distance down the given bool.
+static void setBool(Assembler* a, int distance, bool value)
+{
+    storeImmediate(a, TOP, STACK(distance), BOOL_VAL(value));
+}
+
+static void pushConstant(TraceCompiler* c, Value value)
+{
+    pushImmediate(&c->a, value);
+    if (IS_OBJ(value))
+        writeValueArray(&c->trace->constants, value);
+}
+
+static bool emitStep(TraceCompiler* c, TraceStep* step)
+{
+    Assembler* a = &c->a;
+    Word* ip = c->chunk->words + step->index;
+    Word instruction = genericOp(*ip);
+    int32_t global = (int32_t) ip[1] * VALUE_SIZE;
+
+    switch (instruction)
+    {
+        case OP_ZERO:       pushNumber(a, 0); PUSH_TYPE(VAL_NUMBER); break;
+        case OP_ONE:        pushNumber(a, 1); PUSH_TYPE(VAL_NUMBER); break;
+        case OP_TWO:        pushNumber(a, 2); PUSH_TYPE(VAL_NUMBER); break;
+        case OP_MINUSONE:   pushNumber(a, -1); PUSH_TYPE(VAL_NUMBER); break;
+        case OP_NIL:
+            pushImmediate(a, NIL_VAL);
+            PUSH_TYPE(VAL_NIL);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            pushImmediate(a, BOOL_VAL(instruction == OP_TRUE));
+            PUSH_TYPE(VAL_BOOL);
+            break;
+        case OP_CONSTANT:
+        {
+            Value value = c->chunk->constants.values[ip[1]];
+            pushConstant(c, value);
+            PUSH_TYPE(VALUE_TYPE(value));
+            break;
+        }
+        case OP_DUP:
+        {
+            NEED(1);
+            ValueType type = TYPE_AT(1);
+            pushFrom(a, TOP, STACK(1));
+            PUSH_TYPE(type);
+            break;
+        }
+        case OP_POP:
+            NEED(1);
+            addImmediate(a, TOP, -VALUE_SIZE);
+            c->depth--;
+            break;
+        case OP_POPN:
+            NEED((int) ip[1]);
+            addImmediate(a, TOP, -(int32_t) ip[1] * VALUE_SIZE);
+            c->depth -= (int) ip[1];
+            break;
+        case OP_GET_LOCAL:
+            if (!guardLocal(c, ip[1], step->type, ip)) return false;
+            pushFrom(a, SLOTS, (int32_t) ip[1] * VALUE_SIZE);
+            PUSH_TYPE(step->type);
+            break;
+        case OP_SET_LOCAL:
+            NEED(1);
+            storeTop(a, SLOTS, (int32_t) ip[1] * VALUE_SIZE);
+            setLocal(c, ip[1], TYPE_AT(1));
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_DEFINED_GLOBAL:
+            loadGlobals(a);
+            sideExit(c, NEGATE(compareType(a, RAX, global, step->type)), ip);
+            pushFrom(a, RAX, global);
+            PUSH_TYPE(step->type);
+            break;
+        case OP_SET_GLOBAL:
+            NEED(1);
+            loadGlobals(a);
+            sideExit(c, compareType(a, RAX, global, VAL_UNDEFINED), ip);
+            storeTop(a, RAX, global);
+            break;
+        case OP_SET_DEFINED_GLOBAL:
+            NEED(1);
+            loadGlobals(a);
+            storeTop(a, RAX, global);
+            break;
+        case OP_GET_UPVALUE:
+            loadUpvalue(a, ip[1]);
+            sideExit(c, NEGATE(compareType(a, RAX, 0, step->type)), ip);
+            pushFrom(a, RAX, 0);
+            PUSH_TYPE(step->type);
+            break;
+        case OP_SET_UPVALUE:
+            NEED(1);
+            loadUpvalue(a, ip[1]);
+            storeTop(a, RAX, 0);
+            // The upvalue may still be one of the locals.
+            forgetLocals(c);
+            break;
+        case OP_GET_CAPTURED:
+        {
+            int32_t captured = (int32_t) ip[1] * VALUE_SIZE;
+            loadQword(a, RAX, CLOSURE, offsetof(ObjClosure, captured));
+            sideExit(c, NEGATE(compareType(a, RAX, captured, step->type)), ip);
+            pushFrom(a, RAX, captured);
+            PUSH_TYPE(step->type);
+            break;
+        }
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            NEED(2);
+            if ((TYPE_AT(1) != VAL_NUMBER) || (TYPE_AT(2) != VAL_NUMBER))
+                return false;
+            if (instruction == OP_DIVIDE)
+            {
+                // Leave the error (or NaN) to the interpreter.
+                compareDivisor(a);
+                sideExit(c, CC_E, ip);
+            }
+            numberArithmetic(a, instruction);
+            c->depth--;
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            NEED(2);
+            if ((TYPE_AT(1) != VAL_NUMBER) || (TYPE_AT(2) != VAL_NUMBER))
+                return false;
+            numberComparison(a, instruction);
+            c->depth--;
+            TYPE_AT(1) = VAL_BOOL;
+            break;
+        case OP_NOT:
+            NEED(1);
+            if (TYPE_AT(1) == VAL_BOOL)
+            {
+                rex(a, false, 0, TOP);
+                emitByte(a, 0x80); // xor byte [top - 1], 1
+                memory(a, 6, TOP, STACK(1) + PAYLOAD);
+                emitByte(a, 1);
+            }
+            else
+                setBool(a, 1, TYPE_AT(1) == VAL_NIL);
+            TYPE_AT(1) = VAL_BOOL;
+            break;
+        case OP_COMPZER0:
+            NEED(1);
+            if (TYPE_AT(1) == VAL_NUMBER)
+            {
+                sse(a, MOVSD_LOAD, 0, TOP, STACK(1) + PAYLOAD);
+                emitBytes(a, (uint8_t[]) { 0x66, 0x0F, 0x57, 0xC9 }, 4); // xorpd xmm1, xmm1
+                emitBytes(a, (uint8_t[]) { 0x66, 0x0F, 0x2E, 0xC1 }, 4); // ucomisd xmm0, xmm1
+                setCondition(a, CC_E, RAX);
+                setCondition(a, CC_NP, RCX);
+                emitBytes(a, (uint8_t[]) { 0x20, 0xC8 }, 2); // and al, cl
+                storeBool(a, 1);
+            }
+            else
+                setBool(a, 1, false);
+            TYPE_AT(1) = VAL_BOOL;
+            break;
+        case OP_NEGATE:
+        case OP_INCREMENT:
+        case OP_DECREMENT:
+            NEED(1);
+            if (TYPE_AT(1) != VAL_NUMBER) return false;
+            numberUnary(a, instruction);
+            break;
+        case OP_JUMP:
+            break;
+        case OP_JUMP_IF_FALSE:
+        {
+            NEED(1);
+            Word* fallthrough = ip + 2;
+            Word* target = fallthrough + ip[1];
+            ValueType type = TYPE_AT(1);
+            if (type == VAL_BOOL)
+            {
+                rex(a, false, 0, TOP);
+                emitByte(a, 0x80); // cmp byte [top - 1], 0
+                memory(a, 7, TOP, STACK(1) + PAYLOAD);
+                emitByte(a, 0);
+                if (step->taken)
+                    sideExit(c, CC_NE, fallthrough);
+                else
+                    sideExit(c, CC_E, target);
+            }
+            // Other types always go the same way.
+            else if (step->taken != (type == VAL_NIL))
+                return false;
+            break;
+        }
+        case OP_LOOP:
+            break;
+        case OP_ADD_LOCALS:
+        {
+            int32_t left = (int32_t) ip[1] * VALUE_SIZE;
+            int32_t right = (int32_t) ip[2] * VALUE_SIZE;
+            if (!guardLocal(c, ip[1], VAL_NUMBER, ip) ||
+                !guardLocal(c, ip[2], VAL_NUMBER, ip))
+                return false;
+            sse(a, MOVSD_LOAD, 0, SLOTS, left + PAYLOAD);
+            sse(a, 0xF2, 0x58, 0, SLOTS, right + PAYLOAD); // addsd
+            storeNumberType(a, TOP, 0);
+            sse(a, MOVSD_STORE, 0, TOP, PAYLOAD);
+            addImmediate(a, TOP, VALUE_SIZE);
+            PUSH_TYPE(VAL_NUMBER);
+            break;
+        }
+        case OP_LOCAL_LESS_CONST_JUMP:
+        {
+            Value bound = c->chunk->constants.values[ip[2]];
+            if (!IS_NUMBER(bound) || !guardLocal(c, ip[1], VAL_NUMBER, ip))
+                return false;
+
+            // slot < bound is bound > slot.
+            double number = AS_NUMBER(bound);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            loadImmediate(a, RAX, bits);
+            emitBytes(a, (uint8_t[]) { 0x66, 0x48, 0x0F, 0x6E, 0xC0 }, 5); // movq xmm0, rax
+            sse(a, UCOMISD, 0, SLOTS, (int32_t) ip[1] * VALUE_SIZE + PAYLOAD);
+            setCondition(a, CC_A, RAX);
+            storeBool(a, 0);
+            addImmediate(a, TOP, VALUE_SIZE);
+            PUSH_TYPE(VAL_BOOL);
+
+            Word* fallthrough = ip + 4;
+            emitBytes(a, (uint8_t[]) { 0x85, 0xC0 }, 2); // test eax, eax
+            if (step->taken)
+                sideExit(c, CC_NE, fallthrough);
+            else
+                sideExit(c, CC_E, fallthrough + ip[3]);
+            break;
+        }
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+static bool emitIteration(TraceCompiler* c, Recording* recording)
+{
+    c->depth = 0;
+    for (int i = 0; i < recording->count; i++)
+    {
+        if (!emitStep(c, &recording->steps[i]))
+            return false;
+    }
+    // Back at the header with what was there before.
+    return c->depth == 0;
+}
+
+static void backEdge(Assembler* a, int start)
+{
+    patchAt(a, jump(a, ALWAYS), start);
+}
+
+static bool compileTrace(Trace* trace, Chunk* chunk, Recording* recording)
+{
+    TraceCompiler c;
+    initAssembler(&c.a);
+    c.trace = trace;
+    c.chunk = chunk;
+    c.exits = NULL;
+    c.exitCount = 0;
+    c.exitCapacity = 0;
+    forgetLocals(&c);
+
+    Assembler* a = &c.a;
+    saveRegisters(a);
+    emitBytes(a, (uint8_t[]) { 0x49, 0x89, 0xFE }, 3); // mov r14, rdi
+    loadImmediate(a, VM_BASE, (uint64_t) (uintptr_t) &vm);
+    loadQword(a, TOP, VM_BASE, offsetof(VM, stackTop));
+    loadQword(a, SLOTS, FRAME, offsetof(CallFrame, slots));
+    loadQword(a, CLOSURE, FRAME, offsetof(CallFrame, closure));
+
+    int first = a->count;
+    bool compiled = emitIteration(&c, recording);
+    if (compiled)
+    {
+        int known[TRACE_MAX_SLOTS];
+        memcpy(known, c.locals, sizeof(known));
+
+        // Second copy, which loops on itself as long as
+        // the first copy's types still hold at its end.
+        int second = a->count;
+        int patchCount = a->patchCount;
+        int exitCount = c.exitCount;
+        bool loops = emitIteration(&c, recording);
+        for (int i = 0; loops && (i < TRACE_MAX_SLOTS); i++)
+        {
+            if ((known[i] != UNKNOWN) && (c.locals[i] != known[i]))
+                loops = false;
+        }
+
+        if (loops)
+            backEdge(a, second);
+        else
+        {
+            // Types that change from one iteration to the
+            // next: just loop the first copy.
+            a->count = second;
+            a->patchCount = patchCount;
+            c.exitCount = exitCount;
+            backEdge(a, first);
+        }
+
+        // Each exit loads where to resume and goes to a
+        // common one, which writes the state back.
+        int* stubs = ALLOCATE(int, c.exitCount);
+        int* toCommon = ALLOCATE(int, c.exitCount);
+        for (int i = 0; i < c.exitCount; i++)
+        {
+            stubs[i] = a->count;
+            loadImmediate(a, RAX, (uint64_t) (uintptr_t) c.exits[i]);
+            toCommon[i] = jump(a, ALWAYS);
+        }
+        for (int i = 0; i < c.exitCount; i++)
+            patchHere(a, toCommon[i]);
+        storeQword(a, FRAME, offsetof(CallFrame, ip), RAX);
+        storeQword(a, VM_BASE, offsetof(VM, stackTop), TOP);
+        emitBytes(a, (uint8_t[]) { 0x31, 0xC0 }, 2); // xor eax, eax
+        restoreRegisters(a);
+        emitByte(a, 0xC3); // ret
+
+        for (int i = 0; i < a->patchCount; i++)
+            patchAt(a, a->patches[i], stubs[a->targets[i]]);
+        FREE_ARRAY(int, stubs, c.exitCount);
+        FREE_ARRAY(int, toCommon, c.exitCount);
+
+        trace->native = installCode(a);
+        trace->nativeSize = (size_t) a->count;
+        compiled = (trace->native != NULL);
+    }
+
+    FREE_ARRAY(Word*, c.exits, c.exitCapacity);
+    freeAssembler(a);
+    return compiled;
+}
+
+#undef PUSH_TYPE
+#undef TYPE_AT
+#undef NEED
+
+// ---- Running. ----
+
+static Trace* findTrace(ObjFunction* function, Word* header)
+{
+    for (Trace* trace = function->traces; trace != NULL; trace = trace->next)
+    {
+        if (trace->header == header) return trace;
+    }
+
+    Trace* trace = ALLOCATE(Trace, 1);
+    trace->header = header;
+    trace->hotness = 0;
+    trace->aborts = 0;
+    trace->native = NULL;
+    trace->nativeSize = 0;
+    initValueArray(&trace->constants);
+    trace->next = function->traces;
+    function->traces = trace;
+    return trace;
+}
+
+bool traceLoop(Word* header)
+{
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    ObjFunction* function = frame->closure->function;
+    Trace* trace = findTrace(function, header);
+
+    if (trace->native == NULL)
+    {
+        if (trace->aborts >= TRACE_MAX_ABORTS) return false;
+        if (++trace->hotness < TRACE_THRESHOLD) return true;
+
+        trace->hotness = 0;
+        Recording recording;
+        if (!record(&recording, frame, header))
+        {
+            trace->aborts++;
+            return true;
+        }
+        if (!compileTrace(trace, &function->chunk, &recording))
+        {
+            // Recorded fine but cannot be compiled, and
+            // never will be.
+            trace->aborts = TRACE_MAX_ABORTS;
+            return true;
+        }
+    }
+
+    ((TraceCode) trace->native)(frame);
+    return true;
+}
+
+void markTraces(ObjFunction* function)
+{
+    for (Trace* trace = function->traces; trace != NULL; trace = trace->next)
+        markValueArray(&trace->constants);
+}
+
+void freeTraces(ObjFunction* function)
+{
+    Trace* trace = function->traces;
+    while (trace != NULL)
+    {
+        Trace* next = trace->next;
+        freeCode(trace->native, trace->nativeSize);
+        freeValueArray(&trace->constants);
+        FREE(Trace, trace);
+        trace = next;
+    }
+    function->traces = NULL;
+}
+
+#endif
@@ -52,7 +52,7 @@ static uint32_t hashDouble(double value)
 
 uint32_t hashValue(Value value)
 {
-    switch (value.type)
+    switch (VALUE_TYPE(value))
     {
         case VAL_BOOL:      return AS_BOOL(value) ? 3 : 5;
         case VAL_NIL:       return 7;
@@ -65,7 +65,7 @@ uint32_t hashValue(Value value)
 
 void printValue(Value value)
 {
-    switch (value.type)
+    switch (VALUE_TYPE(value))
     {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -80,6 +80,12 @@ void printValue(Value value)
 
 bool valuesEqual(Value a, Value b)
 {
+    #ifdef NAN_BOXING
+    // Numbers compare as doubles (NaN is not equal to itself,
+    // -0 equals 0). Anything else is equal only to itself.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return (AS_NUMBER(a) == AS_NUMBER(b));
+    return (a == b);
+    #else
     if (a.type != b.type) return false;
     switch (a.type)
     {
@@ -89,4 +95,5 @@ bool valuesEqual(Value a, Value b)
         case VAL_OBJ:       return (AS_OBJ(a) == AS_OBJ(b));
         default:            return false; // Unreachable.
     }
+    #endif
 }
\ No newline at end of file
@@ -1,9 +1,16 @@
 #include "../include/vm.h"
+#include "../include/cache.h"
 #include "../include/common.h"
 #include "../include/compiler.h"
 #include "../include/debug.h"
+#include "../include/jit.h"
+#include "../include/tier.h"
+#include "../include/trace.h"
 #include "../include/memory.h"
 #include "../include/object.h"
+#include "../include/optimizer.h"
+#include "../include/register.h"
+#include "../include/shape.h"
 #include "../include/table.h"
 #include "../include/value.h"
 #include <stdarg.h>
@@ -12,22 +19,50 @@
 
 VM vm;
 
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+// Instructions run in either mode, reported by freeVM().
+static unsigned long instructionCount = 0;
+#define COUNT_INSTRUCTION() instructionCount++
+#else
+#define COUNT_INSTRUCTION() do {} while (false)
+#endif
+
 static void resetStack()
 {
-    vm.stackCount = 0;
+    vm.stackTop = vm.stack;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
 }
 
 void initVM()
 {
+    vm.registerMode = false;
+    vm.jit = false;
+    vm.tierStats = false;
+    vm.optLevel = 1;
+    vm.repl = false;
     vm.stack = NULL;
     vm.stackCapacity = 0;
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
+    vm.frameLimit = FRAMES_MAX;
     resetStack();
 
     vm.objects = NULL;
+    vm.youngBytes = 0;
+    vm.oldObjects = NULL;
+    vm.unsweptOld = NULL;
+    vm.unsweptYoung = NULL;
+    vm.gcPause = GC_MAX_PAUSE;
+    vm.concurrentGC = false;
+    vm.gcThreads = 1;
+    vm.markingConcurrently = false;
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.nextGC = GC_FIRST_MAJOR;
+
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
@@ -37,13 +72,22 @@ void initVM()
     initTable(&vm.globalNames);
     initValueArray(&vm.globalValues);
 
+    vm.stack = ALLOCATE(Value, STACK_INITIAL);
+    vm.stackCapacity = STACK_INITIAL;
+    vm.stackTop = vm.stack;
+
     // Null the field first in case
     // GC is triggered before it is
     // properly copied.
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
+    vm.rootShape = NULL;
+    vm.rootShape = newShape(NULL, NULL);
+    vm.cacheEpoch = 0;
 
     initTable(&vm.globalAccess);
+    initTable(&vm.globalConstants);
+    initTable(&vm.assignedGlobals);
     initTable(&vm.localAccess);
 }
 
@@ -53,61 +97,138 @@ void freeVM()
     freeValueArray(&vm.globalValues);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.rootShape = NULL;
 
     freeTable(&vm.globalAccess);
+    freeTable(&vm.globalConstants);
+    freeTable(&vm.assignedGlobals);
     freeTable(&vm.localAccess);
 
     freeObjects();
     FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+
+    #ifdef DEBUG_PROFILE_OPCODES
+    printOpcodeProfile();
+    #endif
+    #ifdef DEBUG_COUNT_INSTRUCTIONS
+    fprintf(stderr, "Instructions executed: %lu\n", instructionCount);
+    #endif
+    #ifdef DEBUG_CACHE_STATS
+    printCacheStats();
+    #endif
+    #ifdef DEBUG_PEEPHOLE_STATS
+    printPeepholeStats();
+    #endif
+    #ifdef DEBUG_MEMORY_STATS
+    printMemoryStats();
+    #endif
+    #ifdef DEBUG_GC_STATS
+    printGCStats();
+    #endif
 }
 
-static void runtimeError(const char* format, ...)
+// Prints one frame of the stack trace, unless it falls among
+// the middle ones of a long trace (runaway recursion).
+static void traceFrame(int index, int total, int line, const char* name)
 {
-    fprintf(stderr, "Runtime Error: ");
-    
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
+    if ((total > 2 * TRACE_FRAMES + 1) && (index >= TRACE_FRAMES) &&
+        (index < total - TRACE_FRAMES))
+    {
+        if (index == TRACE_FRAMES)
+            fprintf(stderr, "... %d more frames\n", total - 2 * TRACE_FRAMES);
+        return;
+    }
 
+    fprintf(stderr, "[line %d] in ", line);
+    if (name == NULL)
+        fprintf(stderr, "script\n");
+    else
+        fprintf(stderr, "%s()\n", name);
+}
+
+// Walks the frames from the innermost out, and returns how
+// many there are. Calls inlined into a function count as the
+// frames they would have had. Prints them unless total is 0.
+static int traceFrames(int total)
+{
+    int index = 0;
     for (int i = vm.frameCount - 1; i >= 0; i--)
     {
         CallFrame* frame = &vm.frames[i];
+        Chunk* chunk = &frame->closure->function->chunk;
         ObjFunction* function = frame->closure->function;
         // -1 to point to the previous failed instruction.
-        size_t offset = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, offset));
-        if (function->name == NULL)
-            fprintf(stderr, "script\n");
-        else
-            fprintf(stderr, "%s()\n", function->name->chars);
+        // Lines are kept for the compact code, so map the
+        // word back to the instruction it was decoded from.
+        int offset = vm.registerMode ?
+                chunk->regOffsets[frame->ip - chunk->regWords - 1] :
+                chunk->wordOffsets[frame->ip - chunk->words - 1];
+        int line = getLine(&function->chunk, offset);
+        while (IS_INLINED(line))
+        {
+            InlinedLine* inlined = &chunk->inlinedLines[INLINED_INDEX(line)];
+            if (total > 0)
+                traceFrame(index, total, inlined->line,
+                            inlined->function->chars);
+            index++;
+            line = inlined->caller;
+        }
+        if (total > 0)
+            traceFrame(index, total, line,
+                        function->name == NULL ? NULL : function->name->chars);
+        index++;
     }
+    return index;
+}
+
+void runtimeError(const char* format, ...)
+{
+    fprintf(stderr, "Runtime Error: ");
+    
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
 
+    traceFrames(traceFrames(0));
     resetStack();
 }
 
 void push(Value value)
 {
-    if (vm.stackCapacity < vm.stackCount + 1)
-    {
-        int oldCapacity = vm.stackCapacity;
-        vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-        vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
-    }
-
-    vm.stack[vm.stackCount++] = value;
+    *vm.stackTop++ = value;
 }
 
 Value pop()
 {
-    vm.stackCount--;
-    return vm.stack[vm.stackCount];
+    return *--vm.stackTop;
 }
 
 static Value peek(int distance)
 {
-    return vm.stack[vm.stackCount - distance - 1];
+    return vm.stackTop[-1 - distance];
+}
+
+// Moves the stack to a bigger array. Call frames and open
+// upvalues point into it, so they are moved along.
+static void growStack(int needed)
+{
+    Value* oldStack = vm.stack;
+    int oldCapacity = vm.stackCapacity;
+    while (vm.stackCapacity < needed)
+        vm.stackCapacity = GROW_CAPACITY(vm.stackCapacity);
+    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
+    vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+
+    for (int i = 0; i < vm.frameCount; i++)
+        vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+
+    for (ObjUpvalue* upvalue = vm.openUpvalues;
+        upvalue != NULL;
+        upvalue = upvalue->next)
+            upvalue->location = vm.stack + (upvalue->location - oldStack);
 }
 
 static bool call(ObjClosure* closure, int argCount)
@@ -122,20 +243,44 @@ static bool call(ObjClosure* closure, int argCount)
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    if (vm.frameCount == vm.frameLimit)
     {
         runtimeError("Stack overflow.");
         return false;
     }
+
+    if (vm.frameCapacity < vm.frameCount + 1)
+    {
+        int oldCapacity = vm.frameCapacity;
+        vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+        if (vm.frameCapacity > vm.frameLimit)
+            vm.frameCapacity = vm.frameLimit;
+        vm.frames = GROW_ARRAY(CallFrame, vm.frames,
+                        oldCapacity, vm.frameCapacity);
+    }
     
+    // The only place the stack grows. Callers reload
+    // anything they hold into it once this returns.
+    ObjFunction* function = closure->function;
+    int depth = vm.registerMode ? function->chunk.maxRegisters :
+                                    function->maxStack;
+    int needed = (int) (vm.stackTop - vm.stack) - argCount - 1 +
+                    depth + STACK_SLACK;
+    if (vm.stackCapacity < needed)
+        growStack(needed);
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stack + vm.stackCount - argCount - 1;
+    frame->ip = vm.registerMode ? function->chunk.regWords :
+                                    function->chunk.words;
+    frame->slots = vm.stackTop - argCount - 1;
+    // Native code, if the function has any, is entered by
+    // the caller (see jitEnter()) once the frame is set up.
+    countCall(function);
     return true;
 }
 
-static bool callValue(Value callee, int argCount)
+bool callValue(Value callee, int argCount)
 {
     if (IS_OBJ(callee))
     {
@@ -159,19 +304,18 @@ static bool callValue(Value callee, int argCount)
                 }
 
                 NativeFn native = AS_NATIVE(callee);
-                if (!native(argCount, vm.stack + vm.stackCount - argCount))
+                if (!native(argCount, vm.stackTop - argCount))
                 {
-                    runtimeError(AS_CSTRING(vm.stack[vm.stackCount - argCount - 1]));
+                    runtimeError(AS_CSTRING(vm.stackTop[-argCount - 1]));
                     return false;
                 };
-                vm.stackCount -= argCount;
+                vm.stackTop -= argCount;
                 return true;
             }
             case OBJ_CLASS:
             {
                 ObjClass* klass = AS_CLASS(callee);
-                vm.stack[vm.stackCount - argCount - 1] = 
-                                    OBJ_VAL(newInstance(klass));
+                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
                 if (klass->init != NULL)
                     return call(klass->init, argCount);
                 else if (argCount != 0)
@@ -184,7 +328,7 @@ static bool callValue(Value callee, int argCount)
             case OBJ_BOUND_METHOD:
             {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stack[vm.stackCount - argCount - 1] = bound->receiver;
+                vm.stackTop[-argCount - 1] = bound->receiver;
                 return call(bound->method, argCount);
             }
             default:
@@ -196,19 +340,7 @@ static bool callValue(Value callee, int argCount)
     return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
-{
-    Value method;
-    if (!tableGet(&klass->methods, OBJ_VAL(name), &method))
-    {
-        runtimeError("Undefined property '%s'.", name->chars);
-        return false;
-    }
-    
-    return call(AS_CLOSURE(method), argCount);
-}
-
-static bool invoke(ObjString* name, int argCount)
+bool invoke(InlineCache* cache, ObjString* name, int argCount)
 {
     Value receiver = peek(argCount);
 
@@ -219,21 +351,27 @@ static bool invoke(ObjString* name, int argCount)
     }
 
     ObjInstance* instance = AS_INSTANCE(receiver);
+    CacheEntry* entry = cacheLoad(cache, instance, name);
+    if (entry == NULL)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
 
-    Value value;
-    if (tableGet(&instance->fields, OBJ_VAL(name), &value))
+    if (entry->slot != -1)
     {
         // If the object is a field (function) on the 
         // instance, we instead load the field on the
         // stack *below* the arguments and call it.
-        vm.stack[vm.stackCount - argCount - 1] = value;
+        Value value = instance->fields[entry->slot];
+        vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    return call(entry->method, argCount);
 }
 
-static ObjUpvalue* captureUpvalue(Value* local)
+ObjUpvalue* captureUpvalue(Value* local)
 {
     ObjUpvalue* prevUpvalue = NULL;
     ObjUpvalue* upvalue = vm.openUpvalues;
@@ -243,7 +381,7 @@ static ObjUpvalue* captureUpvalue(Value* local)
         upvalue = upvalue->next;
     }
 
-    if ((upvalue != NULL) && (upvalue->location = local))
+    if ((upvalue != NULL) && (upvalue->location == local))
         return upvalue;
     
     ObjUpvalue* createdUpvalue = newUpvalue(local);
@@ -260,7 +398,7 @@ static ObjUpvalue* captureUpvalue(Value* local)
     return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last)
+void closeUpvalues(Value* last)
 {
     while ((vm.openUpvalues != NULL) && 
             (vm.openUpvalues->location >= last))
@@ -269,35 +407,48 @@ static void closeUpvalues(Value* last)
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
         vm.openUpvalues = upvalue->next;
+        WRITE_BARRIER(upvalue);
     }
 }
 
-static void defineMethod(ObjString* name)
+// Makes the call just made a tail call. The callee's frame
+// replaces its caller's, and the callee and its arguments
+// slide down into the caller's slots.
+void replaceCaller()
+{
+    CallFrame* callee = &vm.frames[vm.frameCount - 1];
+    CallFrame* caller = callee - 1;
+    closeUpvalues(caller->slots);
+
+    int window = (int) (vm.stackTop - callee->slots);
+    memmove(caller->slots, callee->slots, window * sizeof(Value));
+    vm.stackTop = caller->slots + window;
+    callee->slots = caller->slots;
+    *caller = *callee;
+    vm.frameCount--;
+}
+
+// The method must stay reachable until this returns.
+void defineMethod(ObjClass* klass, ObjString* name, Value method)
 {
-    Value method = peek(0);
-    ObjClass* klass = AS_CLASS(peek(1));
+    // Any cached lookup may now have a different answer.
+    vm.cacheEpoch++;
     if (name == vm.initString)
         klass->init = AS_CLOSURE(method);
     else
         tableSet(&klass->methods, OBJ_VAL(name), method);
-    pop();
+    WRITE_BARRIER(klass);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name)
+void bindMethod(ObjClosure* method)
 {
-    Value method;
-    if (!tableGet(&klass->methods, OBJ_VAL(name), &method))
-        // Error reporting will occur back in run().
-        return false;
-    
     // We don't pop() the instance directly in case
     // GC runs before we add the instance as a field on the
     // ObjBoundMethod object (since newBoundMethod
     // involves allocation first).
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
-    return true;
 }
 
 static bool isFalsey(Value value)
@@ -305,67 +456,129 @@ static bool isFalsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+// Both strings must stay reachable until this returns.
+static ObjString* joinStrings(ObjString* a, ObjString* b)
 {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
     int length = a->length + b->length;
     ObjString* result = makeString(length);
     memcpy(result->chars, a->chars, a->length);
     memcpy(result->chars + a->length, b->chars, b->length);
+    result->chars[length] = '\0';
 
     uint32_t hash = hashString(result->chars, result->length);
     ObjString* interned = tableFindString(&vm.strings, result->chars,
                                             result->length, hash);
     
+    // The new string is already on the object list, so
+    // it is left for the GC to free.
     if (interned != NULL)
-    {
-        reallocate(result, sizeof(ObjString) + result->length + 1, 0);
-        push(OBJ_VAL(interned));
-        return;
-    }
+        return interned;
 
-    result->chars[length] = '\0';
     result->hash = hash;
 
+    // Intern it, so it compares equal to other copies.
+    push(OBJ_VAL(result));
+    tableSet(&vm.strings, OBJ_VAL(result), NIL_VAL);
+    pop();
+    return result;
+}
+
+void concatenate()
+{
+    ObjString* b = AS_STRING(peek(0));
+    ObjString* a = AS_STRING(peek(1));
+    ObjString* result = joinStrings(a, b);
+
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run()
+InterpretResult run(int baseFrame)
 {
     // Top-most call-frame.
     // Using local variable to be concise and
     // encourage compiler to store frame
     // in a register, accessing IP faster.
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    register uint8_t* ip = frame->ip;
+    register Word* ip = frame->ip;
     
-    #define READ_BYTE() (*ip++) // Dereference then increment.
-    #define READ_SHORT() \
-        (ip += 2, \
-            (uint16_t)((ip[-2] << 8) | ip[-1]))
-    #define READ_TRIBYTE() \
-        (ip += 3, \
-            (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
-    #define READ_OPERAND() (READ_BYTE() == OP_LONG ? READ_TRIBYTE() : READ_BYTE())
-
+    // Every opcode and operand is a single word in the
+    // decoded code, so none of these need to branch.
+    #define READ_WORD() (*ip++) // Dereference then increment.
     #define READ_CONSTANT() \
-        (frame->closure->function->chunk.constants.values[READ_BYTE()])
-    #define READ_CONST_LONG() \
-        (frame->closure->function->chunk.constants.values[READ_TRIBYTE()])
-    #define READ_VALUE() \
-        (READ_BYTE() == OP_CONSTANT ? READ_CONSTANT() : READ_CONST_LONG())
-    #define READ_CONST_OPER() (READ_BYTE() == OP_LONG ? READ_CONSTANT() : READ_CONST_LONG())
-
+        (frame->closure->function->chunk.constants.values[READ_WORD()])
     #define READ_STRING() AS_STRING(READ_CONSTANT())
-    #define READ_STRING_LONG() AS_STRING(READ_CONST_LONG())
-    #define READ_STRING_OPER() AS_STRING(READ_CONST_OPER())
-    #define READ_STRING_VALUE() AS_STRING(READ_VALUE())
+    #define READ_CACHE() \
+        (&frame->closure->function->chunk.caches[READ_WORD()])
+
+    #ifdef JIT
+        // Hands a frame a call has just pushed to its native
+        // code, if it has any (or gets some now). Afterwards
+        // the top frame, whichever it is, carries on here.
+        #define ENTER_NATIVE(pushed) \
+            do \
+            { \
+                if (vm.jit && (pushed)) \
+                { \
+                    JitStatus status = jitEnter(); \
+                    if (status == JIT_ERROR) \
+                        return INTERPRET_RUNTIME_ERROR; \
+                    if (vm.frameCount == baseFrame) \
+                        return INTERPRET_OK; \
+                } \
+            } while (false)
+        // Counts the loop the back-edge just taken belongs to,
+        // and runs its trace if it has one (see traceLoop()).
+        // Loops that cannot be traced carry on in the native
+        // code for the whole function instead, once it is hot.
+        #define RUN_TRACE() \
+            do \
+            { \
+                if (vm.jit) \
+                { \
+                    frame->ip = ip; \
+                    if (!traceLoop(ip)) \
+                    { \
+                        JitStatus status = jitLoop(ip); \
+                        if (status == JIT_ERROR) \
+                            return INTERPRET_RUNTIME_ERROR; \
+                        if ((status == JIT_RETURNED) && \
+                            (vm.frameCount == baseFrame)) \
+                            return INTERPRET_OK; \
+                        frame = &vm.frames[vm.frameCount - 1]; \
+                    } \
+                    ip = frame->ip; \
+                } \
+            } while (false)
+    #else
+        #define ENTER_NATIVE(pushed) do { (void) (pushed); } while (false)
+        #define RUN_TRACE() do {} while (false)
+    #endif
 
-    #define BINARY_OP(valueType, op) \
+    // Type-feedback quickening. A generic arithmetic or
+    // comparison instruction that has just run on two numbers
+    // rewrites itself into its quickened form, which only
+    // checks that both operands are still numbers. If they
+    // are not, it turns back into the generic form and runs
+    // again as that. None of these have operands, so the
+    // opcode is always the word just read. Code only quickens
+    // once its function is warm (see tier.h).
+    #define QUICKEN(opcode) \
+            do \
+            { \
+                if (frame->closure->function->tier != TIER_INTERPRETED) \
+                    ip[-1] = (Word) (opcode); \
+            } while (false)
+    #define DEOPTIMIZE(generic) \
+            do \
+            { \
+                ip[-1] = (Word) (generic); \
+                ip--; \
+                DISPATCH(); \
+            } while (false)
+
+    #define BINARY_OP(valueType, op, quickened) \
             do \
             { \
                 if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
@@ -377,392 +590,1322 @@ static InterpretResult run()
                 double b = AS_NUMBER(pop()); \
                 double a = AS_NUMBER(pop()); \
                 push(valueType(a op b)); \
+                QUICKEN(quickened); \
+            } while (false)
+    // Quickened BINARY_OP. Works on the stack in place.
+    #define NUMBER_OP(valueType, op, generic) \
+            do \
+            { \
+                Value b = vm.stackTop[-1]; \
+                Value a = vm.stackTop[-2]; \
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+                    DEOPTIMIZE(generic); \
+                vm.stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+                vm.stackTop--; \
             } while (false)
+    #define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+    #ifdef DEBUG_TRACE_EXECUTION
+        #ifdef DEBUG_TRACE_STACK
+            // Our stack is empty before the first instruction executes.
+            // So this only starts printing after (at least) the first
+            // instruction is disassembled.
+            #define TRACE_STACK() \
+                do \
+                { \
+                    printf("          "); \
+                    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) \
+                    { \
+                        printf("[ "); \
+                        printValue(*slot); \
+                        printf(" ]"); \
+                    } \
+                    printf("\n"); \
+                } while (false)
+        #else
+            #define TRACE_STACK() do {} while (false)
+        #endif
+        // Disassemble the next instruction we will execute
+        // prior to execution.
+        #define TRACE_INSTRUCTION() \
+            do \
+            { \
+                TRACE_STACK(); \
+                disassembleInstruction(&frame->closure->function->chunk, \
+                    frame->closure->function->chunk.wordOffsets[ \
+                        ip - frame->closure->function->chunk.words]); \
+            } while (false)
+    #else
+        #define TRACE_INSTRUCTION() do {} while (false)
+    #endif
+
+    #ifdef DEBUG_PROFILE_OPCODES
+        #define PROFILE_INSTRUCTION() profileInstruction((int) *ip)
+    #else
+        #define PROFILE_INSTRUCTION() do {} while (false)
+    #endif
+
+    #ifdef COMPUTED_GOTO
+        // One label address per opcode, with the ones run()
+        // never sees sent to the default. Every handler jumps
+        // straight to the handler of the next instruction, so
+        // each opcode gets its own indirect branch (and its own
+        // prediction history) instead of all sharing the
+        // switch's.
+        static void* dispatchTable[] = {
+            [OP_ZERO] = &&CASE_OP_ZERO,
+            [OP_ONE] = &&CASE_OP_ONE,
+            [OP_TWO] = &&CASE_OP_TWO,
+            [OP_MINUSONE] = &&CASE_OP_MINUSONE,
+            [OP_CONSTANT] = &&CASE_OP_CONSTANT,
+            [OP_CONSTANT_LONG] = &&CASE_DEFAULT,
+            [OP_SHORT] = &&CASE_DEFAULT,
+            [OP_LONG] = &&CASE_DEFAULT,
+            [OP_DUP] = &&CASE_OP_DUP,
+            [OP_NIL] = &&CASE_OP_NIL,
+            [OP_TRUE] = &&CASE_OP_TRUE,
+            [OP_FALSE] = &&CASE_OP_FALSE,
+            [OP_POP] = &&CASE_OP_POP,
+            [OP_POPN] = &&CASE_OP_POPN,
+            [OP_DEFINE_GLOBAL] = &&CASE_OP_DEFINE_GLOBAL,
+            [OP_GET_GLOBAL] = &&CASE_OP_GET_GLOBAL,
+            [OP_GET_LOCAL] = &&CASE_OP_GET_LOCAL,
+            [OP_SET_GLOBAL] = &&CASE_OP_SET_GLOBAL,
+            [OP_SET_LOCAL] = &&CASE_OP_SET_LOCAL,
+            [OP_GET_UPVALUE] = &&CASE_OP_GET_UPVALUE,
+            [OP_SET_UPVALUE] = &&CASE_OP_SET_UPVALUE,
+            [OP_GET_CAPTURED] = &&CASE_OP_GET_CAPTURED,
+            [OP_GET_DEFINED_GLOBAL] = &&CASE_OP_GET_DEFINED_GLOBAL,
+            [OP_SET_DEFINED_GLOBAL] = &&CASE_OP_SET_DEFINED_GLOBAL,
+            [OP_EQUAL] = &&CASE_OP_EQUAL,
+            [OP_GREATER] = &&CASE_OP_GREATER,
+            [OP_LESS] = &&CASE_OP_LESS,
+            [OP_COMPZER0] = &&CASE_OP_COMPZER0,
+            [OP_INCREMENT] = &&CASE_OP_INCREMENT,
+            [OP_DECREMENT] = &&CASE_OP_DECREMENT,
+            [OP_ADD] = &&CASE_OP_ADD,
+            [OP_SUBTRACT] = &&CASE_OP_SUBTRACT,
+            [OP_MULTIPLY] = &&CASE_OP_MULTIPLY,
+            [OP_DIVIDE] = &&CASE_OP_DIVIDE,
+            [OP_NOT] = &&CASE_OP_NOT,
+            [OP_NEGATE] = &&CASE_OP_NEGATE,
+            [OP_PRINT] = &&CASE_OP_PRINT,
+            [OP_JUMP] = &&CASE_OP_JUMP,
+            [OP_JUMP_IF_FALSE] = &&CASE_OP_JUMP_IF_FALSE,
+            [OP_LOOP] = &&CASE_OP_LOOP,
+            [OP_CALL] = &&CASE_OP_CALL,
+            [OP_TAIL_CALL] = &&CASE_OP_TAIL_CALL,
+            [OP_INVOKE] = &&CASE_OP_INVOKE,
+            [OP_CLOSURE] = &&CASE_OP_CLOSURE,
+            [OP_CLOSE_UPVALUE] = &&CASE_OP_CLOSE_UPVALUE,
+            [OP_CLASS] = &&CASE_OP_CLASS,
+            [OP_METHOD] = &&CASE_OP_METHOD,
+            [OP_GET_PROPERTY] = &&CASE_OP_GET_PROPERTY,
+            [OP_SET_PROPERTY] = &&CASE_OP_SET_PROPERTY,
+            [OP_DEL_PROPERTY] = &&CASE_OP_DEL_PROPERTY,
+            [OP_RETURN] = &&CASE_OP_RETURN,
+            [OP_NOT_EQUAL] = &&CASE_OP_NOT_EQUAL,
+            [OP_GREATER_EQUAL] = &&CASE_OP_GREATER_EQUAL,
+            [OP_LESS_EQUAL] = &&CASE_OP_LESS_EQUAL,
+            [OP_ADD_LOCALS] = &&CASE_OP_ADD_LOCALS,
+            [OP_LOCAL_LESS_CONST_JUMP] = &&CASE_OP_LOCAL_LESS_CONST_JUMP,
+            [OP_ADD_NUM] = &&CASE_OP_ADD_NUM,
+            [OP_SUBTRACT_NUM] = &&CASE_OP_SUBTRACT_NUM,
+            [OP_MULTIPLY_NUM] = &&CASE_OP_MULTIPLY_NUM,
+            [OP_DIVIDE_NUM] = &&CASE_OP_DIVIDE_NUM,
+            [OP_EQUAL_NUM] = &&CASE_OP_EQUAL_NUM,
+            [OP_NOT_EQUAL_NUM] = &&CASE_OP_NOT_EQUAL_NUM,
+            [OP_GREATER_NUM] = &&CASE_OP_GREATER_NUM,
+            [OP_GREATER_EQUAL_NUM] = &&CASE_OP_GREATER_EQUAL_NUM,
+            [OP_LESS_NUM] = &&CASE_OP_LESS_NUM,
+            [OP_LESS_EQUAL_NUM] = &&CASE_OP_LESS_EQUAL_NUM
+        };
+        _Static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) ==
+                        OP_COUNT, "Every opcode needs a handler.");
+
+        #define INTERPRET_LOOP  DISPATCH();
+        #define CASE(opcode)    CASE_##opcode
+        #define DEFAULT()       CASE_DEFAULT
+        #define DISPATCH() \
+            do \
+            { \
+                TRACE_INSTRUCTION(); \
+                PROFILE_INSTRUCTION(); \
+                COUNT_INSTRUCTION(); \
+                goto *dispatchTable[READ_WORD()]; \
+            } while (false)
+    #else
+        #define INTERPRET_LOOP \
+            loop: \
+                TRACE_INSTRUCTION(); \
+                PROFILE_INSTRUCTION(); \
+                COUNT_INSTRUCTION(); \
+                switch (READ_WORD())
+        #define CASE(opcode)    case opcode
+        #define DEFAULT()       default
+        #define DISPATCH()      goto loop
+    #endif
 
     #ifdef DEBUG_TRACE_EXECUTION
         printf("== debug trace == \n");
     #endif
 
-    while (true)
+    INTERPRET_LOOP
     {
-        #ifdef DEBUG_TRACE_EXECUTION
-            #ifdef DEBUG_TRACE_STACK
-                printf("          ");
-                // Our stack is empty before the first instruction executes.
-                // So this only starts printing after (at least) the first
-                // instruction is disassembled.
-                for (Value* slot = vm.stack; slot - vm.stack < vm.stackCount; slot++)
-                {
-                    printf("[ ");
-                    printValue(*slot);
-                    printf(" ]");
-                }
-                printf("\n");
-            #endif
-            // Disassemble the next instruction we will execute
-            // prior to execution.
-            disassembleInstruction(&frame->closure->function->chunk, 
-                                    (int) (ip - frame->closure->function->chunk.code));
-        #endif
-        
-        uint8_t instruction = READ_BYTE();
-        switch (instruction)
+        CASE(OP_ZERO):      push(NUMBER_VAL((double) 0)); DISPATCH();
+        CASE(OP_ONE):        push(NUMBER_VAL((double) 1)); DISPATCH();
+        CASE(OP_TWO):        push(NUMBER_VAL((double) 2)); DISPATCH();
+        CASE(OP_MINUSONE):   push(NUMBER_VAL((double) -1)); DISPATCH();
+        CASE(OP_CONSTANT):
+        {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_DUP):    push(peek(0)); DISPATCH();
+        CASE(OP_NIL):    push(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE):   push(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE):  push(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP):    pop(); DISPATCH();
+        CASE(OP_POPN):
+        {
+            vm.stackTop -= READ_WORD();
+            DISPATCH();
+            // No return since this is only for local variables.
+            // We don't return the last variable popped.
+        }
+        CASE(OP_DEFINE_GLOBAL):
         {
-            // Handles OP_ZERO and OP_COMPZERO.
-            case OP_ZERO:
+            vm.globalValues.values[READ_WORD()] = pop();
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL):
+        {
+            Value value = vm.globalValues.values[READ_WORD()];
+            if (IS_UNDEFINED(value))
             {
-                if (*ip == OP_COMPZER0)
-                {
-                    Value value = pop();
-                    (void) READ_BYTE(); // Skip the COMPZERO opcode.
-                    push(BOOL_VAL(valuesEqual(value, NUMBER_VAL(0))));
-                }
-                else
-                    push(NUMBER_VAL((double) 0));
-                break;
+                // When we report a runtime error, 
+                // it has to appear at the right instruction.
+                frame->ip = ip;
+                runtimeError("Undefined variable.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_ONE:        push(NUMBER_VAL((double) 1)); break;
-            case OP_TWO:        push(NUMBER_VAL((double) 2)); break;
-            case OP_MINUSONE:   push(NUMBER_VAL((double) -1)); break;
-            case OP_CONSTANT:
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL):
+        {
+            // Access stack slot relative to frame
+            // beginning.
+            push(frame->slots[READ_WORD()]);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE):
+        {
+            push(*frame->closure->upvalues[READ_WORD()]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL):
+        {
+            int index = READ_WORD();
+            if (IS_UNDEFINED(vm.globalValues.values[index]))
             {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+                frame->ip = ip;
+                runtimeError("Undefined variable.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CONSTANT_LONG:
+
+            vm.globalValues.values[index] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL):
+        {
+            frame->slots[READ_WORD()] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE):
+        {
+            *frame->closure->upvalues[READ_WORD()]->location = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_CAPTURED):
+        {
+            push(frame->closure->captured[READ_WORD()]);
+            DISPATCH();
+        }
+        CASE(OP_GET_DEFINED_GLOBAL):
+        {
+            push(vm.globalValues.values[READ_WORD()]);
+            DISPATCH();
+        }
+        CASE(OP_SET_DEFINED_GLOBAL):
+        {
+            vm.globalValues.values[READ_WORD()] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_EQUAL):
+        {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+                QUICKEN(OP_EQUAL_NUM);
+            DISPATCH();
+        }
+        CASE(OP_GREATER):    BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_LESS):       BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+        // Decoded from OP_ZERO followed by OP_COMPZER0.
+        CASE(OP_COMPZER0):
+        {
+            Value value = pop();
+            push(BOOL_VAL(valuesEqual(value, NUMBER_VAL(0))));
+            DISPATCH();
+        }
+        CASE(OP_INCREMENT):
+        {
+            if (!IS_NUMBER(peek(0)))
             {
-                Value constant = READ_CONST_LONG();
-                push(constant);
-                break;
+                frame->ip = ip;
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DUP:    push(peek(0)); break;
-            case OP_NIL:    push(NIL_VAL); break;
-            case OP_TRUE:   push(BOOL_VAL(true)); break;
-            case OP_FALSE:  push(BOOL_VAL(false)); break;
-            case OP_POP:    pop(); break;
-            case OP_POPN:
+            vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) + 1);
+            DISPATCH();
+        }
+        CASE(OP_DECREMENT):
+        {
+            if (!IS_NUMBER(peek(0)))
             {
-                vm.stackCount -= READ_OPERAND();
-                break;
-                // No return since this is only for local variables.
-                // We don't return the last variable popped.
+                frame->ip = ip;
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DEFINE_GLOBAL:
+            vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) - 1);
+            DISPATCH();
+        }
+        CASE(OP_ADD):
+        // Superinstructions that fail their number fast path
+        // push their operands and finish here.
+        addValues:
+        {
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+                concatenate();
+            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
             {
-                vm.globalValues.values[READ_OPERAND()] = pop();
-                break;
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+                // Superinstructions only come here with
+                // something other than two numbers, so this
+                // is always a real OP_ADD.
+                QUICKEN(OP_ADD_NUM);
             }
-            case OP_GET_GLOBAL:
+            else
             {
-                Value value = vm.globalValues.values[READ_OPERAND()];
-                if (IS_UNDEFINED(value))
-                {
-                    // When we report a runtime error, 
-                    // it has to appear at the right instruction.
-                    frame->ip = ip;
-                    runtimeError("Undefined variable.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+                frame->ip = ip;
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_LOCAL:
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT):   BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+        CASE(OP_MULTIPLY):   BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+        CASE(OP_DIVIDE):
+        {
+            if (IS_NUMBER(peek(0)) && AS_NUMBER(peek(0)) == 0)
             {
-                // Access stack slot relative to frame
-                // beginning.
-                push(frame->slots[READ_OPERAND()]);
-                break;
+                frame->ip = ip;
+                runtimeError("Cannot divide by zero.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_UPVALUE:
+            BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+            DISPATCH();
+        }
+        CASE(OP_NOT):
+        {
+            push(BOOL_VAL(isFalsey(pop())));
+            DISPATCH();
+        }
+        CASE(OP_NEGATE):
+        {
+            if (!IS_NUMBER(peek(0)))
             {
-                READ_BYTE(); // Get rid of OP_SHORT.
-                push(*frame->closure->upvalues[READ_BYTE()]->location);
-                break;
+                frame->ip = ip;
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_GLOBAL:
-            {
-                int index = READ_OPERAND();
-                if (IS_UNDEFINED(vm.globalValues.values[index]))
-                {
-                    frame->ip = ip;
-                    runtimeError("Undefined variable.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) * -1);
+            DISPATCH();
+        }
+        CASE(OP_PRINT):
+        {
+            printValue(pop());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP):
+        {
+            Word jump = READ_WORD();
+            ip += jump;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE):
+        {
+            Word offset = READ_WORD();
+            if (isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP):
+        {
+            Word loop = READ_WORD();
+            ip -= loop;
+            countBackEdge(frame->closure->function);
+            RUN_TRACE();
+            DISPATCH();
+        }
+        CASE(OP_CALL):
+        {
+            int argCount = READ_WORD();
+            frame->ip = ip;
+            int frameCount = vm.frameCount;
+            if (!callValue(peek(argCount), argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            ENTER_NATIVE(vm.frameCount > frameCount);
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL):
+        {
+            int argCount = READ_WORD();
+            frame->ip = ip;
+            int frameCount = vm.frameCount;
+            if (!callValue(peek(argCount), argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            // Natives and classes without an initializer
+            // leave their result for the OP_RETURN after.
+            bool pushed = vm.frameCount > frameCount;
+            if (pushed)
+                replaceCaller();
+            ENTER_NATIVE(pushed);
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_INVOKE):
+        {
+            ObjString* method = READ_STRING();
+            int argCount = READ_WORD();
+            InlineCache* cache = READ_CACHE();
+            frame->ip = ip;
+            int frameCount = vm.frameCount;
+            if (!invoke(cache, method, argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            ENTER_NATIVE(vm.frameCount > frameCount);
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE):
+        {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure* closure = makeClosure(function);
+            push(OBJ_VAL(closure));
 
-                vm.globalValues.values[index] = peek(0);
-                break;
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                Word isLocal = READ_WORD();
+                Word index = READ_WORD();
+                if (isLocal)
+                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                else
+                    closure->upvalues[i] = frame->closure->upvalues[index];
             }
-            case OP_SET_LOCAL:
+            for (int i = 0; i < closure->capturedCount; i++)
             {
-                frame->slots[READ_OPERAND()] = peek(0);
-                break;
+                Word isLocal = READ_WORD();
+                Word index = READ_WORD();
+                closure->captured[i] = isLocal ? frame->slots[index] :
+                                            frame->closure->captured[index];
             }
-            case OP_SET_UPVALUE:
+            // captureUpvalue() may have collected, and promoted
+            // the closure.
+            WRITE_BARRIER(closure);
+
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+        {
+            // Close the upvalue at top of stack.
+            closeUpvalues(vm.stackTop - 1);
+            // Pop that stack slot.
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_CLASS):
+        {
+            push(OBJ_VAL(newClass(READ_STRING())));
+            DISPATCH();
+        }
+        CASE(OP_METHOD):
+        {
+            defineMethod(AS_CLASS(peek(1)), READ_STRING(), peek(0));
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY):
+        {
+            if (!IS_INSTANCE(peek(0)))
             {
-                READ_BYTE(); // Get rid of OP_SHORT.
-                *frame->closure->upvalues[READ_BYTE()]->location = peek(0);
-                break;
+                frame->ip = ip;
+                runtimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_EQUAL:
+            
+            ObjInstance* instance = AS_INSTANCE(peek(0));
+            ObjString* name = READ_STRING();
+            CacheEntry* entry = cacheLoad(READ_CACHE(), instance, name);
+            if (entry == NULL)
             {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+                frame->ip = ip;
+                runtimeError("Undefined property '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GREATER:    BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:       BINARY_OP(BOOL_VAL, <); break;
-            case OP_INCREMENT:
+
+            // Check for field.
+            if (entry->slot != -1)
             {
-                if (!IS_NUMBER(peek(0)))
-                {
-                    frame->ip = ip;
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                vm.stack[vm.stackCount - 1].as.number++;
-                break;
+                pop(); // Instance;
+                push(instance->fields[entry->slot]);
+                DISPATCH();
             }
-            case OP_DECREMENT:
+
+            bindMethod(entry->method);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY):
+        {
+            if (!IS_INSTANCE(peek(1)))
             {
-                if (!IS_NUMBER(peek(0)))
-                {
-                    frame->ip = ip;
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                vm.stack[vm.stackCount - 1].as.number--;
-                break;
+                frame->ip = ip;
+                runtimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_ADD:
+            
+            ObjInstance* instance = AS_INSTANCE(peek(1));
+            ObjString* name = READ_STRING();
+            cacheStore(READ_CACHE(), instance, name, peek(0));
+            Value value = pop(); // Pop stored value.
+            pop(); // Pop instance.
+            push(value); // Push stored value back on top.
+            DISPATCH();
+        }
+        CASE(OP_DEL_PROPERTY):
+        {
+            if (!IS_INSTANCE(peek(0)))
             {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                    concatenate();
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(0)))
-                {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                }
-                else
-                {
-                    frame->ip = ip;
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                frame->ip = ip;
+                runtimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:
+
+            ObjInstance* instance = AS_INSTANCE(peek(0));
+            ObjString* name = READ_STRING();
+
+            if (!deleteField(instance, name))
             {
-                if (IS_NUMBER(peek(0)) && AS_NUMBER(peek(0)) == 0)
-                {
-                    frame->ip = ip;
-                    runtimeError("Cannot divide by zero.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                BINARY_OP(NUMBER_VAL, / );
-                break;
+                frame->ip = ip;
+                runtimeError("Failed to delete field '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_NOT:
+
+            DISPATCH();
+        }
+        CASE(OP_RETURN):
+        {
+            Value result = pop();
+            closeUpvalues(frame->slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0)
             {
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
+                // Pop script function.
+                pop();
+                return INTERPRET_OK;
             }
-            case OP_NEGATE:
+
+            vm.stackTop = frame->slots;
+            push(result);
+            // Back in the native code that called the
+            // function (see jitCall()).
+            if (vm.frameCount == baseFrame)
+                return INTERPRET_OK;
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL):
+        {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!valuesEqual(a, b)));
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+                QUICKEN(OP_NOT_EQUAL_NUM);
+            DISPATCH();
+        }
+        // Negated rather than >= and <= so NaN compares
+        // exactly as OP_LESS/OP_GREATER followed by OP_NOT.
+        CASE(OP_GREATER_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUM);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUM);
+            DISPATCH();
+        CASE(OP_ADD_LOCALS):
+        {
+            Value a = frame->slots[READ_WORD()];
+            Value b = frame->slots[READ_WORD()];
+            if (IS_NUMBER(a) && IS_NUMBER(b))
             {
-                if (!IS_NUMBER(peek(0)))
-                {
-                    frame->ip = ip;
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                vm.stack[vm.stackCount - 1].as.number *= -1;
-                break;
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
             }
-            case OP_PRINT:
+
+            push(a);
+            push(b);
+            goto addValues;
+        }
+        CASE(OP_LOCAL_LESS_CONST_JUMP):
+        {
+            Value a = frame->slots[READ_WORD()];
+            Value b = READ_CONSTANT();
+            Word offset = READ_WORD();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
             {
-                printValue(pop());
-                printf("\n");
-                break;
+                frame->ip = ip;
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP:
+
+            // Leave the result for the OP_POPs that follow
+            // either way, just as OP_JUMP_IF_FALSE does.
+            bool less = AS_NUMBER(a) < AS_NUMBER(b);
+            push(BOOL_VAL(less));
+            if (!less) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM):        NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+        CASE(OP_SUBTRACT_NUM):   NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+        CASE(OP_MULTIPLY_NUM):   NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+        CASE(OP_DIVIDE_NUM):
+            // Leaves the error for a zero divisor to OP_DIVIDE.
+            if (IS_NUMBER(vm.stackTop[-1]) && AS_NUMBER(vm.stackTop[-1]) == 0)
+                DEOPTIMIZE(OP_DIVIDE);
+            NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+            DISPATCH();
+        CASE(OP_EQUAL_NUM):      NUMBER_OP(BOOL_VAL, ==, OP_EQUAL); DISPATCH();
+        CASE(OP_NOT_EQUAL_NUM):  NUMBER_OP(BOOL_VAL, !=, OP_NOT_EQUAL); DISPATCH();
+        CASE(OP_GREATER_NUM):    NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+        CASE(OP_GREATER_EQUAL_NUM):
+            NUMBER_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL);
+            DISPATCH();
+        CASE(OP_LESS_NUM):       NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+        CASE(OP_LESS_EQUAL_NUM):
+            NUMBER_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL);
+            DISPATCH();
+        DEFAULT():
+            // OP_CONSTANT_LONG, OP_SHORT and OP_LONG are
+            // dropped when the chunk is decoded.
+            frame->ip = ip;
+            runtimeError("Unknown opcode.");
+            return INTERPRET_RUNTIME_ERROR;
+    }
+
+    #undef READ_WORD
+    #undef READ_CONSTANT
+    #undef READ_STRING
+    #undef READ_CACHE
+    #undef ENTER_NATIVE
+    #undef RUN_TRACE
+
+    #undef QUICKEN
+    #undef DEOPTIMIZE
+    #undef BINARY_OP
+    #undef NUMBER_OP
+    #undef NOT_BOOL_VAL
+
+    #undef TRACE_STACK
+    #undef TRACE_INSTRUCTION
+    #undef PROFILE_INSTRUCTION
+
+    #undef INTERPRET_LOOP
+    #undef CASE
+    #undef DEFAULT
+    #undef DISPATCH
+}
+
+// Claims all of the frame's registers on entry (call()
+// has made room for them). The GC scans every one of them
+// while the frame runs, so the ones the caller did not
+// pass in start out nil.
+static void reserveRegisters(CallFrame* frame)
+{
+    Value* end = frame->slots + frame->closure->function->chunk.maxRegisters;
+    while (vm.stackTop < end)
+        *vm.stackTop++ = NIL_VAL;
+}
+
+// Back in frame after a call, with the result just below
+// from. The registers from there on were not scanned
+// during the call and may point at freed objects, so they
+// are cleared before the GC can see them again.
+static void restoreRegisters(CallFrame* frame, Value* from)
+{
+    Value* end = frame->slots + frame->closure->function->chunk.maxRegisters;
+    for (Value* slot = from; slot < end; slot++)
+        *slot = NIL_VAL;
+    vm.stackTop = end;
+}
+
+// Runs the register code built by buildRegisterCode().
+// Mirrors run(), one handler per RegOpCode.
+static InterpretResult runRegisters()
+{
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    reserveRegisters(frame);
+    register Word* ip = frame->ip;
+    // Only valid until the frame changes or the stack moves.
+    register Value* slots = frame->slots;
+    Value* constants = frame->closure->function->chunk.constants.values;
+
+    #define READ_WORD() (*ip++)
+    #define READ_STRING() AS_STRING(constants[READ_WORD()])
+    #define READ_CACHE() \
+        (&frame->closure->function->chunk.caches[READ_WORD()])
+    // Operands are read into a variable first,
+    // since this uses them twice.
+    #define RK(operand) (IS_RK_CONSTANT(operand) ? \
+                constants[RK_INDEX(operand)] : slots[operand])
+    #define LOAD_FRAME() \
+            do \
+            { \
+                frame = &vm.frames[vm.frameCount - 1]; \
+                ip = frame->ip; \
+                slots = frame->slots; \
+                constants = frame->closure->function->chunk.constants.values; \
+            } while (false)
+
+    // Quickening, as in run(). Every instruction with a
+    // quickened form has three operands, which have all been
+    // read by the time it quickens, but none of which have
+    // been read when the quickened form deoptimizes.
+    #define QUICKEN(opcode) \
+            do \
+            { \
+                if (frame->closure->function->tier != TIER_INTERPRETED) \
+                    ip[-4] = (Word) (opcode); \
+            } while (false)
+    #define DEOPTIMIZE(generic) \
+            do \
+            { \
+                ip[-1] = (Word) (generic); \
+                ip--; \
+                DISPATCH(); \
+            } while (false)
+
+    #define BINARY_OP(valueType, op, quickened) \
+            do \
+            { \
+                Word dest = READ_WORD(); \
+                Word left = READ_WORD(); \
+                Word right = READ_WORD(); \
+                Value a = RK(left); \
+                Value b = RK(right); \
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+                { \
+                    frame->ip = ip; \
+                    runtimeError("Operands must be numbers."); \
+                    return INTERPRET_RUNTIME_ERROR; \
+                } \
+                slots[dest] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+                QUICKEN(quickened); \
+            } while (false)
+    #define NUMBER_OP(valueType, op, generic) \
+            do \
+            { \
+                Value a = RK(ip[1]); \
+                Value b = RK(ip[2]); \
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+                    DEOPTIMIZE(generic); \
+                slots[ip[0]] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+                ip += 3; \
+            } while (false)
+    #define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+    #ifdef DEBUG_TRACE_EXECUTION
+        #ifdef DEBUG_TRACE_STACK
+            // Shows every register of every frame.
+            #define TRACE_STACK() \
+                do \
+                { \
+                    printf("          "); \
+                    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) \
+                    { \
+                        printf("[ "); \
+                        printValue(*slot); \
+                        printf(" ]"); \
+                    } \
+                    printf("\n"); \
+                } while (false)
+        #else
+            #define TRACE_STACK() do {} while (false)
+        #endif
+        #define TRACE_INSTRUCTION() \
+            do \
+            { \
+                TRACE_STACK(); \
+                disassembleRegisterInstruction(&frame->closure->function->chunk, \
+                    (int) (ip - frame->closure->function->chunk.regWords)); \
+            } while (false)
+    #else
+        #define TRACE_INSTRUCTION() do {} while (false)
+    #endif
+
+    #ifdef COMPUTED_GOTO
+        // One label address per register opcode.
+        static void* dispatchTable[] = {
+            [REG_MOVE] = &&CASE_REG_MOVE,
+            [REG_DEFINE_GLOBAL] = &&CASE_REG_DEFINE_GLOBAL,
+            [REG_GET_GLOBAL] = &&CASE_REG_GET_GLOBAL,
+            [REG_SET_GLOBAL] = &&CASE_REG_SET_GLOBAL,
+            [REG_GET_UPVALUE] = &&CASE_REG_GET_UPVALUE,
+            [REG_SET_UPVALUE] = &&CASE_REG_SET_UPVALUE,
+            [REG_GET_CAPTURED] = &&CASE_REG_GET_CAPTURED,
+            [REG_GET_DEFINED_GLOBAL] = &&CASE_REG_GET_DEFINED_GLOBAL,
+            [REG_SET_DEFINED_GLOBAL] = &&CASE_REG_SET_DEFINED_GLOBAL,
+            [REG_EQUAL] = &&CASE_REG_EQUAL,
+            [REG_NOT_EQUAL] = &&CASE_REG_NOT_EQUAL,
+            [REG_GREATER] = &&CASE_REG_GREATER,
+            [REG_GREATER_EQUAL] = &&CASE_REG_GREATER_EQUAL,
+            [REG_LESS] = &&CASE_REG_LESS,
+            [REG_LESS_EQUAL] = &&CASE_REG_LESS_EQUAL,
+            [REG_ADD] = &&CASE_REG_ADD,
+            [REG_SUBTRACT] = &&CASE_REG_SUBTRACT,
+            [REG_MULTIPLY] = &&CASE_REG_MULTIPLY,
+            [REG_DIVIDE] = &&CASE_REG_DIVIDE,
+            [REG_COMPZERO] = &&CASE_REG_COMPZERO,
+            [REG_INCREMENT] = &&CASE_REG_INCREMENT,
+            [REG_DECREMENT] = &&CASE_REG_DECREMENT,
+            [REG_NOT] = &&CASE_REG_NOT,
+            [REG_NEGATE] = &&CASE_REG_NEGATE,
+            [REG_PRINT] = &&CASE_REG_PRINT,
+            [REG_JUMP] = &&CASE_REG_JUMP,
+            [REG_JUMP_IF_FALSE] = &&CASE_REG_JUMP_IF_FALSE,
+            [REG_LOOP] = &&CASE_REG_LOOP,
+            [REG_CALL] = &&CASE_REG_CALL,
+            [REG_TAIL_CALL] = &&CASE_REG_TAIL_CALL,
+            [REG_INVOKE] = &&CASE_REG_INVOKE,
+            [REG_CLOSURE] = &&CASE_REG_CLOSURE,
+            [REG_CLOSE_UPVALUE] = &&CASE_REG_CLOSE_UPVALUE,
+            [REG_CLASS] = &&CASE_REG_CLASS,
+            [REG_METHOD] = &&CASE_REG_METHOD,
+            [REG_GET_PROPERTY] = &&CASE_REG_GET_PROPERTY,
+            [REG_SET_PROPERTY] = &&CASE_REG_SET_PROPERTY,
+            [REG_DEL_PROPERTY] = &&CASE_REG_DEL_PROPERTY,
+            [REG_RETURN] = &&CASE_REG_RETURN,
+            [REG_ADD_NUM] = &&CASE_REG_ADD_NUM,
+            [REG_SUBTRACT_NUM] = &&CASE_REG_SUBTRACT_NUM,
+            [REG_MULTIPLY_NUM] = &&CASE_REG_MULTIPLY_NUM,
+            [REG_DIVIDE_NUM] = &&CASE_REG_DIVIDE_NUM,
+            [REG_EQUAL_NUM] = &&CASE_REG_EQUAL_NUM,
+            [REG_NOT_EQUAL_NUM] = &&CASE_REG_NOT_EQUAL_NUM,
+            [REG_GREATER_NUM] = &&CASE_REG_GREATER_NUM,
+            [REG_GREATER_EQUAL_NUM] = &&CASE_REG_GREATER_EQUAL_NUM,
+            [REG_LESS_NUM] = &&CASE_REG_LESS_NUM,
+            [REG_LESS_EQUAL_NUM] = &&CASE_REG_LESS_EQUAL_NUM
+        };
+        _Static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) ==
+                        REG_OP_COUNT, "Every opcode needs a handler.");
+
+        #define INTERPRET_LOOP  DISPATCH();
+        #define CASE(opcode)    CASE_##opcode
+        #define DISPATCH() \
+            do \
+            { \
+                TRACE_INSTRUCTION(); \
+                COUNT_INSTRUCTION(); \
+                goto *dispatchTable[READ_WORD()]; \
+            } while (false)
+    #else
+        #define INTERPRET_LOOP \
+            loop: \
+                TRACE_INSTRUCTION(); \
+                COUNT_INSTRUCTION(); \
+                switch (READ_WORD())
+        #define CASE(opcode)    case opcode
+        #define DISPATCH()      goto loop
+    #endif
+
+    #ifdef DEBUG_TRACE_EXECUTION
+        printf("== debug trace (registers) == \n");
+    #endif
+
+    INTERPRET_LOOP
+    {
+        CASE(REG_MOVE):
+        {
+            Word dest = READ_WORD();
+            Word source = READ_WORD();
+            slots[dest] = RK(source);
+            DISPATCH();
+        }
+        CASE(REG_DEFINE_GLOBAL):
+        {
+            Word index = READ_WORD();
+            Word value = READ_WORD();
+            vm.globalValues.values[index] = RK(value);
+            DISPATCH();
+        }
+        CASE(REG_GET_GLOBAL):
+        {
+            Word dest = READ_WORD();
+            Value value = vm.globalValues.values[READ_WORD()];
+            if (IS_UNDEFINED(value))
             {
-                uint16_t jump = READ_SHORT();
-                ip += jump;
-                break;
+                frame->ip = ip;
+                runtimeError("Undefined variable.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE:
+            slots[dest] = value;
+            DISPATCH();
+        }
+        CASE(REG_SET_GLOBAL):
+        {
+            Word index = READ_WORD();
+            Word value = READ_WORD();
+            if (IS_UNDEFINED(vm.globalValues.values[index]))
             {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) ip += offset;
-                break;
+                frame->ip = ip;
+                runtimeError("Undefined variable.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_LOOP:
+
+            vm.globalValues.values[index] = RK(value);
+            DISPATCH();
+        }
+        CASE(REG_GET_UPVALUE):
+        {
+            Word dest = READ_WORD();
+            slots[dest] = *frame->closure->upvalues[READ_WORD()]->location;
+            DISPATCH();
+        }
+        CASE(REG_SET_UPVALUE):
+        {
+            Word index = READ_WORD();
+            Word value = READ_WORD();
+            *frame->closure->upvalues[index]->location = RK(value);
+            DISPATCH();
+        }
+        CASE(REG_GET_CAPTURED):
+        {
+            Word dest = READ_WORD();
+            slots[dest] = frame->closure->captured[READ_WORD()];
+            DISPATCH();
+        }
+        CASE(REG_GET_DEFINED_GLOBAL):
+        {
+            Word dest = READ_WORD();
+            slots[dest] = vm.globalValues.values[READ_WORD()];
+            DISPATCH();
+        }
+        CASE(REG_SET_DEFINED_GLOBAL):
+        {
+            Word index = READ_WORD();
+            Word value = READ_WORD();
+            vm.globalValues.values[index] = RK(value);
+            DISPATCH();
+        }
+        CASE(REG_EQUAL):
+        {
+            Word dest = READ_WORD();
+            Word left = READ_WORD();
+            Word right = READ_WORD();
+            Value a = RK(left);
+            Value b = RK(right);
+            slots[dest] = BOOL_VAL(valuesEqual(a, b));
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+                QUICKEN(REG_EQUAL_NUM);
+            DISPATCH();
+        }
+        CASE(REG_NOT_EQUAL):
+        {
+            Word dest = READ_WORD();
+            Word left = READ_WORD();
+            Word right = READ_WORD();
+            Value a = RK(left);
+            Value b = RK(right);
+            slots[dest] = BOOL_VAL(!valuesEqual(a, b));
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+                QUICKEN(REG_NOT_EQUAL_NUM);
+            DISPATCH();
+        }
+        CASE(REG_GREATER):
+            BINARY_OP(BOOL_VAL, >, REG_GREATER_NUM);
+            DISPATCH();
+        CASE(REG_GREATER_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, <, REG_GREATER_EQUAL_NUM);
+            DISPATCH();
+        CASE(REG_LESS):
+            BINARY_OP(BOOL_VAL, <, REG_LESS_NUM);
+            DISPATCH();
+        CASE(REG_LESS_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, >, REG_LESS_EQUAL_NUM);
+            DISPATCH();
+        CASE(REG_ADD):
+        {
+            Word dest = READ_WORD();
+            Word left = READ_WORD();
+            Word right = READ_WORD();
+            Value a = RK(left);
+            Value b = RK(right);
+            if (IS_NUMBER(a) && IS_NUMBER(b))
             {
-                uint16_t loop = READ_SHORT();
-                ip -= loop;
-                break;
+                slots[dest] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                QUICKEN(REG_ADD_NUM);
             }
-            case OP_CALL:
+            else if (IS_STRING(a) && IS_STRING(b))
+                // Both are still in registers or constants.
+                slots[dest] = OBJ_VAL(joinStrings(AS_STRING(a), AS_STRING(b)));
+            else
             {
-                uint8_t argCount = READ_BYTE();
                 frame->ip = ip;
-                if (!callValue(peek(argCount), argCount))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INVOKE:
+            DISPATCH();
+        }
+        CASE(REG_SUBTRACT):  BINARY_OP(NUMBER_VAL, -, REG_SUBTRACT_NUM); DISPATCH();
+        CASE(REG_MULTIPLY):  BINARY_OP(NUMBER_VAL, *, REG_MULTIPLY_NUM); DISPATCH();
+        CASE(REG_DIVIDE):
+        {
+            Value divisor = RK(ip[2]);
+            if (IS_NUMBER(divisor) && AS_NUMBER(divisor) == 0)
             {
-                ObjString* method = READ_STRING_VALUE();
-                int argCount = READ_BYTE();
+                ip += 3;
                 frame->ip = ip;
-                if (!invoke(method, argCount))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                runtimeError("Cannot divide by zero.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSURE:
+            BINARY_OP(NUMBER_VAL, /, REG_DIVIDE_NUM);
+            DISPATCH();
+        }
+        CASE(REG_COMPZERO):
+        {
+            Word dest = READ_WORD();
+            Word source = READ_WORD();
+            slots[dest] = BOOL_VAL(valuesEqual(RK(source), NUMBER_VAL(0)));
+            DISPATCH();
+        }
+        CASE(REG_INCREMENT):
+        CASE(REG_DECREMENT):
+        {
+            bool increment = (ip[-1] == REG_INCREMENT);
+            Word dest = READ_WORD();
+            Word source = READ_WORD();
+            Value value = RK(source);
+            if (!IS_NUMBER(value))
             {
-                ObjFunction* function = AS_FUNCTION(READ_VALUE());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-
-                for (int i = 0; i < closure->upvalueCount; i++)
-                {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal)
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    else
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-
-                break;
+                frame->ip = ip;
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE:
+            slots[dest] = NUMBER_VAL(AS_NUMBER(value) + (increment ? 1 : -1));
+            DISPATCH();
+        }
+        CASE(REG_NOT):
+        {
+            Word dest = READ_WORD();
+            Word source = READ_WORD();
+            slots[dest] = BOOL_VAL(isFalsey(RK(source)));
+            DISPATCH();
+        }
+        CASE(REG_NEGATE):
+        {
+            Word dest = READ_WORD();
+            Word source = READ_WORD();
+            Value value = RK(source);
+            if (!IS_NUMBER(value))
             {
-                // Close the upvalue at top of stack.
-                closeUpvalues(vm.stack + vm.stackCount - 1);
-                // Pop that stack slot.
-                pop();
-                break;
+                frame->ip = ip;
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLASS:
+            slots[dest] = NUMBER_VAL(AS_NUMBER(value) * -1);
+            DISPATCH();
+        }
+        CASE(REG_PRINT):
+        {
+            Word value = READ_WORD();
+            printValue(RK(value));
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(REG_JUMP):
+        {
+            Word jump = READ_WORD();
+            ip += jump;
+            DISPATCH();
+        }
+        CASE(REG_JUMP_IF_FALSE):
+        {
+            Word test = READ_WORD();
+            Word offset = READ_WORD();
+            if (isFalsey(slots[test])) ip += offset;
+            DISPATCH();
+        }
+        CASE(REG_LOOP):
+        {
+            Word loop = READ_WORD();
+            ip -= loop;
+            countBackEdge(frame->closure->function);
+            DISPATCH();
+        }
+        CASE(REG_CALL):
+        CASE(REG_TAIL_CALL):
+        CASE(REG_INVOKE):
+        {
+            bool isInvoke = (ip[-1] == REG_INVOKE);
+            bool isTail = (ip[-1] == REG_TAIL_CALL);
+            Word callee = READ_WORD();
+            ObjString* method = isInvoke ? READ_STRING() : NULL;
+            int argCount = (int) READ_WORD();
+            InlineCache* cache = isInvoke ? READ_CACHE() : NULL;
+            frame->ip = ip;
+
+            // The callee and its arguments become the top
+            // of the stack, where call() expects them.
+            vm.stackTop = slots + callee + argCount + 1;
+            int frameCount = vm.frameCount;
+            if (isInvoke ? !invoke(cache, method, argCount) :
+                            !callValue(slots[callee], argCount))
+                return INTERPRET_RUNTIME_ERROR;
+
+            if (vm.frameCount == frameCount)
             {
-                push(OBJ_VAL(newClass(READ_STRING_VALUE())));
-                break;
+                // A native, or a class without an initializer.
+                // The result is already in the callee's register.
+                restoreRegisters(frame, slots + callee + 1);
+                DISPATCH();
             }
-            case OP_METHOD:
+
+            if (isTail)
+                replaceCaller();
+            reserveRegisters(&vm.frames[vm.frameCount - 1]);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(REG_CLOSURE):
+        {
+            Word dest = READ_WORD();
+            ObjFunction* function = AS_FUNCTION(constants[READ_WORD()]);
+            ObjClosure* closure = makeClosure(function);
+            slots[dest] = OBJ_VAL(closure);
+
+            for (int i = 0; i < closure->upvalueCount; i++)
             {
-                defineMethod(READ_STRING_VALUE());
-                break;
+                Word isLocal = READ_WORD();
+                Word index = READ_WORD();
+                if (isLocal)
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                else
+                    closure->upvalues[i] = frame->closure->upvalues[index];
             }
-            case OP_GET_PROPERTY:
+            for (int i = 0; i < closure->capturedCount; i++)
             {
-                if (!IS_INSTANCE(peek(0)))
-                {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING_VALUE();
-
-                Value value;
-                // Check for field.
-                if (tableGet(&instance->fields, OBJ_VAL(name), &value))
-                {
-                    pop(); // Instance;
-                    push(value);
-                    break;
-                }
-
-                // Check for method.
-                if (!bindMethod(instance->klass, name))
-                {
-                    runtimeError("Undefined property '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                break;
+                Word isLocal = READ_WORD();
+                Word index = READ_WORD();
+                closure->captured[i] = isLocal ? slots[index] :
+                                            frame->closure->captured[index];
             }
-            case OP_SET_PROPERTY:
+            WRITE_BARRIER(closure);
+
+            DISPATCH();
+        }
+        CASE(REG_CLOSE_UPVALUE):
+        {
+            closeUpvalues(slots + READ_WORD());
+            DISPATCH();
+        }
+        CASE(REG_CLASS):
+        {
+            Word dest = READ_WORD();
+            slots[dest] = OBJ_VAL(newClass(READ_STRING()));
+            DISPATCH();
+        }
+        CASE(REG_METHOD):
+        {
+            Word klass = READ_WORD();
+            Word method = READ_WORD();
+            defineMethod(AS_CLASS(RK(klass)), READ_STRING(), RK(method));
+            DISPATCH();
+        }
+        CASE(REG_GET_PROPERTY):
+        {
+            Word dest = READ_WORD();
+            Word object = READ_WORD();
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            Value receiver = RK(object);
+            if (!IS_INSTANCE(receiver))
             {
-                if (!IS_INSTANCE(peek(1)))
-                {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, OBJ_VAL(READ_STRING_VALUE()), peek(0));
-                Value value = pop(); // Pop stored value.
-                pop(); // Pop instance.
-                push(value); // Push stored value back on top.
-                break;
+                frame->ip = ip;
+                runtimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DEL_PROPERTY:
+
+            ObjInstance* instance = AS_INSTANCE(receiver);
+            CacheEntry* entry = cacheLoad(cache, instance, name);
+            if (entry == NULL)
             {
-                if (!IS_INSTANCE(peek(0)))
-                {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                frame->ip = ip;
+                runtimeError("Undefined property '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING_VALUE();
+            // Check for field.
+            if (entry->slot != -1)
+            {
+                slots[dest] = instance->fields[entry->slot];
+                DISPATCH();
+            }
 
-                if (!tableDelete(&instance->fields, OBJ_VAL(name)))
-                {
-                    runtimeError("Failed to delete field '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            // The receiver stays in its register while
+            // the bound method is allocated.
+            slots[dest] = OBJ_VAL(newBoundMethod(receiver, entry->method));
+            DISPATCH();
+        }
+        CASE(REG_SET_PROPERTY):
+        {
+            Word dest = READ_WORD();
+            Word object = READ_WORD();
+            ObjString* name = READ_STRING();
+            Word operand = READ_WORD();
+            InlineCache* cache = READ_CACHE();
+            Value receiver = RK(object);
+            if (!IS_INSTANCE(receiver))
+            {
+                frame->ip = ip;
+                runtimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                break;
+            Value value = RK(operand);
+            cacheStore(cache, AS_INSTANCE(receiver), name, value);
+            slots[dest] = value;
+            DISPATCH();
+        }
+        CASE(REG_DEL_PROPERTY):
+        {
+            Word object = READ_WORD();
+            ObjString* name = READ_STRING();
+            Value receiver = RK(object);
+            if (!IS_INSTANCE(receiver))
+            {
+                frame->ip = ip;
+                runtimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_RETURN:
+
+            if (!deleteField(AS_INSTANCE(receiver), name))
             {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0)
-                {
-                    // Pop script function.
-                    pop();
-                    return INTERPRET_OK;
-                }
+                frame->ip = ip;
+                runtimeError("Failed to delete field '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                vm.stackCount = (int) (frame->slots - vm.stack);
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+            DISPATCH();
+        }
+        CASE(REG_RETURN):
+        {
+            Word operand = READ_WORD();
+            Value result = RK(operand);
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0)
+            {
+                vm.stackTop = vm.stack;
+                return INTERPRET_OK;
             }
+
+            // The callee's slot 0 is the register
+            // the caller expects the result in.
+            slots[0] = result;
+            Value* above = slots + 1;
+            LOAD_FRAME();
+            restoreRegisters(frame, above);
+            DISPATCH();
+        }
+        CASE(REG_ADD_NUM):       NUMBER_OP(NUMBER_VAL, +, REG_ADD); DISPATCH();
+        CASE(REG_SUBTRACT_NUM):  NUMBER_OP(NUMBER_VAL, -, REG_SUBTRACT); DISPATCH();
+        CASE(REG_MULTIPLY_NUM):  NUMBER_OP(NUMBER_VAL, *, REG_MULTIPLY); DISPATCH();
+        CASE(REG_DIVIDE_NUM):
+        {
+            // Leaves the error for a zero divisor to REG_DIVIDE.
+            Value divisor = RK(ip[2]);
+            if (IS_NUMBER(divisor) && AS_NUMBER(divisor) == 0)
+                DEOPTIMIZE(REG_DIVIDE);
+            NUMBER_OP(NUMBER_VAL, /, REG_DIVIDE);
+            DISPATCH();
         }
+        CASE(REG_EQUAL_NUM):     NUMBER_OP(BOOL_VAL, ==, REG_EQUAL); DISPATCH();
+        CASE(REG_NOT_EQUAL_NUM): NUMBER_OP(BOOL_VAL, !=, REG_NOT_EQUAL); DISPATCH();
+        CASE(REG_GREATER_NUM):   NUMBER_OP(BOOL_VAL, >, REG_GREATER); DISPATCH();
+        CASE(REG_GREATER_EQUAL_NUM):
+            NUMBER_OP(NOT_BOOL_VAL, <, REG_GREATER_EQUAL);
+            DISPATCH();
+        CASE(REG_LESS_NUM):      NUMBER_OP(BOOL_VAL, <, REG_LESS); DISPATCH();
+        CASE(REG_LESS_EQUAL_NUM):
+            NUMBER_OP(NOT_BOOL_VAL, >, REG_LESS_EQUAL);
+            DISPATCH();
     }
 
-    #undef READ_BYTE
-    #undef READ_SHORT
-    #undef READ_TRIBYTE
-    #undef READ_OPERAND
-
-    #undef READ_CONSTANT
-    #undef READ_CONST_LONG
-    #undef READ_VALUE
-    #undef READ_CONST_OPER
+    // Every RegOpCode has a handler above.
+    return INTERPRET_RUNTIME_ERROR;
 
+    #undef READ_WORD
     #undef READ_STRING
-    #undef READ_STRING_LONG
-    #undef READ_STRING_OPER
-    #undef READ_STRING_VALUE
+    #undef READ_CACHE
+    #undef RK
+    #undef LOAD_FRAME
 
+    #undef QUICKEN
+    #undef DEOPTIMIZE
     #undef BINARY_OP
+    #undef NUMBER_OP
+    #undef NOT_BOOL_VAL
+
+    #undef TRACE_STACK
+    #undef TRACE_INSTRUCTION
+
+    #undef INTERPRET_LOOP
+    #undef CASE
+    #undef DISPATCH
+}
+
+// Decodes a freshly compiled function, and every function
+// nested in its constant pool, into the form run() executes
+// (or runRegisters(), in register mode).
+static void loadFunction(ObjFunction* function)
+{
+    decodeChunk(&function->chunk);
+    if (vm.registerMode)
+        buildRegisterCode(function);
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        if (IS_FUNCTION(constants->values[i]))
+            loadFunction(AS_FUNCTION(constants->values[i]));
+    }
 }
 
 // Interpret pipeline driver.
@@ -775,12 +1918,15 @@ InterpretResult interpret(const char* source)
     // Stack will hold at least one function
     // object.
     // Goes in the dedicated slot 0.
+    // Also keeps the function reachable while it
+    // is decoded.
     push(OBJ_VAL(function));
+    loadFunction(function);
     ObjClosure* closure = newClosure(function);
     // Push then pop in case GC triggered.
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    return vm.registerMode ? runRegisters() : run(0);
 }
\ No newline at end of file